@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Blocklist prefilter.
+ *
+ * A blocklist file is a split block Bloom filter over PANs: each PAN
+ * is hashed to one 32-byte block, and sets one bit in each of the
+ * block's eight words, so a check reads a single cache line and never
+ * misses a listed PAN. The file is mapped read-only and populated up
+ * front, so checks never fault.
+ *
+ * Loading a new file swaps it in under running checks. Checks announce
+ * themselves in one of two counters, chosen by a generation number the
+ * loader flips after publishing the new filter; the loader then waits
+ * for the old generation's counter to drain before unmapping the old
+ * filter. A check that raced with the flip sees the new generation and
+ * tries again.
+ */
+
+#define BL_MAGIC "MSRB"
+#define BL_VERSION 1
+#define BL_HDRLEN 64
+#define BL_BLOCKLEN 32
+
+/* Digits in the longest PAN we hash. */
+#define BL_PANLEN 32
+
+/* The file header, in host byte order, padded to BL_HDRLEN. */
+struct bl_hdr {
+	char magic[4];
+	uint32_t version;
+	uint64_t k0, k1; /* the hash key */
+	uint64_t nblocks;
+	uint64_t nkeys; /* for information only */
+};
+
+struct bl_map {
+	void *base;
+	size_t size;
+	const uint32_t *blocks;
+	uint64_t nblocks;
+	uint64_t k0, k1;
+};
+
+struct bl_count {
+	unsigned long n;
+} __attribute__((aligned(64)));
+
+struct msr_blocklist {
+	struct bl_map *cur;
+	unsigned long gen;
+	struct bl_count active[2];
+	pthread_mutex_t load;
+};
+
+/* Odd constants spreading a hash over the bits of each word. */
+static const uint32_t salt[8] = {
+	0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+	0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+/* Hash a PAN's digits, ignoring anything else, such as spaces. */
+static int pan_hash (uint64_t k0, uint64_t k1, const uint8_t *pan,
+	size_t len, uint64_t *h)
+{
+	uint8_t digits[BL_PANLEN];
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (pan[i] < '0' || pan[i] > '9')
+			continue;
+		if (n == sizeof(digits))
+			return 0;
+		digits[n++] = pan[i];
+	}
+
+	if (n == 0)
+		return 0;
+
+	*h = msr_siphash (k0, k1, digits, n);
+	return 1;
+}
+
+static uint32_t *block_for (uint32_t *blocks, uint64_t nblocks, uint64_t h)
+{
+	return blocks + ((h >> 32) * nblocks >> 32) * (BL_BLOCKLEN / 4);
+}
+
+static int test (const struct bl_map *m, uint64_t h)
+{
+	const uint32_t *b = block_for ((uint32_t *) m->blocks, m->nblocks, h);
+	uint32_t miss = 0;
+	int j;
+
+	for (j = 0; j < 8; j++)
+		miss |= ~b[j] & (1u << (((uint32_t) h * salt[j]) >> 27));
+
+	return miss == 0;
+}
+
+int msr_blocklist_build(const char *path, const char *const *pans, size_t n,
+	unsigned int bits)
+{
+	struct bl_hdr hdr;
+	uint8_t pad[BL_HDRLEN];
+	uint32_t *blocks, *b;
+	uint64_t h, key[2];
+	size_t i, size;
+	char *tmp;
+	FILE *fp;
+	int j, fd, r = LIBMSR_ERR_GENERIC;
+
+	if (bits == 0)
+		bits = MSR_BLOCKLIST_BITS;
+
+	memset (&hdr, 0, sizeof(hdr));
+	memcpy (hdr.magic, BL_MAGIC, sizeof(hdr.magic));
+	hdr.version = BL_VERSION;
+	hdr.nkeys = n;
+	hdr.nblocks = ((uint64_t) n * bits + BL_BLOCKLEN * 8 - 1)
+		/ (BL_BLOCKLEN * 8);
+	if (hdr.nblocks == 0)
+		hdr.nblocks = 1;
+	if (hdr.nblocks > UINT32_MAX)
+		return LIBMSR_ERR_GENERIC;
+
+	if (getrandom (key, sizeof(key), 0) != sizeof(key))
+		return LIBMSR_ERR_GENERIC;
+	hdr.k0 = key[0];
+	hdr.k1 = key[1];
+
+	size = hdr.nblocks * BL_BLOCKLEN;
+	if ((blocks = calloc (1, size)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	for (i = 0; i < n; i++) {
+		if (!pan_hash (hdr.k0, hdr.k1, (const uint8_t *) pans[i],
+		    strlen (pans[i]), &h))
+			continue;
+		b = block_for (blocks, hdr.nblocks, h);
+		for (j = 0; j < 8; j++)
+			b[j] |= 1u << (((uint32_t) h * salt[j]) >> 27);
+	}
+
+	/* Write a new file and rename it over the old, for loaders. */
+	if ((tmp = malloc (strlen (path) + 8)) == NULL)
+		goto out;
+	sprintf (tmp, "%s.XXXXXX", path);
+
+	if ((fd = mkstemp (tmp)) == -1)
+		goto out_tmp;
+	if ((fp = fdopen (fd, "w")) == NULL) {
+		close (fd);
+		unlink (tmp);
+		goto out_tmp;
+	}
+
+	memset (pad, 0, sizeof(pad));
+	memcpy (pad, &hdr, sizeof(hdr));
+
+	if (fwrite (pad, sizeof(pad), 1, fp) != 1
+	    || fwrite (blocks, size, 1, fp) != 1
+	    || fflush (fp) != 0 || fchmod (fd, 0644) != 0
+	    || fsync (fd) != 0) {
+		fclose (fp);
+		unlink (tmp);
+		goto out_tmp;
+	}
+
+	if (fclose (fp) != 0 || rename (tmp, path) != 0) {
+		unlink (tmp);
+		goto out_tmp;
+	}
+
+	r = LIBMSR_ERR_OK;
+
+out_tmp:
+	free (tmp);
+out:
+	free (blocks);
+	return r;
+}
+
+static struct bl_map *map (const char *path)
+{
+	struct bl_hdr hdr;
+	struct bl_map *m;
+	struct stat st;
+	int fd;
+
+	if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if (fstat (fd, &st) != 0 || st.st_size < BL_HDRLEN
+	    || pread (fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+	    || memcmp (hdr.magic, BL_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != BL_VERSION
+	    || hdr.nblocks == 0 || hdr.nblocks > UINT32_MAX
+	    || (uint64_t) st.st_size != BL_HDRLEN
+	    + hdr.nblocks * BL_BLOCKLEN
+	    || (m = malloc (sizeof(*m))) == NULL) {
+		close (fd);
+		return NULL;
+	}
+
+	m->size = st.st_size;
+	m->base = mmap (NULL, m->size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+		fd, 0);
+	close (fd);
+
+	if (m->base == MAP_FAILED) {
+		free (m);
+		return NULL;
+	}
+
+	m->blocks = (const uint32_t *) ((const uint8_t *) m->base + BL_HDRLEN);
+	m->nblocks = hdr.nblocks;
+	m->k0 = hdr.k0;
+	m->k1 = hdr.k1;
+
+	return m;
+}
+
+static void unmap (struct bl_map *m)
+{
+	if (m == NULL)
+		return;
+
+	munmap (m->base, m->size);
+	free (m);
+}
+
+int msr_blocklist_create(msr_blocklist_t **blp)
+{
+	msr_blocklist_t *bl;
+
+	if (posix_memalign ((void **) &bl, 64, sizeof(*bl)) != 0)
+		return LIBMSR_ERR_GENERIC;
+
+	memset (bl, 0, sizeof(*bl));
+	pthread_mutex_init (&bl->load, NULL);
+
+	*blp = bl;
+	return LIBMSR_ERR_OK;
+}
+
+void msr_blocklist_destroy(msr_blocklist_t *bl)
+{
+	if (bl == NULL)
+		return;
+
+	unmap (bl->cur);
+	pthread_mutex_destroy (&bl->load);
+	free (bl);
+}
+
+int msr_blocklist_load(msr_blocklist_t *bl, const char *path)
+{
+	struct bl_map *m, *old;
+	unsigned long g;
+
+	if ((m = map (path)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	pthread_mutex_lock (&bl->load);
+
+	old = __atomic_exchange_n (&bl->cur, m, __ATOMIC_SEQ_CST);
+	g = __atomic_fetch_add (&bl->gen, 1, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n (&bl->active[g & 1].n, __ATOMIC_SEQ_CST) != 0)
+		sched_yield ();
+
+	pthread_mutex_unlock (&bl->load);
+
+	unmap (old);
+	return LIBMSR_ERR_OK;
+}
+
+int msr_blocklist_check(msr_blocklist_t *bl, const uint8_t *pan, size_t len)
+{
+	const struct bl_map *m;
+	unsigned long g;
+	uint64_t h;
+	int r = MSR_SCREEN_UNCHECKED;
+
+	for (;;) {
+		g = __atomic_load_n (&bl->gen, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add (&bl->active[g & 1].n, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&bl->gen, __ATOMIC_SEQ_CST) == g)
+			break;
+		__atomic_fetch_sub (&bl->active[g & 1].n, 1, __ATOMIC_RELEASE);
+	}
+
+	m = __atomic_load_n (&bl->cur, __ATOMIC_ACQUIRE);
+
+	if (m != NULL && pan_hash (m->k0, m->k1, pan, len, &h))
+		r = test (m, h) ? MSR_SCREEN_HIT : MSR_SCREEN_CLEAR;
+
+	__atomic_fetch_sub (&bl->active[g & 1].n, 1, __ATOMIC_RELEASE);
+
+	return r;
+}
+
+int msr_blocklist_screen(msr_blocklist_t *bl, const msr_tracks_t *tracks)
+{
+	msr_iso_fields_t f;
+	int tn;
+
+	/* Track 2 is the one most often present, and the quickest to parse. */
+	for (tn = 1; tn >= 0; tn--) {
+		if (msr_iso7813_parse (tracks, tn, &f) != LIBMSR_ERR_OK
+		    || f.msr_pan.msr_len == 0)
+			continue;
+		return msr_blocklist_check (bl,
+			MSR_VIEW_PTR(tracks->msr_tracks[tn].msr_tk_data,
+			f.msr_pan), f.msr_pan.msr_len);
+	}
+
+	return MSR_SCREEN_UNCHECKED;
+}
+
+int msr_iso_read_screened(int fd, msr_tracks_t *tracks,
+	msr_blocklist_t *bl, int *screen)
+{
+	int r;
+
+	*screen = MSR_SCREEN_UNCHECKED;
+
+	r = msr_iso_read (fd, tracks);
+
+	if (r == LIBMSR_ERR_OK || r == LIBMSR_ERR_ISO)
+		*screen = msr_blocklist_screen (bl, tracks);
+
+	return r;
+}
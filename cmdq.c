@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+
+#include "msr_internal.h"
+
+/*
+ * Command queues.
+ *
+ * A queue holds a whole workflow, built up front. Commands that are
+ * answered straight away (settings, tests, LEDs) are sent back to back
+ * in a single write, from frames prepared when they were queued, and
+ * their answers are then matched to them in order; the device handles
+ * commands strictly in sequence, so the Nth answer belongs to the Nth
+ * command that has one. Commands that wait for a swipe are barriers:
+ * everything before them is answered and checked first, so a card is
+ * never written with settings that failed to apply. An LED change ends
+ * a write, since the device may drop a command sent hard on its heels;
+ * whatever follows waits out the pause msr_flash_led() makes.
+ */
+
+#define CMDQ_BATCH 256
+
+/* Whether a queued command waits for a swipe. */
+static int is_barrier (uint8_t op)
+{
+	switch (op) {
+	case MSR_CMDQ_ERASE:
+	case MSR_CMDQ_ISO_WRITE:
+	case MSR_CMDQ_RAW_WRITE:
+	case MSR_CMDQ_ISO_READ:
+	case MSR_CMDQ_RAW_READ:
+		return 1;
+	}
+
+	return 0;
+}
+
+void msr_cmdq_init(msr_cmdq_t *q)
+{
+	q->msr_ops = NULL;
+	q->msr_nops = 0;
+	q->msr_cap = 0;
+}
+
+void msr_cmdq_free(msr_cmdq_t *q)
+{
+	free (q->msr_ops);
+	msr_cmdq_init (q);
+}
+
+void msr_cmdq_clear(msr_cmdq_t *q)
+{
+	q->msr_nops = 0;
+}
+
+static msr_cmdq_op_t *push (msr_cmdq_t *q, uint8_t op, uint8_t cmd, int *idx)
+{
+	msr_cmdq_op_t *ops, *o;
+	size_t cap;
+
+	if (q->msr_nops == q->msr_cap) {
+		cap = q->msr_cap ? q->msr_cap * 2 : 16;
+		if ((ops = realloc (q->msr_ops, cap * sizeof(*ops))) == NULL)
+			return NULL;
+		q->msr_ops = ops;
+		q->msr_cap = cap;
+	}
+
+	*idx = q->msr_nops;
+	o = &q->msr_ops[q->msr_nops++];
+	memset (o, 0, sizeof(*o));
+	o->msr_op = op;
+	o->msr_result = MSR_CMDQ_NOT_RUN;
+
+	/* Every command starts the same way. */
+	o->msr_frame[0] = MSR_ESC;
+	o->msr_frame[1] = cmd;
+	o->msr_framelen = 2;
+
+	return o;
+}
+
+static int push_simple (msr_cmdq_t *q, uint8_t op, uint8_t cmd)
+{
+	int idx;
+
+	if (push (q, op, cmd, &idx) == NULL)
+		return -1;
+
+	return idx;
+}
+
+int msr_cmdq_commtest(msr_cmdq_t *q)
+{
+	return push_simple (q, MSR_CMDQ_COMMTEST, MSR_CMD_DIAG_COMM);
+}
+
+int msr_cmdq_set_hi_co(msr_cmdq_t *q)
+{
+	return push_simple (q, MSR_CMDQ_SET_HI_CO, MSR_CMD_SETCO_HI);
+}
+
+int msr_cmdq_set_lo_co(msr_cmdq_t *q)
+{
+	return push_simple (q, MSR_CMDQ_SET_LO_CO, MSR_CMD_SETCO_LO);
+}
+
+int msr_cmdq_get_co(msr_cmdq_t *q)
+{
+	return push_simple (q, MSR_CMDQ_GET_CO, MSR_CMD_GETCO);
+}
+
+int msr_cmdq_set_bpi(msr_cmdq_t *q, uint8_t bpi)
+{
+	msr_cmdq_op_t *o;
+	int idx;
+
+	if ((o = push (q, MSR_CMDQ_SET_BPI, MSR_CMD_SETBPI, &idx)) == NULL)
+		return -1;
+
+	o->msr_frame[o->msr_framelen++] = bpi;
+
+	return idx;
+}
+
+int msr_cmdq_set_bpc(msr_cmdq_t *q, uint8_t bpc1, uint8_t bpc2, uint8_t bpc3)
+{
+	msr_cmdq_op_t *o;
+	int idx;
+
+	if ((o = push (q, MSR_CMDQ_SET_BPC, MSR_CMD_SETBPC, &idx)) == NULL)
+		return -1;
+
+	o->msr_frame[o->msr_framelen++] = bpc1;
+	o->msr_frame[o->msr_framelen++] = bpc2;
+	o->msr_frame[o->msr_framelen++] = bpc3;
+
+	return idx;
+}
+
+int msr_cmdq_led(msr_cmdq_t *q, uint8_t led)
+{
+	msr_cmdq_op_t *o;
+	int idx;
+
+	if ((o = push (q, MSR_CMDQ_LED, led, &idx)) == NULL)
+		return -1;
+
+	return idx;
+}
+
+int msr_cmdq_erase(msr_cmdq_t *q, uint8_t tracks)
+{
+	msr_cmdq_op_t *o;
+	int idx;
+
+	if ((o = push (q, MSR_CMDQ_ERASE, MSR_CMD_ERASE, &idx)) == NULL)
+		return -1;
+
+	o->msr_mask = tracks;
+
+	return idx;
+}
+
+static int push_tracks (msr_cmdq_t *q, uint8_t op, uint8_t cmd,
+	msr_tracks_t *tracks)
+{
+	msr_cmdq_op_t *o;
+	int idx;
+
+	if ((o = push (q, op, cmd, &idx)) == NULL)
+		return -1;
+
+	o->msr_tracks = tracks;
+
+	return idx;
+}
+
+int msr_cmdq_iso_write(msr_cmdq_t *q, msr_tracks_t *tracks)
+{
+	return push_tracks (q, MSR_CMDQ_ISO_WRITE, MSR_CMD_WRITE, tracks);
+}
+
+int msr_cmdq_raw_write(msr_cmdq_t *q, msr_tracks_t *tracks)
+{
+	return push_tracks (q, MSR_CMDQ_RAW_WRITE, MSR_CMD_RAW_WRITE, tracks);
+}
+
+int msr_cmdq_iso_read(msr_cmdq_t *q, msr_tracks_t *tracks)
+{
+	return push_tracks (q, MSR_CMDQ_ISO_READ, MSR_CMD_READ, tracks);
+}
+
+int msr_cmdq_raw_read(msr_cmdq_t *q, msr_tracks_t *tracks)
+{
+	return push_tracks (q, MSR_CMDQ_RAW_READ, MSR_CMD_RAW_READ, tracks);
+}
+
+static int run_barrier (int fd, msr_cmdq_op_t *o)
+{
+	switch (o->msr_op) {
+	case MSR_CMDQ_ERASE:
+		return msr_erase (fd, o->msr_mask);
+	case MSR_CMDQ_ISO_WRITE:
+		return msr_iso_write (fd, o->msr_tracks);
+	case MSR_CMDQ_RAW_WRITE:
+		return msr_raw_write (fd, o->msr_tracks);
+	case MSR_CMDQ_ISO_READ:
+		return msr_iso_read (fd, o->msr_tracks);
+	case MSR_CMDQ_RAW_READ:
+		return msr_raw_read (fd, o->msr_tracks);
+	}
+
+	return LIBMSR_ERR_GENERIC;
+}
+
+static int getbyte (int fd, uint8_t *b)
+{
+	int r;
+
+	if ((r = msr_serial_readchar_timeout (fd, b, MSR_CMDQ_TIMEOUT)) == 1)
+		return LIBMSR_ERR_OK;
+
+	return msr_fail (fd, r == 0 ? LIBMSR_ERR_TIMEOUT : LIBMSR_ERR_SERIAL,
+	    MSR_PHASE_STATUS, 0, 0);
+}
+
+/*
+ * Read and check the answer to one streamed command. If the answer
+ * isn't shaped as expected, we can no longer tell which answer belongs
+ * to which command, and *lost is set.
+ */
+static int getresp (int fd, const msr_cmdq_op_t *o, int *lost)
+{
+	uint8_t b[2], echo[3];
+	int i, r;
+
+	*lost = 1;
+
+	switch (o->msr_op) {
+	case MSR_CMDQ_LED:
+		*lost = 0;
+		return LIBMSR_ERR_OK;
+
+	case MSR_CMDQ_COMMTEST:
+		/* As in msr_commtest(), the escape may be lost. */
+		while ((r = getbyte (fd, &b[0])) == LIBMSR_ERR_OK)
+			if (b[0] == MSR_STS_COMM_OK) {
+				*lost = 0;
+				return LIBMSR_ERR_OK;
+			}
+		return r;
+	}
+
+	if ((r = getbyte (fd, &b[0])) != LIBMSR_ERR_OK)
+		return r;
+	if (b[0] != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    b[0], 0);
+	if ((r = getbyte (fd, &b[1])) != LIBMSR_ERR_OK)
+		return r;
+
+	*lost = 0;
+
+	switch (o->msr_op) {
+	case MSR_CMDQ_GET_CO:
+		if (b[1] == MSR_CO_HI || b[1] == MSR_CO_LO)
+			return b[1];
+		break;
+
+	case MSR_CMDQ_SET_BPC:
+		if (b[1] != MSR_STS_OK)
+			break;
+		for (i = 0; i < 3; i++) {
+			if ((r = getbyte (fd, &echo[i])) != LIBMSR_ERR_OK) {
+				*lost = 1;
+				return r;
+			}
+		}
+		/* As in msr_set_bpc(), check what was actually set. */
+		if (memcmp (echo, &o->msr_frame[2], 3) != 0)
+			return msr_fail (fd, LIBMSR_ERR_DEVICE,
+			    MSR_PHASE_STATUS, MSR_STS_BPC_ERR, 0);
+		return LIBMSR_ERR_OK;
+
+	default:
+		if (b[1] == MSR_STS_OK)
+			return LIBMSR_ERR_OK;
+	}
+
+	return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS, b[1], 0);
+}
+
+/* Whether a result counts as a failure of its command. */
+static int failed (const msr_cmdq_op_t *o)
+{
+	if (o->msr_op == MSR_CMDQ_GET_CO)
+		return o->msr_result != MSR_CO_HI && o->msr_result != MSR_CO_LO;
+
+	return o->msr_result != LIBMSR_ERR_OK;
+}
+
+/* Keep track of the settings a streamed command changed. */
+static void note (struct msr_settings *set, const msr_cmdq_op_t *o)
+{
+	int ok = o->msr_result == LIBMSR_ERR_OK;
+
+	switch (o->msr_op) {
+	case MSR_CMDQ_SET_HI_CO:
+		set->co = ok ? MSR_CO_HI : 0;
+		break;
+	case MSR_CMDQ_SET_LO_CO:
+		set->co = ok ? MSR_CO_LO : 0;
+		break;
+	case MSR_CMDQ_GET_CO:
+		if (!failed (o))
+			set->co = o->msr_result;
+		break;
+	case MSR_CMDQ_SET_BPI:
+		set->bpi = ok ? o->msr_frame[2] : 0;
+		break;
+	case MSR_CMDQ_SET_BPC:
+		if (ok)
+			memcpy (set->bpc, &o->msr_frame[2], sizeof(set->bpc));
+		else
+			memset (set->bpc, 0, sizeof(set->bpc));
+		break;
+	}
+}
+
+/*
+ * Send a run of commands that are answered straight away, in a single
+ * write, then match up their answers. Returns the number of commands
+ * sent, which is less than n if they didn't all fit in one write or an
+ * LED change came before the end.
+ */
+static size_t run_batch (int fd, msr_cmdq_op_t *ops, size_t n)
+{
+	struct msr_devstate *ds = msr_devstate (fd);
+	struct msr_settings *set = msr_settings (fd);
+	uint8_t buf[CMDQ_BATCH];
+	size_t i, len = 0;
+	int lost = 0, r;
+
+	/*
+	 * A queued LED change goes first, and the batch waits for what is
+	 * left of its pause. If it can't be sent, the batch isn't either.
+	 */
+	if ((r = msr_led_flush (fd)) != LIBMSR_ERR_OK) {
+		ops[0].msr_result = r;
+		return 1;
+	}
+	msr_led_settle (fd);
+
+	for (i = 0; i < n && len + ops[i].msr_framelen <= sizeof(buf); i++) {
+		memcpy (buf + len, ops[i].msr_frame, ops[i].msr_framelen);
+		len += ops[i].msr_framelen;
+
+		/* As in msr_flash_led(), this supersedes anything queued. */
+		if (ops[i].msr_op == MSR_CMDQ_LED) {
+			if (ds != NULL) {
+				__atomic_store_n (&ds->led_pending, 0,
+				    __ATOMIC_RELEASE);
+				ds->led_applied = ops[i].msr_frame[1];
+			}
+			i++;
+			break;
+		}
+	}
+	n = i;
+
+	if (msr_serial_write (fd, buf, len) != (int) len) {
+		msr_fail (fd, LIBMSR_ERR_SERIAL, MSR_PHASE_COMMAND, 0, 0);
+		for (i = 0; i < n; i++)
+			ops[i].msr_result = LIBMSR_ERR_SERIAL;
+	} else {
+		/* What comes after the LED change waits out its pause. */
+		if (ops[n - 1].msr_op == MSR_CMDQ_LED)
+			msr_led_note (fd);
+
+		for (i = 0; i < n; i++) {
+			/* The rest of the batch fails the same way. */
+			if (lost) {
+				ops[i].msr_result = ops[i - 1].msr_result;
+				continue;
+			}
+
+			ops[i].msr_result = getresp (fd, &ops[i], &lost);
+			if (lost)
+				tcflush (fd, TCIFLUSH);
+		}
+	}
+
+	if (set != NULL)
+		for (i = 0; i < n; i++)
+			note (set, &ops[i]);
+
+	return n;
+}
+
+int msr_cmdq_submit(int fd, msr_cmdq_t *q)
+{
+	MSR_LOCKED(fd);
+	msr_cmdq_op_t *ops = q->msr_ops;
+	size_t i, j, n = q->msr_nops;
+	int ret = LIBMSR_ERR_OK;
+
+	for (i = 0; i < n; i++)
+		ops[i].msr_result = MSR_CMDQ_NOT_RUN;
+
+	for (i = 0; i < n && ret == LIBMSR_ERR_OK; ) {
+		if (is_barrier (ops[i].msr_op)) {
+			ops[i].msr_result = run_barrier (fd, &ops[i]);
+			ret = ops[i].msr_result;
+			i++;
+			continue;
+		}
+
+		for (j = i; j < n && !is_barrier (ops[j].msr_op); j++)
+			;
+
+		j = i + run_batch (fd, &ops[i], j - i);
+
+		/* Everything in the batch ran, so report the first failure. */
+		for (; i < j; i++)
+			if (failed (&ops[i]) && ret == LIBMSR_ERR_OK)
+				ret = ops[i].msr_result;
+	}
+
+	return ret;
+}
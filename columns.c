@@ -0,0 +1,1106 @@
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Columnar export of swipes, as Arrow IPC files.
+ *
+ * Records are gathered into batches. Each batch is decoded and parsed
+ * into one row of fields per record, split between the caller and a
+ * pool of threads started with the export, then laid out as one Arrow
+ * record batch. BIN, expiry and service code are
+ * dictionary encoded: each batch is preceded by a delta dictionary
+ * batch holding the values first seen in it. Statistics for each
+ * column are kept as rows are added and written into the footer's
+ * schema as field metadata.
+ *
+ * Arrow metadata is flatbuffers, which are built here back to front,
+ * children first, as the flatbuffers library does.
+ */
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_V5 4
+
+/* Message header types. */
+#define ARROW_SCHEMA 1
+#define ARROW_DICTIONARY 2
+#define ARROW_RECORDS 3
+
+/* Field types. */
+#define ARROW_INT 2
+#define ARROW_UTF8 5
+#define ARROW_BOOL 6
+
+/* The most threads a batch is parsed by. */
+#define COL_MAXTHREADS 64
+
+/* The number of columns that are dictionary encoded. */
+#define COL_NDICT 3
+
+/* The most fields in a flatbuffers table built here. */
+#define FB_MAXFIELDS 8
+
+static const char *const col_names[MSR_COLUMNS] = {
+	"bin", "exp", "svc", "pan_len", "luhn_ok", "track",
+};
+
+/* A flatbuffer, built from the end of buf towards its start. */
+struct fb {
+	uint8_t *buf;
+	size_t cap, len;
+	uint32_t field[FB_MAXFIELDS]; /* where the open table's fields are */
+	int nfields;
+	size_t start;
+	int err;
+};
+
+/* The fields of one record. String fields are packed by pack(). */
+struct col_row {
+	uint64_t val[COL_NDICT]; /* 0 if absent */
+	uint8_t track; /* 1 or 2, or 0 if neither parsed */
+	uint8_t pan_len;
+	uint8_t luhn;
+};
+
+/* A dictionary: a hash table of values to indexes, and the values. */
+struct col_dict {
+	uint64_t *keys;
+	int32_t *ids;
+	size_t cap;
+	uint64_t *vals;
+	size_t n, vcap;
+	size_t written; /* how many values are in the file */
+};
+
+struct col_job {
+	msr_columns_t *w;
+	const msr_tracks_t *recs;
+	struct col_row *rows;
+	size_t n;
+	int flags;
+};
+
+/* An Arrow message body: buffers, each 8-byte aligned. */
+struct col_body {
+	uint8_t *buf;
+	size_t len, cap;
+	uint64_t bufs[2 * 2 * MSR_COLUMNS]; /* offset and length of each */
+	int nbufs;
+	uint64_t nodes[2 * MSR_COLUMNS]; /* length and null count of each */
+	int nnodes;
+	int err;
+};
+
+struct msr_columns {
+	FILE *fp;
+	char *path, *tmp;
+	int flags;
+	uint64_t off;
+	msr_tracks_t *recs; /* the batch being gathered */
+	struct col_row *rows;
+	size_t nrecs;
+	struct col_dict dict[COL_NDICT];
+	uint64_t *blocks[2]; /* dictionary and record batch blocks */
+	size_t nblocks[2], bcap[2];
+	uint8_t seen[MSR_COLUMNS][32]; /* the small values seen */
+	msr_colstats_t stats[MSR_COLUMNS];
+	int batches;
+
+	/* The pool; thread i parses jobs[i], and the caller the last job. */
+	pthread_t threads[COL_MAXTHREADS - 1];
+	int nstarted;
+	struct col_job jobs[COL_MAXTHREADS];
+	pthread_mutex_t lock; /* guards what follows */
+	pthread_cond_t go, done;
+	unsigned long gen; /* batches handed out */
+	int pending; /* threads still parsing their share */
+	int stop;
+};
+
+static void fb_push (struct fb *b, const void *p, size_t n)
+{
+	uint8_t *nb;
+	size_t cap;
+
+	if (b->err || n == 0)
+		return;
+
+	if (b->len + n > b->cap) {
+		for (cap = b->cap ? b->cap * 2 : 1024; cap < b->len + n;)
+			cap *= 2;
+		if ((nb = malloc (cap)) == NULL) {
+			b->err = 1;
+			return;
+		}
+		if (b->len > 0)
+			memcpy (nb + cap - b->len, b->buf + b->cap - b->len,
+			    b->len);
+		free (b->buf);
+		b->buf = nb;
+		b->cap = cap;
+	}
+
+	b->len += n;
+	if (p != NULL)
+		memcpy (b->buf + b->cap - b->len, p, n);
+	else
+		memset (b->buf + b->cap - b->len, 0, n);
+}
+
+/* Pad so that n more bytes end on an a-byte boundary. */
+static void fb_align (struct fb *b, size_t a, size_t n)
+{
+	fb_push (b, NULL, (a - (b->len + n) % a) % a);
+}
+
+/* Push an n-byte little-endian scalar, aligned to its size. */
+static void fb_scalar (struct fb *b, uint64_t v, size_t n)
+{
+	uint8_t t[8];
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		t[i] = v >> (8 * i);
+
+	fb_align (b, n, n);
+	fb_push (b, t, n);
+}
+
+/* An offset, from where it is about to be pushed, to ref. */
+static void fb_offset (struct fb *b, uint32_t ref)
+{
+	fb_align (b, 4, 4);
+	fb_scalar (b, b->len + 4 - ref, 4);
+}
+
+static uint32_t fb_string (struct fb *b, const char *s, size_t n)
+{
+	fb_align (b, 4, n + 1);
+	fb_push (b, NULL, 1);
+	fb_push (b, s, n);
+	fb_scalar (b, n, 4);
+
+	return b->len;
+}
+
+static uint32_t fb_offsets (struct fb *b, const uint32_t *refs, size_t n)
+{
+	size_t i;
+
+	for (i = n; i-- > 0;)
+		fb_offset (b, refs[i]);
+	fb_scalar (b, n, 4);
+
+	return b->len;
+}
+
+/* A vector of n structs, each made of 64-bit words. */
+static uint32_t fb_structs (struct fb *b, const uint64_t *words,
+	size_t nwords, size_t n)
+{
+	fb_align (b, 8, 0);
+	while (nwords-- > 0)
+		fb_scalar (b, words[nwords], 8);
+	fb_scalar (b, n, 4);
+
+	return b->len;
+}
+
+static void fb_start (struct fb *b)
+{
+	memset (b->field, 0, sizeof(b->field));
+	b->nfields = 0;
+	b->start = b->len;
+}
+
+static void fb_mark (struct fb *b, int id)
+{
+	b->field[id] = b->len;
+	if (id >= b->nfields)
+		b->nfields = id + 1;
+}
+
+static void fb_add (struct fb *b, int id, uint64_t v, size_t n)
+{
+	fb_scalar (b, v, n);
+	fb_mark (b, id);
+}
+
+static void fb_addref (struct fb *b, int id, uint32_t ref)
+{
+	fb_offset (b, ref);
+	fb_mark (b, id);
+}
+
+static uint32_t fb_end (struct fb *b)
+{
+	uint8_t vt[2 * (2 + FB_MAXFIELDS)];
+	uint32_t t, v;
+	int i;
+
+	fb_align (b, 4, 4);
+	fb_push (b, NULL, 4);
+	t = b->len;
+
+	vt[0] = 4 + 2 * b->nfields;
+	vt[1] = 0;
+	vt[2] = t - b->start;
+	vt[3] = (t - b->start) >> 8;
+	for (i = 0; i < b->nfields; i++) {
+		v = b->field[i] ? t - b->field[i] : 0;
+		vt[4 + 2 * i] = v;
+		vt[5 + 2 * i] = v >> 8;
+	}
+	fb_push (b, vt, vt[0]);
+
+	if (b->err)
+		return 0;
+
+	/* The table starts with the signed offset back to its vtable. */
+	v = b->len - t;
+	for (i = 0; i < 4; i++)
+		b->buf[b->cap - t + i] = v >> (8 * i);
+
+	return t;
+}
+
+static void fb_finish (struct fb *b, uint32_t root)
+{
+	fb_align (b, 8, 4);
+	fb_offset (b, root);
+}
+
+static const uint8_t *fb_data (const struct fb *b)
+{
+	return b->buf + b->cap - b->len;
+}
+
+static void fb_reset (struct fb *b)
+{
+	b->len = 0;
+	b->err = 0;
+}
+
+/* Pack a short string into a nonzero key, with its length on top. */
+static uint64_t pack (const uint8_t *s, size_t n)
+{
+	uint64_t v = (uint64_t) n << 56;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		v |= (uint64_t) s[i] << (8 * i);
+
+	return v;
+}
+
+static size_t unpack (uint64_t v, char *s)
+{
+	size_t n = v >> 56, i;
+
+	for (i = 0; i < n; i++)
+		s[i] = v >> (8 * i);
+	s[n] = '\0';
+
+	return n;
+}
+
+static void parse_row (const msr_tracks_t *rec, int flags,
+	struct col_row *row)
+{
+	msr_decode_info_t info;
+	msr_iso_fields_t f;
+	msr_tracks_t iso;
+	const msr_tracks_t *t = rec;
+	const uint8_t *d;
+	int tn;
+
+	memset (row, 0, sizeof(*row));
+
+	if (flags & MSR_COLUMNS_RAW) {
+		msr_iso_decode (rec, &iso, &info);
+		t = &iso;
+	}
+
+	for (tn = 1; tn >= 0; tn--)
+		if (msr_iso7813_parse (t, tn, &f) == LIBMSR_ERR_OK)
+			break;
+	if (tn < 0)
+		return;
+
+	d = t->msr_tracks[tn].msr_tk_data;
+	row->track = tn + 1;
+	row->pan_len = f.msr_pan.msr_len;
+	row->luhn = f.msr_luhn_ok;
+
+	if (f.msr_pan.msr_len >= 6)
+		row->val[MSR_COL_BIN] = pack (MSR_VIEW_PTR(d, f.msr_pan), 6);
+	if (f.msr_exp.msr_len == 4)
+		row->val[MSR_COL_EXP] = pack (MSR_VIEW_PTR(d, f.msr_exp), 4);
+	if (f.msr_svc.msr_len == 3)
+		row->val[MSR_COL_SVC] = pack (MSR_VIEW_PTR(d, f.msr_svc), 3);
+}
+
+static void parse_job (const struct col_job *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->n; i++)
+		parse_row (&job->recs[i], job->flags, &job->rows[i]);
+}
+
+/* A pool thread: parse a share of each batch as it is handed out. */
+static void *parse_thread (void *arg)
+{
+	struct col_job *job = arg;
+	msr_columns_t *w = job->w;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock (&w->lock);
+	for (;;) {
+		while (w->gen == gen && !w->stop)
+			pthread_cond_wait (&w->go, &w->lock);
+		if (w->stop)
+			break;
+		gen = w->gen;
+		pthread_mutex_unlock (&w->lock);
+
+		parse_job (job);
+
+		pthread_mutex_lock (&w->lock);
+		if (--w->pending == 0)
+			pthread_cond_signal (&w->done);
+	}
+	pthread_mutex_unlock (&w->lock);
+
+	return NULL;
+}
+
+/* Parse the gathered batch, split between the pool and the caller. */
+static void parse_batch (msr_columns_t *w)
+{
+	size_t per, first = 0;
+	int i, n = w->nstarted + 1;
+
+	per = (w->nrecs + n - 1) / n;
+
+	for (i = 0; i < n; i++) {
+		w->jobs[i].recs = w->recs + first;
+		w->jobs[i].rows = w->rows + first;
+		w->jobs[i].n = w->nrecs - first < per ? w->nrecs - first : per;
+		first += w->jobs[i].n;
+	}
+
+	if (n > 1) {
+		pthread_mutex_lock (&w->lock);
+		w->pending = n - 1;
+		w->gen++;
+		pthread_cond_broadcast (&w->go);
+		pthread_mutex_unlock (&w->lock);
+	}
+
+	parse_job (&w->jobs[n - 1]);
+
+	if (n > 1) {
+		pthread_mutex_lock (&w->lock);
+		while (w->pending > 0)
+			pthread_cond_wait (&w->done, &w->lock);
+		pthread_mutex_unlock (&w->lock);
+	}
+}
+
+static int dict_grow (struct col_dict *d)
+{
+	size_t cap = d->cap ? d->cap * 2 : 1024, i, j;
+	uint64_t *keys;
+	int32_t *ids;
+
+	keys = calloc (cap, sizeof(*keys));
+	ids = malloc (cap * sizeof(*ids));
+	if (keys == NULL || ids == NULL) {
+		free (keys);
+		free (ids);
+		return -1;
+	}
+
+	for (i = 0; i < d->cap; i++) {
+		if (d->keys[i] == 0)
+			continue;
+		for (j = (d->keys[i] * 0x9E3779B97F4A7C15ULL) >> 40 & (cap - 1);
+		    keys[j] != 0; j = (j + 1) & (cap - 1))
+			;
+		keys[j] = d->keys[i];
+		ids[j] = d->ids[i];
+	}
+
+	free (d->keys);
+	free (d->ids);
+	d->keys = keys;
+	d->ids = ids;
+	d->cap = cap;
+
+	return 0;
+}
+
+/* Find a value's index in a dictionary, adding it if it's new. */
+static int32_t dict_index (struct col_dict *d, uint64_t key,
+	msr_colstats_t *st)
+{
+	size_t i, mask;
+	char s[8];
+	void *p;
+
+	if (d->n * 2 >= d->cap && dict_grow (d) != 0)
+		return -1;
+
+	mask = d->cap - 1;
+	for (i = (key * 0x9E3779B97F4A7C15ULL) >> 40 & mask; d->keys[i] != 0;
+	    i = (i + 1) & mask)
+		if (d->keys[i] == key)
+			return d->ids[i];
+
+	if (d->n == d->vcap) {
+		d->vcap = d->vcap ? d->vcap * 2 : 1024;
+		if ((p = realloc (d->vals, d->vcap * sizeof(*d->vals))) == NULL)
+			return -1;
+		d->vals = p;
+	}
+
+	d->keys[i] = key;
+	d->ids[i] = d->n;
+	d->vals[d->n] = key;
+
+	/* Only a new value can be a new minimum or maximum. */
+	unpack (key, s);
+	if (d->n == 0 || strcmp (s, st->msr_min) < 0)
+		strcpy (st->msr_min, s);
+	if (d->n == 0 || strcmp (s, st->msr_max) > 0)
+		strcpy (st->msr_max, s);
+
+	st->msr_distinct = d->n + 1;
+	return d->n++;
+}
+
+static void dict_free (struct col_dict *d)
+{
+	free (d->keys);
+	free (d->ids);
+	free (d->vals);
+}
+
+static void body_add (struct col_body *bd, const void *p, size_t n)
+{
+	size_t pad = (8 - n % 8) % 8, cap;
+	void *nb;
+
+	if (bd->err)
+		return;
+
+	if (bd->len + n + pad > bd->cap) {
+		for (cap = bd->cap ? bd->cap * 2 : 65536;
+		    cap < bd->len + n + pad;)
+			cap *= 2;
+		if ((nb = realloc (bd->buf, cap)) == NULL) {
+			bd->err = 1;
+			return;
+		}
+		bd->buf = nb;
+		bd->cap = cap;
+	}
+
+	bd->bufs[2 * bd->nbufs] = bd->len;
+	bd->bufs[2 * bd->nbufs + 1] = n;
+	bd->nbufs++;
+
+	if (n > 0)
+		memcpy (bd->buf + bd->len, p, n);
+	if (pad > 0)
+		memset (bd->buf + bd->len + n, 0, pad);
+	bd->len += n + pad;
+}
+
+static void body_node (struct col_body *bd, uint64_t len, uint64_t nulls)
+{
+	bd->nodes[2 * bd->nnodes] = len;
+	bd->nodes[2 * bd->nnodes + 1] = nulls;
+	bd->nnodes++;
+}
+
+static void body_reset (struct col_body *bd)
+{
+	bd->len = 0;
+	bd->nbufs = 0;
+	bd->nnodes = 0;
+}
+
+static int put_le (msr_columns_t *w, uint64_t v, size_t n)
+{
+	uint8_t t[8];
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		t[i] = v >> (8 * i);
+
+	w->off += n;
+	return fwrite (t, n, 1, w->fp) == 1 ? 0 : -1;
+}
+
+/*
+ * Write an encapsulated message: a marker, the metadata's length, the
+ * metadata and the body. Its place is kept for the footer if which is
+ * 0 or 1, for dictionaries or record batches.
+ */
+static int write_message (msr_columns_t *w, const struct fb *b,
+	const struct col_body *bd, int which)
+{
+	uint64_t off = w->off, *blk;
+	size_t cap;
+	void *p;
+
+	if (b->err || (bd != NULL && bd->err))
+		return -1;
+
+	if (put_le (w, 0xFFFFFFFF, 4) != 0 || put_le (w, b->len, 4) != 0
+	    || fwrite (fb_data (b), b->len, 1, w->fp) != 1)
+		return -1;
+	w->off += b->len;
+
+	if (bd != NULL && bd->len > 0) {
+		if (fwrite (bd->buf, bd->len, 1, w->fp) != 1)
+			return -1;
+		w->off += bd->len;
+	}
+
+	if (which < 0)
+		return 0;
+
+	if (w->nblocks[which] == w->bcap[which]) {
+		cap = w->bcap[which] ? w->bcap[which] * 2 : 64;
+		if ((p = realloc (w->blocks[which], cap * 3 * sizeof(*blk)))
+		    == NULL)
+			return -1;
+		w->blocks[which] = p;
+		w->bcap[which] = cap;
+	}
+
+	blk = w->blocks[which] + 3 * w->nblocks[which]++;
+	blk[0] = off;
+	blk[1] = 8 + b->len;
+	blk[2] = bd != NULL ? bd->len : 0;
+
+	return 0;
+}
+
+/* Build a RecordBatch table for a body. */
+static uint32_t record_batch (struct fb *b, const struct col_body *bd,
+	uint64_t length)
+{
+	uint32_t nodes, bufs;
+
+	nodes = fb_structs (b, bd->nodes, 2 * bd->nnodes, bd->nnodes);
+	bufs = fb_structs (b, bd->bufs, 2 * bd->nbufs, bd->nbufs);
+
+	fb_start (b);
+	fb_add (b, 0, length, 8);
+	fb_addref (b, 1, nodes);
+	fb_addref (b, 2, bufs);
+	return fb_end (b);
+}
+
+static uint32_t message (struct fb *b, int type, uint32_t header,
+	uint64_t bodylen)
+{
+	uint32_t m;
+
+	fb_start (b);
+	fb_add (b, 3, bodylen, 8);
+	fb_addref (b, 2, header);
+	fb_add (b, 0, ARROW_V5, 2);
+	fb_add (b, 1, type, 1);
+	m = fb_end (b);
+
+	fb_finish (b, m);
+	return m;
+}
+
+static uint32_t int_type (struct fb *b, int bits, int is_signed)
+{
+	fb_start (b);
+	fb_add (b, 0, bits, 4);
+	fb_add (b, 1, is_signed, 1);
+	return fb_end (b);
+}
+
+static uint32_t key_value (struct fb *b, const char *key, const char *val)
+{
+	uint32_t k, v;
+
+	k = fb_string (b, key, strlen (key));
+	v = fb_string (b, val, strlen (val));
+
+	fb_start (b);
+	fb_addref (b, 0, k);
+	fb_addref (b, 1, v);
+	return fb_end (b);
+}
+
+/* A field's statistics, as Arrow key-value metadata. */
+static uint32_t stats_metadata (struct fb *b, const msr_colstats_t *st)
+{
+	uint32_t kv[5];
+	char num[3][24];
+
+	snprintf (num[0], sizeof(num[0]), "%llu",
+		(unsigned long long) st->msr_count);
+	snprintf (num[1], sizeof(num[1]), "%llu",
+		(unsigned long long) st->msr_nulls);
+	snprintf (num[2], sizeof(num[2]), "%llu",
+		(unsigned long long) st->msr_distinct);
+
+	kv[0] = key_value (b, "count", num[0]);
+	kv[1] = key_value (b, "null_count", num[1]);
+	kv[2] = key_value (b, "distinct_count", num[2]);
+	kv[3] = key_value (b, "min", st->msr_min);
+	kv[4] = key_value (b, "max", st->msr_max);
+
+	return fb_offsets (b, kv, 5);
+}
+
+static uint32_t field (struct fb *b, int col, const msr_colstats_t *st)
+{
+	uint32_t name, type, dict = 0, children, meta = 0;
+	int type_id;
+
+	name = fb_string (b, col_names[col], strlen (col_names[col]));
+
+	if (col < COL_NDICT) {
+		type_id = ARROW_UTF8;
+		fb_start (b);
+		type = fb_end (b);
+
+		dict = int_type (b, 32, 1);
+		fb_start (b);
+		fb_add (b, 0, col, 8);
+		fb_addref (b, 1, dict);
+		dict = fb_end (b);
+	} else if (col == MSR_COL_LUHN) {
+		type_id = ARROW_BOOL;
+		fb_start (b);
+		type = fb_end (b);
+	} else {
+		type_id = ARROW_INT;
+		type = int_type (b, 8, 0);
+	}
+
+	children = fb_offsets (b, NULL, 0);
+	if (st != NULL)
+		meta = stats_metadata (b, st);
+
+	fb_start (b);
+	fb_addref (b, 0, name);
+	fb_addref (b, 3, type);
+	if (dict != 0)
+		fb_addref (b, 4, dict);
+	fb_addref (b, 5, children);
+	if (meta != 0)
+		fb_addref (b, 6, meta);
+	fb_add (b, 1, 1, 1);
+	fb_add (b, 2, type_id, 1);
+	return fb_end (b);
+}
+
+static uint32_t schema (struct fb *b, const msr_colstats_t *stats)
+{
+	uint32_t fields[MSR_COLUMNS], v;
+	int i;
+
+	for (i = 0; i < MSR_COLUMNS; i++)
+		fields[i] = field (b, i, stats != NULL ? &stats[i] : NULL);
+	v = fb_offsets (b, fields, MSR_COLUMNS);
+
+	fb_start (b);
+	fb_addref (b, 1, v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	fb_add (b, 0, 1, 2);
+#endif
+	return fb_end (b);
+}
+
+/* Write a batch's new dictionary values, as a delta after the first. */
+static int write_dict (msr_columns_t *w, struct fb *b, struct col_body *bd,
+	int col)
+{
+	struct col_dict *d = &w->dict[col];
+	size_t n = d->n - d->written, i, len = 0;
+	int32_t *offs;
+	uint8_t *chars;
+	uint32_t rb, db;
+	int r;
+
+	if (w->batches > 0 && n == 0)
+		return 0;
+
+	offs = malloc ((n + 1) * sizeof(*offs));
+	chars = malloc (n * 7 + 1);
+	if (offs == NULL || chars == NULL) {
+		free (offs);
+		free (chars);
+		return -1;
+	}
+
+	offs[0] = 0;
+	for (i = 0; i < n; i++) {
+		len += unpack (d->vals[d->written + i], (char *) chars + len);
+		offs[i + 1] = len;
+	}
+
+	body_reset (bd);
+	body_node (bd, n, 0);
+	body_add (bd, NULL, 0);
+	body_add (bd, offs, (n + 1) * sizeof(*offs));
+	body_add (bd, chars, len);
+
+	free (offs);
+	free (chars);
+
+	fb_reset (b);
+	rb = record_batch (b, bd, n);
+	fb_start (b);
+	fb_add (b, 0, col, 8);
+	fb_addref (b, 1, rb);
+	fb_add (b, 2, w->batches > 0, 1);
+	db = fb_end (b);
+	message (b, ARROW_DICTIONARY, db, bd->len);
+
+	if ((r = write_message (w, b, bd, 0)) == 0)
+		d->written = d->n;
+
+	return r;
+}
+
+static void bit_set (uint8_t *bits, size_t i)
+{
+	bits[i / 8] |= 1 << (i % 8);
+}
+
+/* Add a column's validity bitmap, or nothing if none are null. */
+static void add_validity (struct col_body *bd, const uint8_t *valid,
+	size_t n, uint64_t nulls)
+{
+	body_node (bd, n, nulls);
+	body_add (bd, valid, nulls > 0 ? (n + 7) / 8 : 0);
+}
+
+static int flush_batch (msr_columns_t *w)
+{
+	struct fb b;
+	struct col_body bd;
+	size_t n = w->nrecs, nb = (n + 7) / 8, i;
+	uint8_t *valid = NULL, *small = NULL, *bits;
+	int32_t *idx = NULL;
+	uint64_t nulls;
+	struct col_row *row;
+	msr_colstats_t *st;
+	int c, r = -1;
+
+	if (n == 0)
+		return 0;
+
+	parse_batch (w);
+
+	memset (&b, 0, sizeof(b));
+	memset (&bd, 0, sizeof(bd));
+
+	idx = malloc (COL_NDICT * n * sizeof(*idx));
+	valid = calloc (MSR_COLUMNS, nb);
+	small = malloc (2 * n + nb);
+	if (idx == NULL || valid == NULL || small == NULL)
+		goto out;
+	bits = small + 2 * n;
+	memset (bits, 0, nb);
+
+	/* Lay out the columns, adding new values to the dictionaries. */
+	for (i = 0; i < n; i++) {
+		row = &w->rows[i];
+		for (c = 0; c < COL_NDICT; c++) {
+			idx[c * n + i] = 0;
+			if (row->val[c] == 0)
+				continue;
+			if ((idx[c * n + i] = dict_index (&w->dict[c],
+			    row->val[c], &w->stats[c])) < 0)
+				goto out;
+			bit_set (valid + c * nb, i);
+		}
+
+		small[i] = row->pan_len;
+		small[n + i] = row->track;
+		if (row->track == 0)
+			continue;
+		for (c = COL_NDICT; c < MSR_COLUMNS; c++)
+			bit_set (valid + c * nb, i);
+		if (row->luhn)
+			bit_set (bits, i);
+		w->seen[MSR_COL_PAN_LEN][row->pan_len / 8] |=
+			1 << (row->pan_len % 8);
+		w->seen[MSR_COL_LUHN][0] |= 1 << !!row->luhn;
+		w->seen[MSR_COL_TRACK][0] |= 1 << row->track;
+	}
+
+	for (c = 0; c < COL_NDICT; c++)
+		if (write_dict (w, &b, &bd, c) != 0)
+			goto out;
+
+	body_reset (&bd);
+	for (c = 0; c < MSR_COLUMNS; c++) {
+		st = &w->stats[c];
+		for (i = 0, nulls = 0; i < nb; i++)
+			nulls += 8 - __builtin_popcount (valid[c * nb + i]);
+		nulls -= nb * 8 - n;
+		st->msr_count += n - nulls;
+		st->msr_nulls += nulls;
+
+		add_validity (&bd, valid + c * nb, n, nulls);
+		if (c < COL_NDICT)
+			body_add (&bd, idx + c * n, n * sizeof(*idx));
+		else if (c == MSR_COL_PAN_LEN)
+			body_add (&bd, small, n);
+		else if (c == MSR_COL_TRACK)
+			body_add (&bd, small + n, n);
+		else
+			body_add (&bd, bits, nb);
+	}
+
+	fb_reset (&b);
+	message (&b, ARROW_RECORDS, record_batch (&b, &bd, n), bd.len);
+
+	if (write_message (w, &b, &bd, 1) != 0)
+		goto out;
+
+	w->batches++;
+	w->nrecs = 0;
+	r = 0;
+
+out:
+	free (b.buf);
+	free (bd.buf);
+	free (idx);
+	free (valid);
+	free (small);
+	return r;
+}
+
+int msr_columns_create(const char *path, int flags, int nthreads,
+	msr_columns_t **wp)
+{
+	static const uint8_t magic[8] = ARROW_MAGIC;
+	msr_columns_t *w;
+	struct fb b;
+	long ncpu;
+	int fd, i, r;
+
+	if (nthreads <= 0) {
+		ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? ncpu : 1;
+	}
+	if (nthreads > COL_MAXTHREADS)
+		nthreads = COL_MAXTHREADS;
+
+	if ((w = calloc (1, sizeof(*w))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	w->flags = flags;
+	pthread_mutex_init (&w->lock, NULL);
+	pthread_cond_init (&w->go, NULL);
+	pthread_cond_init (&w->done, NULL);
+	w->recs = malloc (MSR_COLUMNS_BATCH * sizeof(*w->recs));
+	w->rows = malloc (MSR_COLUMNS_BATCH * sizeof(*w->rows));
+	w->path = strdup (path);
+	w->tmp = malloc (strlen (path) + 8);
+	if (w->recs == NULL || w->rows == NULL || w->path == NULL
+	    || w->tmp == NULL)
+		goto fail;
+
+	/* Write a new file and rename it over the old when finished. */
+	sprintf (w->tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp (w->tmp)) == -1)
+		goto fail;
+	if (fchmod (fd, 0644) != 0 || (w->fp = fdopen (fd, "w")) == NULL) {
+		close (fd);
+		unlink (w->tmp);
+		goto fail;
+	}
+
+	memset (&b, 0, sizeof(b));
+	message (&b, ARROW_SCHEMA, schema (&b, NULL), 0);
+
+	w->off = sizeof(magic);
+	r = fwrite (magic, sizeof(magic), 1, w->fp) != 1
+		|| write_message (w, &b, NULL, -1) != 0;
+	free (b.buf);
+
+	if (r) {
+		fclose (w->fp);
+		unlink (w->tmp);
+		goto fail;
+	}
+
+	/* Any threads that can't be started leave more to the caller. */
+	for (i = 0; i < COL_MAXTHREADS; i++) {
+		w->jobs[i].w = w;
+		w->jobs[i].flags = flags;
+	}
+	while (w->nstarted < nthreads - 1 && pthread_create (
+	    &w->threads[w->nstarted], NULL, parse_thread,
+	    &w->jobs[w->nstarted]) == 0)
+		w->nstarted++;
+
+	*wp = w;
+	return LIBMSR_ERR_OK;
+
+fail:
+	w->fp = NULL;
+	msr_columns_destroy (w);
+	return LIBMSR_ERR_GENERIC;
+}
+
+void msr_columns_destroy(msr_columns_t *w)
+{
+	int c;
+
+	if (w == NULL)
+		return;
+
+	if (w->fp != NULL) {
+		fclose (w->fp);
+		unlink (w->tmp);
+	}
+
+	pthread_mutex_lock (&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast (&w->go);
+	pthread_mutex_unlock (&w->lock);
+	for (c = 0; c < w->nstarted; c++)
+		pthread_join (w->threads[c], NULL);
+	pthread_cond_destroy (&w->done);
+	pthread_cond_destroy (&w->go);
+	pthread_mutex_destroy (&w->lock);
+
+	for (c = 0; c < COL_NDICT; c++)
+		dict_free (&w->dict[c]);
+	free (w->blocks[0]);
+	free (w->blocks[1]);
+	free (w->recs);
+	free (w->rows);
+	free (w->path);
+	free (w->tmp);
+	free (w);
+}
+
+int msr_columns_add(msr_columns_t *w, const msr_tracks_t *tracks, size_t n)
+{
+	size_t k;
+
+	if (w->fp == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	while (n > 0) {
+		k = MSR_COLUMNS_BATCH - w->nrecs;
+		if (k > n)
+			k = n;
+		memcpy (w->recs + w->nrecs, tracks, k * sizeof(*tracks));
+		w->nrecs += k;
+		tracks += k;
+		n -= k;
+
+		if (w->nrecs == MSR_COLUMNS_BATCH && flush_batch (w) != 0)
+			return LIBMSR_ERR_GENERIC;
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Fill in the statistics of the columns of small values. */
+static void small_stats (msr_columns_t *w)
+{
+	msr_colstats_t *st;
+	int c, v, lo, hi;
+
+	for (c = COL_NDICT; c < MSR_COLUMNS; c++) {
+		st = &w->stats[c];
+		st->msr_distinct = 0;
+		lo = hi = -1;
+		for (v = 0; v < 256; v++) {
+			if (!(w->seen[c][v / 8] & (1 << (v % 8))))
+				continue;
+			st->msr_distinct++;
+			if (lo < 0)
+				lo = v;
+			hi = v;
+		}
+		if (lo < 0)
+			continue;
+
+		if (c == MSR_COL_LUHN) {
+			strcpy (st->msr_min, lo ? "true" : "false");
+			strcpy (st->msr_max, hi ? "true" : "false");
+		} else {
+			snprintf (st->msr_min, sizeof(st->msr_min), "%d", lo);
+			snprintf (st->msr_max, sizeof(st->msr_max), "%d", hi);
+		}
+	}
+}
+
+int msr_columns_finish(msr_columns_t *w, msr_colstats_t *stats)
+{
+	static const uint8_t magic[6] = { 'A', 'R', 'R', 'O', 'W', '1' };
+	uint32_t s, dicts, recs, f;
+	struct fb b;
+	int r = LIBMSR_ERR_GENERIC;
+
+	if (w->fp == NULL || flush_batch (w) != 0)
+		return LIBMSR_ERR_GENERIC;
+
+	small_stats (w);
+
+	memset (&b, 0, sizeof(b));
+	s = schema (&b, w->stats);
+	dicts = fb_structs (&b, w->blocks[0], 3 * w->nblocks[0],
+		w->nblocks[0]);
+	recs = fb_structs (&b, w->blocks[1], 3 * w->nblocks[1],
+		w->nblocks[1]);
+	fb_start (&b);
+	fb_addref (&b, 1, s);
+	fb_addref (&b, 2, dicts);
+	fb_addref (&b, 3, recs);
+	fb_add (&b, 0, ARROW_V5, 2);
+	f = fb_end (&b);
+	fb_finish (&b, f);
+
+	/* The end of the stream, then the footer and its length. */
+	if (b.err || put_le (w, 0xFFFFFFFF, 4) != 0 || put_le (w, 0, 4) != 0
+	    || fwrite (fb_data (&b), b.len, 1, w->fp) != 1
+	    || put_le (w, b.len, 4) != 0
+	    || fwrite (magic, sizeof(magic), 1, w->fp) != 1)
+		goto out;
+
+	r = fclose (w->fp);
+	w->fp = NULL;
+	if (r != 0 || rename (w->tmp, w->path) != 0) {
+		unlink (w->tmp);
+		r = LIBMSR_ERR_GENERIC;
+		goto out;
+	}
+
+	if (stats != NULL)
+		memcpy (stats, w->stats, sizeof(w->stats));
+	r = LIBMSR_ERR_OK;
+
+out:
+	free (b.buf);
+	return r;
+}
@@ -0,0 +1,707 @@
+#define _GNU_SOURCE
+
+#include <sys/random.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRYPT_X86 1
+#endif
+
+#include "msr_internal.h"
+
+/*
+ * AES-GCM sealing of track data.
+ *
+ * Each track is sealed on its own, in place, under a 96-bit nonce made
+ * of 88 random bits drawn for its record and the track's index, so
+ * tracks can't be moved from one record or position to another without
+ * failing to open. Nonces are random rather than counted so that any
+ * number of processes can share a key. A repeat only becomes likely
+ * around 2^44 records, but as with any random nonce, a key should be
+ * replaced before 2^32 records have been sealed with it in all.
+ *
+ * On x86 CPUs with AES-NI and PCLMULQDQ, blocks are encrypted four at a
+ * time with AESENC and hashed with carry-less multiplies; otherwise a
+ * portable implementation is used. The portable AES looks bytes up in
+ * the S-box, so unlike the hardware path it isn't constant time.
+ */
+
+#define AES_BLOCK 16
+#define AES_MAXROUNDS 14
+
+struct msr_crypt {
+	uint8_t rk[(AES_MAXROUNDS + 1) * AES_BLOCK]; /* round keys */
+	int rounds;
+	uint8_t h[AES_BLOCK]; /* the hash subkey, E(0) */
+	uint64_t hh[16], hl[16]; /* portable GHASH table of multiples of H */
+	int hw; /* use AES-NI and PCLMULQDQ */
+};
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/* Reduction of the four bits shifted out of a GHASH product. */
+static const uint64_t last4[16] = {
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0,
+};
+
+static uint64_t get_be64 (const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static void put_be64 (uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v;
+}
+
+/* Expand a key into the standard schedule, which AES-NI can use as is. */
+static void aes_expand (const uint8_t *key, size_t keylen, uint8_t *rk)
+{
+	size_t nk = keylen / 4, i, n = (keylen / 4 + 7) * 4;
+	uint8_t t[4], rcon = 1, x;
+
+	memcpy (rk, key, keylen);
+
+	for (i = nk; i < n; i++) {
+		memcpy (t, rk + 4 * (i - 1), 4);
+		if (i % nk == 0) {
+			x = t[0];
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[x];
+			rcon = (rcon << 1) ^ ((rcon >> 7) * 0x1b);
+		} else if (nk > 6 && i % nk == 4) {
+			t[0] = sbox[t[0]];
+			t[1] = sbox[t[1]];
+			t[2] = sbox[t[2]];
+			t[3] = sbox[t[3]];
+		}
+		rk[4 * i] = rk[4 * (i - nk)] ^ t[0];
+		rk[4 * i + 1] = rk[4 * (i - nk) + 1] ^ t[1];
+		rk[4 * i + 2] = rk[4 * (i - nk) + 2] ^ t[2];
+		rk[4 * i + 3] = rk[4 * (i - nk) + 3] ^ t[3];
+	}
+}
+
+static uint8_t xtime (uint8_t b)
+{
+	return (b << 1) ^ ((b >> 7) * 0x1b);
+}
+
+static void aes_block (const msr_crypt_t *c, const uint8_t *in, uint8_t *out)
+{
+	uint8_t s[AES_BLOCK], t[AES_BLOCK], a, b, d, e;
+	int r, i;
+
+	for (i = 0; i < AES_BLOCK; i++)
+		s[i] = in[i] ^ c->rk[i];
+
+	for (r = 1; r <= c->rounds; r++) {
+		/* SubBytes and ShiftRows; the state is column-major. */
+		for (i = 0; i < AES_BLOCK; i++)
+			t[i] = sbox[s[(i + 4 * (i % 4)) % AES_BLOCK]];
+
+		/* MixColumns, on every round but the last. */
+		for (i = 0; r < c->rounds && i < AES_BLOCK; i += 4) {
+			a = t[i];
+			b = t[i + 1];
+			d = t[i + 2];
+			e = t[i + 3];
+			t[i] = xtime (a ^ b) ^ b ^ d ^ e;
+			t[i + 1] = xtime (b ^ d) ^ a ^ d ^ e;
+			t[i + 2] = xtime (d ^ e) ^ a ^ b ^ e;
+			t[i + 3] = xtime (e ^ a) ^ a ^ b ^ d;
+		}
+
+		for (i = 0; i < AES_BLOCK; i++)
+			s[i] = t[i] ^ c->rk[r * AES_BLOCK + i];
+	}
+
+	memcpy (out, s, AES_BLOCK);
+}
+
+/* Build the table of H times each 4-bit value, for ghash_mult(). */
+static void ghash_table (msr_crypt_t *c)
+{
+	uint64_t vh = get_be64 (c->h), vl = get_be64 (c->h + 8), t;
+	int i, j;
+
+	c->hh[0] = c->hl[0] = 0;
+	c->hh[8] = vh;
+	c->hl[8] = vl;
+
+	for (i = 4; i > 0; i >>= 1) {
+		t = (vl & 1) * 0xe1000000;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ (t << 32);
+		c->hh[i] = vh;
+		c->hl[i] = vl;
+	}
+
+	for (i = 2; i <= 8; i *= 2) {
+		for (j = 1; j < i; j++) {
+			c->hh[i + j] = c->hh[i] ^ c->hh[j];
+			c->hl[i + j] = c->hl[i] ^ c->hl[j];
+		}
+	}
+}
+
+/* x = x * H in GF(2^128), four bits at a time. */
+static void ghash_mult (const msr_crypt_t *c, uint8_t *x)
+{
+	uint64_t zh, zl;
+	uint8_t lo, hi, rem;
+	int i;
+
+	lo = x[15] & 0xf;
+	zh = c->hh[lo];
+	zl = c->hl[lo];
+
+	for (i = 15; i >= 0; i--) {
+		lo = x[i] & 0xf;
+		hi = x[i] >> 4;
+
+		if (i != 15) {
+			rem = zl & 0xf;
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ (last4[rem] << 48);
+			zh ^= c->hh[lo];
+			zl ^= c->hl[lo];
+		}
+
+		rem = zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ (last4[rem] << 48);
+		zh ^= c->hh[hi];
+		zl ^= c->hl[hi];
+	}
+
+	put_be64 (x, zh);
+	put_be64 (x + 8, zl);
+}
+
+/* Absorb a buffer into a GHASH, zero padding the last block. */
+static void ghash_update (const msr_crypt_t *c, uint8_t *x,
+	const uint8_t *p, size_t len)
+{
+	size_t i, n;
+
+	for (; len > 0; p += n, len -= n) {
+		n = len < AES_BLOCK ? len : AES_BLOCK;
+		for (i = 0; i < n; i++)
+			x[i] ^= p[i];
+		ghash_mult (c, x);
+	}
+}
+
+static void ctr_inc (uint8_t *ctr)
+{
+	int i;
+
+	for (i = AES_BLOCK - 1; i >= AES_BLOCK - 4; i--)
+		if (++ctr[i] != 0)
+			break;
+}
+
+/* Encrypt or decrypt in counter mode, from the block after j0. */
+static void ctr_xor (const msr_crypt_t *c, const uint8_t *j0, uint8_t *p,
+	size_t len)
+{
+	uint8_t ctr[AES_BLOCK], ks[AES_BLOCK];
+	size_t i, n;
+
+	memcpy (ctr, j0, AES_BLOCK);
+
+	for (; len > 0; p += n, len -= n) {
+		ctr_inc (ctr);
+		aes_block (c, ctr, ks);
+		n = len < AES_BLOCK ? len : AES_BLOCK;
+		for (i = 0; i < n; i++)
+			p[i] ^= ks[i];
+	}
+}
+
+/* The tag: E(J0) xor the GHASH of the AAD, ciphertext and lengths. */
+static void gcm_tag (const msr_crypt_t *c, const uint8_t *j0,
+	const uint8_t *aad, size_t aadlen, const uint8_t *ct, size_t len,
+	uint8_t *tag)
+{
+	uint8_t x[AES_BLOCK], lens[AES_BLOCK], ek[AES_BLOCK];
+	int i;
+
+	memset (x, 0, sizeof(x));
+	ghash_update (c, x, aad, aadlen);
+	ghash_update (c, x, ct, len);
+
+	put_be64 (lens, (uint64_t) aadlen * 8);
+	put_be64 (lens + 8, (uint64_t) len * 8);
+	ghash_update (c, x, lens, AES_BLOCK);
+
+	aes_block (c, j0, ek);
+	for (i = 0; i < AES_BLOCK; i++)
+		tag[i] = x[i] ^ ek[i];
+}
+
+#ifdef CRYPT_X86
+#define HW __attribute__((target("aes,pclmul,ssse3")))
+
+HW static __m128i hw_bswap (__m128i x)
+{
+	return _mm_shuffle_epi8 (x, _mm_set_epi8 (0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+/* Multiply in GF(2^128), on byte-reversed operands. */
+HW static __m128i hw_gfmul (__m128i a, __m128i b)
+{
+	__m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+	t3 = _mm_clmulepi64_si128 (a, b, 0x00);
+	t4 = _mm_clmulepi64_si128 (a, b, 0x10);
+	t5 = _mm_clmulepi64_si128 (a, b, 0x01);
+	t6 = _mm_clmulepi64_si128 (a, b, 0x11);
+
+	t4 = _mm_xor_si128 (t4, t5);
+	t5 = _mm_slli_si128 (t4, 8);
+	t4 = _mm_srli_si128 (t4, 8);
+	t3 = _mm_xor_si128 (t3, t5);
+	t6 = _mm_xor_si128 (t6, t4);
+
+	/* Shift the 256-bit product left by one, for the bit order. */
+	t7 = _mm_srli_epi32 (t3, 31);
+	t8 = _mm_srli_epi32 (t6, 31);
+	t3 = _mm_slli_epi32 (t3, 1);
+	t6 = _mm_slli_epi32 (t6, 1);
+	t9 = _mm_srli_si128 (t7, 12);
+	t8 = _mm_slli_si128 (t8, 4);
+	t7 = _mm_slli_si128 (t7, 4);
+	t3 = _mm_or_si128 (t3, t7);
+	t6 = _mm_or_si128 (t6, t8);
+	t6 = _mm_or_si128 (t6, t9);
+
+	/* Reduce modulo x^128 + x^7 + x^2 + x + 1. */
+	t7 = _mm_slli_epi32 (t3, 31);
+	t8 = _mm_slli_epi32 (t3, 30);
+	t9 = _mm_slli_epi32 (t3, 25);
+	t7 = _mm_xor_si128 (t7, t8);
+	t7 = _mm_xor_si128 (t7, t9);
+	t8 = _mm_srli_si128 (t7, 4);
+	t7 = _mm_slli_si128 (t7, 12);
+	t3 = _mm_xor_si128 (t3, t7);
+
+	t2 = _mm_srli_epi32 (t3, 1);
+	t4 = _mm_srli_epi32 (t3, 2);
+	t5 = _mm_srli_epi32 (t3, 7);
+	t2 = _mm_xor_si128 (t2, t4);
+	t2 = _mm_xor_si128 (t2, t5);
+	t2 = _mm_xor_si128 (t2, t8);
+	t3 = _mm_xor_si128 (t3, t2);
+
+	return _mm_xor_si128 (t6, t3);
+}
+
+HW static __m128i hw_load (const uint8_t *p, size_t n)
+{
+	uint8_t b[AES_BLOCK];
+
+	if (n == AES_BLOCK)
+		return _mm_loadu_si128 ((const __m128i *) p);
+
+	memset (b, 0, sizeof(b));
+	memcpy (b, p, n);
+	return _mm_loadu_si128 ((const __m128i *) b);
+}
+
+HW static __m128i hw_ghash (__m128i x, __m128i h, const uint8_t *p,
+	size_t len)
+{
+	size_t n;
+
+	for (; len > 0; p += n, len -= n) {
+		n = len < AES_BLOCK ? len : AES_BLOCK;
+		x = hw_gfmul (_mm_xor_si128 (x, hw_bswap (hw_load (p, n))), h);
+	}
+
+	return x;
+}
+
+HW static __m128i hw_aes (const msr_crypt_t *c, __m128i b)
+{
+	const __m128i *rk = (const __m128i *) c->rk;
+	int r;
+
+	b = _mm_xor_si128 (b, _mm_loadu_si128 (rk));
+	for (r = 1; r < c->rounds; r++)
+		b = _mm_aesenc_si128 (b, _mm_loadu_si128 (rk + r));
+
+	return _mm_aesenclast_si128 (b, _mm_loadu_si128 (rk + r));
+}
+
+/* Encrypt four blocks at once, interleaving their rounds. */
+HW static void hw_aes4 (const msr_crypt_t *c, __m128i *b)
+{
+	const __m128i *rk = (const __m128i *) c->rk;
+	__m128i k = _mm_loadu_si128 (rk);
+	int r, i;
+
+	for (i = 0; i < 4; i++)
+		b[i] = _mm_xor_si128 (b[i], k);
+
+	for (r = 1; r < c->rounds; r++) {
+		k = _mm_loadu_si128 (rk + r);
+		for (i = 0; i < 4; i++)
+			b[i] = _mm_aesenc_si128 (b[i], k);
+	}
+
+	k = _mm_loadu_si128 (rk + r);
+	for (i = 0; i < 4; i++)
+		b[i] = _mm_aesenclast_si128 (b[i], k);
+}
+
+HW static void hw_ctr_xor (const msr_crypt_t *c, const uint8_t *j0,
+	uint8_t *p, size_t len)
+{
+	/* Byte-reversed, the 32-bit big-endian counter is the low lane. */
+	const __m128i one = _mm_set_epi32 (0, 0, 0, 1);
+	__m128i ctr = hw_bswap (_mm_loadu_si128 ((const __m128i *) j0));
+	__m128i b[4];
+	uint8_t ks[4 * AES_BLOCK];
+	size_t i, n;
+	int k;
+
+	for (; len > 0; p += n, len -= n) {
+		for (k = 0; k < 4; k++) {
+			ctr = _mm_add_epi32 (ctr, one);
+			b[k] = hw_bswap (ctr);
+		}
+		hw_aes4 (c, b);
+
+		n = len < sizeof(ks) ? len : sizeof(ks);
+		if (n == sizeof(ks)) {
+			for (k = 0; k < 4; k++)
+				_mm_storeu_si128 ((__m128i *) (p + k * AES_BLOCK),
+				    _mm_xor_si128 (b[k], _mm_loadu_si128 (
+				    (const __m128i *) (p + k * AES_BLOCK))));
+			continue;
+		}
+
+		/* Unused counters are dropped; this is the last pass. */
+		for (k = 0; k < 4; k++)
+			_mm_storeu_si128 ((__m128i *) (ks + k * AES_BLOCK), b[k]);
+		for (i = 0; i < n; i++)
+			p[i] ^= ks[i];
+	}
+}
+
+HW static void hw_tag (const msr_crypt_t *c, const uint8_t *j0,
+	const uint8_t *aad, size_t aadlen, const uint8_t *ct, size_t len,
+	uint8_t *tag)
+{
+	__m128i h = hw_bswap (_mm_loadu_si128 ((const __m128i *) c->h));
+	__m128i x = _mm_setzero_si128 ();
+	uint8_t lens[AES_BLOCK];
+
+	x = hw_ghash (x, h, aad, aadlen);
+	x = hw_ghash (x, h, ct, len);
+
+	put_be64 (lens, (uint64_t) aadlen * 8);
+	put_be64 (lens + 8, (uint64_t) len * 8);
+	x = hw_ghash (x, h, lens, AES_BLOCK);
+
+	x = _mm_xor_si128 (hw_bswap (x),
+		hw_aes (c, _mm_loadu_si128 ((const __m128i *) j0)));
+	_mm_storeu_si128 ((__m128i *) tag, x);
+}
+
+static int hw_usable (void)
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid (1, &a, &b, &c, &d))
+		return 0;
+
+	return (c & bit_AES) && (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+#endif
+
+static void gcm_j0 (const uint8_t *nonce, uint8_t *j0)
+{
+	memcpy (j0, nonce, 12);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+}
+
+static void gcm_xor (const msr_crypt_t *c, const uint8_t *j0, uint8_t *p,
+	size_t len)
+{
+#ifdef CRYPT_X86
+	if (c->hw) {
+		hw_ctr_xor (c, j0, p, len);
+		return;
+	}
+#endif
+	ctr_xor (c, j0, p, len);
+}
+
+static void gcm_hash (const msr_crypt_t *c, const uint8_t *j0,
+	const uint8_t *aad, size_t aadlen, const uint8_t *ct, size_t len,
+	uint8_t *tag)
+{
+#ifdef CRYPT_X86
+	if (c->hw) {
+		hw_tag (c, j0, aad, aadlen, ct, len, tag);
+		return;
+	}
+#endif
+	gcm_tag (c, j0, aad, aadlen, ct, len, tag);
+}
+
+/* Seal a buffer in place under a 96-bit nonce. */
+static void gcm_seal (const msr_crypt_t *c, const uint8_t *nonce,
+	const uint8_t *aad, size_t aadlen, uint8_t *p, size_t len,
+	uint8_t *tag)
+{
+	uint8_t j0[AES_BLOCK];
+
+	gcm_j0 (nonce, j0);
+	gcm_xor (c, j0, p, len);
+	gcm_hash (c, j0, aad, aadlen, p, len, tag);
+}
+
+/* Check a sealed buffer's tag, in constant time. */
+static int gcm_check (const msr_crypt_t *c, const uint8_t *nonce,
+	const uint8_t *aad, size_t aadlen, const uint8_t *p, size_t len,
+	const uint8_t *tag)
+{
+	uint8_t j0[AES_BLOCK], t[AES_BLOCK], diff = 0;
+	int i;
+
+	gcm_j0 (nonce, j0);
+	gcm_hash (c, j0, aad, aadlen, p, len, t);
+
+	for (i = 0; i < AES_BLOCK; i++)
+		diff |= t[i] ^ tag[i];
+
+	return diff == 0;
+}
+
+int msr_crypt_create(const uint8_t *key, size_t keylen, msr_crypt_t **cp)
+{
+	msr_crypt_t *c;
+	uint8_t zero[AES_BLOCK];
+
+	if (keylen != 16 && keylen != 24 && keylen != 32)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((c = calloc (1, sizeof(*c))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	aes_expand (key, keylen, c->rk);
+	c->rounds = keylen / 4 + 6;
+
+	memset (zero, 0, sizeof(zero));
+	aes_block (c, zero, c->h);
+	ghash_table (c);
+
+#ifdef CRYPT_X86
+	c->hw = hw_usable ();
+#endif
+
+	*cp = c;
+	return LIBMSR_ERR_OK;
+}
+
+void msr_crypt_destroy(msr_crypt_t *c)
+{
+	if (c == NULL)
+		return;
+
+	explicit_bzero (c, sizeof(*c));
+	free (c);
+}
+
+int msr_crypt_hw(const msr_crypt_t *c)
+{
+	return c->hw;
+}
+
+/* The random part of a nonce; the last byte is the track's index. */
+#define NONCE_RANDOM 11
+
+/* Records whose nonces are drawn with one getrandom() call. */
+#define NONCE_BATCH (256 / NONCE_RANDOM)
+
+/* Fill a buffer with random bytes, or fail rather than run short. */
+static int fill_random (uint8_t *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = getrandom (buf, len, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+int msr_crypt_begin(msr_seal_t *seal)
+{
+	if (fill_random (seal->msr_nonce, NONCE_RANDOM) != 0)
+		return LIBMSR_ERR_GENERIC;
+	seal->msr_nonce[NONCE_RANDOM] = 0;
+
+	return LIBMSR_ERR_OK;
+}
+
+void msr_crypt_seal_track(const msr_crypt_t *c, msr_seal_t *seal, int tn,
+	msr_track_t *tk)
+{
+	uint8_t nonce[12];
+
+	memcpy (nonce, seal->msr_nonce, sizeof(nonce));
+	nonce[11] = tn;
+
+	gcm_seal (c, nonce, NULL, 0, tk->msr_tk_data, tk->msr_tk_len,
+		seal->msr_tag[tn]);
+}
+
+static void seal_tracks (const msr_crypt_t *c, msr_tracks_t *tracks,
+	msr_seal_t *seal)
+{
+	int tn;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++)
+		msr_crypt_seal_track (c, seal, tn, &tracks->msr_tracks[tn]);
+}
+
+int msr_crypt_seal(msr_crypt_t *c, msr_tracks_t *tracks, msr_seal_t *seal)
+{
+	int r;
+
+	if ((r = msr_crypt_begin (seal)) != LIBMSR_ERR_OK)
+		return r;
+
+	seal_tracks (c, tracks, seal);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_crypt_open(const msr_crypt_t *c, msr_tracks_t *tracks,
+	const msr_seal_t *seal)
+{
+	uint8_t nonce[12], j0[AES_BLOCK];
+	msr_track_t *tk;
+	int tn;
+
+	memcpy (nonce, seal->msr_nonce, sizeof(nonce));
+
+	/* Check every track before opening any, so all or none are. */
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		tk = &tracks->msr_tracks[tn];
+		nonce[11] = tn;
+		if (!gcm_check (c, nonce, NULL, 0, tk->msr_tk_data,
+		    tk->msr_tk_len, seal->msr_tag[tn]))
+			return LIBMSR_ERR_GENERIC;
+	}
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		tk = &tracks->msr_tracks[tn];
+		nonce[11] = tn;
+		gcm_j0 (nonce, j0);
+		gcm_xor (c, j0, tk->msr_tk_data, tk->msr_tk_len);
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_crypt_seal_batch(msr_crypt_t *c, msr_tracks_t *tracks, size_t n,
+	msr_seal_t *seals)
+{
+	uint8_t rnd[NONCE_BATCH * NONCE_RANDOM];
+	size_t i, j, k;
+
+	/* Draw the nonces for several records at a time. */
+	for (i = 0; i < n; i += k) {
+		k = n - i < NONCE_BATCH ? n - i : NONCE_BATCH;
+		if (fill_random (rnd, k * NONCE_RANDOM) != 0)
+			return LIBMSR_ERR_GENERIC;
+
+		for (j = 0; j < k; j++) {
+			memcpy (seals[i + j].msr_nonce, rnd + j * NONCE_RANDOM,
+				NONCE_RANDOM);
+			seals[i + j].msr_nonce[NONCE_RANDOM] = 0;
+			seal_tracks (c, &tracks[i + j], &seals[i + j]);
+		}
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+size_t msr_crypt_open_batch(const msr_crypt_t *c, msr_tracks_t *tracks,
+	size_t n, const msr_seal_t *seals, int *status)
+{
+	size_t i, ok = 0;
+	int r;
+
+	for (i = 0; i < n; i++) {
+		r = msr_crypt_open (c, &tracks[i], &seals[i]);
+		if (status != NULL)
+			status[i] = r;
+		ok += r == LIBMSR_ERR_OK;
+	}
+
+	return ok;
+}
@@ -0,0 +1,442 @@
+#include <string.h>
+
+#include "msr_internal.h"
+
+/*
+ * In-library ISO decoding of raw tracks.
+ *
+ * Raw tracks hold the bits in the order they come off the card, most
+ * significant bit of each byte first. Each character is bpc bits wide,
+ * least significant bit first, with the last bit being odd parity. A
+ * track is a run of leading zeros, a start sentinel, the data, an end
+ * sentinel and a longitudinal redundancy check (LRC) character.
+ */
+
+struct charset {
+	int bpc;
+	uint8_t ss; /* start sentinel, without parity */
+	uint8_t es; /* end sentinel, without parity */
+	uint8_t base; /* added to a data value to get its character */
+};
+
+static const struct charset charsets[] = {
+	{ 5, 0x0B, 0x0F, 0x30 }, /* ISO numeric: ';' and '?' */
+	{ 7, 0x05, 0x1F, 0x20 }, /* ISO alphanumeric: '%' and '?' */
+	{ 8, 0x25, 0x3F, 0x00 }, /* 7-bit ASCII: '%' and '?' */
+};
+
+static const struct charset *charset_for(int bpc)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(charsets) / sizeof(charsets[0]); i++)
+		if (charsets[i].bpc == bpc)
+			return &charsets[i];
+
+	return NULL;
+}
+
+/* Add odd parity to a (bpc - 1)-bit value. */
+static unsigned int with_parity(unsigned int v, int bpc)
+{
+	return v | (!__builtin_parity(v) << (bpc - 1));
+}
+
+/*
+ * Read n bits of a character starting at bit pos, the first bit read
+ * being the least significant. When reversed, the track is read from
+ * its last bit backwards, as if the card had been swiped the other way.
+ */
+static unsigned int getbits(const uint8_t *buf, int nbits, int pos, int n,
+	int reverse)
+{
+	unsigned int v = 0;
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		k = reverse ? nbits - 1 - (pos + i) : pos + i;
+		v |= ((buf[k >> 3] >> (7 - (k & 7))) & 1) << i;
+	}
+
+	return v;
+}
+
+/*
+ * What we found walking a track from its start sentinel.
+ */
+struct walk {
+	int good; /* characters with good parity, including the sentinel */
+	int es; /* whether the end sentinel was found */
+	int clean; /* whether the LRC after the end sentinel matched */
+};
+
+/*
+ * Walk a track from the start sentinel at bit pos, decoding characters
+ * into iso (if given) until the end sentinel or a parity error.
+ */
+static void walk(const msr_track_t *raw, msr_track_t *iso,
+	const struct charset *cs, int reverse, int pos, struct walk *w)
+{
+	int nbits = raw->msr_tk_len * 8;
+	int bpc = cs->bpc;
+	unsigned int mask = (1U << (bpc - 1)) - 1;
+	unsigned int c, lrc = cs->ss;
+	uint8_t len = 0;
+
+	memset(w, 0, sizeof(*w));
+	w->good = 1;
+
+	for (pos += bpc; pos + bpc <= nbits; pos += bpc) {
+		c = getbits(raw->msr_tk_data, nbits, pos, bpc, reverse);
+
+		if (!__builtin_parity(c))
+			break;
+
+		w->good++;
+		lrc ^= c & mask;
+
+		if ((c & mask) == cs->es) {
+			w->es = 1;
+			pos += bpc;
+			if (pos + bpc > nbits)
+				break;
+
+			c = getbits(raw->msr_tk_data, nbits, pos, bpc, reverse);
+			w->clean = c == with_parity(lrc, bpc);
+			break;
+		}
+
+		if (iso && len < MSR_MAX_TRACK_LEN)
+			iso->msr_tk_data[len++] = (c & mask) + cs->base;
+	}
+
+	if (iso)
+		iso->msr_tk_len = len;
+}
+
+/*
+ * Decode one track at one character width and direction, searching
+ * for the start sentinel. Returns the number of well-formed characters
+ * found, and sets *clean if the whole track checked out.
+ */
+static int decode_one(const msr_track_t *raw, msr_track_t *iso,
+	const struct charset *cs, int reverse, int *clean)
+{
+	int nbits = raw->msr_tk_len * 8;
+	unsigned int ss = with_parity(cs->ss, cs->bpc);
+	struct walk w;
+	int pos;
+
+	*clean = 0;
+	iso->msr_tk_len = 0;
+
+	for (pos = 0; pos + cs->bpc <= nbits; pos++)
+		if (getbits(raw->msr_tk_data, nbits, pos, cs->bpc, reverse) == ss)
+			break;
+
+	if (pos + cs->bpc > nbits)
+		return 0;
+
+	walk(raw, iso, cs, reverse, pos, &w);
+	*clean = w.clean;
+
+	return w.good;
+}
+
+/*
+ * Start sentinels, with parity, as they appear in the 8 bits following
+ * a track's first set bit (the first bit read in bit 0). Each entry is
+ * a mask of the charsets[] whose start sentinel matches: bit 0 for 5-bit
+ * ';', bit 1 for 7-bit '%' and bit 2 for 8-bit '%'.
+ */
+static const uint8_t ss_match[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/*
+ * How far past the first set bit to keep looking for a start sentinel,
+ * in case of noise in the leading zeros.
+ */
+#define DETECT_SCAN 32
+
+/* The index of the first set bit of a track read in a direction, or -1. */
+static int first_one(const msr_track_t *raw, int reverse)
+{
+	int i, n = raw->msr_tk_len;
+
+	if (!reverse) {
+		for (i = 0; i < n; i++)
+			if (raw->msr_tk_data[i])
+				return i * 8 + __builtin_clz(raw->msr_tk_data[i]) - 24;
+	} else {
+		for (i = n - 1; i >= 0; i--)
+			if (raw->msr_tk_data[i])
+				return (n - 1 - i) * 8
+					+ __builtin_ctz(raw->msr_tk_data[i]);
+	}
+
+	return -1;
+}
+
+/*
+ * Score a walk out of 100: 100 for a clean track, otherwise mostly
+ * by how much of the data on the track decoded with good parity.
+ */
+static int confidence(const struct walk *w, int bpc, int span)
+{
+	int expect, conf;
+
+	if (w->clean)
+		return 100;
+
+	expect = span / bpc;
+	if (expect < 1)
+		expect = 1;
+
+	conf = w->good * 90 / expect;
+	if (conf > 90)
+		conf = 90;
+	if (w->es)
+		conf += 9;
+
+	return conf;
+}
+
+/*
+ * Find the character width and direction that best explain a track.
+ * Ties go to the preferred width, if any.
+ */
+static void detect(const msr_track_t *raw, int prefer, msr_detect_t *det)
+{
+	int nbits = raw->msr_tk_len * 8;
+	int rev, pos, first, last, n, i, conf;
+	unsigned int m;
+	struct walk w;
+
+	memset(det, 0, sizeof(*det));
+
+	for (rev = 0; rev < 2; rev++) {
+		if ((first = first_one(raw, rev)) < 0)
+			return;
+		last = nbits - first_one(raw, !rev);
+
+		for (pos = first; pos < nbits && pos <= first + DETECT_SCAN;
+		    pos++) {
+			n = nbits - pos < 8 ? nbits - pos : 8;
+			m = ss_match[getbits(raw->msr_tk_data, nbits, pos, n, rev)];
+
+			for (i = 0; m; i++, m >>= 1) {
+				if (!(m & 1))
+					continue;
+
+				walk(raw, NULL, &charsets[i], rev, pos, &w);
+				conf = confidence(&w, charsets[i].bpc, last - pos);
+
+				if (conf > det->msr_confidence
+				    || (conf == det->msr_confidence && conf > 0
+				    && charsets[i].bpc == prefer)) {
+					det->msr_confidence = conf;
+					det->msr_bpc = charsets[i].bpc;
+					det->msr_reversed = rev;
+					det->msr_lz = pos;
+				}
+			}
+		}
+	}
+}
+
+int msr_detect_track(const msr_track_t *raw, msr_detect_t *det)
+{
+	detect(raw, 0, det);
+
+	return det->msr_confidence ? LIBMSR_ERR_OK : LIBMSR_ERR_ISO;
+}
+
+int msr_detect_decode(const msr_track_t *raw, msr_track_t *iso,
+	msr_detect_t *det)
+{
+	struct walk w;
+
+	iso->msr_tk_len = 0;
+
+	if (msr_detect_track(raw, det) != LIBMSR_ERR_OK)
+		return LIBMSR_ERR_ISO;
+
+	walk(raw, iso, charset_for(det->msr_bpc), det->msr_reversed,
+		det->msr_lz, &w);
+
+	return w.clean ? LIBMSR_ERR_OK : LIBMSR_ERR_ISO;
+}
+
+int msr_iso_decode_track(const msr_track_t *raw, msr_track_t *iso, int bpc,
+	int reverse)
+{
+	const struct charset *cs;
+	int clean;
+
+	if ((cs = charset_for(bpc)) == NULL) {
+		iso->msr_tk_len = 0;
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	decode_one(raw, iso, cs, reverse, &clean);
+
+	return clean ? LIBMSR_ERR_OK : LIBMSR_ERR_ISO;
+}
+
+/* Append a character of bpc bits to a raw track being built. */
+static void putbits(uint8_t *buf, int *pos, unsigned int v, int bpc)
+{
+	int i;
+
+	for (i = 0; i < bpc; i++, (*pos)++)
+		if ((v >> i) & 1)
+			buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+}
+
+int msr_iso_encode_track(const msr_track_t *iso, msr_track_t *raw, int bpc)
+{
+	const struct charset *cs;
+	const uint8_t *d = iso->msr_tk_data;
+	unsigned int mask, v, lrc;
+	int i, start = 0, end = iso->msr_tk_len, pos = 0;
+
+	raw->msr_tk_len = 0;
+
+	if ((cs = charset_for(bpc)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	mask = (1U << (bpc - 1)) - 1;
+
+	/* Sentinels are optional, as with msr_iso_write(). */
+	if (end > 0 && d[0] == cs->ss + cs->base)
+		start = 1;
+	if (end > start && d[end - 1] == cs->es + cs->base)
+		end--;
+
+	/* The data, plus the sentinels and LRC. */
+	if ((end - start + 3) * bpc > MSR_MAX_TRACK_LEN * 8)
+		return LIBMSR_ERR_ISO;
+
+	memset(raw->msr_tk_data, 0, MSR_MAX_TRACK_LEN);
+
+	lrc = cs->ss;
+	putbits(raw->msr_tk_data, &pos, with_parity(cs->ss, bpc), bpc);
+
+	for (i = start; i < end; i++) {
+		v = d[i] - cs->base;
+		if (d[i] < cs->base || v > mask || v == cs->es)
+			return LIBMSR_ERR_ISO;
+
+		lrc ^= v;
+		putbits(raw->msr_tk_data, &pos, with_parity(v, bpc), bpc);
+	}
+
+	lrc ^= cs->es;
+	putbits(raw->msr_tk_data, &pos, with_parity(cs->es, bpc), bpc);
+	putbits(raw->msr_tk_data, &pos, with_parity(lrc, bpc), bpc);
+
+	raw->msr_tk_len = (pos + 7) / 8;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* The usual character widths of each track. */
+static const uint8_t default_bpc[MSR_MAX_TRACKS] = { 7, 5, 5 };
+
+int msr_iso_decode(const msr_tracks_t *raw, msr_tracks_t *iso,
+	msr_decode_info_t *info)
+{
+	msr_track_t tmp;
+	msr_detect_t det;
+	struct walk w;
+	int tn, i, rev, clean, good, best, bpc;
+	int ret = LIBMSR_ERR_OK;
+
+	memset(info, 0, sizeof(*info));
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		const msr_track_t *t = &raw->msr_tracks[tn];
+		msr_track_t *out = &iso->msr_tracks[tn];
+
+		out->msr_tk_len = 0;
+		info->msr_status[tn] = LIBMSR_ERR_OK;
+		info->msr_bpc[tn] = default_bpc[tn];
+
+		if (t->msr_tk_len == 0)
+			continue;
+
+		/* Most tracks are settled by the detector. */
+		detect(t, default_bpc[tn], &det);
+		if (det.msr_confidence == 100) {
+			walk(t, out, charset_for(det.msr_bpc), det.msr_reversed,
+				det.msr_lz, &w);
+			info->msr_bpc[tn] = det.msr_bpc;
+			info->msr_reversed[tn] = det.msr_reversed;
+			continue;
+		}
+
+		/*
+		 * Otherwise, try the track's usual width first, then the
+		 * others, each in both directions, searching the whole track
+		 * for a start sentinel. Stop at the first clean decode, or
+		 * keep whichever attempt got furthest.
+		 */
+		info->msr_status[tn] = LIBMSR_ERR_ISO;
+		best = 0;
+		clean = 0;
+
+		for (i = -1; i < (int) (sizeof(charsets) / sizeof(charsets[0]))
+		    && !clean; i++) {
+			bpc = i < 0 ? default_bpc[tn] : charsets[i].bpc;
+			if (i >= 0 && bpc == default_bpc[tn])
+				continue;
+
+			for (rev = 0; rev < 2 && !clean; rev++) {
+				good = decode_one(t, &tmp, charset_for(bpc), rev,
+					&clean);
+
+				if (clean || good > best) {
+					best = good;
+					memcpy(out, &tmp, sizeof(tmp));
+					info->msr_bpc[tn] = bpc;
+					info->msr_reversed[tn] = rev;
+				}
+			}
+		}
+
+		if (clean)
+			info->msr_status[tn] = LIBMSR_ERR_OK;
+		else
+			ret = LIBMSR_ERR_ISO;
+	}
+
+	return ret;
+}
+
+int msr_dual_read(int fd, msr_tracks_t *raw, msr_tracks_t *iso,
+	msr_decode_info_t *info)
+{
+	MSR_LOCKED(fd);
+	int r;
+
+	if ((r = msr_raw_read(fd, raw)) != LIBMSR_ERR_OK)
+		return r;
+
+	return msr_iso_decode(raw, iso, info);
+}
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Per-device state.
+ *
+ * libmsr identifies devices by fd, so state that has to outlive a single
+ * call (learned timings and the like) is kept in a table indexed by fd.
+ */
+
+static struct msr_devstate devstates[MSR_MAX_DEVFD];
+
+struct msr_devstate *msr_devstate(int fd)
+{
+	if (fd < 0 || fd >= MSR_MAX_DEVFD)
+		return NULL;
+
+	return &devstates[fd];
+}
+
+void msr_devstate_reset(int fd)
+{
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) != NULL)
+		memset (ds, 0, sizeof(*ds));
+}
+
+struct msr_settings *msr_settings(int fd)
+{
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return NULL;
+
+	return &ds->settings;
+}
+
+/*
+ * Error records.
+ *
+ * Functions that fail record why with msr_fail() as they return, so the
+ * caller can look at the details afterwards without the error codes
+ * themselves having to carry them.
+ */
+
+int msr_fail(int fd, int code, int phase, uint8_t sts, int track)
+{
+	struct msr_devstate *ds;
+	int e = errno;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return code;
+
+	/* Serial failures on an unplugged device all come down to that. */
+	if (MSR_ERR_CLASS(code) == LIBMSR_ERR_SERIAL
+	    && __atomic_load_n (&ds->gone, __ATOMIC_ACQUIRE)) {
+		code = LIBMSR_ERR_DISCONNECT;
+		e = ENODEV;
+	}
+
+	ds->err.msr_code = code;
+	ds->err.msr_phase = phase;
+	ds->err.msr_sts = sts;
+	ds->err.msr_track = track;
+	ds->err.msr_errno = code == LIBMSR_ERR_SERIAL
+		|| code == LIBMSR_ERR_DISCONNECT ? e : 0;
+
+	return code;
+}
+
+int msr_last_error(int fd, msr_err_t *e)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	*e = ds->err;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_err_recovery(const msr_err_t *e)
+{
+	switch (e->msr_code) {
+	case LIBMSR_ERR_ISO:
+	case LIBMSR_ERR_VERIFY:
+		return MSR_RECOVER_RETRY;
+	case LIBMSR_ERR_FRAMING:
+	case LIBMSR_ERR_TIMEOUT:
+		return MSR_RECOVER_RESET;
+	case LIBMSR_ERR_SERIAL:
+	case LIBMSR_ERR_DISCONNECT:
+		return MSR_RECOVER_RECONNECT;
+	case LIBMSR_ERR_DEVICE:
+		break;
+	default:
+		return MSR_RECOVER_NONE;
+	}
+
+	switch (e->msr_sts) {
+	case MSR_STS_RW_CMDFMT_ERR:
+	case MSR_STS_RW_CMDBAD_ERR:
+		return MSR_RECOVER_RESET;
+	}
+
+	/* Any other status means the swipe or the card was bad. */
+	return MSR_RECOVER_RETRY;
+}
+
+/*
+ * Device locks.
+ *
+ * Each device has a recursive lock, so that public functions can call
+ * each other freely. The lock word is 0 when free, 1 when held and 2
+ * when held with waiters; a contended lock is spun on briefly before
+ * sleeping on a futex, since most exchanges with the device are short.
+ */
+
+#define LOCK_SPIN 100
+
+static __thread pid_t self;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+/* The child of a fork runs on with the forking thread's cached tid. */
+static void self_forget (void)
+{
+	self = 0;
+}
+
+static void self_init (void)
+{
+	pthread_atfork (NULL, NULL, self_forget);
+}
+
+static pid_t gettid_cached (void)
+{
+	if (self == 0) {
+		pthread_once (&self_once, self_init);
+		self = syscall (SYS_gettid);
+	}
+
+	return self;
+}
+
+static void futex (uint32_t *word, int op, uint32_t val)
+{
+	syscall (SYS_futex, word, op | FUTEX_PRIVATE_FLAG, val, NULL, NULL, 0);
+}
+
+struct msr_devstate *msr_devstate_lock(int fd)
+{
+	struct msr_devstate *ds;
+	uint32_t c;
+	pid_t tid;
+	int i;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return NULL;
+
+	tid = gettid_cached ();
+
+	if (__atomic_load_n (&ds->lock_owner, __ATOMIC_RELAXED) == tid) {
+		ds->lock_depth++;
+		return ds;
+	}
+
+	c = 0;
+	if (__atomic_compare_exchange_n (&ds->lock, &c, 1, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		goto locked;
+
+	/* Spinners don't mark the lock word, so they are counted apart. */
+	__atomic_add_fetch (&ds->spinning, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < LOCK_SPIN; i++) {
+		cpu_relax ();
+		c = 0;
+		if (__atomic_compare_exchange_n (&ds->lock, &c, 1, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (i < LOCK_SPIN) {
+		__atomic_sub_fetch (&ds->spinning, 1, __ATOMIC_RELAXED);
+		goto locked;
+	}
+
+	/*
+	 * Counted as waiting before we stop counting as spinning, so that
+	 * msr_devstate_close() never sees us as neither.
+	 */
+	__atomic_add_fetch (&ds->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch (&ds->spinning, 1, __ATOMIC_RELAXED);
+
+	while (__atomic_exchange_n (&ds->lock, 2, __ATOMIC_ACQUIRE) != 0) {
+		/* The device is being closed; give up on it. */
+		if (__atomic_load_n (&ds->closing, __ATOMIC_ACQUIRE)) {
+			__atomic_sub_fetch (&ds->waiting, 1, __ATOMIC_RELEASE);
+			return NULL;
+		}
+		futex (&ds->lock, FUTEX_WAIT, 2);
+	}
+	__atomic_sub_fetch (&ds->waiting, 1, __ATOMIC_RELAXED);
+
+locked:
+	__atomic_store_n (&ds->lock_owner, tid, __ATOMIC_RELAXED);
+	ds->lock_depth = 1;
+	__atomic_store_n (&ds->uses, ds->uses + 1, __ATOMIC_RELAXED);
+
+	return ds;
+}
+
+struct msr_devstate *msr_devstate_trylock(int fd)
+{
+	struct msr_devstate *ds;
+	uint32_t c = 0;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return NULL;
+
+	if (__atomic_load_n (&ds->lock_owner, __ATOMIC_RELAXED)
+	    == gettid_cached ()) {
+		ds->lock_depth++;
+		return ds;
+	}
+
+	if (!__atomic_compare_exchange_n (&ds->lock, &c, 1, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return NULL;
+
+	__atomic_store_n (&ds->lock_owner, gettid_cached (), __ATOMIC_RELAXED);
+	ds->lock_depth = 1;
+	__atomic_store_n (&ds->uses, ds->uses + 1, __ATOMIC_RELAXED);
+
+	return ds;
+}
+
+int msr_devstate_contended(const struct msr_devstate *ds)
+{
+	return __atomic_load_n (&ds->lock, __ATOMIC_RELAXED) == 2
+		|| __atomic_load_n (&ds->spinning, __ATOMIC_RELAXED) != 0;
+}
+
+void msr_devstate_unlock(struct msr_devstate *ds)
+{
+	if (ds == NULL || --ds->lock_depth > 0)
+		return;
+
+	__atomic_store_n (&ds->lock_owner, 0, __ATOMIC_RELAXED);
+
+	if (__atomic_exchange_n (&ds->lock, 0, __ATOMIC_RELEASE) == 2)
+		futex (&ds->lock, FUTEX_WAKE, 1);
+}
+
+void msr_devstate_unlock_scope(struct msr_devstate **ds)
+{
+	msr_devstate_unlock (*ds);
+}
+
+/*
+ * Close a device's fd and clear its state. The device is marked gone
+ * first, so the call holding its lock, if any, fails at its next I/O
+ * and lets go. Then the threads still waiting for the lock are woken
+ * and turned away, and their calls fail the same way. The lock word is
+ * moved under them each time, so none can go back to sleep on it, and
+ * the state is only cleared once they have all left.
+ */
+void msr_devstate_close(int fd)
+{
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL) {
+		close (fd);
+		return;
+	}
+
+	__atomic_store_n (&ds->gone, 1, __ATOMIC_RELEASE);
+	__atomic_store_n (&ds->closing, 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n (&ds->lock_owner, __ATOMIC_RELAXED)
+	    != gettid_cached ())
+		while (__atomic_exchange_n (&ds->lock, 2, __ATOMIC_ACQUIRE)
+		    != 0)
+			futex (&ds->lock, FUTEX_WAIT, 2);
+
+	while (__atomic_load_n (&ds->waiting, __ATOMIC_ACQUIRE) != 0
+	    || __atomic_load_n (&ds->spinning, __ATOMIC_ACQUIRE) != 0) {
+		__atomic_store_n (&ds->lock, 3, __ATOMIC_RELEASE);
+		futex (&ds->lock, FUTEX_WAKE, INT_MAX);
+		sched_yield ();
+	}
+
+	close (fd);
+	memset (ds, 0, sizeof(*ds));
+}
+
+int msr_lock(int fd)
+{
+	return msr_devstate_lock (fd) ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+}
+
+int msr_unlock(int fd)
+{
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL
+	    || __atomic_load_n (&ds->lock_owner, __ATOMIC_RELAXED)
+	       != gettid_cached ())
+		return LIBMSR_ERR_GENERIC;
+
+	msr_devstate_unlock (ds);
+
+	return LIBMSR_ERR_OK;
+}
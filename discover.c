@@ -0,0 +1,146 @@
+#include <glob.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+/*
+ * Device discovery.
+ *
+ * Every candidate port is probed on its own thread, so the fixed delays
+ * in msr_reset() overlap instead of adding up.
+ */
+
+struct probe {
+	const char *path;
+	speed_t baud;
+	int ok;
+	int threaded;
+	msr_dev_t dev;
+};
+
+static void *probe_thread (void *arg)
+{
+	struct probe *p = arg;
+	int fd;
+
+	p->ok = 0;
+
+	if (msr_serial_open ((char *) p->path, &fd, MSR_BLOCKING, p->baud)
+	    != LIBMSR_ERR_OK)
+		return NULL;
+
+	/* This is msr_init(), but without hanging on a silent port. */
+	msr_reset (fd);
+
+	if (msr_commtest_timeout (fd, MSR_DISCOVER_TIMEOUT) != LIBMSR_ERR_OK) {
+		msr_serial_close (fd);
+		return NULL;
+	}
+
+	msr_reset (fd);
+
+	if (msr_model (fd, p->dev.msr_model) != LIBMSR_ERR_OK
+	    || msr_fwrev (fd, p->dev.msr_fwrev) != LIBMSR_ERR_OK) {
+		msr_serial_close (fd);
+		return NULL;
+	}
+
+	p->dev.msr_fd = fd;
+	p->ok = 1;
+
+	return NULL;
+}
+
+int msr_discover(const char *pattern, speed_t baud, msr_devset_t *set)
+{
+	struct probe *probes;
+	pthread_t *threads;
+	char *pats, *pat, *save = NULL;
+	glob_t g;
+	size_t i, n;
+	int flags = 0;
+	int ret = LIBMSR_ERR_GENERIC;
+
+	set->msr_devs = NULL;
+	set->msr_ndevs = 0;
+
+	if ((pats = strdup (pattern ? pattern : MSR_DISCOVER_DEFAULT)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	memset (&g, 0, sizeof(g));
+	for (pat = strtok_r (pats, ":", &save); pat;
+	    pat = strtok_r (NULL, ":", &save)) {
+		if (glob (pat, flags, NULL, &g) == GLOB_NOSPACE)
+			goto out;
+		flags = GLOB_APPEND;
+	}
+
+	if (g.gl_pathc == 0) {
+		ret = LIBMSR_ERR_OK;
+		goto out;
+	}
+
+	probes = calloc (g.gl_pathc, sizeof(*probes));
+	threads = calloc (g.gl_pathc, sizeof(*threads));
+	set->msr_devs = calloc (g.gl_pathc, sizeof(*set->msr_devs));
+
+	if (probes == NULL || threads == NULL || set->msr_devs == NULL) {
+		free (set->msr_devs);
+		set->msr_devs = NULL;
+		goto out_free;
+	}
+
+	for (i = 0; i < g.gl_pathc; i++) {
+		probes[i].path = g.gl_pathv[i];
+		probes[i].baud = baud;
+		probes[i].threaded = !pthread_create (&threads[i], NULL,
+			probe_thread, &probes[i]);
+		if (!probes[i].threaded)
+			probe_thread (&probes[i]);
+	}
+
+	for (i = 0, n = 0; i < g.gl_pathc; i++) {
+		if (probes[i].threaded)
+			pthread_join (threads[i], NULL);
+
+		if (!probes[i].ok)
+			continue;
+
+		set->msr_devs[n] = probes[i].dev;
+		if ((set->msr_devs[n].msr_path = strdup (probes[i].path)) == NULL) {
+			msr_serial_close (probes[i].dev.msr_fd);
+			continue;
+		}
+		n++;
+	}
+
+	set->msr_ndevs = n;
+	ret = LIBMSR_ERR_OK;
+
+out_free:
+	free (threads);
+	free (probes);
+out:
+	globfree (&g);
+	free (pats);
+
+	return ret;
+}
+
+void msr_devset_free(msr_devset_t *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->msr_ndevs; i++) {
+		msr_serial_close (set->msr_devs[i].msr_fd);
+		free (set->msr_devs[i].msr_path);
+	}
+
+	free (set->msr_devs);
+	set->msr_devs = NULL;
+	set->msr_ndevs = 0;
+}
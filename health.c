@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Health monitor.
+ *
+ * A monitor thread looks at each of its devices every MON_TICK_MS. A
+ * device is busy while its lock is held, while a read is armed on it,
+ * or if its lock has been taken since the last look, which the lock
+ * counts for us; otherwise it has been idle since it was last seen
+ * busy. Once it has been idle long enough, the checks of a round are
+ * run on it one command at a time, each under a lock that is only
+ * tried for, and the lock is given up after each command. Anyone
+ * waiting for the lock when a command ends gets it straight away, and
+ * the rest of the round waits for the device's next idle spell, so
+ * real traffic usually waits for at most one diagnostic command, which
+ * is given MSR_MONITOR_TIMEOUT_MS to answer. A caller that only starts
+ * waiting in the moment between the end of a command and the lock
+ * being given up can wait for one more.
+ *
+ * The monitor's own lock is not held while a device is being looked
+ * at, so adding and removing devices never waits for a check. Removing
+ * the device being looked at waits for that look to finish.
+ *
+ * The checks leave the device's last error as they found it, since
+ * that belongs to whoever used the device last.
+ */
+
+#define MON_TICK_MS 100
+
+enum { STEP_COMM, STEP_RAM, STEP_CO, STEPS };
+
+struct mon_dev {
+	int fd;
+	unsigned long uses; /* the lock's count when we last looked */
+	int64_t idle_since;
+	int64_t due; /* when the next round may start */
+	int step; /* the next check of the round */
+	int busy; /* being looked at, without the monitor's lock */
+	msr_health_t h;
+};
+
+struct msr_monitor {
+	pthread_t thr;
+	pthread_mutex_t lock; /* guards devs */
+	pthread_cond_t idle; /* signalled when a look finishes */
+	int stop; /* an eventfd */
+	int64_t idle_ns, interval_ns;
+	struct mon_dev *devs;
+	size_t ndevs, cap;
+};
+
+static int64_t now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Publish what we know of a device, for msr_health(). */
+static void publish (struct msr_devstate *ds, const struct mon_dev *d,
+	int64_t checked)
+{
+	struct msr_healthstate *hs = &ds->health;
+
+	__atomic_store_n (&hs->seq, hs->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	hs->h = d->h;
+	hs->idle_since = d->idle_since;
+	hs->uses = d->uses;
+	if (checked != 0)
+		hs->checked = checked;
+
+	__atomic_store_n (&hs->seq, hs->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Run the next check of a device's round, with its lock held. */
+static void step (struct mon_dev *d)
+{
+	int r;
+
+	switch (d->step) {
+	case STEP_COMM:
+		r = d->h.msr_comm = msr_commtest_timeout (d->fd,
+			MSR_MONITOR_TIMEOUT_MS);
+		/* A device that doesn't answer this won't answer the rest. */
+		d->step = r == LIBMSR_ERR_OK ? STEP_RAM : STEPS;
+		if (r != LIBMSR_ERR_OK) {
+			d->h.msr_ram = -1;
+			d->h.msr_co = -1;
+		}
+		break;
+	case STEP_RAM:
+		d->h.msr_ram = msr_ram_test_timeout (d->fd,
+			MSR_MONITOR_TIMEOUT_MS);
+		d->step = STEP_CO;
+		break;
+	case STEP_CO:
+		d->h.msr_co = msr_get_co_timeout (d->fd,
+			MSR_MONITOR_TIMEOUT_MS);
+		d->step = STEPS;
+		break;
+	}
+
+	if (d->step < STEPS)
+		return;
+
+	d->h.msr_state = d->h.msr_comm == LIBMSR_ERR_OK
+		&& d->h.msr_ram == LIBMSR_ERR_OK
+		&& (d->h.msr_co == MSR_CO_HI || d->h.msr_co == MSR_CO_LO)
+		? MSR_HEALTH_OK : MSR_HEALTH_FAILED;
+	d->h.msr_rounds++;
+	d->step = STEP_COMM;
+}
+
+/* Look at a device, and run what checks it has time for. */
+static void look (msr_monitor_t *m, struct mon_dev *d)
+{
+	struct msr_devstate *ds;
+	unsigned long uses;
+	int64_t now, checked = 0;
+	msr_err_t err;
+	int busy;
+
+	if ((ds = msr_devstate (d->fd)) == NULL)
+		return;
+
+	now = now_ns ();
+	uses = __atomic_load_n (&ds->uses, __ATOMIC_RELAXED);
+	busy = uses != d->uses
+		|| __atomic_load_n (&ds->lock, __ATOMIC_RELAXED) != 0
+		|| __atomic_load_n (&ds->armed, __ATOMIC_RELAXED)
+		|| __atomic_load_n (&ds->gone, __ATOMIC_RELAXED);
+
+	if (busy) {
+		/* Someone got in while a round was under way. */
+		if (d->step != STEP_COMM && uses != d->uses)
+			d->h.msr_preempted++;
+		d->uses = uses;
+		d->idle_since = now;
+		publish (ds, d, 0);
+		return;
+	}
+
+	if (now - d->idle_since < m->idle_ns
+	    || (d->step == STEP_COMM && now < d->due))
+		return;
+
+	do {
+		if (msr_devstate_trylock (d->fd) == NULL)
+			break;
+
+		err = ds->err;
+		step (d);
+		ds->err = err;
+
+		d->uses = ds->uses;
+		busy = msr_devstate_contended (ds);
+
+		msr_devstate_unlock (ds);
+
+		if (d->step == STEP_COMM) {
+			checked = now_ns ();
+			d->due = checked + m->interval_ns;
+		}
+	} while (!busy && d->step != STEP_COMM);
+
+	/* The waiter's use shows up next time, and counts against the round. */
+	if (busy)
+		d->idle_since = now_ns ();
+
+	publish (ds, d, checked);
+}
+
+static void *monitor_thread (void *arg)
+{
+	msr_monitor_t *m = arg;
+	struct pollfd pfd;
+	struct mon_dev d;
+	size_t i, j;
+	int r;
+
+	pfd.fd = m->stop;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		if ((r = poll (&pfd, 1, MON_TICK_MS)) == -1 && errno != EINTR)
+			break;
+		if (r > 0 && (pfd.revents & POLLIN))
+			break;
+
+		pthread_mutex_lock (&m->lock);
+		for (i = 0; i < m->ndevs; i++) {
+			m->devs[i].busy = 1;
+			d = m->devs[i];
+			pthread_mutex_unlock (&m->lock);
+
+			look (m, &d);
+
+			/* Others may have moved it, but not removed it. */
+			pthread_mutex_lock (&m->lock);
+			for (j = 0; !m->devs[j].busy; j++)
+				;
+			d.busy = 0;
+			m->devs[j] = d;
+			pthread_cond_broadcast (&m->idle);
+			i = j;
+		}
+		pthread_mutex_unlock (&m->lock);
+	}
+
+	return NULL;
+}
+
+int msr_monitor_create(int idle_ms, int interval_ms, msr_monitor_t **mp)
+{
+	msr_monitor_t *m;
+
+	if ((m = calloc (1, sizeof(*m))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	m->idle_ns = (int64_t) (idle_ms > 0 ? idle_ms : MSR_MONITOR_IDLE_MS)
+		* 1000000;
+	m->interval_ns = (int64_t) (interval_ms > 0 ? interval_ms
+		: MSR_MONITOR_INTERVAL_MS) * 1000000;
+	m->stop = eventfd (0, EFD_CLOEXEC);
+	pthread_mutex_init (&m->lock, NULL);
+	pthread_cond_init (&m->idle, NULL);
+
+	if (m->stop == -1
+	    || pthread_create (&m->thr, NULL, monitor_thread, m) != 0) {
+		if (m->stop != -1)
+			close (m->stop);
+		pthread_cond_destroy (&m->idle);
+		pthread_mutex_destroy (&m->lock);
+		free (m);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	*mp = m;
+	return LIBMSR_ERR_OK;
+}
+
+void msr_monitor_destroy(msr_monitor_t *m)
+{
+	uint64_t v = 1;
+
+	if (m == NULL)
+		return;
+
+	if (write (m->stop, &v, sizeof(v)) != sizeof(v))
+		return;
+	pthread_join (m->thr, NULL);
+
+	free (m->devs);
+	close (m->stop);
+	pthread_cond_destroy (&m->idle);
+	pthread_mutex_destroy (&m->lock);
+	free (m);
+}
+
+int msr_monitor_add(msr_monitor_t *m, int fd)
+{
+	struct msr_devstate *ds;
+	struct mon_dev *d;
+	size_t cap;
+	void *p;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	pthread_mutex_lock (&m->lock);
+
+	if (m->ndevs == m->cap) {
+		cap = m->cap ? m->cap * 2 : 8;
+		if ((p = realloc (m->devs, cap * sizeof(*d))) == NULL) {
+			pthread_mutex_unlock (&m->lock);
+			return LIBMSR_ERR_GENERIC;
+		}
+		m->devs = p;
+		m->cap = cap;
+	}
+
+	d = &m->devs[m->ndevs++];
+	memset (d, 0, sizeof(*d));
+	d->fd = fd;
+	d->uses = __atomic_load_n (&ds->uses, __ATOMIC_RELAXED);
+	d->idle_since = now_ns ();
+	d->h.msr_state = MSR_HEALTH_UNKNOWN;
+	d->h.msr_comm = d->h.msr_ram = d->h.msr_co = -1;
+	publish (ds, d, 0);
+
+	pthread_mutex_unlock (&m->lock);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_monitor_remove(msr_monitor_t *m, int fd)
+{
+	struct msr_devstate *ds;
+	size_t i;
+
+	pthread_mutex_lock (&m->lock);
+
+	for (;;) {
+		for (i = 0; i < m->ndevs; i++)
+			if (m->devs[i].fd == fd)
+				break;
+
+		if (i == m->ndevs) {
+			pthread_mutex_unlock (&m->lock);
+			return LIBMSR_ERR_GENERIC;
+		}
+
+		if (!m->devs[i].busy)
+			break;
+		pthread_cond_wait (&m->idle, &m->lock);
+	}
+
+	/* Keep what was found, but stop reporting the device as idle. */
+	m->devs[i].idle_since = 0;
+	if ((ds = msr_devstate (fd)) != NULL)
+		publish (ds, &m->devs[i], 0);
+
+	m->devs[i] = m->devs[--m->ndevs];
+
+	pthread_mutex_unlock (&m->lock);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_health(int fd, msr_health_t *h)
+{
+	struct msr_devstate *ds;
+	struct msr_healthstate *hs;
+	int64_t idle_since, checked, now;
+	unsigned long uses;
+	uint32_t seq;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	hs = &ds->health;
+
+	/* Not under the device's lock, which a read may hold for ages. */
+	do {
+		while ((seq = __atomic_load_n (&hs->seq, __ATOMIC_ACQUIRE)) & 1)
+			cpu_relax ();
+		*h = hs->h;
+		idle_since = hs->idle_since;
+		uses = hs->uses;
+		checked = hs->checked;
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n (&hs->seq, __ATOMIC_RELAXED) != seq);
+
+	/* No monitor has published anything since the device was opened. */
+	if (seq == 0)
+		h->msr_comm = h->msr_ram = h->msr_co = -1;
+
+	/* The device may have been used since the monitor last looked. */
+	if (idle_since != 0 && (uses != __atomic_load_n (&ds->uses,
+	    __ATOMIC_RELAXED) || __atomic_load_n (&ds->lock,
+	    __ATOMIC_RELAXED) != 0))
+		idle_since = now_ns ();
+
+	now = now_ns ();
+	h->msr_idle_ms = idle_since != 0 ? (now - idle_since) / 1000000 : -1;
+	h->msr_age_ms = checked != 0 ? (now - checked) / 1000000 : -1;
+
+	return LIBMSR_ERR_OK;
+}
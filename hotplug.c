@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Hotplug.
+ *
+ * A manager thread watches the directory each managed device's path is
+ * in, and polls the devices themselves for hangups. A device that
+ * hangs up or whose path is removed is marked gone, which makes every
+ * call on it fail at once with LIBMSR_ERR_DISCONNECT. When its path
+ * comes back, the device is reopened onto the same fd with dup2(), so
+ * callers never see the fd change, and then initialised and given back
+ * the settings it had. Events can be missed while a path is replaced,
+ * so gone devices are also retried every HP_RETRY_MS.
+ */
+
+#define HP_RETRY_MS 250
+
+struct hp_dev {
+	int fd;
+	char *path;
+	const char *name; /* the last part of path */
+	int wd; /* the watch on path's directory */
+	int blocking;
+	speed_t baud;
+	int gone;
+	int busy; /* being reconnected, with hp->lock dropped */
+};
+
+struct msr_hotplug {
+	pthread_t thr;
+	pthread_mutex_t lock; /* guards devs and stopping */
+	pthread_cond_t idle; /* signalled as reconnects finish */
+	int ino;
+	int wake; /* an eventfd */
+	int stopping;
+	struct hp_dev *devs;
+	size_t ndevs, cap;
+	msr_hotplug_cb_t cb;
+	void *arg;
+};
+
+/* A change to report once the lock is dropped. */
+struct hp_event {
+	int fd;
+	int event;
+};
+
+/* Whether calls on a device have found it gone before we have. */
+static int found_gone (const struct hp_dev *d)
+{
+	struct msr_devstate *ds = msr_devstate (d->fd);
+
+	return ds != NULL && __atomic_load_n (&ds->gone, __ATOMIC_ACQUIRE);
+}
+
+static void mark_gone (struct hp_dev *d, struct hp_event *ev, size_t *nev)
+{
+	struct msr_devstate *ds;
+
+	if (d->gone)
+		return;
+
+	d->gone = 1;
+	if ((ds = msr_devstate (d->fd)) != NULL)
+		__atomic_store_n (&ds->gone, 1, __ATOMIC_RELEASE);
+
+	ev[*nev].fd = d->fd;
+	ev[(*nev)++].event = MSR_HOTPLUG_GONE;
+}
+
+/*
+ * Reopen a device onto its fd, initialise it and put its settings
+ * back. The device's lock is held throughout, so no other call on it
+ * sees it half set up.
+ */
+static int reconnect (const struct hp_dev *d)
+{
+	struct msr_devstate *ds;
+	struct msr_settings saved;
+	msr_latency_t lat;
+	msr_profile_t p;
+	int nf, r;
+
+	if ((nf = open (d->path, d->blocking | O_RDWR | O_FSYNC)) == -1)
+		return -1;
+
+	if (msr_serial_setup (nf, d->baud) != LIBMSR_ERR_OK) {
+		close (nf);
+		return -1;
+	}
+
+	if ((ds = msr_devstate_lock (d->fd)) == NULL) {
+		close (nf);
+		return -1;
+	}
+
+	r = dup2 (nf, d->fd);
+	close (nf);
+	if (r == -1) {
+		msr_devstate_unlock (ds);
+		return -1;
+	}
+
+	__atomic_store_n (&ds->gone, 0, __ATOMIC_RELEASE);
+
+	if (ds->latency != 0)
+		msr_serial_latency (d->fd, ds->latency, &lat);
+
+	saved = ds->settings;
+
+	memset (&p, 0, sizeof(p));
+	p.msr_co = saved.co;
+	p.msr_bpi = saved.bpi;
+	memcpy (p.msr_bpc, saved.bpc, sizeof(p.msr_bpc));
+
+	if ((r = msr_init (d->fd)) == LIBMSR_ERR_OK)
+		r = msr_profile_apply (d->fd, &p);
+
+	/* Not ready yet; keep what it should have for the next try. */
+	if (r != LIBMSR_ERR_OK) {
+		ds->settings = saved;
+		__atomic_store_n (&ds->gone, 1, __ATOMIC_RELEASE);
+	}
+
+	msr_devstate_unlock (ds);
+
+	return r == LIBMSR_ERR_OK ? 0 : -1;
+}
+
+static void notify (msr_hotplug_t *hp, const struct hp_event *ev, size_t n)
+{
+	size_t i;
+
+	if (hp->cb == NULL)
+		return;
+
+	for (i = 0; i < n; i++)
+		hp->cb (ev[i].fd, ev[i].event, hp->arg);
+}
+
+/* Mark devices gone as their paths are removed. */
+static void read_events (msr_hotplug_t *hp, struct hp_event *ev,
+	size_t *nev)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	ssize_t len;
+	char *p;
+	size_t i;
+
+	while ((len = read (hp->ino, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ie) + ie->len) {
+			ie = (const struct inotify_event *) p;
+			if (!(ie->mask & (IN_DELETE | IN_MOVED_FROM))
+			    || ie->len == 0)
+				continue;
+			for (i = 0; i < hp->ndevs; i++)
+				if (hp->devs[i].wd == ie->wd && strcmp (ie->name,
+				    hp->devs[i].name) == 0)
+					mark_gone (&hp->devs[i], ev, nev);
+		}
+	}
+}
+
+static void *hotplug_thread (void *arg)
+{
+	msr_hotplug_t *hp = arg;
+	struct pollfd *pfds = NULL;
+	struct hp_event *ev = NULL;
+	struct hp_dev *retry = NULL;
+	size_t i, n, nev, nretry, cap = 0;
+	uint64_t v;
+	int timeout;
+	void *p;
+
+	for (;;) {
+		pthread_mutex_lock (&hp->lock);
+
+		if (hp->stopping) {
+			pthread_mutex_unlock (&hp->lock);
+			break;
+		}
+
+		if (pfds == NULL || hp->ndevs > cap) {
+			cap = hp->cap > 0 ? hp->cap : 1;
+			if ((p = realloc (pfds, (cap + 2) * sizeof(*pfds)))
+			    != NULL)
+				pfds = p;
+			if ((p = realloc (ev, cap * sizeof(*ev))) != NULL)
+				ev = p;
+			if ((p = realloc (retry, cap * sizeof(*retry))) != NULL)
+				retry = p;
+			if (pfds == NULL || ev == NULL || retry == NULL
+			    || hp->ndevs > cap) {
+				pthread_mutex_unlock (&hp->lock);
+				break;
+			}
+		}
+
+		pfds[0].fd = hp->wake;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = hp->ino;
+		pfds[1].events = POLLIN;
+
+		/* Hangups are always reported, whatever is asked for. */
+		timeout = -1;
+		for (i = 0; i < hp->ndevs; i++) {
+			pfds[i + 2].fd = hp->devs[i].gone ? -1 : hp->devs[i].fd;
+			pfds[i + 2].events = 0;
+			pfds[i + 2].revents = 0;
+			if (hp->devs[i].gone)
+				timeout = HP_RETRY_MS;
+			else if (found_gone (&hp->devs[i]))
+				timeout = 0;
+		}
+		n = hp->ndevs;
+
+		pthread_mutex_unlock (&hp->lock);
+
+		if (poll (pfds, n + 2, timeout) == -1 && errno != EINTR)
+			break;
+		if ((pfds[0].revents & POLLIN)
+		    && read (hp->wake, &v, sizeof(v)) == -1 && errno != EAGAIN)
+			break;
+
+		pthread_mutex_lock (&hp->lock);
+
+		nev = 0;
+		read_events (hp, ev, &nev);
+
+		/* The devices may have changed while we were polling. */
+		for (i = 0; i < n && i < hp->ndevs; i++)
+			if ((pfds[i + 2].fd == hp->devs[i].fd
+			    && (pfds[i + 2].revents
+			    & (POLLERR | POLLHUP | POLLNVAL)))
+			    || found_gone (&hp->devs[i]))
+				mark_gone (&hp->devs[i], ev, &nev);
+
+		/*
+		 * Devices being reconnected are marked busy, and
+		 * msr_hotplug_remove() waits for them, so their paths and
+		 * fds stay theirs while the lock is dropped.
+		 */
+		for (i = 0, nretry = 0; i < hp->ndevs; i++) {
+			if (!hp->devs[i].gone)
+				continue;
+			hp->devs[i].busy = 1;
+			retry[nretry++] = hp->devs[i];
+		}
+
+		pthread_mutex_unlock (&hp->lock);
+
+		notify (hp, ev, nev);
+
+		/* Initialising a device takes a while; don't hold the lock. */
+		for (i = 0, nev = 0; i < nretry; i++) {
+			if (reconnect (&retry[i]) == 0) {
+				ev[nev].fd = retry[i].fd;
+				ev[nev++].event = MSR_HOTPLUG_BACK;
+			}
+		}
+
+		pthread_mutex_lock (&hp->lock);
+		for (n = 0; n < hp->ndevs; n++) {
+			if (!hp->devs[n].busy)
+				continue;
+			hp->devs[n].busy = 0;
+			for (i = 0; i < nev; i++)
+				if (hp->devs[n].fd == ev[i].fd)
+					hp->devs[n].gone = 0;
+		}
+		pthread_cond_broadcast (&hp->idle);
+		pthread_mutex_unlock (&hp->lock);
+
+		notify (hp, ev, nev);
+	}
+
+	free (pfds);
+	free (ev);
+	free (retry);
+
+	return NULL;
+}
+
+int msr_hotplug_create(msr_hotplug_cb_t cb, void *arg, msr_hotplug_t **hpp)
+{
+	msr_hotplug_t *hp;
+
+	if ((hp = calloc (1, sizeof(*hp))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	hp->cb = cb;
+	hp->arg = arg;
+	hp->ino = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	hp->wake = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pthread_mutex_init (&hp->lock, NULL);
+	pthread_cond_init (&hp->idle, NULL);
+
+	if (hp->ino == -1 || hp->wake == -1
+	    || pthread_create (&hp->thr, NULL, hotplug_thread, hp) != 0) {
+		if (hp->ino != -1)
+			close (hp->ino);
+		if (hp->wake != -1)
+			close (hp->wake);
+		pthread_cond_destroy (&hp->idle);
+		pthread_mutex_destroy (&hp->lock);
+		free (hp);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	*hpp = hp;
+	return LIBMSR_ERR_OK;
+}
+
+/* Wake the manager thread, to poll the devices as they are now. */
+static void kick (msr_hotplug_t *hp)
+{
+	uint64_t v = 1;
+
+	/* It only fails if the counter is full, and then it's awake anyway. */
+	if (write (hp->wake, &v, sizeof(v)) != sizeof(v))
+		return;
+}
+
+void msr_hotplug_destroy(msr_hotplug_t *hp)
+{
+	size_t i;
+
+	if (hp == NULL)
+		return;
+
+	pthread_mutex_lock (&hp->lock);
+	hp->stopping = 1;
+	pthread_mutex_unlock (&hp->lock);
+
+	kick (hp);
+	pthread_join (hp->thr, NULL);
+
+	for (i = 0; i < hp->ndevs; i++)
+		free (hp->devs[i].path);
+	free (hp->devs);
+
+	close (hp->ino);
+	close (hp->wake);
+	pthread_cond_destroy (&hp->idle);
+	pthread_mutex_destroy (&hp->lock);
+	free (hp);
+}
+
+int msr_hotplug_add(msr_hotplug_t *hp, int fd, const char *path,
+	int blocking, speed_t baud)
+{
+	struct hp_dev *d;
+	char *dir, *slash;
+	size_t cap;
+	void *p;
+	int wd;
+
+	if (msr_devstate (fd) == NULL || (dir = strdup (path)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((slash = strrchr (dir, '/')) == NULL)
+		strcpy (dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	wd = inotify_add_watch (hp->ino, dir, IN_DELETE | IN_MOVED_FROM
+		| IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+	free (dir);
+	if (wd == -1)
+		return LIBMSR_ERR_GENERIC;
+
+	pthread_mutex_lock (&hp->lock);
+
+	if (hp->ndevs == hp->cap) {
+		cap = hp->cap ? hp->cap * 2 : 8;
+		if ((p = realloc (hp->devs, cap * sizeof(*d))) == NULL) {
+			pthread_mutex_unlock (&hp->lock);
+			return LIBMSR_ERR_GENERIC;
+		}
+		hp->devs = p;
+		hp->cap = cap;
+	}
+
+	d = &hp->devs[hp->ndevs];
+	memset (d, 0, sizeof(*d));
+	if ((d->path = strdup (path)) == NULL) {
+		pthread_mutex_unlock (&hp->lock);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	d->name = strrchr (d->path, '/') ? strrchr (d->path, '/') + 1
+		: d->path;
+	d->fd = fd;
+	d->wd = wd;
+	d->blocking = blocking;
+	d->baud = baud;
+	hp->ndevs++;
+
+	pthread_mutex_unlock (&hp->lock);
+
+	kick (hp);
+	return LIBMSR_ERR_OK;
+}
+
+int msr_hotplug_remove(msr_hotplug_t *hp, int fd)
+{
+	size_t i;
+
+	pthread_mutex_lock (&hp->lock);
+
+	/* Don't let a reconnect put the device back after it is closed. */
+	for (;;) {
+		for (i = 0; i < hp->ndevs; i++)
+			if (hp->devs[i].fd == fd)
+				break;
+
+		if (i == hp->ndevs) {
+			pthread_mutex_unlock (&hp->lock);
+			return LIBMSR_ERR_GENERIC;
+		}
+
+		if (!hp->devs[i].busy)
+			break;
+
+		pthread_cond_wait (&hp->idle, &hp->lock);
+	}
+
+	free (hp->devs[i].path);
+	hp->devs[i] = hp->devs[--hp->ndevs];
+
+	pthread_mutex_unlock (&hp->lock);
+
+	kick (hp);
+	return LIBMSR_ERR_OK;
+}
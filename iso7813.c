@@ -0,0 +1,221 @@
+#include <string.h>
+
+#include "libmsr.h"
+
+/*
+ * ISO/IEC 7813 track parsing.
+ *
+ * The parsers below make a single pass over the track data, checking
+ * field separators and character sets and computing the Luhn check of
+ * the PAN as they go. They record where each field is rather than
+ * copying it, so they never allocate.
+ *
+ * Start and end sentinels are optional, since msr_iso_read() strips
+ * them, and parsing stops at an end sentinel if there is one.
+ */
+
+#define ISO_TK1_FS '^'
+#define ISO_TK2_FS '='
+#define ISO_SS1 '%'
+#define ISO_SS2 ';'
+#define ISO_ES '?'
+
+#define ISO_PAN_MAX 19
+#define ISO_NAME_MIN 2
+#define ISO_NAME_MAX 26
+
+/* The Luhn value of a doubled digit. */
+static const uint8_t luhn_dbl[10] = { 0, 2, 4, 6, 8, 1, 3, 5, 7, 9 };
+
+struct cursor {
+	const uint8_t *data;
+	int pos;
+	int len;
+};
+
+static int is_digit(uint8_t c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static void view(msr_view_t *v, int off, int len)
+{
+	v->msr_off = off;
+	v->msr_len = len;
+}
+
+/*
+ * Scan the PAN up to the field separator, checking the Luhn digit as we
+ * go. Since we don't know the length up front, we keep the sum for both
+ * possible alignments of the doubled digits and pick one at the end.
+ */
+static int scan_pan(struct cursor *c, uint8_t fs, msr_iso_fields_t *f)
+{
+	int start = c->pos;
+	int sum[2] = { 0, 0 };
+	int n, d;
+
+	while (c->pos < c->len && c->data[c->pos] != fs) {
+		if (!is_digit(c->data[c->pos]))
+			return LIBMSR_ERR_ISO;
+
+		d = c->data[c->pos] - '0';
+		n = c->pos - start;
+		sum[n & 1] += luhn_dbl[d];
+		sum[!(n & 1)] += d;
+		c->pos++;
+	}
+
+	n = c->pos - start;
+	if (c->pos == c->len || n == 0 || n > ISO_PAN_MAX)
+		return LIBMSR_ERR_ISO;
+
+	/* The rightmost digit is never doubled. */
+	f->msr_luhn_ok = (sum[n & 1] % 10) == 0;
+	view(&f->msr_pan, start, n);
+	c->pos++;
+
+	return LIBMSR_ERR_OK;
+}
+
+/*
+ * Scan a fixed-width numeric field, which the card may leave out by
+ * putting a field separator in its place.
+ */
+static int scan_fixed(struct cursor *c, uint8_t fs, int width, msr_view_t *v)
+{
+	int i;
+
+	if (c->pos < c->len && c->data[c->pos] == fs) {
+		view(v, c->pos, 0);
+		c->pos++;
+		return LIBMSR_ERR_OK;
+	}
+
+	if (c->len - c->pos < width)
+		return LIBMSR_ERR_ISO;
+
+	for (i = 0; i < width; i++)
+		if (!is_digit(c->data[c->pos + i]))
+			return LIBMSR_ERR_ISO;
+
+	view(v, c->pos, width);
+	c->pos += width;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* The rest of the track, up to the end sentinel, is discretionary. */
+static void scan_disc(struct cursor *c, msr_view_t *v)
+{
+	int start = c->pos;
+
+	while (c->pos < c->len && c->data[c->pos] != ISO_ES)
+		c->pos++;
+
+	view(v, start, c->pos - start);
+}
+
+static void cursor_init(struct cursor *c, const uint8_t *data, uint8_t len,
+	uint8_t ss, msr_iso_fields_t *f)
+{
+	memset(f, 0, sizeof(*f));
+
+	c->data = data;
+	c->len = len;
+	c->pos = (len > 0 && data[0] == ss) ? 1 : 0;
+}
+
+int msr_iso7813_tk1(const uint8_t *data, uint8_t len, msr_iso_fields_t *f)
+{
+	struct cursor c;
+	int start;
+	uint8_t b;
+
+	cursor_init(&c, data, len, ISO_SS1, f);
+
+	/* Format code 'B' is the only one defined for financial cards. */
+	if (c.pos == c.len || data[c.pos] != 'B')
+		goto bad;
+	f->msr_fmt = data[c.pos++];
+
+	if (scan_pan(&c, ISO_TK1_FS, f) != LIBMSR_ERR_OK)
+		goto bad;
+
+	start = c.pos;
+	while (c.pos < c.len && (b = data[c.pos]) != ISO_TK1_FS) {
+		if (b < 0x20 || b > 0x5F || b == ISO_ES)
+			goto bad;
+		c.pos++;
+	}
+	if (c.pos == c.len || c.pos - start < ISO_NAME_MIN
+	    || c.pos - start > ISO_NAME_MAX)
+		goto bad;
+	view(&f->msr_name, start, c.pos - start);
+	c.pos++;
+
+	if (scan_fixed(&c, ISO_TK1_FS, 4, &f->msr_exp) != LIBMSR_ERR_OK
+	    || scan_fixed(&c, ISO_TK1_FS, 3, &f->msr_svc) != LIBMSR_ERR_OK)
+		goto bad;
+
+	scan_disc(&c, &f->msr_disc);
+
+	return f->msr_status = LIBMSR_ERR_OK;
+
+bad:
+	return f->msr_status = LIBMSR_ERR_ISO;
+}
+
+int msr_iso7813_tk2(const uint8_t *data, uint8_t len, msr_iso_fields_t *f)
+{
+	struct cursor c;
+	int i;
+
+	cursor_init(&c, data, len, ISO_SS2, f);
+
+	if (scan_pan(&c, ISO_TK2_FS, f) != LIBMSR_ERR_OK
+	    || scan_fixed(&c, ISO_TK2_FS, 4, &f->msr_exp) != LIBMSR_ERR_OK
+	    || scan_fixed(&c, ISO_TK2_FS, 3, &f->msr_svc) != LIBMSR_ERR_OK)
+		goto bad;
+
+	scan_disc(&c, &f->msr_disc);
+
+	/* Track 2 is numeric throughout. */
+	for (i = 0; i < f->msr_disc.msr_len; i++)
+		if (!is_digit(data[f->msr_disc.msr_off + i]))
+			goto bad;
+
+	return f->msr_status = LIBMSR_ERR_OK;
+
+bad:
+	return f->msr_status = LIBMSR_ERR_ISO;
+}
+
+int msr_iso7813_parse(const msr_tracks_t *tracks, int tn, msr_iso_fields_t *f)
+{
+	const msr_track_t *t;
+
+	if (tn < 0 || tn > 1) {
+		memset(f, 0, sizeof(*f));
+		return f->msr_status = LIBMSR_ERR_GENERIC;
+	}
+
+	t = &tracks->msr_tracks[tn];
+
+	if (tn == 0)
+		return msr_iso7813_tk1(t->msr_tk_data, t->msr_tk_len, f);
+
+	return msr_iso7813_tk2(t->msr_tk_data, t->msr_tk_len, f);
+}
+
+size_t msr_iso7813_parse_batch(const msr_tracks_t *tracks, size_t n, int tn,
+	msr_iso_fields_t *fields)
+{
+	size_t i, ok = 0;
+
+	for (i = 0; i < n; i++)
+		if (msr_iso7813_parse(&tracks[i], tn, &fields[i]) == LIBMSR_ERR_OK)
+			ok++;
+
+	return ok;
+}
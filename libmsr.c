@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "libmsr.h"
 
@@ -168,63 +170,98 @@ int msr_reverse_track (msr_track_t * track)
 	return LIBMSR_ERR_OK;
 }
 
+/* Write a single track as hex bytes. */
+static void output_track_hex(int fd, int tn, const uint8_t *buf, int len)
+{
+	int x;
+
+	dprintf(fd, "Track %d: \n", tn + 1);
+	for (x = 0; x < len; x++) {
+		dprintf(fd, "%02x ", buf[x]);
+	}
+	dprintf(fd, "\n");
+}
+
+/* Write a single track as a string, if it isn't empty. */
+static void output_track_string(int fd, int tn, const uint8_t *buf, int len)
+{
+	if (len) {
+		dprintf(fd, "Track %d: \n[%.*s]\n", tn + 1, len, buf);
+	}
+}
+
+/* Write a single track as bits. */
+static void output_track_bits(int fd, int tn, const uint8_t *buf, int len)
+{
+	dprintf(fd, "Track %d: \n", tn + 1);
+	output_bits(fd, (uint8_t *) buf, len);
+}
+
 /* Take a track structure and write it as hex bytes. */
-void msr_pretty_output_hex(int fd, msr_tracks_t tracks)
+void msr_pretty_output_tracks_hex(int fd, const msr_tracks_t *tracks)
 {
 	int tn;
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		int x;
-		dprintf(fd, "Track %d: \n", tn + 1);
-		for (x = 0; x < tracks.msr_tracks[tn].msr_tk_len; x++) {
-			dprintf(fd, "%02x ", tracks.msr_tracks[tn].msr_tk_data[x]);
-		}
-		dprintf(fd, "\n");
+		output_track_hex(fd, tn, tracks->msr_tracks[tn].msr_tk_data,
+			tracks->msr_tracks[tn].msr_tk_len);
 	}
 }
 
+void msr_pretty_output_hex(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_tracks_hex(fd, &tracks);
+}
+
 /* Take a track structure and write it as a string. */
-void msr_pretty_output_string(int fd, msr_tracks_t tracks)
+void msr_pretty_output_tracks_string(int fd, const msr_tracks_t *tracks)
 {
 	int tn;
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		if (tracks.msr_tracks[tn].msr_tk_len) {
-			dprintf(fd, "Track %d: \n[%s]\n", tn + 1,
-				tracks.msr_tracks[tn].msr_tk_data);
-		}
+		output_track_string(fd, tn, tracks->msr_tracks[tn].msr_tk_data,
+			tracks->msr_tracks[tn].msr_tk_len);
 	}
 }
 
+void msr_pretty_output_string(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_tracks_string(fd, &tracks);
+}
+
 /* Take a track structure and write it as bits. */
-void msr_pretty_output_bits(int fd, msr_tracks_t tracks)
+void msr_pretty_output_tracks_bits(int fd, const msr_tracks_t *tracks)
 {
 	int tn;
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		dprintf(fd, "Track %d: \n", tn + 1);
-		output_bits(fd, tracks.msr_tracks[tn].msr_tk_data,
-			tracks.msr_tracks[tn].msr_tk_len);
+		output_track_bits(fd, tn, tracks->msr_tracks[tn].msr_tk_data,
+			tracks->msr_tracks[tn].msr_tk_len);
 	}
 }
 
+void msr_pretty_output_bits(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_tracks_bits(fd, &tracks);
+}
+
 /* Take a track structure and print it as hex bytes. */
 void msr_pretty_printer_hex (msr_tracks_t tracks)
 {
-	msr_pretty_output_hex(1, tracks);
+	msr_pretty_output_tracks_hex(1, &tracks);
 }
 
 /* Take a track structure and print it as a string. */
 void msr_pretty_printer_string (msr_tracks_t tracks)
 {
-	msr_pretty_output_string(1, tracks);
+	msr_pretty_output_tracks_string(1, &tracks);
 }
 
 /* Take a track structure and print it as bits. */
 void msr_pretty_printer_bits(msr_tracks_t tracks)
 {
-	msr_pretty_output_bits(1, tracks);
+	msr_pretty_output_tracks_bits(1, &tracks);
 }
 
 /* Reverse a byte. */
-const unsigned char msr_reverse_byte(const unsigned char byte)
+unsigned char msr_reverse_byte(const unsigned char byte)
 {
 	return
 	((byte & 1<<7) >> 7) |
@@ -236,3 +273,208 @@ const unsigned char msr_reverse_byte(const unsigned char byte)
 	((byte & 1<<1) << 5) |
 	((byte & 1<<0) << 7);
 }
+
+/*
+ * Compact track storage.
+ *
+ * A compact record is an msr_ctracks_t header holding the three track
+ * lengths, followed directly by the track data back to back. Records
+ * are usually kept one after another in an msr_arena_t and referred to
+ * by their offset in it.
+ */
+
+static const uint8_t *ctracks_base(const msr_ctracks_t *ct)
+{
+	return (const uint8_t *) ct + sizeof(*ct);
+}
+
+size_t msr_ctracks_size(const msr_tracks_t *tracks)
+{
+	size_t size = sizeof(msr_ctracks_t);
+	int tn;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++)
+		size += tracks->msr_tracks[tn].msr_tk_len;
+
+	return size;
+}
+
+size_t msr_ctracks_len(const msr_ctracks_t *ct)
+{
+	size_t size = sizeof(*ct);
+	int tn;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++)
+		size += ct->msr_ct_len[tn];
+
+	return size;
+}
+
+size_t msr_ctracks_pack(const msr_tracks_t *tracks, void *buf, size_t len)
+{
+	msr_ctracks_t *ct = buf;
+	uint8_t *p;
+	size_t size;
+	int tn;
+
+	if ((size = msr_ctracks_size(tracks)) > len)
+		return 0;
+
+	p = (uint8_t *) buf + sizeof(*ct);
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		const msr_track_t *t = &tracks->msr_tracks[tn];
+
+		ct->msr_ct_len[tn] = t->msr_tk_len;
+		memcpy(p, t->msr_tk_data, t->msr_tk_len);
+		p += t->msr_tk_len;
+	}
+
+	return size;
+}
+
+int msr_ctracks_unpack(const msr_ctracks_t *ct, msr_tracks_t *tracks)
+{
+	const uint8_t *p = ctracks_base(ct);
+	int tn;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		msr_track_t *t = &tracks->msr_tracks[tn];
+
+		t->msr_tk_len = ct->msr_ct_len[tn];
+		memcpy(t->msr_tk_data, p, t->msr_tk_len);
+		p += t->msr_tk_len;
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+const uint8_t *msr_ctracks_data(const msr_ctracks_t *ct, int tn, uint8_t *len)
+{
+	const uint8_t *p = ctracks_base(ct);
+	int i;
+
+	if (tn < 0 || tn >= MSR_MAX_TRACKS) {
+		*len = 0;
+		return NULL;
+	}
+
+	for (i = 0; i < tn; i++)
+		p += ct->msr_ct_len[i];
+
+	*len = ct->msr_ct_len[tn];
+
+	return p;
+}
+
+int msr_ctracks_decode(const msr_ctracks_t *ct, int tn,
+    uint8_t *outbuf, uint8_t *outlen, int bpc)
+{
+	const uint8_t *p;
+	uint8_t len;
+
+	if ((p = msr_ctracks_data(ct, tn, &len)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	return msr_decode((uint8_t *) p, len, outbuf, outlen, bpc);
+}
+
+/* Take a compact track record and write it as hex bytes. */
+void msr_pretty_output_ctracks_hex(int fd, const msr_ctracks_t *ct)
+{
+	const uint8_t *p = ctracks_base(ct);
+	int tn;
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		output_track_hex(fd, tn, p, ct->msr_ct_len[tn]);
+		p += ct->msr_ct_len[tn];
+	}
+}
+
+/* Take a compact track record and write it as a string. */
+void msr_pretty_output_ctracks_string(int fd, const msr_ctracks_t *ct)
+{
+	const uint8_t *p = ctracks_base(ct);
+	int tn;
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		output_track_string(fd, tn, p, ct->msr_ct_len[tn]);
+		p += ct->msr_ct_len[tn];
+	}
+}
+
+/* Take a compact track record and write it as bits. */
+void msr_pretty_output_ctracks_bits(int fd, const msr_ctracks_t *ct)
+{
+	const uint8_t *p = ctracks_base(ct);
+	int tn;
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		output_track_bits(fd, tn, p, ct->msr_ct_len[tn]);
+		p += ct->msr_ct_len[tn];
+	}
+}
+
+int msr_arena_init(msr_arena_t *arena, size_t size)
+{
+	if (size < MSR_ARENA_MIN)
+		size = MSR_ARENA_MIN;
+
+	if ((arena->msr_ar_base = malloc(size)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	arena->msr_ar_used = 0;
+	arena->msr_ar_size = size;
+
+	return LIBMSR_ERR_OK;
+}
+
+void msr_arena_free(msr_arena_t *arena)
+{
+	free(arena->msr_ar_base);
+	arena->msr_ar_base = NULL;
+	arena->msr_ar_used = arena->msr_ar_size = 0;
+}
+
+int msr_arena_add(msr_arena_t *arena, const msr_tracks_t *tracks, size_t *off)
+{
+	size_t need, size;
+	uint8_t *base;
+
+	need = msr_ctracks_size(tracks);
+
+	if (arena->msr_ar_size - arena->msr_ar_used < need) {
+		size = arena->msr_ar_size ? arena->msr_ar_size : MSR_ARENA_MIN;
+		while (size - arena->msr_ar_used < need)
+			size *= 2;
+
+		if ((base = realloc(arena->msr_ar_base, size)) == NULL)
+			return LIBMSR_ERR_GENERIC;
+
+		arena->msr_ar_base = base;
+		arena->msr_ar_size = size;
+	}
+
+	if (off)
+		*off = arena->msr_ar_used;
+
+	arena->msr_ar_used += msr_ctracks_pack(tracks,
+		arena->msr_ar_base + arena->msr_ar_used,
+		arena->msr_ar_size - arena->msr_ar_used);
+
+	return LIBMSR_ERR_OK;
+}
+
+const msr_ctracks_t *msr_arena_get(const msr_arena_t *arena, size_t off)
+{
+	if (off + sizeof(msr_ctracks_t) > arena->msr_ar_used)
+		return NULL;
+
+	return (const msr_ctracks_t *) (arena->msr_ar_base + off);
+}
+
+size_t msr_arena_next(const msr_arena_t *arena, size_t off)
+{
+	const msr_ctracks_t *ct;
+
+	if ((ct = msr_arena_get(arena, off)) == NULL)
+		return arena->msr_ar_used;
+
+	return off + msr_ctracks_len(ct);
+}
@@ -1,10 +1,17 @@
 /* Everyone must include libmsr.h or they're doing it wrong! */
+#ifndef LIBMSR_H
+#define LIBMSR_H
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Returned on operation success.
  */
@@ -20,16 +27,53 @@
  */
 #define LIBMSR_ERR_ISO 0x1100
 
+/**
+ * Returned when a card reads back differently from how it was written.
+ * In the ::LIBMSR_ERR_GENERIC class.
+ */
+#define LIBMSR_ERR_VERIFY 0x1200
+
 /**
  * Returned on error with device control.
  */
 #define LIBMSR_ERR_DEVICE 0x2000
 
+/**
+ * Returned when the device's response isn't shaped as the protocol
+ * says, such as a missing delimiter. In the ::LIBMSR_ERR_DEVICE class.
+ */
+#define LIBMSR_ERR_FRAMING 0x2100
+
 /**
  * Returned on error in serial I/O.
  */
 #define LIBMSR_ERR_SERIAL 0x4000
 
+/**
+ * Returned when the device did not respond in time. In the
+ * ::LIBMSR_ERR_SERIAL class.
+ */
+#define LIBMSR_ERR_TIMEOUT 0x4100
+
+/**
+ * Returned when the device has been unplugged. In the
+ * ::LIBMSR_ERR_SERIAL class.
+ */
+#define LIBMSR_ERR_DISCONNECT 0x4200
+
+/**
+ * The class of an error code: ::LIBMSR_ERR_GENERIC, ::LIBMSR_ERR_DEVICE
+ * or ::LIBMSR_ERR_SERIAL.
+ *
+ * Failures that used to be reported as a bare class code may now come
+ * back as one of the more specific codes in that class: a timeout or an
+ * unplugged device is no longer equal to ::LIBMSR_ERR_SERIAL, nor a
+ * garbled response to ::LIBMSR_ERR_DEVICE. Code that tests a result
+ * against a class should compare MSR_ERR_CLASS(r) with it rather than
+ * r itself.
+ */
+#define MSR_ERR_CLASS(code) ((code) & 0xF000)
+
 /**
  * The maximum length, in bytes, of a track.
  */
@@ -115,7 +159,6 @@ typedef struct msr_cmd {
 
 /**
  * @brief Represents the end of a read/write command.
- * @note Currently unused.
  */
 typedef struct msr_end {
 	uint8_t msr_enddelim;
@@ -403,6 +446,38 @@ typedef struct msr_bpc {
  */
 #define MSR_CMD_LED_RED_ON 0x85
 
+/**
+ * Wait a fixed tenth of a second after commands without a response.
+ * This is the default.
+ *
+ * @see msr_set_ready_mode()
+ */
+#define MSR_READY_FIXED 0
+
+/**
+ * Poll the device with communications tests after commands without a
+ * response, and continue as soon as it answers.
+ *
+ * @see msr_set_ready_mode()
+ */
+#define MSR_READY_PROBE 1
+
+/**
+ * The fixed delay after commands without a response, in nanoseconds.
+ */
+#define MSR_READY_FIXED_NS 100000000L
+
+/**
+ * How long to wait for an answer to each readiness probe, in milliseconds.
+ */
+#define MSR_READY_PROBE_TIMEOUT 10
+
+/**
+ * The number of consecutive unanswered readiness checks after which a
+ * device is switched back to ::MSR_READY_FIXED.
+ */
+#define MSR_READY_MAX_FAILS 3
+
 /**
  * @brief Represents a single track on a magnetic card.
  */
@@ -421,6 +496,10 @@ typedef struct msr_tracks {
 /**
  * @brief Open a serial connection to the MSR device.
  *
+ * @details The fd must be below 1024, since libmsr keeps each device's
+ * lock and other state in a table indexed by fd; a higher one is closed
+ * again, and the call fails with errno set to EMFILE.
+ *
  * @param path The path to the serial device.
  * @param fd The int pointer to store the file descriptor in.
  * @param blocking The blocking flag (e.g., ::MSR_BLOCKING)
@@ -432,6 +511,10 @@ extern int msr_serial_open(char *path, int *fd, int blocking, speed_t baud);
 
 /**
  * @brief Close a serial connection to the MSR device.
+ * @details This may be called while other threads are using the
+ * device. A call that is under way fails at its next I/O, as on an
+ * unplugged device, and calls waiting for the device's lock give up on
+ * it and fail the same way. The fd is closed once they have let go.
  *
  * @param fd The file descriptor to close.
  * @return ::LIBMSR_ERR_OK
@@ -440,14 +523,28 @@ extern int msr_serial_close(int fd);
 
 /**
  * @brief Read a single character from the MSR device.
+ * @details Waits for as long as it takes, even on an fd opened with
+ * ::MSR_BLOCKING.
  *
  * @param fd The file descriptor to read from.
  * @param c A pointer to write the character into.
  *
- * @return The character read
+ * @return 1 if a character was read, 0 if the device was closed at the
+ * other end, or -1 on error, with errno set.
  */
 extern int msr_serial_readchar(int fd, uint8_t *c);
 
+/**
+ * @brief Read a single character from the MSR device, with a timeout.
+ *
+ * @param fd The file descriptor to read from.
+ * @param c A pointer to write the character into.
+ * @param timeout The timeout in milliseconds, or -1 to wait forever.
+ *
+ * @return 1 if a character was read, 0 on timeout, or -1 on error.
+ */
+extern int msr_serial_readchar_timeout(int fd, uint8_t *c, int timeout);
+
 /**
  * @brief Write a series of bytes to the MSR device.
  *
@@ -464,7 +561,9 @@ extern int msr_serial_write(int fd, void *buf, size_t len);
  * @param fd The file descriptor to read from.
  * @param buf The buffer to read into.
  * @param len The length of the buffer.
- * @return ::LIBMSR_ERR_OK
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL if the device couldn't be read, or was
+ * closed before @p len bytes arrived.
  */
 extern int msr_serial_read(int fd, void *buf, size_t len);
 
@@ -495,6 +594,20 @@ extern int msr_zeros(int fd, msr_lz_t *lz);
  */
 extern int msr_commtest(int fd);
 
+/**
+ * @brief Perform a communications test, giving up after a timeout.
+ * @details This function behaves like msr_commtest(), but stops waiting for
+ * the ::MSR_STS_COMM_OK byte once @p timeout milliseconds have passed. It
+ * is safe to use on a port that may not have an MSR device behind it.
+ *
+ * @param fd The device's fd.
+ * @param timeout The timeout in milliseconds.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @return ::LIBMSR_ERR_TIMEOUT if the device did not respond in time.
+ */
+extern int msr_commtest_timeout(int fd, int timeout);
+
 /**
  * @brief Initialize the MSR device.
  * @details This function issues a reset command to the MSR206 device, and
@@ -566,6 +679,21 @@ extern int msr_sensor_test(int fd);
  */
 extern int msr_ram_test(int fd);
 
+/**
+ * @brief Check the device's RAM, giving up after a timeout.
+ * @details This function behaves like msr_ram_test(), but stops waiting
+ * for the device's answer once @p timeout milliseconds have passed, and
+ * then throws away anything it has received.
+ *
+ * @param fd The device's fd.
+ * @param timeout The timeout in milliseconds.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @return ::LIBMSR_ERR_TIMEOUT if the device did not respond in time.
+ */
+extern int msr_ram_test_timeout(int fd, int timeout);
+
 /**
  * @brief Get the device's coercivity level.
  * @details This function issues an ::MSR_CMD_GETCO command to retrieve the
@@ -579,6 +707,22 @@ extern int msr_ram_test(int fd);
  */
 extern int msr_get_co(int fd);
 
+/**
+ * @brief Get the device's coercivity level, giving up after a timeout.
+ * @details This function behaves like msr_get_co(), but stops waiting for
+ * the device's answer once @p timeout milliseconds have passed, and then
+ * throws away anything it has received.
+ *
+ * @param fd The device's fd.
+ * @param timeout The timeout in milliseconds.
+ * @return ::MSR_CO_HI if the device is in hi-co mode.
+ * @return ::MSR_CO_LO if the device is in lo-co mode.
+ * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @return ::LIBMSR_ERR_TIMEOUT if the device did not respond in time.
+ */
+extern int msr_get_co_timeout(int fd, int timeout);
+
 /**
  * @brief Set the device's coercivity to high.
  * @details This function issues an ::MSR_CMD_SETCO_HI command to switch the
@@ -611,13 +755,48 @@ extern int msr_set_lo_co(int fd);
  * @brief Reset the MSR device.
  * @details This function issues an ::MSR_CMD_RESET command to reset the device.
  * This command does not return a status code. The routine pauses
- * for a tenth of a second to wait for the reset to complete.
+ * for a tenth of a second to wait for the reset to complete, or, if the
+ * device is in ::MSR_READY_PROBE mode, until the device responds again.
+ *
+ * @see msr_set_ready_mode()
  *
  * @param fd The device's fd.
- * @return ::LIBMSR_ERR_OK.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
  */
 extern int msr_reset(int fd);
 
+/**
+ * @brief Choose how the library waits for the device to become ready.
+ * @details msr_reset() and msr_flash_led() send commands that the device
+ * does not answer, so the library has to wait before sending anything
+ * else. In ::MSR_READY_FIXED mode (the default) it waits a tenth of a
+ * second. In ::MSR_READY_PROBE mode it sends communications tests with a
+ * short timeout and continues as soon as one is answered. The time the
+ * device takes is learned (separately for resets and LED changes), and
+ * most of it is slept through before the first probe. If the device does
+ * not answer within the fixed delay, the library falls back to it, and
+ * after ::MSR_READY_MAX_FAILS such failures in a row the device is
+ * switched back to ::MSR_READY_FIXED mode.
+ *
+ * The mode is kept per device and reset by msr_serial_open().
+ *
+ * @param fd The device's fd.
+ * @param mode ::MSR_READY_FIXED or ::MSR_READY_PROBE.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on an invalid mode or fd.
+ */
+extern int msr_set_ready_mode(int fd, int mode);
+
+/**
+ * @brief Get the time the device currently takes to recover from a reset.
+ *
+ * @param fd The device's fd.
+ * @return The learned delay in microseconds, or the fixed delay if
+ * none has been learned.
+ */
+extern long msr_ready_delay(int fd);
+
 /**
  * @brief Read an ISO formatted card.
  * @details This routine issues an ::MSR_CMD_READ command to the device to
@@ -628,13 +807,45 @@ extern int msr_reset(int fd);
  * a pointer to an ::msr_tracks_t structure and supply a pointer
  * to this structure via the tracks argument.
  *
+ * A track the device couldn't decode is returned empty without failing
+ * the read, but the status the device gave for it is recorded as an
+ * ::LIBMSR_ERR_ISO failure for msr_last_error(), with the track's number.
+ *
  * @param fd The device's fd.
  * @param tracks A pointer to the ::msr_tracks_t to populate.
  * @return ::LIBMSR_ERR_OK on success.
  * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @return ::LIBMSR_ERR_FRAMING if the response was malformed.
+ * @return ::LIBMSR_ERR_DEVICE if the device reported an error status,
+ * such as ::MSR_STS_RW_SWIPEBAD_ERR; see msr_last_error().
  */
 extern int msr_iso_read(int fd, msr_tracks_t *tracks);
 
+/**
+ * @brief Arm the MSR device for an ISO formatted read.
+ * @details This is the first half of msr_iso_read(). It issues an
+ * ::MSR_CMD_READ command and returns immediately, leaving the device
+ * waiting for a swipe. Callers that multiplex several devices can
+ * poll(2) the fd for readability and then call msr_iso_read_collect()
+ * to parse the response. A pending read can be cancelled with msr_reset().
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ */
+extern int msr_iso_read_arm(int fd);
+
+/**
+ * @brief Collect the response to an armed ISO formatted read.
+ * @details This is the second half of msr_iso_read(). It blocks until the
+ * device returns the track data requested by msr_iso_read_arm().
+ *
+ * @param fd The device's fd.
+ * @param tracks A pointer to the ::msr_tracks_t to populate.
+ * @return As for msr_iso_read().
+ */
+extern int msr_iso_read_collect(int fd, msr_tracks_t *tracks);
+
 /**
  * @brief Write an ISO formatted card.
  * @details This routine issues an ::MSR_CMD_WRITE command to the device to
@@ -674,10 +885,35 @@ extern int msr_iso_write(int fd, msr_tracks_t *tracks);
  * @param fd The device's fd.
  * @param tracks A pointer to the ::msr_tracks_t to populate.
  * @return ::LIBMSR_ERR_OK on success.
- * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @return ::LIBMSR_ERR_FRAMING if the response was malformed.
+ * @return ::LIBMSR_ERR_DEVICE if the device reported an error status;
+ * see msr_last_error().
  */
 extern int msr_raw_read(int fd, msr_tracks_t *tracks);
 
+/**
+ * @brief Arm the MSR device for a raw read.
+ * @details This is the first half of msr_raw_read(). It issues an
+ * ::MSR_CMD_RAW_READ command and returns without waiting for a swipe.
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ * @see msr_iso_read_arm()
+ */
+extern int msr_raw_read_arm(int fd);
+
+/**
+ * @brief Collect the response to an armed raw read.
+ * @details This is the second half of msr_raw_read().
+ *
+ * @param fd The device's fd.
+ * @param tracks A pointer to the ::msr_tracks_t to populate.
+ * @return As for msr_raw_read().
+ */
+extern int msr_raw_read_collect(int fd, msr_tracks_t *tracks);
+
 /**
  * @brief Write raw data to a card.
  * @details This routine issues an ::MSR_CMD_RAW_WRITE command to the device to
@@ -752,15 +988,56 @@ extern int msr_erase(int fd, uint8_t tracks);
  *
  * After an LED control command is issued to the device, the
  * routine will pause for a tenth of a second to allow time for the
- * command to be processed and the LED to light up.
+ * command to be processed and the LED to light up. In ::MSR_READY_PROBE
+ * mode, it instead returns as soon as the device responds again.
+ * Use msr_led_queue() to give feedback without blocking.
  *
  * @param fd The device's fd.
  * @param led The LED to control.
  * @return ::LIBMSR_ERR_OK on success.
- * @return ::LIBMSR_ERR_SERIAL | ::LIBMSR_ERR_DEVICE on error.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
  */
 extern int msr_flash_led(int fd, uint8_t led);
 
+/**
+ * @brief Queue an LED change without waiting for it.
+ * @details Unlike msr_flash_led(), this function never waits. If the
+ * device is idle, the LED command is written at once; otherwise it is
+ * sent once the device is idle again, after the response to the
+ * exchange in progress has been collected, and never in the middle of
+ * an exchange. The device needs the same pause after it as in
+ * msr_flash_led(), or it may drop the command that follows, but that
+ * pause runs while the caller gets on with other things: the next
+ * command, such as the one that re-arms the device for reading, only
+ * waits for whatever is left of it.
+ *
+ * Only the latest queued change is kept, and changes that would leave the
+ * LEDs as they are are dropped, so feedback can be queued freely after
+ * every swipe. The queue may be written from any thread.
+ *
+ * @param fd The device's fd.
+ * @param led The LED command, as for msr_flash_led().
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on an invalid fd or LED command.
+ * @return ::LIBMSR_ERR_SERIAL if the change was written at once and
+ * that failed.
+ */
+extern int msr_led_queue(int fd, uint8_t led);
+
+/**
+ * @brief Send a queued LED change now.
+ * @details This function writes the change queued with msr_led_queue(), if
+ * any, without waiting for the device to take it; the next command waits
+ * for whatever is left of the pause. It returns at once if nothing is
+ * queued. It must not be called while an exchange with the device is in
+ * progress (for example, while a read is armed).
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ */
+extern int msr_led_flush(int fd);
+
 /**
  * @brief Set the MSR device's BPI value.
  * @details This function issues an ::MSR_CMD_SETBPI command to set the bits per
@@ -789,7 +1066,8 @@ extern int msr_set_bpi(int fd, uint8_t bpi);
  * @param bpc2 The new BPC value for track 2.
  * @param bpc3 The new BPC value for track 3.
  * @return ::LIBMSR_ERR_OK on success.
- * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_DEVICE on device failure, or if the settings the
+ * device echoed back aren't the ones requested.
  */
 extern int msr_set_bpc(int fd, uint8_t bpc1, uint8_t bpc2, uint8_t bpc3);
 
@@ -854,10 +1132,2142 @@ extern void msr_pretty_printer_string(msr_tracks_t tracks);
  */
 extern void msr_pretty_printer_bits(msr_tracks_t tracks);
 
+/**
+ * @brief As msr_pretty_output_hex(), without copying the tracks.
+ *
+ * @param fd The fd to write to.
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_output_tracks_hex(int fd, const msr_tracks_t *tracks);
+
+/**
+ * @brief As msr_pretty_output_string(), without copying the tracks.
+ *
+ * @param fd The fd to write to.
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_output_tracks_string(int fd,
+	const msr_tracks_t *tracks);
+
+/**
+ * @brief As msr_pretty_output_bits(), without copying the tracks.
+ *
+ * @param fd The fd to write to.
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_output_tracks_bits(int fd, const msr_tracks_t *tracks);
+
 /**
  * @brief Reverse a single byte.
  *
  * @param byte The byte to reverse.
  * @return The reversed byte.
  */
-extern const unsigned char msr_reverse_byte(const unsigned char byte);
+extern unsigned char msr_reverse_byte(const unsigned char byte);
+
+/**
+ * The magic number at the start of a swipe ring ("MSRR").
+ */
+#define MSR_SHM_MAGIC 0x4D535252
+
+/**
+ * The default number of slots in a swipe ring.
+ */
+#define MSR_SHM_SLOTS 64
+
+/**
+ * @brief Represents a single swipe published into a shared-memory ring.
+ * @details A slot is stable while ::msr_shm_slot::msr_seq equals the
+ * sequence number of the swipe plus one. The publisher zeroes
+ * the sequence while rewriting a slot, so readers must check it again
+ * after using the data (see msr_shm_check()).
+ */
+typedef struct msr_shm_slot {
+	uint64_t msr_seq; /**< The swipe's sequence number plus one. */
+	uint64_t msr_time; /**< The swipe's CLOCK_REALTIME time, in ns. */
+	uint32_t msr_dev; /**< The publisher's index for the device. */
+	int32_t msr_status; /**< The result of the read. */
+	msr_tracks_t msr_tracks; /**< The tracks read. */
+} msr_shm_slot_t;
+
+/**
+ * @brief Represents the header at the start of a swipe ring.
+ */
+typedef struct msr_shm_hdr {
+	uint32_t msr_magic; /**< ::MSR_SHM_MAGIC */
+	uint32_t msr_nslots; /**< The number of slots, a power of two. */
+	uint32_t msr_slotsize; /**< The size of each slot, in bytes. */
+	uint32_t msr_futex; /**< Bumped and woken on every publish. */
+	uint64_t msr_head; /**< The number of swipes published so far. */
+} msr_shm_hdr_t;
+
+/**
+ * @brief Represents a mapping of a swipe ring.
+ */
+typedef struct msr_shm {
+	int msr_shm_fd; /**< The memfd backing the ring. */
+	size_t msr_shm_len; /**< The length of the mapping. */
+	msr_shm_hdr_t *msr_shm_hdr; /**< The mapped ring. */
+} msr_shm_t;
+
+/**
+ * @brief Create a swipe ring for publishing.
+ * @details This function creates a sealed memfd holding a ring of
+ * @p nslots swipe slots and maps it read-write. The memfd is then
+ * sealed against writes, so this mapping is the only one through which
+ * the ring can be changed, and it can be handed to subscribers with
+ * msr_shm_send_fd(), who can only map it read-only, with
+ * msr_shm_attach(). Sealing needs Linux 5.1 or later. Publishing a
+ * swipe costs one copy into the ring no matter how many subscribers
+ * there are.
+ *
+ * @param nslots The number of slots, rounded up to a power of two.
+ * @param ring A pointer to the ::msr_shm_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_shm_create(uint32_t nslots, msr_shm_t *ring);
+
+/**
+ * @brief Map an existing swipe ring read-only.
+ * @details The memfd must carry the seals msr_shm_create() puts on it,
+ * so that its size can't change under the mapping.
+ *
+ * @param memfd The memfd received from the publisher.
+ * @param ring A pointer to the ::msr_shm_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the memfd is not a sealed, valid ring.
+ */
+extern int msr_shm_attach(int memfd, msr_shm_t *ring);
+
+/**
+ * @brief Unmap a swipe ring and close its memfd.
+ *
+ * @param ring The ring to close.
+ * @return ::LIBMSR_ERR_OK
+ */
+extern int msr_shm_close(msr_shm_t *ring);
+
+/**
+ * @brief Publish a swipe into a ring and wake all subscribers.
+ * @details There must be only one publisher per ring at a time.
+ *
+ * @param ring The ring to publish into.
+ * @param dev The publisher's index for the device that read the swipe.
+ * @param status The result of the read.
+ * @param tracks The tracks read.
+ * @return The sequence number of the published swipe.
+ */
+extern uint64_t msr_shm_publish(msr_shm_t *ring, uint32_t dev, int status,
+	const msr_tracks_t *tracks);
+
+/**
+ * @brief Wait for a swipe to be published.
+ * @details This function returns as soon as the ring holds a swipe with
+ * sequence number @p seq or later. Waiting is done with a futex on the
+ * shared mapping, so idle subscribers cost nothing.
+ *
+ * @param ring The ring to wait on.
+ * @param seq The sequence number to wait for.
+ * @param timeout The timeout in milliseconds, or -1 to wait forever.
+ * @return ::LIBMSR_ERR_OK once the swipe is available.
+ * @return ::LIBMSR_ERR_GENERIC on timeout.
+ */
+extern int msr_shm_wait(msr_shm_t *ring, uint64_t seq, int timeout);
+
+/**
+ * @brief Get the sequence number of the next swipe to be published.
+ *
+ * @param ring The ring.
+ * @return The ring's current head.
+ */
+extern uint64_t msr_shm_head(msr_shm_t *ring);
+
+/**
+ * @brief Look at a published swipe in place.
+ * @details The returned slot points into the shared mapping and is not
+ * copied. Once done with it, the caller must confirm with msr_shm_check()
+ * that it was not overwritten in the meantime.
+ *
+ * @param ring The ring.
+ * @param seq The sequence number of the swipe.
+ * @return A pointer to the slot, or NULL if the swipe is not in the ring.
+ */
+extern const msr_shm_slot_t *msr_shm_peek(msr_shm_t *ring, uint64_t seq);
+
+/**
+ * @brief Check that a slot returned by msr_shm_peek() is still valid.
+ *
+ * @param slot The slot.
+ * @param seq The sequence number the slot was peeked at.
+ * @return ::LIBMSR_ERR_OK if the slot still holds the swipe.
+ * @return ::LIBMSR_ERR_GENERIC if the publisher has lapped the reader.
+ */
+extern int msr_shm_check(const msr_shm_slot_t *slot, uint64_t seq);
+
+/**
+ * @brief Copy a published swipe out of a ring.
+ *
+ * @param ring The ring.
+ * @param seq The sequence number of the swipe.
+ * @param slot A pointer to the ::msr_shm_slot_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the swipe is not in the ring.
+ */
+extern int msr_shm_read(msr_shm_t *ring, uint64_t seq, msr_shm_slot_t *slot);
+
+/**
+ * @brief Pass a ring's memfd over a Unix socket.
+ *
+ * @param sock The connected Unix socket.
+ * @param memfd The memfd to pass.
+ * @param msg The message to send with the fd.
+ * @param len The length of the message, at least 1.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on I/O failure.
+ */
+extern int msr_shm_send_fd(int sock, int memfd, const void *msg, size_t len);
+
+/**
+ * @brief Receive a ring's memfd over a Unix socket.
+ *
+ * @param sock The connected Unix socket.
+ * @param memfd The int pointer to store the memfd in.
+ * @param msg The buffer to receive the accompanying message into.
+ * @param len A pointer to the buffer's length, updated with the length read.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on I/O failure or if no fd was passed.
+ */
+extern int msr_shm_recv_fd(int sock, int *memfd, void *msg, size_t *len);
+
+/**
+ * The default glob patterns searched by msr_discover().
+ */
+#define MSR_DISCOVER_DEFAULT "/dev/ttyUSB*:/dev/ttyACM*"
+
+/**
+ * How long msr_discover() waits for a port to answer a communications
+ * test, in milliseconds.
+ */
+#define MSR_DISCOVER_TIMEOUT 500
+
+/**
+ * @brief Represents a discovered and initialized MSR device.
+ */
+typedef struct msr_dev {
+	char *msr_path; /**< The path to the serial device. */
+	int msr_fd; /**< The device's open fd. */
+	uint8_t msr_model[10]; /**< The model, as returned by msr_model(). */
+	uint8_t msr_fwrev[9]; /**< The revision, as returned by msr_fwrev(). */
+} msr_dev_t;
+
+/**
+ * @brief Represents a set of discovered MSR devices.
+ */
+typedef struct msr_devset {
+	msr_dev_t *msr_devs; /**< The devices, in the order they matched. */
+	size_t msr_ndevs; /**< The number of devices. */
+} msr_devset_t;
+
+/**
+ * @brief Find and initialize all MSR devices matching a pattern.
+ * @details This function expands @p pattern, a colon-separated list of
+ * glob(7) patterns, and probes every matching serial port concurrently.
+ * Each port is opened, reset, checked with msr_commtest_timeout() and
+ * reset again (the equivalent of msr_init()), and then fingerprinted
+ * with msr_model() and msr_fwrev(). Since all ports are handled at once,
+ * the reset delays overlap and bringing up N devices takes about as long
+ * as bringing up one.
+ *
+ * Ports that do not answer like an MSR206-compatible device are closed
+ * and left out of the set. Note that probing writes to every matching
+ * port, so the pattern should not match unrelated hardware.
+ *
+ * @param pattern The patterns to search, or NULL for ::MSR_DISCOVER_DEFAULT.
+ * @param baud The baud rate of the serial devices (e.g., ::MSR_BAUD)
+ * @param set A pointer to the ::msr_devset_t to populate.
+ * @return ::LIBMSR_ERR_OK on success, even if no devices were found.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_discover(const char *pattern, speed_t baud, msr_devset_t *set);
+
+/**
+ * @brief Close and free all devices in a set.
+ *
+ * @param set The set to free.
+ */
+extern void msr_devset_free(msr_devset_t *set);
+
+/**
+ * @brief Decode raw track data into characters.
+ * @details This function decodes a raw bit stream (as returned by
+ * msr_raw_read()) into characters of @p bpc bits each, the last of which
+ * is a parity bit. Characters of fewer than 7 bits are mapped into the
+ * ISO numeric set ('0' and up), the rest into the ISO alphanumeric set
+ * (' ' and up).
+ *
+ * @param inbuf The raw track data.
+ * @param inlen The length of the raw track data.
+ * @param outbuf The buffer to decode into.
+ * @param outlen A pointer to the size of @p outbuf, updated with the
+ * number of characters decoded.
+ * @param bpc The number of bits per character, including parity.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if @p outbuf was too small.
+ */
+extern int msr_decode(uint8_t *inbuf, uint8_t inlen,
+	uint8_t *outbuf, uint8_t *outlen, int bpc);
+
+/**
+ * @brief Represents all tracks on a card in compact form.
+ * @details An ::msr_tracks_t reserves ::MSR_MAX_TRACK_LEN bytes for every
+ * track. A compact record instead stores just the three lengths, and
+ * is followed directly in memory by the data of each track, back to back.
+ * Records are variable-length, so they are built with msr_ctracks_pack()
+ * or msr_arena_add() rather than declared, and their data is reached with
+ * msr_ctracks_data().
+ */
+typedef struct msr_ctracks {
+	uint8_t msr_ct_len[MSR_MAX_TRACKS]; /**< The length of each track. */
+} msr_ctracks_t;
+
+/**
+ * @brief Get the size of the compact form of a set of tracks.
+ *
+ * @param tracks The tracks.
+ * @return The size, in bytes, of the compact record.
+ */
+extern size_t msr_ctracks_size(const msr_tracks_t *tracks);
+
+/**
+ * @brief Get the size of a compact record.
+ *
+ * @param ct The compact record.
+ * @return The size, in bytes, of the record, including its data.
+ */
+extern size_t msr_ctracks_len(const msr_ctracks_t *ct);
+
+/**
+ * @brief Convert tracks into a compact record.
+ *
+ * @param tracks The tracks to convert.
+ * @param buf The buffer to write the compact record into.
+ * @param len The size of the buffer.
+ * @return The number of bytes written, or 0 if the buffer is too small.
+ */
+extern size_t msr_ctracks_pack(const msr_tracks_t *tracks, void *buf,
+	size_t len);
+
+/**
+ * @brief Convert a compact record back into tracks.
+ *
+ * @param ct The compact record.
+ * @param tracks A pointer to the ::msr_tracks_t to populate.
+ * @return ::LIBMSR_ERR_OK
+ */
+extern int msr_ctracks_unpack(const msr_ctracks_t *ct, msr_tracks_t *tracks);
+
+/**
+ * @brief Get a track's data from a compact record, without copying it.
+ *
+ * @param ct The compact record.
+ * @param tn The index of the track, from 0.
+ * @param len A pointer to store the track's length in.
+ * @return A pointer to the track's data, or NULL if @p tn is invalid.
+ */
+extern const uint8_t *msr_ctracks_data(const msr_ctracks_t *ct, int tn,
+	uint8_t *len);
+
+/**
+ * @brief Decode a raw track straight from a compact record.
+ *
+ * @param ct The compact record.
+ * @param tn The index of the track, from 0.
+ * @param outbuf The buffer to decode into.
+ * @param outlen A pointer to the size of @p outbuf, updated with the
+ * number of characters decoded.
+ * @param bpc The number of bits per character, including parity.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ * @see msr_decode()
+ */
+extern int msr_ctracks_decode(const msr_ctracks_t *ct, int tn,
+	uint8_t *outbuf, uint8_t *outlen, int bpc);
+
+/**
+ * @brief Dump a "pretty" hexadecimal representation of a compact record.
+ *
+ * @param fd The fd to write to.
+ * @param ct The compact record to dump.
+ */
+extern void msr_pretty_output_ctracks_hex(int fd, const msr_ctracks_t *ct);
+
+/**
+ * @brief Dump a "pretty" string representation of a compact record.
+ *
+ * @param fd The fd to write to.
+ * @param ct The compact record to dump.
+ */
+extern void msr_pretty_output_ctracks_string(int fd, const msr_ctracks_t *ct);
+
+/**
+ * @brief Dump a "pretty" binary representation of a compact record.
+ *
+ * @param fd The fd to write to.
+ * @param ct The compact record to dump.
+ */
+extern void msr_pretty_output_ctracks_bits(int fd, const msr_ctracks_t *ct);
+
+/**
+ * The smallest initial size of an ::msr_arena_t, in bytes.
+ */
+#define MSR_ARENA_MIN 4096
+
+/**
+ * @brief Represents a contiguous, growable store of compact records.
+ * @details Records are appended back to back and referred to by their
+ * offset from the start of the arena, which stays valid as it grows.
+ */
+typedef struct msr_arena {
+	uint8_t *msr_ar_base; /**< The start of the arena. */
+	size_t msr_ar_used; /**< The number of bytes in use. */
+	size_t msr_ar_size; /**< The number of bytes allocated. */
+} msr_arena_t;
+
+/**
+ * @brief Initialize an empty arena.
+ *
+ * @param arena A pointer to the ::msr_arena_t to initialize.
+ * @param size The number of bytes to allocate up front.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on allocation failure.
+ */
+extern int msr_arena_init(msr_arena_t *arena, size_t size);
+
+/**
+ * @brief Free an arena and all records in it.
+ *
+ * @param arena The arena to free.
+ */
+extern void msr_arena_free(msr_arena_t *arena);
+
+/**
+ * @brief Append tracks to an arena as a compact record.
+ *
+ * @param arena The arena.
+ * @param tracks The tracks to append.
+ * @param off A pointer to store the record's offset in, or NULL.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on allocation failure.
+ */
+extern int msr_arena_add(msr_arena_t *arena, const msr_tracks_t *tracks,
+	size_t *off);
+
+/**
+ * @brief Get the compact record at an offset in an arena.
+ * @details The returned pointer is invalidated by msr_arena_add().
+ *
+ * @param arena The arena.
+ * @param off The record's offset.
+ * @return A pointer to the record, or NULL if @p off is past the end.
+ */
+extern const msr_ctracks_t *msr_arena_get(const msr_arena_t *arena,
+	size_t off);
+
+/**
+ * @brief Get the offset of the record following another in an arena.
+ * @details Starting from 0, this can be used to walk every record in an
+ * arena until the returned offset equals ::msr_arena::msr_ar_used.
+ *
+ * @param arena The arena.
+ * @param off The current record's offset.
+ * @return The next record's offset.
+ */
+extern size_t msr_arena_next(const msr_arena_t *arena, size_t off);
+
+/**
+ * @brief Represents a field within a buffer, by position.
+ */
+typedef struct msr_view {
+	uint8_t msr_off; /**< The offset of the field in the buffer. */
+	uint8_t msr_len; /**< The length of the field. */
+} msr_view_t;
+
+/**
+ * Get a pointer to the start of a ::msr_view_t in the buffer it refers to.
+ */
+#define MSR_VIEW_PTR(buf, v) ((buf) + (v).msr_off)
+
+/**
+ * @brief Represents the fields of an ISO/IEC 7813 track 1 or track 2.
+ * @details Every field is a ::msr_view_t into the track data that was
+ * parsed, so that data must outlive the fields. Optional fields that the
+ * card leaves out have a length of 0.
+ */
+typedef struct msr_iso_fields {
+	int msr_status; /**< The result of the parse. */
+	uint8_t msr_fmt; /**< The format code (track 1 only), e.g. 'B'. */
+	uint8_t msr_luhn_ok; /**< Whether the PAN passes the Luhn check. */
+	msr_view_t msr_pan; /**< The primary account number. */
+	msr_view_t msr_name; /**< The cardholder name (track 1 only). */
+	msr_view_t msr_exp; /**< The expiration date, as YYMM. */
+	msr_view_t msr_svc; /**< The service code. */
+	msr_view_t msr_disc; /**< The discretionary data. */
+} msr_iso_fields_t;
+
+/**
+ * @brief Parse ISO/IEC 7813 track 1 (format B) data.
+ * @details The data may or may not include the start and end sentinels;
+ * anything after an end sentinel is ignored. Field separators, field
+ * lengths and character sets are checked, and the Luhn check of the PAN
+ * is computed, in a single pass. Nothing is copied or allocated.
+ *
+ * A PAN that fails the Luhn check is not treated as a parse error; check
+ * ::msr_iso_fields::msr_luhn_ok.
+ *
+ * @param data The track data, e.g. as read by msr_iso_read().
+ * @param len The length of the track data.
+ * @param f A pointer to the ::msr_iso_fields_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_ISO if the data is not a valid track 1.
+ */
+extern int msr_iso7813_tk1(const uint8_t *data, uint8_t len,
+	msr_iso_fields_t *f);
+
+/**
+ * @brief Parse ISO/IEC 7813 track 2 data.
+ * @details This function works like msr_iso7813_tk1(), but for track 2.
+ * The name is always empty.
+ *
+ * @param data The track data, e.g. as read by msr_iso_read().
+ * @param len The length of the track data.
+ * @param f A pointer to the ::msr_iso_fields_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_ISO if the data is not a valid track 2.
+ */
+extern int msr_iso7813_tk2(const uint8_t *data, uint8_t len,
+	msr_iso_fields_t *f);
+
+/**
+ * @brief Parse track 1 or track 2 of an ISO formatted card.
+ *
+ * @param tracks The tracks, as read by msr_iso_read().
+ * @param tn The index of the track to parse: 0 for track 1, 1 for track 2.
+ * @param f A pointer to the ::msr_iso_fields_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_ISO if the track is not valid.
+ * @return ::LIBMSR_ERR_GENERIC if @p tn is not 0 or 1.
+ */
+extern int msr_iso7813_parse(const msr_tracks_t *tracks, int tn,
+	msr_iso_fields_t *f);
+
+/**
+ * @brief Parse the same track of many cards.
+ * @details This function calls msr_iso7813_parse() on each of @p n
+ * records. Each result is left in ::msr_iso_fields::msr_status.
+ *
+ * @param tracks An array of @p n records.
+ * @param n The number of records.
+ * @param tn The index of the track to parse: 0 for track 1, 1 for track 2.
+ * @param fields An array of @p n ::msr_iso_fields_t to populate.
+ * @return The number of records parsed successfully.
+ */
+extern size_t msr_iso7813_parse_batch(const msr_tracks_t *tracks, size_t n,
+	int tn, msr_iso_fields_t *fields);
+
+/**
+ * @brief Describes how each raw track was decoded by msr_iso_decode().
+ */
+typedef struct msr_decode_info {
+	int msr_status[MSR_MAX_TRACKS]; /**< The result for each track. */
+	uint8_t msr_bpc[MSR_MAX_TRACKS]; /**< The bits per character used. */
+	uint8_t msr_reversed[MSR_MAX_TRACKS]; /**< Whether the track was read
+						backwards. */
+} msr_decode_info_t;
+
+/**
+ * @brief Decode a raw track into ISO characters.
+ * @details This function finds the start sentinel in a raw track (as
+ * returned by msr_raw_read()) and decodes characters of @p bpc bits up
+ * to the end sentinel, checking the parity of each and the LRC that
+ * follows. The result is in the same form as a track read with
+ * msr_iso_read(), without sentinels. 5-bit tracks use the ISO numeric
+ * set, 7-bit tracks the ISO alphanumeric set, and 8-bit tracks 7-bit
+ * ASCII with odd parity.
+ *
+ * @param raw The raw track.
+ * @param iso A pointer to the ::msr_track_t to decode into.
+ * @param bpc The number of bits per character: 5, 7 or 8.
+ * @param reverse Nonzero to decode the track as if swiped backwards.
+ * @return ::LIBMSR_ERR_OK if the track decoded cleanly.
+ * @return ::LIBMSR_ERR_ISO if it did not; @p iso holds what was decoded.
+ * @return ::LIBMSR_ERR_GENERIC on an unsupported @p bpc.
+ */
+extern int msr_iso_decode_track(const msr_track_t *raw, msr_track_t *iso,
+	int bpc, int reverse);
+
+/**
+ * @brief Encode ISO characters into a raw track.
+ * @details This is the reverse of msr_iso_decode_track(): the result is
+ * a start sentinel, the characters, an end sentinel and the LRC, each
+ * @p bpc bits wide with odd parity, without leading or trailing zeros.
+ * Sentinels in @p iso are optional.
+ *
+ * @param iso The ISO track.
+ * @param raw A pointer to the ::msr_track_t to encode into.
+ * @param bpc The number of bits per character: 5, 7 or 8.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_ISO if a character can't be encoded at @p bpc
+ * or the result is too long.
+ * @return ::LIBMSR_ERR_GENERIC on an unsupported @p bpc.
+ */
+extern int msr_iso_encode_track(const msr_track_t *iso, msr_track_t *raw,
+	int bpc);
+
+/**
+ * @brief Decode raw tracks into ISO characters, trying every format.
+ * @details Each non-empty track is first decoded at its usual width
+ * (7 bits for track 1, 5 for tracks 2 and 3), then at the other widths,
+ * each both forwards and backwards, until one decodes cleanly. If none
+ * does, the attempt that got furthest is kept. How each track was
+ * decoded is reported in @p info.
+ *
+ * @param raw The raw tracks.
+ * @param iso A pointer to the ::msr_tracks_t to decode into.
+ * @param info A pointer to the ::msr_decode_info_t to populate.
+ * @return ::LIBMSR_ERR_OK if every track decoded cleanly.
+ * @return ::LIBMSR_ERR_ISO otherwise.
+ */
+extern int msr_iso_decode(const msr_tracks_t *raw, msr_tracks_t *iso,
+	msr_decode_info_t *info);
+
+/**
+ * @brief Read a card once, and return both raw and ISO decoded tracks.
+ * @details This routine performs an msr_raw_read() and then decodes the
+ * result with msr_iso_decode(), so a card that the device's own ISO
+ * decoder would reject (for example, one swiped backwards or encoded at
+ * an unusual density) does not need to be swiped again in raw mode.
+ *
+ * @param fd The device's fd.
+ * @param raw A pointer to the ::msr_tracks_t to read raw tracks into.
+ * @param iso A pointer to the ::msr_tracks_t to decode into.
+ * @param info A pointer to the ::msr_decode_info_t to populate.
+ * @return ::LIBMSR_ERR_OK if the read succeeded and every track decoded.
+ * @return ::LIBMSR_ERR_ISO if a track did not decode cleanly.
+ * @return ::LIBMSR_ERR_DEVICE on device failure.
+ */
+extern int msr_dual_read(int fd, msr_tracks_t *raw, msr_tracks_t *iso,
+	msr_decode_info_t *info);
+
+/**
+ * @brief Describes the format of a raw track, as found by msr_detect_track().
+ */
+typedef struct msr_detect {
+	uint8_t msr_bpc; /**< The bits per character, or 0 if none found. */
+	uint8_t msr_reversed; /**< Whether the track was swiped backwards. */
+	uint8_t msr_confidence; /**< 100 for a clean track, less otherwise. */
+	uint16_t msr_lz; /**< The number of leading zero bits before the start
+			   sentinel, in the detected direction. */
+} msr_detect_t;
+
+/**
+ * @brief Detect the character width and swipe direction of a raw track.
+ * @details This function looks for the start sentinel of each supported
+ * width (5, 7 and 8 bits per character) right after the leading zeros,
+ * reading the track both forwards and backwards, with a single table
+ * lookup per candidate position. Each candidate is then checked for
+ * parity, an end sentinel and a matching LRC, and scored. The best
+ * candidate is reported, with a confidence of 100 if the track decodes
+ * cleanly in that format.
+ *
+ * @param raw The raw track.
+ * @param det A pointer to the ::msr_detect_t to populate.
+ * @return ::LIBMSR_ERR_OK if a format was detected.
+ * @return ::LIBMSR_ERR_ISO if no start sentinel was found.
+ */
+extern int msr_detect_track(const msr_track_t *raw, msr_detect_t *det);
+
+/**
+ * @brief Detect the format of a raw track and decode it.
+ * @details This function calls msr_detect_track() and then decodes the
+ * track in the detected format, as msr_iso_decode_track() would.
+ *
+ * @param raw The raw track.
+ * @param iso A pointer to the ::msr_track_t to decode into.
+ * @param det A pointer to the ::msr_detect_t to populate.
+ * @return ::LIBMSR_ERR_OK if the track decoded cleanly.
+ * @return ::LIBMSR_ERR_ISO otherwise.
+ */
+extern int msr_detect_decode(const msr_track_t *raw, msr_track_t *iso,
+	msr_detect_t *det);
+
+/**
+ * Replay a recording on the schedule it was recorded on.
+ */
+#define MSR_REPLAY_REALTIME 0
+
+/**
+ * Replay a recording as fast as possible, skipping fixed delays.
+ */
+#define MSR_REPLAY_FAST 1
+
+/**
+ * How long a replay waits for libmsr to send each recorded command,
+ * in milliseconds, before counting a desync and moving on.
+ */
+#define MSR_REPLAY_TIMEOUT 1000
+
+/**
+ * @brief Statistics on a replayed session.
+ */
+typedef struct msr_replay_stats {
+	uint64_t msr_chunks; /**< The number of recorded chunks served. */
+	uint64_t msr_rx_bytes; /**< The bytes sent back to libmsr. */
+	uint64_t msr_tx_bytes; /**< The bytes libmsr sent that were checked. */
+	uint64_t msr_tx_mismatch; /**< How many of those differed from the
+				    recording. */
+	uint64_t msr_desyncs; /**< Recorded commands libmsr didn't send in
+				time. */
+} msr_replay_stats_t;
+
+/**
+ * @brief Start recording a session with the MSR device.
+ * @details Every byte written by msr_serial_write() or read through
+ * msr_serial_readchar() and friends is logged to a file with its time,
+ * until msr_record_stop() or msr_serial_close() is called. The
+ * recording can be fed back through libmsr with msr_replay_open().
+ * While it runs, msr_iso_read_sealed() and msr_raw_read_sealed() are
+ * refused.
+ *
+ * @param fd The device's fd.
+ * @param path The path of the recording to create.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the fd is already being recorded or
+ * the file can't be created.
+ */
+extern int msr_record_start(int fd, const char *path);
+
+/**
+ * @brief Stop recording a session.
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the fd isn't being recorded or the
+ * recording couldn't be written out.
+ */
+extern int msr_record_stop(int fd);
+
+/**
+ * @brief Open a recorded session as if it were an MSR device.
+ * @details This function returns an fd that can be used with any libmsr
+ * call in place of one from msr_serial_open(). A thread serves the
+ * recording behind it: commands sent by libmsr are checked against the
+ * recorded ones, and the recorded answers are sent back, either as long
+ * after each command as they were recorded (::MSR_REPLAY_REALTIME), or
+ * immediately (::MSR_REPLAY_FAST). Once the recording runs out, reads
+ * see end-of-file.
+ *
+ * Since the fd is a socket, terminal settings can't be changed on it.
+ *
+ * @param path The path of the recording.
+ * @param mode ::MSR_REPLAY_REALTIME or ::MSR_REPLAY_FAST.
+ * @param fd A pointer to store the new fd in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the recording can't be opened.
+ */
+extern int msr_replay_open(const char *path, int mode, int *fd);
+
+/**
+ * @brief Close a replayed session.
+ * @details msr_serial_close() may be used instead when the statistics
+ * are not wanted.
+ *
+ * @param fd The fd from msr_replay_open().
+ * @param stats A pointer to the ::msr_replay_stats_t to populate, or NULL.
+ * @return ::LIBMSR_ERR_OK if the whole recording was served and libmsr
+ * sent exactly the recorded commands.
+ * @return ::LIBMSR_ERR_GENERIC otherwise.
+ */
+extern int msr_replay_close(int fd, msr_replay_stats_t *stats);
+
+/**
+ * @name Command queue operations
+ * The kinds of command an ::msr_cmdq_t can hold.
+ * @{
+ */
+#define MSR_CMDQ_COMMTEST 1 /**< msr_commtest() */
+#define MSR_CMDQ_SET_BPI 2 /**< msr_set_bpi() */
+#define MSR_CMDQ_SET_BPC 3 /**< msr_set_bpc() */
+#define MSR_CMDQ_SET_HI_CO 4 /**< msr_set_hi_co() */
+#define MSR_CMDQ_SET_LO_CO 5 /**< msr_set_lo_co() */
+#define MSR_CMDQ_GET_CO 6 /**< msr_get_co() */
+#define MSR_CMDQ_LED 7 /**< msr_flash_led(), without blocking */
+#define MSR_CMDQ_ERASE 8 /**< msr_erase() */
+#define MSR_CMDQ_ISO_WRITE 9 /**< msr_iso_write() */
+#define MSR_CMDQ_RAW_WRITE 10 /**< msr_raw_write() */
+#define MSR_CMDQ_ISO_READ 11 /**< msr_iso_read() */
+#define MSR_CMDQ_RAW_READ 12 /**< msr_raw_read() */
+/** @} */
+
+/**
+ * The result of a queued command that was never sent, because an
+ * earlier one failed.
+ */
+#define MSR_CMDQ_NOT_RUN -1
+
+/**
+ * How long msr_cmdq_submit() waits for each byte of an answer to a
+ * streamed command, in milliseconds.
+ */
+#define MSR_CMDQ_TIMEOUT 1000
+
+/**
+ * @brief Represents a command in an ::msr_cmdq_t.
+ */
+typedef struct msr_cmdq_op {
+	uint8_t msr_op; /**< The kind of command, one of MSR_CMDQ_*. */
+	uint8_t msr_framelen; /**< The length of the prepared frame. */
+	uint8_t msr_frame[5]; /**< The command as sent to the device. */
+	uint8_t msr_mask; /**< The tracks to erase, for ::MSR_CMDQ_ERASE. */
+	msr_tracks_t *msr_tracks; /**< The tracks to write or read into. */
+	int msr_result; /**< What the corresponding function would have
+			  returned, or ::MSR_CMDQ_NOT_RUN. */
+} msr_cmdq_op_t;
+
+/**
+ * @brief Represents a sequence of commands to send to a device.
+ */
+typedef struct msr_cmdq {
+	msr_cmdq_op_t *msr_ops; /**< The queued commands, in order. */
+	size_t msr_nops; /**< The number of queued commands. */
+	size_t msr_cap; /**< The number of commands allocated. */
+} msr_cmdq_t;
+
+/**
+ * @brief Initialize an empty command queue.
+ *
+ * @param q A pointer to the ::msr_cmdq_t to initialize.
+ */
+extern void msr_cmdq_init(msr_cmdq_t *q);
+
+/**
+ * @brief Free a command queue's commands.
+ *
+ * @param q The queue, which is left empty.
+ */
+extern void msr_cmdq_free(msr_cmdq_t *q);
+
+/**
+ * @brief Remove all commands from a command queue, so it can be reused.
+ *
+ * @param q The queue.
+ */
+extern void msr_cmdq_clear(msr_cmdq_t *q);
+
+/**
+ * @brief Queue a communications test.
+ *
+ * @param q The queue.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_commtest(msr_cmdq_t *q);
+
+/**
+ * @brief Queue a change of bits per inch for track 2.
+ *
+ * @param q The queue.
+ * @param bpi The new BPI value, 75 or 210.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_set_bpi(msr_cmdq_t *q, uint8_t bpi);
+
+/**
+ * @brief Queue a change of bits per character.
+ *
+ * @param q The queue.
+ * @param bpc1 The bits per character for track 1.
+ * @param bpc2 The bits per character for track 2.
+ * @param bpc3 The bits per character for track 3.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_set_bpc(msr_cmdq_t *q, uint8_t bpc1, uint8_t bpc2,
+	uint8_t bpc3);
+
+/**
+ * @brief Queue a switch to hi-co mode.
+ *
+ * @param q The queue.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_set_hi_co(msr_cmdq_t *q);
+
+/**
+ * @brief Queue a switch to lo-co mode.
+ *
+ * @param q The queue.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_set_lo_co(msr_cmdq_t *q);
+
+/**
+ * @brief Queue a query of the coercivity mode.
+ * @details The command's result is ::MSR_CO_HI or ::MSR_CO_LO on
+ * success, as with msr_get_co().
+ *
+ * @param q The queue.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_get_co(msr_cmdq_t *q);
+
+/**
+ * @brief Queue an LED change.
+ *
+ * @param q The queue.
+ * @param led The LED command, e.g. ::MSR_CMD_LED_GRN_ON.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_led(msr_cmdq_t *q, uint8_t led);
+
+/**
+ * @brief Queue an erase of the next card swiped.
+ *
+ * @param q The queue.
+ * @param tracks The tracks to erase, as for msr_erase().
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_erase(msr_cmdq_t *q, uint8_t tracks);
+
+/**
+ * @brief Queue an ISO write to the next card swiped.
+ *
+ * @param q The queue.
+ * @param tracks The tracks to write, which must stay valid until the
+ * queue is submitted.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_iso_write(msr_cmdq_t *q, msr_tracks_t *tracks);
+
+/**
+ * @brief Queue a raw write to the next card swiped.
+ *
+ * @param q The queue.
+ * @param tracks The tracks to write, which must stay valid until the
+ * queue is submitted.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_raw_write(msr_cmdq_t *q, msr_tracks_t *tracks);
+
+/**
+ * @brief Queue an ISO read of the next card swiped.
+ *
+ * @param q The queue.
+ * @param tracks The tracks to read into, which must stay valid until the
+ * queue is submitted, with each length set to the buffer's capacity.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_iso_read(msr_cmdq_t *q, msr_tracks_t *tracks);
+
+/**
+ * @brief Queue a raw read of the next card swiped.
+ *
+ * @param q The queue.
+ * @param tracks The tracks to read into, which must stay valid until the
+ * queue is submitted, with each length set to the buffer's capacity.
+ * @return The command's index in the queue, or -1 on allocation failure.
+ */
+extern int msr_cmdq_raw_read(msr_cmdq_t *q, msr_tracks_t *tracks);
+
+/**
+ * @brief Run the commands in a queue.
+ * @details Runs of commands that the device answers straight away are
+ * sent back to back in a single write, and their answers are matched
+ * to them in order afterwards, rather than waiting for each answer
+ * before sending the next command. Erases, writes and reads wait for a
+ * swipe, so they are only sent once everything before them has been
+ * answered. An LED change ends a run, and the next command waits for
+ * what is left of the pause after it, as with msr_led_queue(). If any
+ * command fails, commands after the current run are not sent.
+ *
+ * Each command's result is left in its ::msr_cmdq_op_t. If an answer
+ * times out (::LIBMSR_ERR_TIMEOUT) or is malformed
+ * (::LIBMSR_ERR_FRAMING), the answers after it can't be matched up, so
+ * the rest of the run gets the same result. The queue may be submitted
+ * again, to any device.
+ *
+ * @param fd The device's fd.
+ * @param q The queue.
+ * @return ::LIBMSR_ERR_OK if every command succeeded.
+ * @return The result of the first command that failed otherwise.
+ */
+extern int msr_cmdq_submit(int fd, msr_cmdq_t *q);
+
+/**
+ * Verify an msr_iso_write().
+ */
+#define MSR_VERIFY_ISO 0
+
+/**
+ * Verify an msr_raw_write().
+ */
+#define MSR_VERIFY_RAW 1
+
+/**
+ * @brief Reports how a card read back after msr_write_verify().
+ * @details The per-track fields describe the last attempt.
+ */
+typedef struct msr_verify {
+	int msr_attempts; /**< The number of times the card was written. */
+	int msr_status[MSR_MAX_TRACKS]; /**< ::LIBMSR_ERR_OK if the track
+					  matched, ::LIBMSR_ERR_VERIFY if it
+					  didn't, or another error if it
+					  couldn't be compared. */
+	uint16_t msr_bit_errors[MSR_MAX_TRACKS]; /**< The number of bits that
+						   differed. */
+	int16_t msr_first_error[MSR_MAX_TRACKS]; /**< The offset of the first
+						   differing bit from the
+						   start of the data, or
+						   -1. */
+	uint8_t msr_reversed[MSR_MAX_TRACKS]; /**< Whether the card was read
+						back backwards. */
+} msr_verify_t;
+
+/**
+ * @brief Write a card and check that it reads back correctly.
+ * @details This routine writes @p tracks with msr_iso_write() or
+ * msr_raw_write(), then reads the card back with msr_raw_read(), so
+ * the card must be swiped twice. Each written track is compared with
+ * what was read back as a bitstream, ignoring the leading and trailing
+ * zeros and allowing for the card being swiped backwards; ISO tracks
+ * are first encoded with msr_iso_encode_track() at the width they were
+ * read back at. Tracks with no data are not compared.
+ *
+ * If the write, the read or the comparison fails, the whole sequence is
+ * repeated, up to @p retries more times.
+ *
+ * @param fd The device's fd.
+ * @param tracks The tracks to write.
+ * @param mode ::MSR_VERIFY_ISO or ::MSR_VERIFY_RAW.
+ * @param retries The number of times to try again after a failure.
+ * @param v A pointer to the ::msr_verify_t to populate.
+ * @return ::LIBMSR_ERR_OK if every track read back as written.
+ * @return ::LIBMSR_ERR_VERIFY if a track read back differently.
+ * @return The error from the write or read if the last attempt failed
+ * there.
+ */
+extern int msr_write_verify(int fd, msr_tracks_t *tracks, int mode,
+	int retries, msr_verify_t *v);
+
+/**
+ * @brief Take a device's lock, to make a sequence of calls atomic.
+ * @details Every libmsr function that talks to a device holds that
+ * device's lock for the whole exchange, so any number of threads can
+ * share a device: each call sees the device to itself, and calls from
+ * different threads are never interleaved on the wire. The exceptions
+ * are msr_led_queue(), which never blocks, msr_serial_close(), which
+ * fails the calls in progress, and msr_serial_open(), which must not
+ * race with other calls on the same fd.
+ *
+ * A thread that needs several calls to run back to back, such as
+ * msr_iso_read_arm() and msr_iso_read_collect(), can hold the lock
+ * across them with this function. Locks are recursive, and each call
+ * must be matched by a call to msr_unlock(). A contended lock is spun
+ * on briefly before the thread sleeps.
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the fd is out of range and can't be
+ * locked.
+ */
+extern int msr_lock(int fd);
+
+/**
+ * @brief Release a device's lock taken with msr_lock().
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the calling thread doesn't hold the
+ * lock.
+ */
+extern int msr_unlock(int fd);
+
+/**
+ * The phase of an exchange in which an error happened: sending the
+ * command, waiting for the start of a read's response, reading track
+ * data, or reading the status.
+ */
+#define MSR_PHASE_COMMAND 1
+#define MSR_PHASE_START 2
+#define MSR_PHASE_DATA 3
+#define MSR_PHASE_STATUS 4
+
+/**
+ * @brief Describes the last failure on a device.
+ */
+typedef struct msr_err {
+	int msr_code; /**< The error code returned, as LIBMSR_ERR_*. */
+	int msr_phase; /**< Where it happened, as MSR_PHASE_*. */
+	uint8_t msr_sts; /**< The device's status byte, or the unexpected
+			   byte for ::LIBMSR_ERR_FRAMING, or 0. */
+	uint8_t msr_track; /**< The track being read (1-3), or 0. */
+	int msr_errno; /**< The errno of a failed system call, or 0. */
+} msr_err_t;
+
+/**
+ * What to do about an error, as returned by msr_err_recovery().
+ */
+#define MSR_RECOVER_NONE 0 /**< Nothing; the call can't succeed as made. */
+#define MSR_RECOVER_RETRY 1 /**< Re-arm or repeat the command. */
+#define MSR_RECOVER_RESET 2 /**< Reset the device, then repeat. */
+#define MSR_RECOVER_RECONNECT 3 /**< Close and reopen the device. */
+
+/**
+ * @brief Get the details of the last failure on a device.
+ * @details Failures are recorded as they are returned, and successes
+ * don't clear them, so this is only meaningful straight after a call
+ * has failed. The record is kept per device, so take the device's lock
+ * with msr_lock() around the call and this one if other threads share
+ * it.
+ *
+ * @param fd The device's fd.
+ * @param e A pointer to the ::msr_err_t to populate. Its code is
+ * ::LIBMSR_ERR_OK if nothing has failed since the device was opened.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the fd has no state kept for it.
+ */
+extern int msr_last_error(int fd, msr_err_t *e);
+
+/**
+ * @brief Decide how to recover from a failure.
+ * @details A bad swipe or a track that didn't decode is worth another
+ * swipe straight away. A framing error, a timeout or a status saying
+ * the device misunderstood a command means the device and the host
+ * disagree about where they are in the protocol, so it should be reset.
+ * A serial I/O error usually means the link is gone.
+ *
+ * @param e The failure, as from msr_last_error().
+ * @return One of the MSR_RECOVER_* values.
+ */
+extern int msr_err_recovery(const msr_err_t *e);
+
+/**
+ * @brief A named set of device settings for a kind of job.
+ * @details Settings left at 0 are left as they are. The bits per
+ * character are set together, so either all three are given or none.
+ */
+typedef struct msr_profile {
+	const char *msr_name; /**< The profile's name. */
+	uint8_t msr_co; /**< ::MSR_CO_HI or ::MSR_CO_LO. */
+	uint8_t msr_bpi; /**< Bits per inch for track 2, 75 or 210. */
+	uint8_t msr_bpc[MSR_MAX_TRACKS]; /**< Bits per character, 5 to 8. */
+} msr_profile_t;
+
+/**
+ * @brief Look up a built-in profile.
+ * @details The built-in profiles are "iso-hico" and "iso-loco", for
+ * ISO 7811 cards (7, 5 and 5 bits per character, 75 bits per inch on
+ * track 2), and "aamva", for AAMVA driver's licenses (7, 5 and 7 bits
+ * per character, hi-co). Other profiles are made by filling in an
+ * ::msr_profile_t.
+ *
+ * @param name The profile's name.
+ * @return The profile, or NULL if there is no such profile.
+ */
+extern const msr_profile_t *msr_profile_find(const char *name);
+
+/**
+ * @brief Apply a profile's settings to a device.
+ * @details The library keeps track of the settings each device is known
+ * to have, and only sends the ones that differ, as a command queue (see
+ * msr_cmdq_submit()), so they all go out in one write. Switching to the
+ * profile a device already has costs nothing. The bits per character
+ * the device echoes back are checked against the profile.
+ *
+ * Settings are known from the msr_set_*() and msr_get_co() calls and
+ * queued commands that succeeded since the device was opened, and are
+ * forgotten by msr_reset() and msr_init(). Settings changed some other
+ * way, such as by a power cycle, aren't noticed; reset the device
+ * first if that could have happened.
+ *
+ * @param fd The device's fd.
+ * @param p The profile to apply.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the profile has invalid settings.
+ * @return The result of the first setting that failed otherwise.
+ */
+extern int msr_profile_apply(int fd, const msr_profile_t *p);
+
+/**
+ * @brief An io_uring backend serving many devices from one thread.
+ */
+typedef struct msr_uring msr_uring_t;
+
+/**
+ * How a device on an ::msr_uring_t reads and writes cards.
+ */
+#define MSR_URING_ISO 0 /**< As msr_iso_read() and msr_iso_write(). */
+#define MSR_URING_RAW 1 /**< As msr_raw_read() and msr_raw_write(). */
+
+/**
+ * Kinds of event reported by msr_uring_wait().
+ */
+#define MSR_URING_EV_READ 1 /**< A card was read. */
+#define MSR_URING_EV_WRITE 2 /**< A write queued with msr_uring_write()
+				 finished. */
+
+/**
+ * @brief An event on a device served by an ::msr_uring_t.
+ */
+typedef struct msr_uring_event {
+	int msr_fd; /**< The device's fd. */
+	int msr_type; /**< What happened, as MSR_URING_EV_*. */
+	int msr_result; /**< The result, as the blocking call would return. */
+	const msr_tracks_t *msr_tracks; /**< For reads, the tracks read. They
+					  stay valid until the next
+					  msr_uring_wait(). */
+} msr_uring_event_t;
+
+/**
+ * @brief Create an io_uring backend.
+ * @details On hosts with many devices, a ring keeps a read posted on
+ * every device and reports swipes and finished writes in batches, with
+ * no system calls per device beyond those the ring itself needs. Each
+ * device is armed again after every event. Reads are multishot where
+ * the kernel supports them, and draw on a pool of buffers shared by
+ * every device.
+ *
+ * A ring must be used from one thread at a time. While a device is on
+ * a ring, it must not be used through any other libmsr call, though
+ * msr_led_queue() may be used to change its LEDs. A queued change is
+ * sent after the device's next event, and msr_uring_wait() re-arms the
+ * device once the pause after the change is over, returning early if
+ * need be to do so.
+ *
+ * Building with `make URING=0` leaves the backend out, for systems
+ * whose kernel headers lack io_uring; this function then always fails.
+ *
+ * @param entries The size of the submission queue; a few per device is
+ * plenty.
+ * @param ru A pointer to the ::msr_uring_t pointer to set.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if io_uring is unavailable or the ring
+ * can't be set up.
+ */
+extern int msr_uring_create(unsigned int entries, msr_uring_t **ru);
+
+/**
+ * @brief Destroy an io_uring backend, cancelling anything in flight.
+ * @details The devices on the ring are left open, but in an unknown
+ * state; reset them before using them again.
+ *
+ * @param ru The ring.
+ */
+extern void msr_uring_destroy(msr_uring_t *ru);
+
+/**
+ * @brief Add a device to a ring and arm it for reading.
+ *
+ * @param ru The ring.
+ * @param fd The device's fd, as from msr_serial_open().
+ * @param mode ::MSR_URING_ISO or ::MSR_URING_RAW.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the device is already on the ring, the
+ * mode is invalid or the ring is full.
+ */
+extern int msr_uring_add(msr_uring_t *ru, int fd, int mode);
+
+/**
+ * @brief Take a device off a ring.
+ * @details The device is left armed; reset it before using it through
+ * the rest of libmsr. A device that failed with ::LIBMSR_ERR_SERIAL gets
+ * no further events, and should be removed and reopened.
+ *
+ * @param ru The ring.
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the device isn't on the ring.
+ */
+extern int msr_uring_remove(msr_uring_t *ru, int fd);
+
+/**
+ * @brief Queue a write on a device served by a ring.
+ * @details The device's pending read is cancelled with a reset, and the
+ * reset, a pause for the device to recover and the whole write frame are
+ * submitted as one linked chain, on the next msr_uring_wait(). The
+ * result is reported as an ::MSR_URING_EV_WRITE event once the card has
+ * been swiped, and the device is then armed for reading again.
+ *
+ * @param ru The ring.
+ * @param fd The device's fd.
+ * @param tracks The tracks to write, ISO or raw according to the mode
+ * the device was added with. They are copied before this returns.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the device isn't on the ring, has
+ * failed or already has a write pending.
+ */
+extern int msr_uring_write(msr_uring_t *ru, int fd, const msr_tracks_t *tracks);
+
+/**
+ * @brief Submit queued work and wait for events.
+ * @details Every completion the kernel has is processed in one pass, and
+ * anything the resulting events call for, such as re-arming a device,
+ * is submitted before returning.
+ *
+ * @param ru The ring.
+ * @param ev The array to store events in.
+ * @param n The size of @p ev.
+ * @param timeout How long to wait for an event in milliseconds, or -1 to
+ * wait forever.
+ * @return The number of events stored, 0 on timeout, or -1 on error.
+ */
+extern int msr_uring_wait(msr_uring_t *ru, msr_uring_event_t *ev, size_t n,
+	int timeout);
+
+/**
+ * @brief An index of recent swipes by card, shared between threads.
+ */
+typedef struct msr_velocity msr_velocity_t;
+
+/**
+ * What kind of tracks msr_velocity_hash() is given.
+ */
+#define MSR_VELOCITY_ISO 0 /**< As read by msr_iso_read(). */
+#define MSR_VELOCITY_RAW 1 /**< As read by msr_raw_read(). */
+
+/**
+ * @brief Create a swipe velocity index.
+ * @details The index counts how often each card has been swiped within
+ * a window of time, for any number of threads at once without locks.
+ * Time is kept in steps of a third of the window, so a swipe is counted
+ * for between one and one and a third windows after it happens, and
+ * counts stop at 254 per step. Once the index is full, cards seen least
+ * recently make way for new ones.
+ *
+ * @param entries The number of cards to make room for.
+ * @param window_ms The length of the window, in milliseconds.
+ * @param key The 16-byte key to hash cards with, or NULL for a random
+ * one. Indexes sharing hashes must share a key.
+ * @param v A pointer to store the new index in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_velocity_create(size_t entries, unsigned int window_ms,
+	const uint8_t key[16], msr_velocity_t **v);
+
+/**
+ * @brief Free a swipe velocity index.
+ *
+ * @param v The index, which no thread may still be using.
+ */
+extern void msr_velocity_destroy(msr_velocity_t *v);
+
+/**
+ * @brief Hash a card for a swipe velocity index.
+ * @details The tracks are hashed in a canonical form, so that a card
+ * hashes the same whichever way it was swiped and whether it was read
+ * raw or ISO: raw tracks are decoded with msr_detect_decode(), and
+ * sentinels are dropped from ISO tracks. A raw track that won't decode
+ * is hashed as its bits from the first one bit to the last, read in
+ * whichever direction sorts first. Empty tracks are left out.
+ *
+ * @param v The index.
+ * @param tracks The card's tracks.
+ * @param mode ::MSR_VELOCITY_ISO or ::MSR_VELOCITY_RAW.
+ * @param hash A pointer to store the hash in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if every track is empty or @p mode is
+ * invalid.
+ */
+extern int msr_velocity_hash(const msr_velocity_t *v,
+	const msr_tracks_t *tracks, int mode, uint64_t *hash);
+
+/**
+ * @brief Count a swipe of a card.
+ *
+ * @param v The index.
+ * @param hash The card's hash, from msr_velocity_hash().
+ * @param n A pointer to store the number of swipes of the card in the
+ * window in, including this one, or NULL.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if there was no room for the card.
+ */
+extern int msr_velocity_add(msr_velocity_t *v, uint64_t hash,
+	unsigned int *n);
+
+/**
+ * @brief Get the number of swipes of a card in the window.
+ *
+ * @param v The index.
+ * @param hash The card's hash, from msr_velocity_hash().
+ * @param n A pointer to store the number of swipes in.
+ * @return ::LIBMSR_ERR_OK.
+ */
+extern int msr_velocity_count(msr_velocity_t *v, uint64_t hash,
+	unsigned int *n);
+
+/**
+ * @brief A blocklist prefilter, which can be reloaded while in use.
+ */
+typedef struct msr_blocklist msr_blocklist_t;
+
+/**
+ * The bits per PAN msr_blocklist_build() uses by default, for about
+ * one false hit in 200 checks.
+ */
+#define MSR_BLOCKLIST_BITS 12
+
+/**
+ * The result of screening a card against a blocklist.
+ */
+#define MSR_SCREEN_CLEAR 0 /**< The PAN is certainly not listed. */
+#define MSR_SCREEN_HIT 1 /**< The PAN is probably listed. */
+#define MSR_SCREEN_UNCHECKED 2 /**< There was no PAN, or no filter loaded. */
+
+/**
+ * @brief Write a blocklist file.
+ * @details The file is a Bloom filter over the PANs, under a random
+ * hash key. A PAN it finds clear is certainly not listed, but a hit
+ * is only probable: a PAN that isn't listed hits now and then too. It
+ * is written and synced under a temporary name, then renamed over
+ * @p path, so a process loading @p path sees either the old file or
+ * the new one, even after a crash.
+ *
+ * @param path The path of the file.
+ * @param pans The PANs to list, as strings. Anything but digits in them
+ * is ignored.
+ * @param n The number of PANs.
+ * @param bits The bits of filter per PAN, or 0 for ::MSR_BLOCKLIST_BITS.
+ * More bits make false hits rarer.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_blocklist_build(const char *path, const char *const *pans,
+	size_t n, unsigned int bits);
+
+/**
+ * @brief Create a blocklist with no filter loaded.
+ *
+ * @param bl A pointer to store the new blocklist in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_blocklist_create(msr_blocklist_t **bl);
+
+/**
+ * @brief Free a blocklist.
+ *
+ * @param bl The blocklist, which no thread may still be checking.
+ */
+extern void msr_blocklist_destroy(msr_blocklist_t *bl);
+
+/**
+ * @brief Load a blocklist file, replacing the one loaded.
+ * @details The file is mapped into memory and swapped in without
+ * stopping checks in other threads. This returns once no check is
+ * using the old file any more, and the old file has been unmapped.
+ *
+ * @param bl The blocklist.
+ * @param path The path of a file written by msr_blocklist_build().
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the file could not be mapped or is not
+ * a blocklist, in which case the one loaded is kept.
+ */
+extern int msr_blocklist_load(msr_blocklist_t *bl, const char *path);
+
+/**
+ * @brief Check a PAN against a blocklist.
+ *
+ * @param bl The blocklist.
+ * @param pan The PAN. Anything but digits in it is ignored.
+ * @param len The length of @p pan.
+ * @return ::MSR_SCREEN_CLEAR, ::MSR_SCREEN_HIT or ::MSR_SCREEN_UNCHECKED.
+ */
+extern int msr_blocklist_check(msr_blocklist_t *bl, const uint8_t *pan,
+	size_t len);
+
+/**
+ * @brief Check the PAN on a card against a blocklist.
+ * @details The PAN is taken from track 2, or from track 1 if track 2
+ * doesn't parse, as msr_iso7813_parse() finds it.
+ *
+ * @param bl The blocklist.
+ * @param tracks The tracks, as read by msr_iso_read().
+ * @return ::MSR_SCREEN_CLEAR, ::MSR_SCREEN_HIT or ::MSR_SCREEN_UNCHECKED.
+ */
+extern int msr_blocklist_screen(msr_blocklist_t *bl,
+	const msr_tracks_t *tracks);
+
+/**
+ * @brief Read a card and check it against a blocklist.
+ * @details This routine performs an msr_iso_read() and screens the
+ * result with msr_blocklist_screen(), so that only probable hits need
+ * be checked any further.
+ *
+ * @param fd The device's fd.
+ * @param tracks A pointer to the ::msr_tracks_t to read into.
+ * @param bl The blocklist.
+ * @param screen A pointer to store the result of screening in. It is
+ * ::MSR_SCREEN_UNCHECKED if the read failed.
+ * @return As for msr_iso_read().
+ */
+extern int msr_iso_read_screened(int fd, msr_tracks_t *tracks,
+	msr_blocklist_t *bl, int *screen);
+
+/**
+ * @brief An AES-GCM key for sealing track data.
+ */
+typedef struct msr_crypt msr_crypt_t;
+
+/**
+ * @brief What is needed besides the key to open a sealed record.
+ * @details Each track is sealed with its own nonce, which is
+ * ::msr_seal::msr_nonce with the last byte set to the track's index.
+ */
+typedef struct msr_seal {
+	uint8_t msr_nonce[12]; /**< The nonce, with a last byte of 0. */
+	uint8_t msr_tag[MSR_MAX_TRACKS][16]; /**< The tag of each track. */
+} msr_seal_t;
+
+/**
+ * @brief Set up a key for sealing track data.
+ * @details Sealing uses AES-NI and PCLMULQDQ if the CPU has them, and
+ * a portable implementation otherwise. Each record is sealed under 88
+ * random bits of nonce, so a key may be shared by any number of
+ * processes, but should be replaced before 2^32 records have been
+ * sealed with it in all, as a repeated nonce gives away the tracks it
+ * sealed.
+ *
+ * @param key The AES key.
+ * @param keylen The length of @p key: 16, 24 or 32 bytes.
+ * @param c A pointer to store the key in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on a bad key length or other failure.
+ */
+extern int msr_crypt_create(const uint8_t *key, size_t keylen,
+	msr_crypt_t **c);
+
+/**
+ * @brief Wipe and free a key.
+ *
+ * @param c The key.
+ */
+extern void msr_crypt_destroy(msr_crypt_t *c);
+
+/**
+ * @brief Find out whether a key is used with AES-NI and PCLMULQDQ.
+ *
+ * @param c The key.
+ * @return 1 if so, 0 if the portable implementation is used.
+ */
+extern int msr_crypt_hw(const msr_crypt_t *c);
+
+/**
+ * @brief Seal tracks in place with AES-GCM.
+ * @details Each track's data is encrypted in place, keeping its
+ * length, and its tag is stored in @p seal. Empty tracks get tags too,
+ * so they can't be filled in unnoticed.
+ *
+ * @param c The key.
+ * @param tracks The tracks to seal.
+ * @param seal A pointer to the ::msr_seal_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if no random nonce could be had, in which
+ * case the tracks are left as they were.
+ */
+extern int msr_crypt_seal(msr_crypt_t *c, msr_tracks_t *tracks,
+	msr_seal_t *seal);
+
+/**
+ * @brief Check and open sealed tracks in place.
+ * @details Every track's tag is checked before any is decrypted, so
+ * the tracks are either all opened or left as they were.
+ *
+ * @param c The key.
+ * @param tracks The tracks to open.
+ * @param seal The ::msr_seal_t they were sealed with.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if a track doesn't match its tag.
+ */
+extern int msr_crypt_open(const msr_crypt_t *c, msr_tracks_t *tracks,
+	const msr_seal_t *seal);
+
+/**
+ * @brief Seal many records, as msr_crypt_seal().
+ *
+ * @param c The key.
+ * @param tracks An array of @p n records.
+ * @param n The number of records.
+ * @param seals An array of @p n ::msr_seal_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if no random nonces could be had, in which
+ * case some records may be left unsealed.
+ */
+extern int msr_crypt_seal_batch(msr_crypt_t *c, msr_tracks_t *tracks,
+	size_t n, msr_seal_t *seals);
+
+/**
+ * @brief Open many records, as msr_crypt_open().
+ *
+ * @param c The key.
+ * @param tracks An array of @p n records.
+ * @param n The number of records.
+ * @param seals An array of the @p n ::msr_seal_t they were sealed with.
+ * @param status An array of @p n ints to store each result in, or NULL.
+ * @return The number of records opened.
+ */
+extern size_t msr_crypt_open_batch(const msr_crypt_t *c,
+	msr_tracks_t *tracks, size_t n, const msr_seal_t *seals, int *status);
+
+/**
+ * @brief Read a card in ISO mode, sealing each track as it arrives.
+ * @details This routine is msr_iso_read(), except that each track is
+ * sealed with msr_crypt_seal()'s scheme as soon as it has been read,
+ * so the tracks are never handed back in the clear. If the read fails
+ * part way, the tracks not yet sealed are wiped. If no random nonce can
+ * be had, or the session is being recorded with msr_record_start(),
+ * which would log the tracks in the clear, it fails with
+ * ::LIBMSR_ERR_GENERIC before the read is armed.
+ *
+ * @param fd The device's fd.
+ * @param tracks A pointer to the ::msr_tracks_t to read into.
+ * @param c The key.
+ * @param seal A pointer to the ::msr_seal_t to populate.
+ * @return As for msr_iso_read().
+ */
+extern int msr_iso_read_sealed(int fd, msr_tracks_t *tracks,
+	msr_crypt_t *c, msr_seal_t *seal);
+
+/**
+ * @brief Read a card in raw mode, sealing each track as it arrives.
+ * @details As msr_iso_read_sealed(), but reading as msr_raw_read().
+ *
+ * @param fd The device's fd.
+ * @param tracks A pointer to the ::msr_tracks_t to read into.
+ * @param c The key.
+ * @param seal A pointer to the ::msr_seal_t to populate.
+ * @return As for msr_raw_read().
+ */
+extern int msr_raw_read_sealed(int fd, msr_tracks_t *tracks,
+	msr_crypt_t *c, msr_seal_t *seal);
+
+/**
+ * @brief The number of records in each block of a track archive.
+ */
+#define MSR_ZARC_BLOCK 64
+
+/**
+ * @brief The most entries a track archive's dictionary can have.
+ */
+#define MSR_ZDICT_MAX 255
+
+/**
+ * @brief A common start of raw tracks, such as a sentinel and a BIN.
+ */
+typedef struct msr_zdict_ent {
+	uint8_t msr_bpc; /**< The bits per character of the track. */
+	uint8_t msr_len; /**< The number of characters. */
+	uint8_t msr_chars[16]; /**< The characters, without parity. */
+} msr_zdict_ent_t;
+
+/**
+ * @brief A dictionary of common track starts for a track archive.
+ */
+typedef struct msr_zdict {
+	int msr_n; /**< The number of entries. */
+	msr_zdict_ent_t msr_ent[MSR_ZDICT_MAX]; /**< The entries. */
+} msr_zdict_t;
+
+/**
+ * @brief A track archive being written.
+ */
+typedef struct msr_zarc msr_zarc_t;
+
+/**
+ * @brief A track archive being read.
+ * @details The fields are set by msr_zarc_open() and point into the
+ * archive, which must outlive the reader.
+ */
+typedef struct msr_zread {
+	const uint8_t *msr_base; /**< The archive. */
+	size_t msr_size; /**< The archive's length. */
+	uint64_t msr_nrecords; /**< The number of records. */
+	uint32_t msr_nblocks; /**< The number of blocks. */
+	uint32_t msr_ndict; /**< The number of dictionary entries. */
+	const msr_zdict_ent_t *msr_dict; /**< The dictionary. */
+	const uint8_t *msr_index; /**< The block offsets. */
+} msr_zread_t;
+
+/**
+ * @brief Build a dictionary for a track archive from sample records.
+ * @details The dictionary holds the track starts, a start sentinel
+ * and a BIN, seen most often among the clean raw tracks in @p tracks.
+ *
+ * @param tracks An array of @p n raw records.
+ * @param n The number of records.
+ * @param dict A pointer to the ::msr_zdict_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if out of memory.
+ */
+extern int msr_zarc_dict_build(const msr_tracks_t *tracks, size_t n,
+	msr_zdict_t *dict);
+
+/**
+ * @brief Start writing a track archive.
+ * @details Clean raw tracks are stored packed at their bits per
+ * character, without parity and leading zeros, and starting with an
+ * entry of @p dict where one matches; other tracks are stored with
+ * runs of zeros compressed. Records are read back exactly as added.
+ *
+ * @param dict A dictionary from msr_zarc_dict_build(), or NULL for none.
+ * @param z A pointer to store the archive in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if out of memory.
+ */
+extern int msr_zarc_create(const msr_zdict_t *dict, msr_zarc_t **z);
+
+/**
+ * @brief Free an archive being written.
+ *
+ * @param z The archive.
+ */
+extern void msr_zarc_destroy(msr_zarc_t *z);
+
+/**
+ * @brief Add a record of raw tracks to an archive.
+ *
+ * @param z The archive.
+ * @param tracks The record, as read by msr_raw_read().
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if out of memory.
+ */
+extern int msr_zarc_add(msr_zarc_t *z, const msr_tracks_t *tracks);
+
+/**
+ * @brief Lay out an archive for storing.
+ * @details The archive is in host byte order. @p z may still be added
+ * to and finished again afterwards.
+ *
+ * @param z The archive.
+ * @param buf A pointer to store the archive in, to be freed with free().
+ * @param len A pointer to store the archive's length in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if out of memory.
+ */
+extern int msr_zarc_finish(msr_zarc_t *z, void **buf, size_t *len);
+
+/**
+ * @brief Open an archive for reading.
+ *
+ * @param buf The archive, as laid out by msr_zarc_finish().
+ * @param len The archive's length.
+ * @param r A pointer to the ::msr_zread_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if @p buf isn't an archive.
+ */
+extern int msr_zarc_open(const void *buf, size_t len, msr_zread_t *r);
+
+/**
+ * @brief Read one record from an archive.
+ * @details This unpacks no more than the record's block.
+ *
+ * @param r The archive.
+ * @param i The record's index.
+ * @param tracks A pointer to the ::msr_tracks_t to read into.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if there is no such record, or it is
+ * malformed.
+ */
+extern int msr_zarc_get(const msr_zread_t *r, uint64_t i,
+	msr_tracks_t *tracks);
+
+/**
+ * @brief Read a whole block of records from an archive.
+ * @details Block @p b holds records from b * ::MSR_ZARC_BLOCK on.
+ * Blocks are independent, so they can be read in parallel.
+ *
+ * @param r The archive.
+ * @param b The block's index.
+ * @param tracks An array of ::MSR_ZARC_BLOCK records to read into.
+ * @param n A pointer to store the number of records read in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if there is no such block, or it is
+ * malformed.
+ */
+extern int msr_zarc_block(const msr_zread_t *r, uint32_t b,
+	msr_tracks_t *tracks, size_t *n);
+
+/**
+ * @brief The number of records in each batch of a columnar export.
+ */
+#define MSR_COLUMNS_BATCH 16384
+
+/**
+ * @brief A flag for msr_columns_create(): records hold raw tracks, to be
+ * decoded with msr_iso_decode() before parsing.
+ */
+#define MSR_COLUMNS_RAW 0x01
+
+/**
+ * @name Columns of a columnar export
+ * @{
+ */
+#define MSR_COL_BIN 0 /**< The first six digits of the PAN, as a string. */
+#define MSR_COL_EXP 1 /**< The expiration date, as a YYMM string. */
+#define MSR_COL_SVC 2 /**< The service code, as a string. */
+#define MSR_COL_PAN_LEN 3 /**< The number of digits in the PAN. */
+#define MSR_COL_LUHN 4 /**< Whether the PAN passes the Luhn check. */
+#define MSR_COL_TRACK 5 /**< The track the fields came from: 1 or 2. */
+#define MSR_COLUMNS 6 /**< The number of columns. */
+/** @} */
+
+/**
+ * @brief Statistics of one column of a columnar export.
+ */
+typedef struct msr_colstats {
+	uint64_t msr_count; /**< The number of values that aren't null. */
+	uint64_t msr_nulls; /**< The number of nulls. */
+	uint64_t msr_distinct; /**< The number of distinct values. */
+	char msr_min[16]; /**< The least value, as text, or "" if none. */
+	char msr_max[16]; /**< The greatest value, as text, or "" if none. */
+} msr_colstats_t;
+
+/**
+ * @brief A columnar export being written.
+ */
+typedef struct msr_columns msr_columns_t;
+
+/**
+ * @brief Start writing records to a columnar file.
+ * @details The file is in the Arrow IPC file format, with one column
+ * for each ::MSR_COL_BIN and so on. BIN, expiry and service code are
+ * dictionary encoded, and a column is null in records where it
+ * couldn't be parsed. Track 2 is parsed if it can be, and track 1
+ * otherwise.
+ *
+ * Records are gathered into batches of ::MSR_COLUMNS_BATCH, which are
+ * decoded and parsed by the calling thread together with
+ * @p nthreads - 1 threads that are started here and kept until
+ * msr_columns_destroy(). The file is written under
+ * a temporary name and only replaces @p path when finished.
+ *
+ * @param path The path of the file to write.
+ * @param flags 0, or ::MSR_COLUMNS_RAW.
+ * @param nthreads The number of threads to parse with, or 0 for one
+ * for each CPU.
+ * @param w A pointer to store the export in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the file can't be created.
+ */
+extern int msr_columns_create(const char *path, int flags, int nthreads,
+	msr_columns_t **w);
+
+/**
+ * @brief Free a columnar export, discarding it if it wasn't finished.
+ *
+ * @param w The export.
+ */
+extern void msr_columns_destroy(msr_columns_t *w);
+
+/**
+ * @brief Add records to a columnar export.
+ *
+ * @param w The export.
+ * @param tracks An array of @p n records.
+ * @param n The number of records.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if writing failed.
+ */
+extern int msr_columns_add(msr_columns_t *w, const msr_tracks_t *tracks,
+	size_t n);
+
+/**
+ * @brief Finish a columnar export and move it into place.
+ * @details The statistics of each column are also written into the
+ * file, as metadata on the fields of the footer's schema, under the
+ * keys "count", "null_count", "distinct_count", "min" and "max".
+ * The export must still be freed with msr_columns_destroy().
+ *
+ * @param w The export.
+ * @param stats An array of ::MSR_COLUMNS ::msr_colstats_t to store each
+ * column's statistics in, or NULL.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if writing failed.
+ */
+extern int msr_columns_finish(msr_columns_t *w, msr_colstats_t *stats);
+
+/**
+ * @name Latency settings for msr_serial_latency()
+ * @{
+ */
+#define MSR_LATENCY_TERMIOS 0x01 /**< Reads return each byte at once. */
+#define MSR_LATENCY_ASYNC 0x02 /**< The driver's ASYNC_LOW_LATENCY flag. */
+#define MSR_LATENCY_TIMER 0x04 /**< A USB adapter's latency timer. */
+#define MSR_LATENCY_ALL 0x07 /**< Every setting. */
+/** @} */
+
+/**
+ * @brief The latency timer, in milliseconds, that ::MSR_LATENCY_TIMER
+ * sets.
+ */
+#define MSR_LATENCY_TIMER_MS 1
+
+/**
+ * @brief What msr_serial_latency() put into effect.
+ */
+typedef struct msr_latency {
+	int msr_applied; /**< The ::MSR_LATENCY_TERMIOS and so on in effect. */
+	int msr_timer_was; /**< The adapter's latency timer in ms before, or
+			     -1 if it has none or it can't be read. */
+	int msr_timer; /**< The adapter's latency timer in ms after, or -1. */
+} msr_latency_t;
+
+/**
+ * @brief Tune a serial device for low latency.
+ * @details Each setting asked for in @p want is tried on its own:
+ * ::MSR_LATENCY_TERMIOS sets VMIN to 1 and VTIME to 0,
+ * ::MSR_LATENCY_ASYNC sets ASYNC_LOW_LATENCY with TIOCSSERIAL, and
+ * ::MSR_LATENCY_TIMER lowers a USB serial adapter's latency timer,
+ * through sysfs, to ::MSR_LATENCY_TIMER_MS. Changing the timer usually
+ * needs root, but ASYNC_LOW_LATENCY lowers it as well on FTDI
+ * adapters. Each setting is read back, and only those in effect are
+ * reported in @p lat.
+ *
+ * @param fd The device's fd.
+ * @param want The ::MSR_LATENCY_TERMIOS and so on to apply.
+ * @param lat A pointer to the ::msr_latency_t to populate.
+ * @return ::LIBMSR_ERR_OK if every setting in @p want is in effect.
+ * @return ::LIBMSR_ERR_SERIAL otherwise.
+ */
+extern int msr_serial_latency(int fd, int want, msr_latency_t *lat);
+
+/**
+ * @brief Open a serial connection to the MSR device, tuned for latency.
+ * @details This is msr_serial_open() followed by msr_serial_latency().
+ * Settings that can't be applied don't make the open fail; check
+ * @p lat to see which were.
+ *
+ * @param path The path to the serial device.
+ * @param fd The int pointer to store the file descriptor in.
+ * @param blocking The blocking flag (e.g., ::MSR_BLOCKING)
+ * @param baud The baud rate of the serial device (e.g., ::MSR_BAUD)
+ * @param want The ::MSR_LATENCY_TERMIOS and so on to apply, usually
+ * ::MSR_LATENCY_ALL.
+ * @param lat A pointer to the ::msr_latency_t to populate, or NULL.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL if the device can't be opened
+ */
+extern int msr_serial_open_latency(char *path, int *fd, int blocking,
+	speed_t baud, int want, msr_latency_t *lat);
+
+/**
+ * @brief A hotplug manager, which reconnects devices when they come back
+ * after being unplugged.
+ */
+typedef struct msr_hotplug msr_hotplug_t;
+
+/**
+ * @name Events passed to an ::msr_hotplug_cb_t
+ * @{
+ */
+#define MSR_HOTPLUG_GONE 1 /**< The device was unplugged. */
+#define MSR_HOTPLUG_BACK 2 /**< The device is back and set up again. */
+/** @} */
+
+/**
+ * @brief A function called when a managed device is unplugged or comes
+ * back.
+ * @details It's called from the manager's own thread, so it should
+ * return quickly and not call msr_hotplug_destroy().
+ *
+ * @param fd The device's fd.
+ * @param event ::MSR_HOTPLUG_GONE or ::MSR_HOTPLUG_BACK.
+ * @param arg The argument given to msr_hotplug_create().
+ */
+typedef void (*msr_hotplug_cb_t)(int fd, int event, void *arg);
+
+/**
+ * @brief Create a hotplug manager.
+ * @details The manager runs a thread that watches the devices added to
+ * it. A device counts as unplugged when its path is removed (watched
+ * with inotify, so symlinks such as those in /dev/serial/by-id work),
+ * when it hangs up, or when the OS fails I/O on it with EIO, ENODEV
+ * or ENXIO. From then on every call on the device fails at once with
+ * ::LIBMSR_ERR_DISCONNECT, including one already waiting on it.
+ *
+ * When the path comes back, the device is reopened onto the same fd,
+ * so callers can keep using the fd they have, and then initialised
+ * with msr_init() and given back the settings it had (see
+ * msr_profile_apply()) and its latency settings, if it was opened with
+ * msr_serial_open_latency(). Until that succeeds, it is tried again
+ * every so often.
+ *
+ * @param cb A function to call on each event, or NULL.
+ * @param arg An argument to pass to @p cb.
+ * @param hp A pointer to store the new manager in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_hotplug_create(msr_hotplug_cb_t cb, void *arg,
+	msr_hotplug_t **hp);
+
+/**
+ * @brief Stop a hotplug manager and free it.
+ * @details The devices it manages are left open, whatever state they
+ * are in.
+ *
+ * @param hp The manager, or NULL.
+ */
+extern void msr_hotplug_destroy(msr_hotplug_t *hp);
+
+/**
+ * @brief Have a hotplug manager watch a device.
+ * @details The device must have been opened with msr_serial_open() or
+ * msr_serial_open_latency(), and @p path, @p blocking and @p baud
+ * should be what it was opened with; they are used to reopen it.
+ *
+ * @param hp The manager.
+ * @param fd The device's fd.
+ * @param path The path the device was opened from.
+ * @param blocking The blocking flag it was opened with.
+ * @param baud The baud rate it was opened with.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if @p fd isn't an open device or its
+ * path's directory can't be watched.
+ */
+extern int msr_hotplug_add(msr_hotplug_t *hp, int fd, const char *path,
+	int blocking, speed_t baud);
+
+/**
+ * @brief Stop a hotplug manager watching a device.
+ * @details Call this before closing the device. If the device is being
+ * reconnected, this waits for that to finish.
+ *
+ * @param hp The manager.
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the device wasn't being watched.
+ */
+extern int msr_hotplug_remove(msr_hotplug_t *hp, int fd);
+
+/**
+ * @name Device health states
+ * @{
+ */
+#define MSR_HEALTH_UNKNOWN 0 /**< No round of checks has finished yet. */
+#define MSR_HEALTH_OK 1 /**< The last round of checks all passed. */
+#define MSR_HEALTH_FAILED 2 /**< A check in the last round failed. */
+/** @} */
+
+/** @brief The default idle time before a device is checked, in ms. */
+#define MSR_MONITOR_IDLE_MS 5000
+
+/** @brief The default time between rounds of checks, in ms. */
+#define MSR_MONITOR_INTERVAL_MS 60000
+
+/** @brief How long a device is given to answer each check, in ms. */
+#define MSR_MONITOR_TIMEOUT_MS 500
+
+/**
+ * @brief A device's health, as found by a health monitor.
+ * @details Each check's result is -1 until it has been run. When
+ * msr_commtest_timeout() fails, the other checks are skipped for that
+ * round and are -1.
+ */
+typedef struct msr_health {
+	int msr_state; /**< ::MSR_HEALTH_OK and so on. */
+	int msr_comm; /**< What msr_commtest_timeout() last returned. */
+	int msr_ram; /**< What msr_ram_test_timeout() last returned. */
+	int msr_co; /**< What msr_get_co_timeout() last returned. */
+	unsigned long msr_rounds; /**< Rounds of checks finished. */
+	unsigned long msr_preempted; /**< Times real traffic cut a round short. */
+	long msr_idle_ms; /**< How long the device has been idle, or -1 if
+			    no monitor is watching it. */
+	long msr_age_ms; /**< Time since the last round finished, or -1. */
+} msr_health_t;
+
+/**
+ * @brief A health monitor, which checks devices while they are idle.
+ */
+typedef struct msr_monitor msr_monitor_t;
+
+/**
+ * @brief Create a health monitor.
+ * @details The monitor runs a thread that keeps track of how long each
+ * of its devices has been idle: not locked, with no read armed, and
+ * unused since it last looked. Once a device has been idle for
+ * @p idle_ms, and @p interval_ms has passed since its last round, it
+ * runs a round of checks on it: msr_commtest_timeout(),
+ * msr_ram_test_timeout() and msr_get_co_timeout(). Each check takes the
+ * device's lock only if it is free, and gives it up as soon as the
+ * check is done. A call that needs the device while a check is under
+ * way isn't let in at once: it waits for that check to end, which
+ * takes up to ::MSR_MONITOR_TIMEOUT_MS on a device that doesn't answer.
+ * A call that starts waiting just as a check ends may wait for one
+ * more, so the longest a call waits for the monitor is twice
+ * ::MSR_MONITOR_TIMEOUT_MS. A round cut short carries on in the
+ * device's next idle spell.
+ *
+ * Checks don't change what msr_last_error() reports. Devices driven
+ * through msr_uring_add() should not be monitored, as the monitor
+ * can't see their reads.
+ *
+ * @param idle_ms How long a device must be idle before it is checked,
+ * or 0 for ::MSR_MONITOR_IDLE_MS.
+ * @param interval_ms The time between rounds of checks on a device, or
+ * 0 for ::MSR_MONITOR_INTERVAL_MS.
+ * @param m A pointer to store the new monitor in.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC on failure.
+ */
+extern int msr_monitor_create(int idle_ms, int interval_ms,
+	msr_monitor_t **m);
+
+/**
+ * @brief Stop a health monitor and free it.
+ *
+ * @param m The monitor, or NULL.
+ */
+extern void msr_monitor_destroy(msr_monitor_t *m);
+
+/**
+ * @brief Have a health monitor check a device.
+ * @details A device should be watched by at most one monitor.
+ *
+ * @param m The monitor.
+ * @param fd The device's fd, as opened by msr_serial_open().
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if @p fd has no device state kept.
+ */
+extern int msr_monitor_add(msr_monitor_t *m, int fd);
+
+/**
+ * @brief Stop a health monitor checking a device.
+ * @details Call this before closing the device. What was found is kept,
+ * and msr_health() still reports it.
+ *
+ * @param m The monitor.
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if the device wasn't being checked.
+ */
+extern int msr_monitor_remove(msr_monitor_t *m, int fd);
+
+/**
+ * @brief Get a device's health.
+ * @details Like msr_last_error(), this reports on the device's state
+ * without talking to it, and it doesn't take the device's lock, so it
+ * returns at once even while a read is waiting for a swipe. A device
+ * that no monitor has watched since it was opened is reported as
+ * ::MSR_HEALTH_UNKNOWN, with every check's result -1.
+ *
+ * @param fd The device's fd.
+ * @param h A pointer to the ::msr_health_t to populate.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_GENERIC if @p fd has no device state kept.
+ */
+extern int msr_health(int fd, msr_health_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBMSR_H */
@@ -0,0 +1,522 @@
+/* C++ interface to libmsr. Needs C++17; uses std::span under C++20. */
+#ifndef LIBMSR_HPP
+#define LIBMSR_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define LIBMSR_HAVE_SPAN 1
+#endif
+
+#include "libmsr.h"
+
+/**
+ * @brief C++ wrappers over the C API.
+ * @details Nothing here copies track data: tracks are viewed in place
+ * through ::msr::Bytes and passed to the C API by pointer. Failures are
+ * returned as ::msr::Result values carrying the device's ::msr_err_t
+ * rather than thrown.
+ */
+namespace msr {
+
+#ifdef LIBMSR_HAVE_SPAN
+/**
+ * @brief A read-only view of bytes.
+ */
+using Bytes = std::span<const std::uint8_t>;
+#else
+/**
+ * @brief A read-only view of bytes, standing in for
+ * std::span<const uint8_t> before C++20.
+ */
+class Bytes {
+public:
+	constexpr Bytes() noexcept : p_(nullptr), n_(0) {}
+	constexpr Bytes(const std::uint8_t *p, std::size_t n) noexcept
+		: p_(p), n_(n) {}
+
+	constexpr const std::uint8_t *data() const noexcept { return p_; }
+	constexpr std::size_t size() const noexcept { return n_; }
+	constexpr bool empty() const noexcept { return n_ == 0; }
+	constexpr const std::uint8_t *begin() const noexcept { return p_; }
+	constexpr const std::uint8_t *end() const noexcept { return p_ + n_; }
+	constexpr std::uint8_t operator[](std::size_t i) const noexcept
+	{
+		return p_[i];
+	}
+
+private:
+	const std::uint8_t *p_;
+	std::size_t n_;
+};
+#endif
+
+/**
+ * @brief View the data of a track.
+ */
+inline Bytes track(const msr_track_t &t) noexcept
+{
+	return Bytes(t.msr_tk_data, t.msr_tk_len);
+}
+
+/**
+ * @brief View the data of one of a card's tracks.
+ *
+ * @param t The tracks.
+ * @param tn The index of the track, from 0.
+ */
+inline Bytes track(const msr_tracks_t &t, int tn) noexcept
+{
+	return track(t.msr_tracks[tn]);
+}
+
+/**
+ * @brief Why a call failed.
+ */
+class Error {
+public:
+	/**
+	 * @brief An error known only by its code.
+	 */
+	explicit Error(int code) noexcept : e_()
+	{
+		e_.msr_code = code;
+	}
+
+	/**
+	 * @brief An error as recorded by msr_last_error().
+	 */
+	explicit Error(const msr_err_t &e) noexcept : e_(e) {}
+
+	/** @brief The error code, as LIBMSR_ERR_*. */
+	int code() const noexcept { return e_.msr_code; }
+	/** @brief Where it happened, as MSR_PHASE_*, or 0. */
+	int phase() const noexcept { return e_.msr_phase; }
+	/** @brief The device's status byte, or 0. */
+	std::uint8_t status() const noexcept { return e_.msr_sts; }
+	/** @brief The track being read (1-3), or 0. */
+	int track() const noexcept { return e_.msr_track; }
+	/** @brief The errno of a failed system call, or 0. */
+	int sys_errno() const noexcept { return e_.msr_errno; }
+	/** @brief What to do about it, as MSR_RECOVER_*. */
+	int recovery() const noexcept { return msr_err_recovery(&e_); }
+	/** @brief The C record. */
+	const msr_err_t &c_err() const noexcept { return e_; }
+
+private:
+	msr_err_t e_;
+};
+
+/**
+ * @brief Thrown by Result::value() when there is no value.
+ */
+class BadResultAccess : public std::exception {
+public:
+	explicit BadResultAccess(const Error &e) noexcept : e_(e) {}
+
+	const char *what() const noexcept override
+	{
+		return "msr::Result has no value";
+	}
+
+	/** @brief The error the result held. */
+	const Error &error() const noexcept { return e_; }
+
+private:
+	Error e_;
+};
+
+/**
+ * @brief Either a value or an ::msr::Error, shaped like std::expected.
+ */
+template <class T>
+class Result {
+public:
+	Result(const T &v) : ok_(true) { new (&v_) T(v); }
+	Result(T &&v) : ok_(true) { new (&v_) T(std::move(v)); }
+	Result(const Error &e) noexcept : ok_(false) { new (&e_) Error(e); }
+
+	Result(const Result &o) : ok_(o.ok_)
+	{
+		if (ok_)
+			new (&v_) T(o.v_);
+		else
+			new (&e_) Error(o.e_);
+	}
+
+	Result(Result &&o) noexcept(std::is_nothrow_move_constructible<T>::value)
+		: ok_(o.ok_)
+	{
+		if (ok_)
+			new (&v_) T(std::move(o.v_));
+		else
+			new (&e_) Error(o.e_);
+	}
+
+	Result &operator=(const Result &) = delete;
+	Result &operator=(Result &&) = delete;
+
+	~Result()
+	{
+		if (ok_)
+			v_.~T();
+	}
+
+	/** @brief Whether there is a value. */
+	bool has_value() const noexcept { return ok_; }
+	explicit operator bool() const noexcept { return ok_; }
+
+	/** @brief The value, throwing ::msr::BadResultAccess if none. */
+	T &value() &
+	{
+		if (!ok_)
+			throw BadResultAccess(e_);
+		return v_;
+	}
+
+	const T &value() const &
+	{
+		if (!ok_)
+			throw BadResultAccess(e_);
+		return v_;
+	}
+
+	T &&value() &&
+	{
+		if (!ok_)
+			throw BadResultAccess(e_);
+		return std::move(v_);
+	}
+
+	/** @brief The value, or @p v if there is none. */
+	template <class U>
+	T value_or(U &&v) const &
+	{
+		return ok_ ? v_ : static_cast<T>(std::forward<U>(v));
+	}
+
+	/** @brief The value, which must be there. */
+	T &operator*() & noexcept { return v_; }
+	const T &operator*() const & noexcept { return v_; }
+	T &&operator*() && noexcept { return std::move(v_); }
+	T *operator->() noexcept { return &v_; }
+	const T *operator->() const noexcept { return &v_; }
+
+	/** @brief The error, which must be there. */
+	const Error &error() const noexcept { return e_; }
+
+private:
+	bool ok_;
+	union {
+		T v_;
+		Error e_;
+	};
+};
+
+/**
+ * @brief Success or an ::msr::Error.
+ */
+template <>
+class Result<void> {
+public:
+	Result() noexcept : ok_(true), e_(LIBMSR_ERR_OK) {}
+	Result(const Error &e) noexcept : ok_(false), e_(e) {}
+
+	/** @brief Whether the call succeeded. */
+	bool has_value() const noexcept { return ok_; }
+	explicit operator bool() const noexcept { return ok_; }
+
+	/** @brief Throw ::msr::BadResultAccess if the call failed. */
+	void value() const
+	{
+		if (!ok_)
+			throw BadResultAccess(e_);
+	}
+
+	/** @brief The error, which must be there. */
+	const Error &error() const noexcept { return e_; }
+
+private:
+	bool ok_;
+	Error e_;
+};
+
+/**
+ * @brief An open MSR device, closed when it goes out of scope.
+ * @details A Device can be moved but not copied. Failures carry what
+ * msr_last_error() recorded for the device when it has a record of
+ * the same code, and just the code otherwise.
+ */
+class Device {
+public:
+	/**
+	 * @brief Open a device, as msr_serial_open().
+	 */
+	static Result<Device> open(const char *path, int blocking = 0,
+		speed_t baud = MSR_BAUD) noexcept
+	{
+		int fd = -1;
+		int r = msr_serial_open(const_cast<char *>(path), &fd,
+			blocking, baud);
+
+		if (r != LIBMSR_ERR_OK)
+			return Error(r);
+		return Device(fd);
+	}
+
+	/**
+	 * @brief Take ownership of an fd opened with msr_serial_open().
+	 */
+	explicit Device(int fd) noexcept : fd_(fd) {}
+
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	Device(Device &&o) noexcept : fd_(o.release()) {}
+
+	Device &operator=(Device &&o) noexcept
+	{
+		if (this != &o) {
+			close();
+			fd_ = o.release();
+		}
+		return *this;
+	}
+
+	~Device() { close(); }
+
+	/** @brief The device's fd, or -1 once closed or released. */
+	int fd() const noexcept { return fd_; }
+
+	/** @brief Give up ownership of the fd without closing it. */
+	int release() noexcept
+	{
+		return std::exchange(fd_, -1);
+	}
+
+	/** @brief Close the device now, as msr_serial_close(). */
+	Result<void> close() noexcept
+	{
+		if (fd_ < 0)
+			return {};
+		return check(msr_serial_close(release()));
+	}
+
+	/** @brief As msr_init(). */
+	Result<void> init() noexcept { return check(msr_init(fd_)); }
+	/** @brief As msr_reset(). */
+	Result<void> reset() noexcept { return check(msr_reset(fd_)); }
+	/** @brief As msr_commtest(). */
+	Result<void> commtest() noexcept { return check(msr_commtest(fd_)); }
+
+	/** @brief As msr_iso_read(). */
+	Result<void> iso_read(msr_tracks_t &t) noexcept
+	{
+		return check(msr_iso_read(fd_, &t));
+	}
+
+	/** @brief As msr_raw_read(). */
+	Result<void> raw_read(msr_tracks_t &t) noexcept
+	{
+		return check(msr_raw_read(fd_, &t));
+	}
+
+	/** @brief As msr_iso_write(). */
+	Result<void> iso_write(const msr_tracks_t &t) noexcept
+	{
+		return check(msr_iso_write(fd_, const_cast<msr_tracks_t *>(&t)));
+	}
+
+	/** @brief As msr_raw_write(). */
+	Result<void> raw_write(const msr_tracks_t &t) noexcept
+	{
+		return check(msr_raw_write(fd_, const_cast<msr_tracks_t *>(&t)));
+	}
+
+	/** @brief As msr_erase(). */
+	Result<void> erase(std::uint8_t tracks) noexcept
+	{
+		return check(msr_erase(fd_, tracks));
+	}
+
+	/** @brief As msr_get_co(), giving ::MSR_CO_HI or ::MSR_CO_LO. */
+	Result<int> get_co() noexcept
+	{
+		int r = msr_get_co(fd_);
+
+		if (r != MSR_CO_HI && r != MSR_CO_LO)
+			return fail(r);
+		return r;
+	}
+
+	/** @brief As msr_set_hi_co(). */
+	Result<void> set_hi_co() noexcept { return check(msr_set_hi_co(fd_)); }
+	/** @brief As msr_set_lo_co(). */
+	Result<void> set_lo_co() noexcept { return check(msr_set_lo_co(fd_)); }
+
+	/** @brief As msr_set_bpi(). */
+	Result<void> set_bpi(std::uint8_t bpi) noexcept
+	{
+		return check(msr_set_bpi(fd_, bpi));
+	}
+
+	/** @brief As msr_set_bpc(). */
+	Result<void> set_bpc(std::uint8_t bpc1, std::uint8_t bpc2,
+		std::uint8_t bpc3) noexcept
+	{
+		return check(msr_set_bpc(fd_, bpc1, bpc2, bpc3));
+	}
+
+	/** @brief As msr_flash_led(). */
+	Result<void> flash_led(std::uint8_t led) noexcept
+	{
+		return check(msr_flash_led(fd_, led));
+	}
+
+	/** @brief As msr_profile_apply(). */
+	Result<void> apply(const msr_profile_t &p) noexcept
+	{
+		return check(msr_profile_apply(fd_, &p));
+	}
+
+	/** @brief As msr_write_verify(). */
+	Result<void> write_verify(const msr_tracks_t &t, int mode,
+		int retries, msr_verify_t &v) noexcept
+	{
+		return check(msr_write_verify(fd_,
+			const_cast<msr_tracks_t *>(&t), mode, retries, &v));
+	}
+
+	/** @brief As msr_cmdq_submit(). */
+	Result<void> submit(msr_cmdq_t &q) noexcept
+	{
+		return check(msr_cmdq_submit(fd_, &q));
+	}
+
+private:
+	Error fail(int code) const noexcept
+	{
+		msr_err_t e;
+
+		if (fd_ >= 0 && msr_last_error(fd_, &e) == LIBMSR_ERR_OK
+		    && e.msr_code == code)
+			return Error(e);
+		return Error(code);
+	}
+
+	Result<void> check(int code) const noexcept
+	{
+		if (code == LIBMSR_ERR_OK)
+			return {};
+		return fail(code);
+	}
+
+	int fd_;
+};
+
+/**
+ * @brief Dump tracks as hex to a fd, as msr_pretty_output_hex().
+ */
+inline void print_hex(const msr_tracks_t &t, int fd = 1) noexcept
+{
+	msr_pretty_output_tracks_hex(fd, &t);
+}
+
+/**
+ * @brief Dump tracks as strings to a fd, as msr_pretty_output_string().
+ */
+inline void print_string(const msr_tracks_t &t, int fd = 1) noexcept
+{
+	msr_pretty_output_tracks_string(fd, &t);
+}
+
+/**
+ * @brief Dump tracks as bits to a fd, as msr_pretty_output_bits().
+ */
+inline void print_bits(const msr_tracks_t &t, int fd = 1) noexcept
+{
+	msr_pretty_output_tracks_bits(fd, &t);
+}
+
+/**
+ * @brief The ISO 7811 character sets, as compile-time tables.
+ * @details A code is a character's bits as read off the card, first bit
+ * least significant, with odd parity in the top bit: 5 bits for the
+ * numeric set used on tracks 2 and 3, and 7 bits for the alphanumeric
+ * set used on track 1. Decoding a code with bad parity gives '\0'.
+ */
+namespace codec {
+
+/** @brief A character set: its width and the ASCII of data value 0. */
+struct Charset {
+	int bpc; /**< Bits per character, including parity. */
+	char base; /**< The character of data value 0. */
+	char ss; /**< The start sentinel. */
+	char es; /**< The end sentinel. */
+};
+
+/** @brief The ISO numeric set. */
+constexpr Charset iso5 = { 5, '0', ';', '?' };
+/** @brief The ISO alphanumeric set. */
+constexpr Charset iso7 = { 7, ' ', '%', '?' };
+
+/** @brief Add odd parity to a (bpc - 1)-bit value. */
+constexpr std::uint8_t with_parity(unsigned int v, int bpc) noexcept
+{
+	unsigned int ones = 0;
+
+	for (unsigned int x = v; x != 0; x >>= 1)
+		ones += x & 1;
+	return static_cast<std::uint8_t>(v | ((ones & 1) ? 0 : 1u << (bpc - 1)));
+}
+
+template <std::size_t N>
+constexpr std::array<char, N> decode_table(const Charset &cs) noexcept
+{
+	std::array<char, N> t{};
+
+	for (unsigned int v = 0; v < N / 2; v++)
+		t[with_parity(v, cs.bpc)] = static_cast<char>(cs.base + v);
+	return t;
+}
+
+/** @brief 5-bit code to character. */
+constexpr std::array<char, 32> iso5_decode = decode_table<32>(iso5);
+/** @brief 7-bit code to character. */
+constexpr std::array<char, 128> iso7_decode = decode_table<128>(iso7);
+
+/**
+ * @brief Character to code in a set.
+ * @return The code, or -1 if the set has no such character.
+ */
+constexpr int encode(const Charset &cs, char c) noexcept
+{
+	int v = c - cs.base;
+
+	if (v < 0 || v >= 1 << (cs.bpc - 1))
+		return -1;
+	return with_parity(static_cast<unsigned int>(v), cs.bpc);
+}
+
+/** @brief Character to 5-bit code, or -1. */
+constexpr int iso5_encode(char c) noexcept { return encode(iso5, c); }
+/** @brief Character to 7-bit code, or -1. */
+constexpr int iso7_encode(char c) noexcept { return encode(iso7, c); }
+
+static_assert(iso5_decode[0x0B] == ';' && iso5_encode('?') == 0x1F,
+	"ISO numeric sentinels");
+static_assert(iso7_decode[0x45] == '%' && iso7_encode('?') == 0x1F,
+	"ISO alphanumeric sentinels");
+
+} /* namespace codec */
+
+} /* namespace msr */
+
+#endif /* LIBMSR_HPP */
@@ -6,24 +6,215 @@
 #include <err.h>
 #include <string.h>
 
-#include "libmsr.h"
+#include "msr_internal.h"
 
 /* Thanks Club Mate and h1kari! Toorcon 10 */
 
+/*
+ * Take the device's queued LED change, if there is one that would
+ * actually change the LEDs.
+ */
+uint8_t msr_led_take (int fd)
+{
+	struct msr_devstate *ds;
+	uint8_t led;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return 0;
+
+	led = __atomic_exchange_n (&ds->led_pending, 0, __ATOMIC_ACQ_REL);
+	if (led == 0 || led == ds->led_applied)
+		return 0;
+
+	ds->led_applied = led;
+
+	return led;
+}
+
+/* CLOCK_MONOTONIC nanoseconds. */
+static int64_t now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Note that an LED change has just been written. The device needs as
+ * long to take it as msr_flash_led() gives it before the next command,
+ * but that pause is left to run while the host gets on with other
+ * things, and the next command only waits out what is left of it.
+ */
+void msr_led_note (int fd)
+{
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) != NULL && !ds->no_pause)
+		ds->led_sent = now_ns ();
+}
+
+/* Nanoseconds left of the pause after the last LED change. */
+long msr_led_left (int fd)
+{
+	struct msr_devstate *ds;
+	int64_t gone;
+
+	if ((ds = msr_devstate (fd)) == NULL || ds->led_sent == 0)
+		return 0;
+
+	gone = now_ns () - ds->led_sent;
+
+	return gone < MSR_READY_FIXED_NS ? MSR_READY_FIXED_NS - gone : 0;
+}
+
+void msr_led_settle (int fd)
+{
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = msr_led_left (fd) };
+	struct msr_devstate *ds;
+
+	if (pause.tv_nsec > 0)
+		nanosleep(&pause, NULL);
+
+	if ((ds = msr_devstate (fd)) != NULL)
+		ds->led_sent = 0;
+}
+
+/* Send an LED change taken from the queue. */
+static int send_led (int fd, uint8_t led)
+{
+	struct msr_devstate *ds;
+	msr_cmd_t cmd;
+
+	cmd.msr_esc = MSR_ESC;
+	cmd.msr_cmd = led;
+
+	if (msr_serial_write (fd, &cmd, sizeof(cmd)) == -1) {
+		/* We no longer know what the LEDs show. */
+		if ((ds = msr_devstate (fd)) != NULL)
+			ds->led_applied = 0;
+		return -1;
+	}
+
+	msr_led_note (fd);
+
+	return 0;
+}
+
+/*
+ * Send a queued LED change while the device is idle, after a response
+ * has been collected, so that its pause runs while the host is busy.
+ */
+static int idle_led (int fd)
+{
+	uint8_t led;
+
+	if ((led = msr_led_take (fd)) != 0 && send_led (fd, led) == -1)
+		return msr_fail (fd, LIBMSR_ERR_SERIAL, MSR_PHASE_COMMAND, 0, 0);
+
+	return LIBMSR_ERR_OK;
+}
+
+/*
+ * Send a command to the device. Every protocol exchange starts here.
+ * LED changes queued with msr_led_queue() are normally sent while the
+ * device is idle, but one that is still queued goes out here, just
+ * before the command. Either way, the command waits for whatever is
+ * left of the LED change's pause.
+ */
 int msr_cmd (int fd, uint8_t c)
 {
+	struct msr_devstate *ds;
 	msr_cmd_t	cmd;
+	uint8_t		led;
+
+	if (c != MSR_CMD_RESET && (led = msr_led_take (fd)) != 0
+	    && send_led (fd, led) == -1)
+		return -1;
+
+	msr_led_settle (fd);
 
 	cmd.msr_esc = MSR_ESC;
 	cmd.msr_cmd = c;
 
-	return (msr_serial_write (fd, &cmd, sizeof(cmd)));
+	/* Any command cancels an armed read. */
+	if ((ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 0, __ATOMIC_RELAXED);
+
+	if (msr_serial_write (fd, &cmd, sizeof(cmd)) == -1)
+		return -1;
+
+	return sizeof(cmd);
+}
+
+/*
+ * Helpers for the exchanges below. Each records what went wrong with
+ * msr_fail() and returns the error, so callers can just pass it on.
+ */
+static int sendcmd (int fd, uint8_t c)
+{
+	if (msr_cmd (fd, c) == -1)
+		return msr_fail (fd, LIBMSR_ERR_SERIAL, MSR_PHASE_COMMAND, 0, 0);
+
+	return LIBMSR_ERR_OK;
+}
+
+static int sendbytes (int fd, void *buf, size_t len)
+{
+	if (msr_serial_write (fd, buf, len) != (int) len)
+		return msr_fail (fd, LIBMSR_ERR_SERIAL, MSR_PHASE_COMMAND, 0, 0);
+
+	return LIBMSR_ERR_OK;
+}
+
+static int getbytes (int fd, void *buf, size_t len, int phase, int track)
+{
+	if (msr_serial_read (fd, buf, len) != LIBMSR_ERR_OK)
+		return msr_fail (fd, LIBMSR_ERR_SERIAL, phase, 0, track);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Check the "<esc><status>" most commands are answered with. */
+static int checkstatus (int fd, const uint8_t *b, uint8_t ok)
+{
+	if (b[0] != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    b[0], 0);
+
+	if (b[1] != ok) {
+#ifdef DEBUG
+		printf ("command returned error status: 0x%x\n", b[1]);
+#endif
+		return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    b[1], 0);
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Read the "<esc><status>" most commands are answered with. */
+static int getstatus (int fd, uint8_t ok)
+{
+	uint8_t b[2];
+	int r;
+
+	if ((r = getbytes (fd, b, 2, MSR_PHASE_STATUS, 0)) != LIBMSR_ERR_OK)
+		return r;
+
+	return checkstatus (fd, b, ok);
 }
 
 int msr_zeros (int fd, msr_lz_t *lz)
 {
-	msr_cmd (fd, MSR_CMD_CLZ);
-	msr_serial_read (fd, lz, sizeof(msr_lz_t));
+	MSR_LOCKED(fd);
+	int r;
+
+	if ((r = sendcmd (fd, MSR_CMD_CLZ)) != LIBMSR_ERR_OK
+	    || (r = getbytes (fd, lz, sizeof(msr_lz_t), MSR_PHASE_STATUS, 0))
+	    != LIBMSR_ERR_OK)
+		return r;
 
 #ifdef DEBUG
 	printf("zero13: %d zero: %d\n", lz->msr_lz_tk1_3, lz->msr_lz_tk2);
@@ -35,18 +226,17 @@ int msr_zeros (int fd, msr_lz_t *lz)
 static int getstart (int fd)
 {
 	uint8_t b;
-	int i;
+	int i, r;
 
 	for (i = 0; i < 3; i++) {
-		msr_serial_readchar(fd, &b);
+		if ((r = getbytes (fd, &b, 1, MSR_PHASE_START, 0))
+		    != LIBMSR_ERR_OK)
+			return r;
 		if (b == MSR_RW_START)
-			break;
+			return LIBMSR_ERR_OK;
 	}
 
-	if (i == 3)
-		return LIBMSR_ERR_ISO;
-
-	return LIBMSR_ERR_OK;
+	return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_START, b, 0);
 }
 
 /*
@@ -58,21 +248,30 @@ static int getstart (int fd)
  * (handled here as a four byte structure), the last byte of
  * which contains the command status code.
  *
- * This function will fail if the serial port is not initialized
- * or the descriptor <fd> is invalid, or if the status code
+ * This function will fail with LIBMSR_ERR_SERIAL if the serial
+ * port can't be read, with LIBMSR_ERR_FRAMING if the status isn't
+ * preceded by an escape, or with LIBMSR_ERR_DEVICE if the status code
  * returned by the device is not MSR_STS_OK.
  */
 static int getend (int fd)
 {
 	msr_end_t m;
+	int r;
+
+	if ((r = getbytes (fd, &m, sizeof(m), MSR_PHASE_STATUS, 0))
+	    != LIBMSR_ERR_OK)
+		return r;
 
-	msr_serial_read (fd, &m, sizeof(m));
+	if (m.msr_esc != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    m.msr_esc, 0);
 
 	if (m.msr_sts != MSR_STS_OK) {
 #ifdef DEBUG
 		printf ("read returned error status: 0x%x\n", m.msr_sts);
 #endif
-		return LIBMSR_ERR_DEVICE;
+		return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    m.msr_sts, 0);
 	}
 
 	return LIBMSR_ERR_OK;
@@ -80,17 +279,12 @@ static int getend (int fd)
 
 int msr_commtest (int fd)
 {
+	MSR_LOCKED(fd);
+	uint8_t b;
 	int r;
-	uint8_t buf[2];
 
-	r = msr_cmd (fd, MSR_CMD_DIAG_COMM);
-
-	if (r == -1) {
-#ifdef DEBUG
-   		err(1, "Commtest write failed");
-#endif
-   		return LIBMSR_ERR_SERIAL;
-	}
+	if ((r = sendcmd (fd, MSR_CMD_DIAG_COMM)) != LIBMSR_ERR_OK)
+		return r;
 
 	/*
 	 * Read the result. Note: we're supposed to get back
@@ -100,32 +294,112 @@ int msr_commtest (int fd)
 	 * and discard the escape.
 	 */
 
-	while (1) {
-		msr_serial_readchar (fd, &buf[0]);
-		if (buf[0] == MSR_STS_COMM_OK)
-			break;
+	do {
+		if ((r = getbytes (fd, &b, 1, MSR_PHASE_STATUS, 0))
+		    != LIBMSR_ERR_OK)
+			return r;
+	} while (b != MSR_STS_COMM_OK);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Milliseconds from now until the given CLOCK_MONOTONIC deadline. */
+static int ms_left (const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000
+		+ (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
+}
+
+/* The CLOCK_MONOTONIC deadline timeout milliseconds from now. */
+static void deadline_in (struct timespec *deadline, int timeout)
+{
+	clock_gettime (CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
 	}
+}
 
-	if (buf[0] != MSR_STS_COMM_OK) {
-#ifdef DEBUG
-		printf("Communications test failure\n");
-#endif
-		return LIBMSR_ERR_DEVICE;
+/*
+ * As getbytes(), but give up at a deadline. An answer that arrives
+ * later would be taken for the answer to the next command, so whatever
+ * has arrived is thrown away on timing out.
+ */
+static int getbytes_timeout (int fd, uint8_t *buf, size_t len, int timeout)
+{
+	struct timespec deadline;
+	size_t n;
+	int r;
+
+	deadline_in (&deadline, timeout);
+
+	for (n = 0; n < len; n++) {
+		r = msr_serial_readchar_timeout (fd, &buf[n],
+			ms_left (&deadline));
+		if (r == -1)
+			return msr_fail (fd, LIBMSR_ERR_SERIAL,
+			    MSR_PHASE_STATUS, 0, 0);
+		if (r == 0) {
+			tcflush (fd, TCIFLUSH);
+			return msr_fail (fd, LIBMSR_ERR_TIMEOUT,
+			    MSR_PHASE_STATUS, 0, 0);
+		}
 	}
 
 	return LIBMSR_ERR_OK;
 }
 
+int msr_commtest_timeout (int fd, int timeout)
+{
+	MSR_LOCKED(fd);
+	struct timespec deadline;
+	uint8_t b;
+	int r;
+
+	deadline_in (&deadline, timeout);
+
+	if ((r = sendcmd (fd, MSR_CMD_DIAG_COMM)) != LIBMSR_ERR_OK)
+		return r;
+
+	/* As in msr_commtest(), skip anything before the 'y'. */
+	while ((r = msr_serial_readchar_timeout (fd, &b,
+	    ms_left (&deadline))) == 1) {
+		if (b == MSR_STS_COMM_OK)
+			return LIBMSR_ERR_OK;
+	}
+
+	if (r == -1)
+		return msr_fail (fd, LIBMSR_ERR_SERIAL, MSR_PHASE_STATUS, 0, 0);
+
+#ifdef DEBUG
+	printf("Communications test timed out\n");
+#endif
+
+	return msr_fail (fd, LIBMSR_ERR_TIMEOUT, MSR_PHASE_STATUS, 0, 0);
+}
+
 int msr_fwrev (int fd, uint8_t *buf)
 {
-	if (msr_cmd (fd, MSR_CMD_FWREV) < 0)
-            return LIBMSR_ERR_SERIAL;
+	MSR_LOCKED(fd);
+	int r;
 
-	msr_serial_readchar (fd, &buf[0]);
+	if ((r = sendcmd (fd, MSR_CMD_FWREV)) != LIBMSR_ERR_OK)
+		return r;
 
-	/* read the result "REV?X.XX" */
+	/* read the escape, then the result "REV?X.XX" */
 
-	msr_serial_read (fd, buf, 8);
+	if ((r = getbytes (fd, buf, 1, MSR_PHASE_STATUS, 0)) != LIBMSR_ERR_OK
+	    || (r = getbytes (fd, buf, 8, MSR_PHASE_STATUS, 0))
+	    != LIBMSR_ERR_OK)
+		return r;
 	buf[8] = '\0';
 
 #ifdef DEBUG
@@ -137,16 +411,26 @@ int msr_fwrev (int fd, uint8_t *buf)
 
 int msr_model (int fd, uint8_t *buf)
 {
+	MSR_LOCKED(fd);
 	msr_model_t	m;
+	int r;
 
-	msr_cmd (fd, MSR_CMD_MODEL);
+	if ((r = sendcmd (fd, MSR_CMD_MODEL)) != LIBMSR_ERR_OK)
+		return r;
 
 	/* read the result as the value of X in "MSR206-X" */
 
-	msr_serial_read (fd, &m, sizeof(m));
+	if ((r = getbytes (fd, &m, sizeof(m), MSR_PHASE_STATUS, 0))
+	    != LIBMSR_ERR_OK)
+		return r;
+
+	if (m.msr_esc != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    m.msr_esc, 0);
 
 	if (m.msr_s != MSR_STS_MODEL_OK)
-		return LIBMSR_ERR_DEVICE;
+		return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    m.msr_s, 0);
 
 	snprintf((char *) buf, 10, "MSR-206-%c", m.msr_model);
 
@@ -157,44 +441,223 @@ int msr_model (int fd, uint8_t *buf)
 	return LIBMSR_ERR_OK;
 }
 
+/* Nanoseconds elapsed since the given CLOCK_MONOTONIC time. */
+static long ns_since (const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000L
+		+ (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Wait for the device to finish a command that has no response of its
+ * own, like a reset or an LED change.
+ *
+ * By default this is a fixed pause. In MSR_READY_PROBE mode we instead
+ * send communications tests until one is answered; the device handles
+ * commands in order, so an answer means the earlier command is done.
+ * The time this takes is learned per device and kind of command
+ * (MSR_READY_RESET or MSR_READY_LED), and most of it is slept
+ * through before the first probe, so a device is rarely probed more
+ * than once. If a device never answers in time, we fall back to the
+ * fixed pause, and after a few such failures stop probing it.
+ */
+static void wait_ready (int fd, int kind)
+{
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = MSR_READY_FIXED_NS};
+	struct msr_devstate *ds = msr_devstate (fd);
+	struct timespec start;
+	long elapsed = 0;
+	int probes = 0;
+	uint8_t b;
+	int r;
+
+	if (ds == NULL || ds->ready_mode != MSR_READY_PROBE) {
+		if (ds == NULL || !ds->no_pause)
+			nanosleep(&pause, NULL);
+		return;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	if (ds->ready_ns[kind] > 0 && !ds->no_pause) {
+		pause.tv_nsec = ds->ready_ns[kind] * 3 / 4;
+		nanosleep(&pause, NULL);
+	}
+
+	/* Anything still buffered would be mistaken for an answer. */
+	tcflush (fd, TCIFLUSH);
+
+	do {
+		if (msr_cmd (fd, MSR_CMD_DIAG_COMM) == -1)
+			break;
+		probes++;
+
+		while ((r = msr_serial_readchar_timeout (fd, &b,
+		    MSR_READY_PROBE_TIMEOUT)) == 1 && b != MSR_STS_COMM_OK)
+			;
+		elapsed = ns_since (&start);
+
+		if (r == 1) {
+			ds->ready_ns[kind] = ds->ready_ns[kind] ?
+				(ds->ready_ns[kind] * 7 + elapsed) / 8 : elapsed;
+			ds->ready_fails = 0;
+
+			/*
+			 * The device answers every probe it received, so
+			 * collect the answers to the ones we gave up on.
+			 */
+			while (--probes > 0)
+				while (msr_serial_readchar_timeout (fd, &b,
+				    MSR_READY_PROBE_TIMEOUT) == 1
+				    && b != MSR_STS_COMM_OK)
+					;
+			return;
+		}
+	} while (r == 0 && elapsed < MSR_READY_FIXED_NS);
+
+	tcflush (fd, TCIFLUSH);
+
+#ifdef DEBUG
+	printf("Device did not become ready, falling back to a fixed delay\n");
+#endif
+
+	if (elapsed < MSR_READY_FIXED_NS && !ds->no_pause) {
+		pause.tv_nsec = MSR_READY_FIXED_NS - elapsed;
+		nanosleep(&pause, NULL);
+	}
+
+	if (++ds->ready_fails >= MSR_READY_MAX_FAILS)
+		ds->ready_mode = MSR_READY_FIXED;
+}
+
+int msr_set_ready_mode (int fd, int mode)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if (mode != MSR_READY_FIXED && mode != MSR_READY_PROBE)
+		return LIBMSR_ERR_GENERIC;
+
+	ds->ready_mode = mode;
+	ds->ready_fails = 0;
+
+	return LIBMSR_ERR_OK;
+}
+
+long msr_ready_delay (int fd)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+
+	if ((ds = msr_devstate (fd)) == NULL || ds->ready_mode != MSR_READY_PROBE
+	    || ds->ready_ns[MSR_READY_RESET] == 0)
+		return MSR_READY_FIXED_NS / 1000;
+
+	return ds->ready_ns[MSR_READY_RESET] / 1000;
+}
+
+int msr_led_queue (int fd, uint8_t led)
+{
+	struct msr_devstate *ds;
+	int r = LIBMSR_ERR_OK;
+
+	if ((ds = msr_devstate (fd)) == NULL || led == 0)
+		return LIBMSR_ERR_GENERIC;
+
+	__atomic_store_n (&ds->led_pending, led, __ATOMIC_RELEASE);
+
+	/*
+	 * If nothing else is going on with the device, send the change
+	 * now; otherwise it is sent once the device is idle again.
+	 */
+	if ((ds = msr_devstate_trylock (fd)) != NULL) {
+		if (!__atomic_load_n (&ds->armed, __ATOMIC_RELAXED))
+			r = idle_led (fd);
+		msr_devstate_unlock (ds);
+	}
+
+	return r;
+}
+
+int msr_led_flush (int fd)
+{
+	MSR_LOCKED(fd);
+
+	return idle_led (fd);
+}
+
 int msr_flash_led (int fd, uint8_t led)
 {
-	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000000};
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
 	int r;
 
-	r = msr_cmd (fd, led);
+	/* An explicit change supersedes anything queued. */
+	if ((ds = msr_devstate (fd)) != NULL) {
+		__atomic_store_n (&ds->led_pending, 0, __ATOMIC_RELEASE);
+		ds->led_applied = led;
+	}
 
-	if (r == -1)
-		return LIBMSR_ERR_SERIAL | LIBMSR_ERR_DEVICE;
+	if ((r = sendcmd (fd, led)) != LIBMSR_ERR_OK)
+		return r;
 
-	nanosleep(&pause, NULL);
+	wait_ready (fd, MSR_READY_LED);
 
 	/* No response, look at the lights Dr. Love */
 	return LIBMSR_ERR_OK;
 }
 
+/*
+ * Read the "<esc><track number>" that starts each track of a read
+ * response.
+ */
+static int gettrack_start (int fd, int t)
+{
+	uint8_t b[2];
+	int r;
+
+	if ((r = getbytes (fd, b, 2, MSR_PHASE_DATA, t)) != LIBMSR_ERR_OK)
+		return r;
+
+	if (b[0] != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_DATA, b[0], t);
+	if (b[1] != t)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_DATA, b[1], t);
+
+	return LIBMSR_ERR_OK;
+}
+
+/*
+ * Read one track of an ISO read response. A track the device couldn't
+ * decode is reported in place of its data as "<esc><status>"; that
+ * leaves the rest of the response intact, so it is returned as
+ * LIBMSR_ERR_ISO with an empty track and the read carries on.
+ */
 static int gettrack_iso (int fd, int t, uint8_t * buf, uint8_t * len)
 {
 	uint8_t b;
 	int i = 0;
 	int l = 0;
+	int r;
 
-	/* Start delimiter should be ESC <track number> */
-
-	msr_serial_readchar (fd, &b);
-	if (b != MSR_ESC) {
-		*len = 0;
-		return LIBMSR_ERR_DEVICE;
-	}
-
-	msr_serial_readchar (fd, &b);
-	if (b != t) {
+	if ((r = gettrack_start (fd, t)) != LIBMSR_ERR_OK) {
 		*len = 0;
-		return LIBMSR_ERR_DEVICE;
+		return r;
 	}
 
 	while (1) {
-		msr_serial_readchar (fd, &b);
+		if ((r = getbytes (fd, &b, 1, MSR_PHASE_DATA, t))
+		    != LIBMSR_ERR_OK) {
+			*len = 0;
+			return r;
+		}
 		if (b == '%')
 			continue;
 		if (b == ';')
@@ -214,12 +677,18 @@ static int gettrack_iso (int fd, int t, uint8_t * buf, uint8_t * len)
 	if (b == MSR_RW_END) {
 		*len = l;
 		return LIBMSR_ERR_OK;
-	} else {
-		*len = 0;
-		msr_serial_readchar (fd, &b);
 	}
 
-	return LIBMSR_ERR_DEVICE;
+	*len = 0;
+	if ((r = getbytes (fd, &b, 1, MSR_PHASE_DATA, t)) != LIBMSR_ERR_OK)
+		return r;
+
+#ifdef DEBUG
+	printf ("track %d returned error status: 0x%x\n", t, b);
+#endif
+
+	/* Keep the device's status for msr_last_error(). */
+	return msr_fail (fd, LIBMSR_ERR_ISO, MSR_PHASE_DATA, b, t);
 }
 
 static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
@@ -227,30 +696,21 @@ static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
 	uint8_t b, s;
 	int i = 0;
 	int l = 0;
+	int r;
 
-	/* Start delimiter should be ESC <track number> */
-
-	msr_serial_readchar (fd, &b);
-	if (b != MSR_ESC) {
-		*len = 0;
-		return LIBMSR_ERR_DEVICE;
-	}
-
-	msr_serial_readchar (fd, &b);
-	if (b != t) {
-		*len = 0;
-		return LIBMSR_ERR_DEVICE;
-	}
-
-	msr_serial_readchar (fd, &s);
-
-	if (!s) {
+	if ((r = gettrack_start (fd, t)) != LIBMSR_ERR_OK
+	    || (r = getbytes (fd, &s, 1, MSR_PHASE_DATA, t))
+	    != LIBMSR_ERR_OK) {
 		*len = 0;
-		return LIBMSR_ERR_OK;
+		return r;
 	}
 
 	for (i = 0; i < s; i++) {
-		msr_serial_readchar (fd, &b);
+		if ((r = getbytes (fd, &b, 1, MSR_PHASE_DATA, t))
+		    != LIBMSR_ERR_OK) {
+			*len = 0;
+			return r;
+		}
 		/* Avoid overflowing the buffer */
 		if (i < *len) {
 			l++;
@@ -265,344 +725,450 @@ static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
 
 int msr_sensor_test (int fd)
 {
-	uint8_t b[4];
+	MSR_LOCKED(fd);
+	int r;
 
-	msr_cmd (fd, MSR_CMD_DIAG_SENSOR);
+	if ((r = sendcmd (fd, MSR_CMD_DIAG_SENSOR)) != LIBMSR_ERR_OK)
+		return r;
 
 #ifdef DEBUG
 	printf("Attempting sensor test -- please slide a card...\n");
 #endif
 
-	msr_serial_read (fd, &b, 2);
+	return getstatus (fd, MSR_STS_SENSOR_OK);
+}
 
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_SENSOR_OK) {
-		return LIBMSR_ERR_OK;
-	}
+int msr_ram_test (int fd)
+{
+	MSR_LOCKED(fd);
+	int r;
 
-#ifdef DEBUG
-	printf("It appears that the sensor did not sense a magnetic card.\n");
-#endif
+	if ((r = sendcmd (fd, MSR_CMD_DIAG_RAM)) != LIBMSR_ERR_OK)
+		return r;
 
-	return LIBMSR_ERR_DEVICE;
+	return getstatus (fd, MSR_STS_RAM_OK);
 }
 
-int msr_ram_test (int fd)
+int msr_ram_test_timeout (int fd, int timeout)
 {
-	uint8_t b[2] = {0};
+	MSR_LOCKED(fd);
+	uint8_t b[2];
+	int r;
+
+	if ((r = sendcmd (fd, MSR_CMD_DIAG_RAM)) != LIBMSR_ERR_OK
+	    || (r = getbytes_timeout (fd, b, 2, timeout)) != LIBMSR_ERR_OK)
+		return r;
 
-	msr_cmd (fd, MSR_CMD_DIAG_RAM);
+	return checkstatus (fd, b, MSR_STS_RAM_OK);
+}
+
+/* Check the "<esc><co>" a coercivity query is answered with. */
+static int checkco (int fd, const uint8_t *b)
+{
+	struct msr_settings *set;
 
-	msr_serial_read(fd, b, sizeof(b));
+	if (b[0] != MSR_ESC)
+		return msr_fail (fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    b[0], 0);
 
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_RAM_OK) {
- 		return LIBMSR_ERR_OK;
+	if (b[1] == MSR_CO_HI || b[1] == MSR_CO_LO) {
+		if ((set = msr_settings (fd)) != NULL)
+			set->co = b[1];
+		return b[1];
 	}
 
 #ifdef DEBUG
-	printf("It appears that the RAM test failed\n");
+	printf("It appears that the reader did not return its coercivity.\n");
 	printf("Got 0x%02x 0x%02x in response.\n", b[0], b[1]);
 #endif
 
-	return LIBMSR_ERR_DEVICE;
+	return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS, b[1], 0);
 }
 
 int msr_get_co(int fd)
 {
-	char b[2] = {0};
+	MSR_LOCKED(fd);
+	uint8_t b[2] = {0};
+	int r;
 
-	msr_cmd(fd, MSR_CMD_GETCO);
+	if ((r = sendcmd (fd, MSR_CMD_GETCO)) != LIBMSR_ERR_OK
+	    || (r = getbytes (fd, b, 2, MSR_PHASE_STATUS, 0)) != LIBMSR_ERR_OK)
+		return r;
 
-	msr_serial_read(fd, &b, 2);
+	return checkco (fd, b);
+}
 
-	if (b[0] == MSR_ESC && (b[1] == MSR_CO_HI || b[1] == MSR_CO_LO)) {
-		return b[1];
-	}
+int msr_get_co_timeout(int fd, int timeout)
+{
+	MSR_LOCKED(fd);
+	uint8_t b[2] = {0};
+	int r;
 
-#ifdef DEBUG
-	printf("It appears that the reader did not return its coercivity.\n");
-	printf("Got 0x%02x 0x%02x in response.\n", b[0], b[1]);
-#endif
+	if ((r = sendcmd (fd, MSR_CMD_GETCO)) != LIBMSR_ERR_OK
+	    || (r = getbytes_timeout (fd, b, 2, timeout)) != LIBMSR_ERR_OK)
+		return r;
 
-	return LIBMSR_ERR_DEVICE;
+	return checkco (fd, b);
 }
 
 int msr_set_hi_co (int fd)
 {
-	char b[2] = {0};
-
-	msr_cmd (fd, MSR_CMD_SETCO_HI);
+	MSR_LOCKED(fd);
+	struct msr_settings *set;
+	int r;
 
 	/* read the result "<esc>0" if OK, unknown or no response if fail */
-	msr_serial_read (fd, &b, 2);
+	if ((r = sendcmd (fd, MSR_CMD_SETCO_HI)) == LIBMSR_ERR_OK)
+		r = getstatus (fd, MSR_STS_CO_OK);
 
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
-#ifdef DEBUG
-		printf("Hi-Co mode: enabled.\n");
-#endif
-		return LIBMSR_ERR_OK;
-	}
-
-#ifdef DEBUG
-	printf("It appears that the reader did not switch to Hi-Co mode.\n");
-	printf("Got 0x%02x 0x%02x in response.\n", b[0], b[1]);
-#endif
+	if ((set = msr_settings (fd)) != NULL)
+		set->co = r == LIBMSR_ERR_OK ? MSR_CO_HI : 0;
 
-	return LIBMSR_ERR_DEVICE;
+	return r;
 }
 
 int msr_set_lo_co (int fd)
 {
-	char b[2] = {0};
-
-	msr_cmd (fd, MSR_CMD_SETCO_LO);
+	MSR_LOCKED(fd);
+	struct msr_settings *set;
+	int r;
 
 	/* read the result "<esc>0" if OK, unknown or no response if fail */
-	msr_serial_read (fd, &b, 2);
-
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
-#ifdef DEBUG
-		printf("Lo-Co mode: enabled.\n");
-#endif
-		return LIBMSR_ERR_OK;
-	}
+	if ((r = sendcmd (fd, MSR_CMD_SETCO_LO)) == LIBMSR_ERR_OK)
+		r = getstatus (fd, MSR_STS_CO_OK);
 
-#ifdef DEBUG
-	printf("It appears that the reader did not switch to Lo-Co mode.\n");
-	printf("Got 0x%02x 0x%02x in response.\n", b[0], b[1]);
-#endif
+	if ((set = msr_settings (fd)) != NULL)
+		set->co = r == LIBMSR_ERR_OK ? MSR_CO_LO : 0;
 
-	return LIBMSR_ERR_DEVICE;
+	return r;
 }
 
 int msr_reset (int fd)
 {
-	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000000};
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+	int r;
 
-	msr_cmd (fd, MSR_CMD_RESET);
+	if ((r = sendcmd (fd, MSR_CMD_RESET)) != LIBMSR_ERR_OK)
+		return r;
 
-	nanosleep(&pause, NULL);
+	/* We no longer know what the LEDs show, or what it's set to. */
+	if ((ds = msr_devstate (fd)) != NULL) {
+		ds->led_applied = 0;
+		memset (&ds->settings, 0, sizeof(ds->settings));
+	}
+
+	wait_ready (fd, MSR_READY_RESET);
 
 	return LIBMSR_ERR_OK;
 }
 
-int msr_iso_read(int fd, msr_tracks_t * tracks)
+int msr_iso_read_arm(int fd)
 {
-	int r, i;
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+	int r;
 
-	r = msr_cmd (fd, MSR_CMD_READ);
+	if ((r = sendcmd (fd, MSR_CMD_READ)) == LIBMSR_ERR_OK
+	    && (ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 1, __ATOMIC_RELAXED);
 
-	if (r == -1) {
-#ifdef DEBUG
-		err(1, "Command write failed");
-#endif
-	}
+	return r;
+}
 
-    /* Wait for start delimiter. */
-	if (getstart (fd) == -1) {
-#ifdef DEBUG
-		err(1, "get start delimiter failed");
-#endif
-	}
+/*
+ * Collect the tracks of a read response. A track that failed to decode
+ * doesn't end the read, but anything that leaves us unsure where we are
+ * in the response does. When sealing, each track is sealed as soon as it
+ * is read, and if the read fails part way, whatever is left of the tracks
+ * not yet sealed is wiped.
+ */
+static int collect (int fd, msr_tracks_t *tracks,
+	int (*gettrack)(int, int, uint8_t *, uint8_t *),
+	msr_crypt_t *c, msr_seal_t *seal)
+{
+	struct msr_devstate *ds;
+	int i = 0, r;
+
+	if ((ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 0, __ATOMIC_RELAXED);
 
-    /* Read track data */
-	for (i = 0; i < MSR_MAX_TRACKS; i++)
-		gettrack_iso (fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
+	/* Wait for start delimiter. */
+	if ((r = getstart (fd)) != LIBMSR_ERR_OK)
+		goto fail;
+
+	/* Read track data */
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		r = gettrack (fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
 		    &tracks->msr_tracks[i].msr_tk_len);
+		if (r != LIBMSR_ERR_OK && r != LIBMSR_ERR_ISO)
+			goto fail;
+		if (c != NULL)
+			msr_crypt_seal_track (c, seal, i,
+				&tracks->msr_tracks[i]);
+	}
 
-    /* Wait for end delimiter. */
-	if (getend (fd) == -1) {
-#ifdef DEBUG
-		warnx("read failed");
-#endif
-		return LIBMSR_ERR_SERIAL;
+	/* Wait for end delimiter. */
+	if ((r = getend (fd)) != LIBMSR_ERR_OK)
+		return r;
+
+	/*
+	 * The tracks are in, so an LED change that can't be sent is left
+	 * for the next command to fail on.
+	 */
+	idle_led (fd);
+
+	return LIBMSR_ERR_OK;
+
+fail:
+	for (; c != NULL && i < MSR_MAX_TRACKS; i++) {
+		memset (tracks->msr_tracks[i].msr_tk_data, 0,
+			sizeof(tracks->msr_tracks[i].msr_tk_data));
+		tracks->msr_tracks[i].msr_tk_len = 0;
 	}
+	return r;
+}
+
+int msr_iso_read_collect(int fd, msr_tracks_t * tracks)
+{
+	MSR_LOCKED(fd);
+
+	return collect (fd, tracks, gettrack_iso, NULL, NULL);
+}
+
+int msr_iso_read(int fd, msr_tracks_t * tracks)
+{
+	MSR_LOCKED(fd);
+	int r;
+
+	if ((r = msr_iso_read_arm (fd)) != LIBMSR_ERR_OK)
+		return r;
+
+	return msr_iso_read_collect (fd, tracks);
+}
+
+/*
+ * A recording of the session would keep the tracks of a sealed read in
+ * the clear, so sealed reads are refused while one is running. The lock
+ * is held, so none can start until the read is done.
+ */
+static int unrecorded (int fd)
+{
+	struct msr_devstate *ds = msr_devstate (fd);
+
+	if (ds != NULL && ds->rec != NULL)
+		return msr_fail (fd, LIBMSR_ERR_GENERIC, MSR_PHASE_COMMAND,
+		    0, 0);
 
 	return LIBMSR_ERR_OK;
 }
 
-int msr_erase (int fd, uint8_t tracks)
+int msr_iso_read_sealed(int fd, msr_tracks_t *tracks, msr_crypt_t *c,
+	msr_seal_t *seal)
 {
-	uint8_t b[2];
+	MSR_LOCKED(fd);
+	int r;
 
-	msr_cmd (fd, MSR_CMD_ERASE);
-	msr_serial_write (fd, &tracks, 1);
+	/* Get the nonce before the card is swiped, in case there's none. */
+	if ((r = unrecorded (fd)) != LIBMSR_ERR_OK
+	    || (r = msr_crypt_begin (seal)) != LIBMSR_ERR_OK
+	    || (r = msr_iso_read_arm (fd)) != LIBMSR_ERR_OK)
+		return r;
 
-	if (msr_serial_read (fd, b, 2) == -1) {
-#ifdef DEBUG
-		err(1, "read erase response failed");
-#endif
-	}
+	return collect (fd, tracks, gettrack_iso, c, seal);
+}
 
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_ERASE_OK) {
-		return LIBMSR_ERR_OK;
-	}
-	else {
-#ifdef DEBUG
-		printf ("%x %x\n", b[0], b[1]);
-#endif
-	}
+int msr_erase (int fd, uint8_t tracks)
+{
+	MSR_LOCKED(fd);
+	int r;
+
+	if ((r = sendcmd (fd, MSR_CMD_ERASE)) != LIBMSR_ERR_OK
+	    || (r = sendbytes (fd, &tracks, 1)) != LIBMSR_ERR_OK)
+		return r;
 
-	return LIBMSR_ERR_DEVICE;
+	return getstatus (fd, MSR_STS_ERASE_OK);
 }
 
 int msr_iso_write(int fd, msr_tracks_t * tracks)
 {
-	int i;
+	MSR_LOCKED(fd);
+	int i, r;
 	uint8_t buf[4];
 
-	msr_cmd(fd, MSR_CMD_WRITE);
-	msr_cmd(fd, MSR_RW_START);
+	if ((r = sendcmd (fd, MSR_CMD_WRITE)) != LIBMSR_ERR_OK)
+		return r;
+
+	buf[0] = MSR_ESC;
+	buf[1] = MSR_RW_START;
+	if ((r = sendbytes (fd, buf, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	for (i = 0; i < MSR_MAX_TRACKS; i++) {
 		buf[0] = MSR_ESC;
 		buf[1] = i + 1;
-		msr_serial_write (fd, buf, 2);
-		msr_serial_write (fd, tracks->msr_tracks[i].msr_tk_data,
-			tracks->msr_tracks[i].msr_tk_len);
+		if ((r = sendbytes (fd, buf, 2)) != LIBMSR_ERR_OK
+		    || (r = sendbytes (fd, tracks->msr_tracks[i].msr_tk_data,
+		    tracks->msr_tracks[i].msr_tk_len)) != LIBMSR_ERR_OK)
+			return r;
 	}
 
 	buf[0] = MSR_RW_END;
 	buf[1] = MSR_FS;
-	msr_serial_write (fd, buf, 2);
+	if ((r = sendbytes (fd, buf, 2)) != LIBMSR_ERR_OK)
+		return r;
 
-	msr_serial_read(fd, buf, 2);
+	return getstatus (fd, MSR_STS_OK);
+}
 
-	if (buf[1] != MSR_STS_OK) {
-#ifdef DEBUG
-		warnx("iso write failed: 0x%02x", buf[1]);
-#endif
-		return LIBMSR_ERR_DEVICE;
-	}
+int msr_raw_read_arm(int fd)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+	int r;
 
-	return LIBMSR_ERR_OK;
+	if ((r = sendcmd (fd, MSR_CMD_RAW_READ)) == LIBMSR_ERR_OK
+	    && (ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 1, __ATOMIC_RELAXED);
+
+	return r;
 }
 
-int msr_raw_read(int fd, msr_tracks_t * tracks)
+int msr_raw_read_collect(int fd, msr_tracks_t * tracks)
 {
-	int r, i;
+	MSR_LOCKED(fd);
 
-	r = msr_cmd(fd, MSR_CMD_RAW_READ);
+	return collect (fd, tracks, gettrack_raw, NULL, NULL);
+}
 
-	if (r == -1) {
-#ifdef DEBUG
-		err(1, "Command write failed");
-#endif
-	}
+int msr_raw_read(int fd, msr_tracks_t * tracks)
+{
+	MSR_LOCKED(fd);
+	int r;
 
-	if (getstart(fd) == -1) {
-#ifdef DEBUG
-		err(1, "get start delimiter failed");
-#endif
-	}
+	if ((r = msr_raw_read_arm (fd)) != LIBMSR_ERR_OK)
+		return r;
 
-	for (i = 0; i < MSR_MAX_TRACKS; i++) {
-		gettrack_raw(fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
-		    &tracks->msr_tracks[i].msr_tk_len);
-	}
+	return msr_raw_read_collect (fd, tracks);
+}
 
-	if (getend(fd) == -1) {
-#ifdef DEBUG
-		err(1, "read failed");
-#endif
-		return LIBMSR_ERR_DEVICE;
-	}
+int msr_raw_read_sealed(int fd, msr_tracks_t *tracks, msr_crypt_t *c,
+	msr_seal_t *seal)
+{
+	MSR_LOCKED(fd);
+	int r;
 
-	return LIBMSR_ERR_OK;
+	/* Get the nonce before the card is swiped, in case there's none. */
+	if ((r = unrecorded (fd)) != LIBMSR_ERR_OK
+	    || (r = msr_crypt_begin (seal)) != LIBMSR_ERR_OK
+	    || (r = msr_raw_read_arm (fd)) != LIBMSR_ERR_OK)
+		return r;
+
+	return collect (fd, tracks, gettrack_raw, c, seal);
 }
 
 int msr_raw_write(int fd, msr_tracks_t * tracks)
 {
-	int i;
+	MSR_LOCKED(fd);
+	int i, r;
 	uint8_t buf[4];
 
-	msr_cmd(fd, MSR_CMD_RAW_WRITE);
-	msr_cmd(fd, MSR_RW_START);
+	if ((r = sendcmd (fd, MSR_CMD_RAW_WRITE)) != LIBMSR_ERR_OK)
+		return r;
+
+	buf[0] = MSR_ESC;
+	buf[1] = MSR_RW_START;
+	if ((r = sendbytes (fd, buf, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	for (i = 0; i < MSR_MAX_TRACKS; i++) {
 		buf[0] = MSR_ESC; /* start delimiter */
 		buf[1] = i + 1; /* track number */
 		buf[2] = tracks->msr_tracks[i].msr_tk_len; /* data length */
-		msr_serial_write (fd, buf, 3);
-		msr_serial_write (fd, tracks->msr_tracks[i].msr_tk_data,
-			tracks->msr_tracks[i].msr_tk_len);
+		if ((r = sendbytes (fd, buf, 3)) != LIBMSR_ERR_OK
+		    || (r = sendbytes (fd, tracks->msr_tracks[i].msr_tk_data,
+		    tracks->msr_tracks[i].msr_tk_len)) != LIBMSR_ERR_OK)
+			return r;
 	}
 
 	buf[0] = MSR_RW_END;
 	buf[1] = MSR_FS;
-	msr_serial_write (fd, buf, 2);
-
-	msr_serial_read(fd, buf, 2);
-
-	if (buf[1] != MSR_STS_OK) {
-#ifdef DEBUG
-		warnx("raw write failed: 0x%02x", buf[1]);
-#endif
-		return LIBMSR_ERR_DEVICE;
-	}
+	if ((r = sendbytes (fd, buf, 2)) != LIBMSR_ERR_OK)
+		return r;
 
-	return LIBMSR_ERR_OK;
+	return getstatus (fd, MSR_STS_OK);
 }
 
 int msr_init(int fd)
 {
-	msr_reset (fd);
-
-	if (msr_commtest (fd) == -1) {
-		return LIBMSR_ERR_DEVICE;
-	}
+	MSR_LOCKED(fd);
+	int r;
 
-	msr_reset (fd);
+	if ((r = msr_reset (fd)) != LIBMSR_ERR_OK
+	    || (r = msr_commtest (fd)) != LIBMSR_ERR_OK)
+		return r;
 
-	return LIBMSR_ERR_OK;
+	return msr_reset (fd);
 }
 
 int msr_set_bpi (int fd, uint8_t bpi)
 {
-	uint8_t b[2] = {0};
-
-	msr_cmd (fd, MSR_CMD_SETBPI);
-	msr_serial_write (fd, &bpi, 1);
-	msr_serial_read (fd, &b, 2);
+	MSR_LOCKED(fd);
+	struct msr_settings *set;
+	int r;
 
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
 #ifdef DEBUG
-		printf("Set bits per inch to: %d\n", bpi);
+	printf("Setting bits per inch to: %d\n", bpi);
 #endif
-		return LIBMSR_ERR_OK;
-	}
 
-#ifdef DEBUG
-	warnx ("Set bpi failed\n");
-#endif
+	if ((r = sendcmd (fd, MSR_CMD_SETBPI)) == LIBMSR_ERR_OK
+	    && (r = sendbytes (fd, &bpi, 1)) == LIBMSR_ERR_OK)
+		r = getstatus (fd, MSR_STS_BPI_OK);
+
+	if ((set = msr_settings (fd)) != NULL)
+		set->bpi = r == LIBMSR_ERR_OK ? bpi : 0;
 
-	return LIBMSR_ERR_DEVICE;
+	return r;
 }
 
 int msr_set_bpc (int fd, uint8_t bpc1, uint8_t bpc2, uint8_t bpc3)
 {
-	uint8_t b[2] = {0};
-	msr_bpc_t bpc;
+	MSR_LOCKED(fd);
+	struct msr_settings *set;
+	msr_bpc_t bpc, echo;
+	int r;
 
 	bpc.msr_bpctk1 = bpc1;
 	bpc.msr_bpctk2 = bpc2;
 	bpc.msr_bpctk3 = bpc3;
 
-	msr_cmd (fd, MSR_CMD_SETBPC);
-	msr_serial_write (fd, &bpc, sizeof(bpc));
+	if ((set = msr_settings (fd)) != NULL)
+		memset (set->bpc, 0, sizeof(set->bpc));
+
+	if ((r = sendcmd (fd, MSR_CMD_SETBPC)) != LIBMSR_ERR_OK
+	    || (r = sendbytes (fd, &bpc, sizeof(bpc))) != LIBMSR_ERR_OK
+	    || (r = getstatus (fd, MSR_STS_BPC_OK)) != LIBMSR_ERR_OK)
+		return r;
+
+	/* The device echoes back what it actually set. */
+	if ((r = getbytes (fd, &echo, sizeof(echo), MSR_PHASE_STATUS, 0))
+	    != LIBMSR_ERR_OK)
+		return r;
 
-	msr_serial_read (fd, &b, 2);
-	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
-		msr_serial_read (fd, &bpc, sizeof(bpc));
 #ifdef DEBUG
-		printf ("Set bpc... %d %d %d\n", bpc.msr_bpctk1,
-		    bpc.msr_bpctk2, bpc.msr_bpctk3);
+	printf ("Set bpc... %d %d %d\n", echo.msr_bpctk1,
+	    echo.msr_bpctk2, echo.msr_bpctk3);
 #endif
-		return LIBMSR_ERR_OK;
+
+	if (set != NULL) {
+		set->bpc[0] = echo.msr_bpctk1;
+		set->bpc[1] = echo.msr_bpctk2;
+		set->bpc[2] = echo.msr_bpctk3;
 	}
 
-#ifdef DEBUG
-	warnx("failed to set bpc");
-#endif
+	if (memcmp (&echo, &bpc, sizeof(bpc)) != 0)
+		return msr_fail (fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    MSR_STS_BPC_ERR, 0);
 
-	return LIBMSR_ERR_DEVICE;
+	return LIBMSR_ERR_OK;
 }
@@ -0,0 +1,164 @@
+/*
+ * Internal interfaces shared between libmsr's translation units.
+ * Nothing in here is part of the public API.
+ */
+#ifndef MSR_INTERNAL_H
+#define MSR_INTERNAL_H
+
+#include "libmsr.h"
+
+/* None of this is exported from the shared library. */
+#pragma GCC visibility push(hidden)
+
+/*
+ * The highest fd (exclusive) that per-device state is kept for. Without
+ * it a device would have no lock, so msr_serial_open() refuses higher
+ * fds.
+ */
+#define MSR_MAX_DEVFD 1024
+
+/* Kinds of command whose ready delay is learned separately. */
+#define MSR_READY_RESET 0
+#define MSR_READY_LED 1
+
+/* Hint to the CPU that we're spinning. */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+/* Directions of traffic, as logged by session recordings. */
+#define MSR_IO_RX 0
+#define MSR_IO_TX 1
+
+struct msr_recorder;
+struct msr_replayer;
+
+/*
+ * The settings known to be in effect on a device, each 0 where it is
+ * unknown. A reset, or a failed attempt to change a setting, forgets
+ * it, since the device may then have anything.
+ */
+struct msr_settings {
+	uint8_t co; /* MSR_CO_HI or MSR_CO_LO */
+	uint8_t bpi; /* track 2 bits per inch */
+	uint8_t bpc[MSR_MAX_TRACKS]; /* bits per character */
+};
+
+/*
+ * What a health monitor last found out about a device. There is one
+ * writer, the monitor, and readers retry while seq is odd or changes.
+ */
+struct msr_healthstate {
+	uint32_t seq;
+	msr_health_t h; /* msr_idle_ms and msr_age_ms are filled in on reading */
+	int64_t idle_since; /* CLOCK_MONOTONIC ns the device went idle, or 0 */
+	unsigned long uses; /* the lock's count at idle_since */
+	int64_t checked; /* CLOCK_MONOTONIC ns of the last round, or 0 */
+};
+
+/*
+ * Per-device state, indexed by fd. It is reset whenever the fd is
+ * opened or closed through msr_serial_open()/msr_serial_close().
+ */
+struct msr_devstate {
+	int ready_mode; /* MSR_READY_* */
+	int ready_fails; /* consecutive probes that never answered */
+	long ready_ns[2]; /* learned time to become ready, by MSR_READY_* kind */
+	uint8_t led_pending; /* LED command queued by msr_led_queue(), or 0 */
+	uint8_t led_applied; /* last LED command sent, or 0 if unknown */
+	int64_t led_sent; /* CLOCK_MONOTONIC ns of the last LED change, or 0 */
+	int no_pause; /* skip fixed delays; the device isn't real hardware */
+	struct msr_recorder *rec; /* recording of this session, or NULL */
+	struct msr_replayer *replay; /* replay serving this fd, or NULL */
+	uint32_t lock; /* see msr_devstate_lock() */
+	pid_t lock_owner; /* thread holding the lock, or 0 */
+	int lock_depth; /* times the owner has taken the lock */
+	uint32_t spinning; /* threads spinning for the lock */
+	uint32_t waiting; /* threads past spinning, waiting for the lock */
+	int closing; /* msr_devstate_close() is under way; read atomically */
+	msr_err_t err; /* last failure, see msr_fail() */
+	struct msr_settings settings;
+	int latency; /* MSR_LATENCY_* asked for when opened */
+	int gone; /* unplugged; accessed atomically */
+	unsigned long uses; /* times the lock was taken; read atomically */
+	int armed; /* a read is armed and not collected; read atomically */
+	struct msr_healthstate health;
+};
+
+extern struct msr_devstate *msr_devstate(int fd);
+extern void msr_devstate_reset(int fd);
+
+/*
+ * Close a device's fd and clear its state, failing the calls that hold
+ * or wait for its lock.
+ */
+extern void msr_devstate_close(int fd);
+
+/* A device's known settings, or NULL if it has no state kept. */
+extern struct msr_settings *msr_settings(int fd);
+
+/*
+ * Take a device's lock, returning its state (NULL if it has none, in
+ * which case nothing is locked). Locks are recursive.
+ */
+extern struct msr_devstate *msr_devstate_lock(int fd);
+extern void msr_devstate_unlock(struct msr_devstate *ds);
+
+/* As msr_devstate_lock(), but return NULL at once if the lock is held. */
+extern struct msr_devstate *msr_devstate_trylock(int fd);
+
+/* Whether anyone is waiting for a device's lock. */
+extern int msr_devstate_contended(const struct msr_devstate *ds);
+extern void msr_devstate_unlock_scope(struct msr_devstate **ds);
+
+/*
+ * Hold a device's lock until the end of the enclosing block. Every
+ * public function that talks to a device starts with this.
+ */
+#define MSR_LOCKED(fd) \
+	struct msr_devstate *msr_locked_ \
+	__attribute__((cleanup(msr_devstate_unlock_scope))) = \
+		msr_devstate_lock (fd)
+
+/*
+ * Record a failure for msr_last_error(), returning its code. The
+ * arguments are as in msr_err_t; errno is picked up for serial errors.
+ */
+extern int msr_fail(int fd, int code, int phase, uint8_t sts, int track);
+
+extern int msr_cmd(int fd, uint8_t c);
+
+/* Set up a serial device's line discipline and speed. */
+extern int msr_serial_setup(int fd, speed_t baud);
+extern uint8_t msr_led_take(int fd);
+
+/*
+ * Note an LED change just written, and how much of the pause the device
+ * needs after it is left, in nanoseconds. msr_led_settle() waits that
+ * out before the next command.
+ */
+extern void msr_led_note(int fd);
+extern long msr_led_left(int fd);
+extern void msr_led_settle(int fd);
+
+extern void msr_record_io(struct msr_recorder *rec, int dir,
+	const void *buf, size_t len);
+
+/*
+ * Start sealing a record, giving it a fresh nonce, then seal each of
+ * its tracks in place as it is read. Starting fails only if no random
+ * bytes can be had.
+ */
+extern int msr_crypt_begin(msr_seal_t *seal);
+extern void msr_crypt_seal_track(const msr_crypt_t *c, msr_seal_t *seal,
+	int tn, msr_track_t *tk);
+
+/* SipHash-2-4 of a buffer, with the key as two little-endian words. */
+extern uint64_t msr_siphash(uint64_t k0, uint64_t k1, const uint8_t *in,
+	size_t len);
+
+#pragma GCC visibility pop
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * msrd: share MSR devices between local processes.
+ *
+ * msrd owns one or more MSR devices and keeps each of them armed for
+ * reading. Every swipe is published once into a shared-memory ring
+ * (see msr_shm_create()) that any number of local subscribers can map
+ * read-only, so adding subscribers adds no serial traffic.
+ *
+ * Clients talk to msrd over a Unix stream socket, one command per line:
+ *
+ *   SUB                              receive the ring's memfd
+ *   ERASE <dev> <tracks>             msr_erase() on the next swipe
+ *   WRITE <dev> <tk1> <tk2> <tk3>    msr_iso_write(), "-" for no data
+ *   RAWWRITE <dev> <hex> <hex> <hex> msr_raw_write(), "-" for no data
+ *
+ * Each command is answered with "OK ..." or "ERR <code>".
+ *
+ * Since clients can write and erase cards, the socket is made 0660 and
+ * only peers running as msrd's user or group, or as root, are served.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+#define MSRD_SOCKET "/run/msrd.sock"
+#define MSRD_LINE 1024
+
+enum { JOB_ERASE, JOB_ISO_WRITE, JOB_RAW_WRITE };
+
+struct job {
+	int type;
+	uint8_t tracks_mask;
+	msr_tracks_t tracks;
+	int result;
+	int done;
+	struct job *next;
+};
+
+struct dev {
+	char *path;
+	int fd;
+	uint32_t idx;
+	int wake[2];
+	pthread_t thr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *head, *tail;
+};
+
+static struct dev *devs;
+static uint32_t ndevs;
+static int raw_mode;
+
+static msr_shm_t ring;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage (void)
+{
+	fprintf (stderr, "usage: msrd [-r] [-n slots] [-s socket] device...\n");
+	exit (1);
+}
+
+static int run_job (struct dev *d, struct job *j)
+{
+	switch (j->type) {
+	case JOB_ERASE:
+		return msr_erase (d->fd, j->tracks_mask);
+	case JOB_ISO_WRITE:
+		return msr_iso_write (d->fd, &j->tracks);
+	case JOB_RAW_WRITE:
+		return msr_raw_write (d->fd, &j->tracks);
+	}
+
+	return LIBMSR_ERR_GENERIC;
+}
+
+static void run_jobs (struct dev *d)
+{
+	struct job *j;
+
+	pthread_mutex_lock (&d->lock);
+	while ((j = d->head) != NULL) {
+		d->head = j->next;
+		if (d->head == NULL)
+			d->tail = NULL;
+		pthread_mutex_unlock (&d->lock);
+
+		j->result = run_job (d, j);
+
+		pthread_mutex_lock (&d->lock);
+		j->done = 1;
+		pthread_cond_broadcast (&d->cond);
+	}
+	pthread_mutex_unlock (&d->lock);
+}
+
+static void *dev_thread (void *arg)
+{
+	struct dev *d = arg;
+	struct pollfd pfd[2];
+	msr_tracks_t tracks;
+	char c;
+	int i, r;
+
+	pfd[0].fd = d->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = d->wake[0];
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		run_jobs (d);
+
+		r = raw_mode ? msr_raw_read_arm (d->fd) : msr_iso_read_arm (d->fd);
+		if (r != LIBMSR_ERR_OK)
+			errx (1, "%s: failed to arm read", d->path);
+
+		if (poll (pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err (1, "poll");
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			memset (&tracks, 0, sizeof(tracks));
+			for (i = 0; i < MSR_MAX_TRACKS; i++)
+				tracks.msr_tracks[i].msr_tk_len = MSR_MAX_TRACK_LEN;
+			r = raw_mode ? msr_raw_read_collect (d->fd, &tracks)
+				: msr_iso_read_collect (d->fd, &tracks);
+
+			pthread_mutex_lock (&ring_lock);
+			msr_shm_publish (&ring, d->idx, r, &tracks);
+			pthread_mutex_unlock (&ring_lock);
+		} else if (pfd[1].revents & POLLIN) {
+			while (read (d->wake[0], &c, 1) == 1)
+				;
+
+			/* Cancel the pending read before running jobs. */
+			msr_reset (d->fd);
+			tcflush (d->fd, TCIFLUSH);
+		}
+	}
+
+	return NULL;
+}
+
+static int submit (struct dev *d, struct job *j)
+{
+	j->done = 0;
+	j->next = NULL;
+
+	pthread_mutex_lock (&d->lock);
+	if (d->tail)
+		d->tail->next = j;
+	else
+		d->head = j;
+	d->tail = j;
+
+	if (write (d->wake[1], "", 1) == -1 && errno != EAGAIN)
+		warn ("%s: wake", d->path);
+
+	while (!j->done)
+		pthread_cond_wait (&d->cond, &d->lock);
+	pthread_mutex_unlock (&d->lock);
+
+	return j->result;
+}
+
+/* Parse a whole number no greater than max, returning -1 if it isn't one. */
+static int unnum (const char *s, int base, unsigned long max,
+	unsigned long *v)
+{
+	char *end;
+
+	if (*s < '0' || *s > '9')
+		return -1;
+
+	errno = 0;
+	*v = strtoul (s, &end, base);
+	if (errno != 0 || *end != '\0' || *v > max)
+		return -1;
+
+	return 0;
+}
+
+static int unhex (const char *s, msr_track_t *t)
+{
+	size_t i, n;
+	unsigned int b;
+
+	t->msr_tk_len = 0;
+	if (!strcmp (s, "-"))
+		return 0;
+
+	n = strlen (s);
+	if (n % 2 || n / 2 > MSR_MAX_TRACK_LEN)
+		return -1;
+
+	for (i = 0; i < n / 2; i++) {
+		if (sscanf (s + 2 * i, "%2x", &b) != 1)
+			return -1;
+		t->msr_tk_data[i] = b;
+	}
+	t->msr_tk_len = n / 2;
+
+	return 0;
+}
+
+static int untext (const char *s, msr_track_t *t)
+{
+	size_t n;
+
+	t->msr_tk_len = 0;
+	if (!strcmp (s, "-"))
+		return 0;
+
+	if ((n = strlen (s)) > MSR_MAX_TRACK_LEN)
+		return -1;
+
+	memcpy (t->msr_tk_data, s, n);
+	t->msr_tk_len = n;
+
+	return 0;
+}
+
+static void reply (int sock, const char *fmt, int v)
+{
+	char buf[64];
+	int n;
+
+	n = snprintf (buf, sizeof(buf), fmt, v);
+	if (send (sock, buf, n, MSG_NOSIGNAL) == -1)
+		warn ("reply");
+}
+
+static void handle (int sock, char *line)
+{
+	char *argv[5], *save = NULL;
+	struct job j;
+	unsigned long dev, mask;
+	int argc, i, r;
+	char buf[32];
+
+	for (argc = 0; argc < 5; argc++)
+		if ((argv[argc] = strtok_r (argc ? NULL : line, " \t\r",
+		    &save)) == NULL)
+			break;
+
+	if (argc == 0)
+		return;
+
+	if (!strcmp (argv[0], "SUB") && argc == 1) {
+		r = snprintf (buf, sizeof(buf), "OK %u\n", ndevs);
+		if (msr_shm_send_fd (sock, ring.msr_shm_fd, buf, r)
+		    != LIBMSR_ERR_OK)
+			warnx ("failed to pass ring");
+		return;
+	}
+
+	if (argc < 3 || ndevs == 0 || unnum (argv[1], 10, ndevs - 1, &dev)) {
+		reply (sock, "ERR %d\n", LIBMSR_ERR_GENERIC);
+		return;
+	}
+
+	memset (&j, 0, sizeof(j));
+
+	if (!strcmp (argv[0], "ERASE") && argc == 3) {
+		j.type = JOB_ERASE;
+		if (unnum (argv[2], 0, MSR_ERASE_ALL, &mask))
+			goto bad;
+		j.tracks_mask = mask;
+	} else if (!strcmp (argv[0], "WRITE") && argc == 5) {
+		j.type = JOB_ISO_WRITE;
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			if (untext (argv[i + 2], &j.tracks.msr_tracks[i]))
+				goto bad;
+	} else if (!strcmp (argv[0], "RAWWRITE") && argc == 5) {
+		j.type = JOB_RAW_WRITE;
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			if (unhex (argv[i + 2], &j.tracks.msr_tracks[i]))
+				goto bad;
+	} else
+		goto bad;
+
+	r = submit (&devs[dev], &j);
+	if (r == LIBMSR_ERR_OK)
+		reply (sock, "OK\n", 0);
+	else
+		reply (sock, "ERR %d\n", r);
+
+	return;
+
+bad:
+	reply (sock, "ERR %d\n", LIBMSR_ERR_GENERIC);
+}
+
+static void *client_thread (void *arg)
+{
+	int sock = (int) (intptr_t) arg;
+	char buf[MSRD_LINE], *nl;
+	size_t len = 0;
+	ssize_t r;
+
+	while ((r = read (sock, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += r;
+		buf[len] = '\0';
+
+		while ((nl = strchr (buf, '\n')) != NULL) {
+			*nl = '\0';
+			handle (sock, buf);
+			len -= nl + 1 - buf;
+			memmove (buf, nl + 1, len + 1);
+		}
+
+		/* Drop overlong lines. */
+		if (len == sizeof(buf) - 1)
+			len = 0;
+	}
+
+	close (sock);
+
+	return NULL;
+}
+
+/*
+ * Clear the way for our socket. Whatever is at the path is only
+ * removed if it is a socket of ours, presumably left by an earlier run.
+ */
+static void unlink_stale (const char *path)
+{
+	struct stat st;
+
+	if (lstat (path, &st) == -1) {
+		if (errno == ENOENT)
+			return;
+		err (1, "%s", path);
+	}
+
+	if (!S_ISSOCK (st.st_mode) || st.st_uid != geteuid ())
+		errx (1, "%s: exists and is not our socket", path);
+
+	if (unlink (path) == -1)
+		err (1, "unlink %s", path);
+}
+
+/* Whether the peer on a client socket may use us. */
+static int allowed (int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt (sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return 0;
+
+	return cred.uid == 0 || cred.uid == geteuid ()
+		|| cred.gid == getegid ();
+}
+
+int main (int argc, char **argv)
+{
+	struct sockaddr_un sun;
+	const char *sockpath = MSRD_SOCKET;
+	uint32_t nslots = MSR_SHM_SLOTS;
+	pthread_attr_t attr;
+	pthread_t thr;
+	uint32_t i;
+	int c, lsock, sock;
+
+	while ((c = getopt (argc, argv, "rn:s:")) != -1) {
+		switch (c) {
+		case 'r':
+			raw_mode = 1;
+			break;
+		case 'n':
+			nslots = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			sockpath = optarg;
+			break;
+		default:
+			usage ();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage ();
+
+	signal (SIGPIPE, SIG_IGN);
+
+	if (msr_shm_create (nslots, &ring) != LIBMSR_ERR_OK)
+		err (1, "failed to create swipe ring");
+
+	ndevs = argc;
+	if ((devs = calloc (ndevs, sizeof(*devs))) == NULL)
+		err (1, "calloc");
+
+	for (i = 0; i < ndevs; i++) {
+		struct dev *d = &devs[i];
+
+		d->path = argv[i];
+		d->idx = i;
+
+		if (msr_serial_open (d->path, &d->fd, MSR_BLOCKING, MSR_BAUD)
+		    != LIBMSR_ERR_OK)
+			errx (1, "%s: failed to open", d->path);
+
+		if (msr_init (d->fd) != LIBMSR_ERR_OK)
+			errx (1, "%s: failed to initialize", d->path);
+
+		if (pipe2 (d->wake, O_CLOEXEC | O_NONBLOCK) == -1)
+			err (1, "pipe2");
+
+		pthread_mutex_init (&d->lock, NULL);
+		pthread_cond_init (&d->cond, NULL);
+	}
+
+	for (i = 0; i < ndevs; i++)
+		if (pthread_create (&devs[i].thr, NULL, dev_thread, &devs[i]))
+			errx (1, "failed to start device thread");
+
+	if ((lsock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		err (1, "socket");
+
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen (sockpath) >= sizeof(sun.sun_path))
+		errx (1, "socket path too long");
+	strcpy (sun.sun_path, sockpath);
+
+	/* Bind with no access for others, rather than fixing it after. */
+	unlink_stale (sockpath);
+	umask (0117);
+	if (bind (lsock, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+		err (1, "bind %s", sockpath);
+	if (chmod (sockpath, 0660) == -1)
+		err (1, "chmod %s", sockpath);
+	if (listen (lsock, 16) == -1)
+		err (1, "listen");
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+	while (1) {
+		if ((sock = accept4 (lsock, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err (1, "accept");
+		}
+
+		if (!allowed (sock)) {
+			warnx ("refused a client without access");
+			close (sock);
+			continue;
+		}
+
+		if (pthread_create (&thr, &attr, client_thread,
+		    (void *) (intptr_t) sock)) {
+			warnx ("failed to start client thread");
+			close (sock);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+/*
+ * Shared-memory swipe rings.
+ *
+ * A ring is a sealed memfd holding an msr_shm_hdr_t followed by a
+ * power-of-two number of slots. There is a single publisher, which
+ * writes each swipe once through the mapping it made before sealing
+ * the memfd against writes; subscribers can only map it read-only, and
+ * read the slots in place, so fan-out costs nothing on the serial side.
+ * Each slot is guarded by its own sequence word in the manner of a
+ * seqlock, and the header carries a futex word for wakeups.
+ */
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 /* Linux 5.1 */
+#endif
+
+/* The seals a ring is published under, and that subscribers insist on. */
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE \
+	| F_SEAL_SEAL)
+
+#define SHM_ALIGN 64
+#define SHM_ROUND(x) (((x) + SHM_ALIGN - 1) & ~((size_t) SHM_ALIGN - 1))
+
+static msr_shm_slot_t *shm_slot (msr_shm_hdr_t *hdr, uint64_t seq)
+{
+	uint8_t *base;
+
+	base = (uint8_t *) hdr + SHM_ROUND(sizeof(*hdr));
+
+	return (msr_shm_slot_t *)
+		(base + (seq & (hdr->msr_nslots - 1)) * hdr->msr_slotsize);
+}
+
+static int shm_futex (uint32_t *word, int op, uint32_t val,
+	const struct timespec *timeout)
+{
+	/* Not FUTEX_PRIVATE_FLAG: waiters live in other processes. */
+	return syscall (SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+int msr_shm_create(uint32_t nslots, msr_shm_t *ring)
+{
+	msr_shm_hdr_t *hdr;
+	uint32_t n;
+	size_t len;
+	int fd;
+
+	for (n = 1; n < nslots && n < (1U << 20); n <<= 1)
+		;
+
+	len = SHM_ROUND(sizeof(msr_shm_hdr_t))
+		+ (size_t) n * SHM_ROUND(sizeof(msr_shm_slot_t));
+
+	fd = memfd_create ("libmsr-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+		return LIBMSR_ERR_GENERIC;
+
+	if (ftruncate (fd, len) == -1) {
+		close (fd);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	hdr = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		close (fd);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	/*
+	 * Subscribers can trust the size of a sealed ring, and once our own
+	 * mapping is made, nobody else holding the memfd can write to it.
+	 */
+	if (fcntl (fd, F_ADD_SEALS, SHM_SEALS) == -1) {
+		munmap (hdr, len);
+		close (fd);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	hdr->msr_nslots = n;
+	hdr->msr_slotsize = SHM_ROUND(sizeof(msr_shm_slot_t));
+	hdr->msr_futex = 0;
+	hdr->msr_head = 0;
+	__atomic_store_n (&hdr->msr_magic, MSR_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	ring->msr_shm_fd = fd;
+	ring->msr_shm_len = len;
+	ring->msr_shm_hdr = hdr;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_shm_attach(int memfd, msr_shm_t *ring)
+{
+	msr_shm_hdr_t *hdr;
+	struct stat st;
+	size_t len;
+	int seals;
+
+	/*
+	 * The size can only be trusted if nobody can change it, or a
+	 * shrunk ring would fault under us.
+	 */
+	if ((seals = fcntl (memfd, F_GET_SEALS)) == -1
+	    || (seals & SHM_SEALS) != SHM_SEALS)
+		return LIBMSR_ERR_GENERIC;
+
+	if (fstat (memfd, &st) == -1
+	    || (size_t) st.st_size < sizeof(msr_shm_hdr_t))
+		return LIBMSR_ERR_GENERIC;
+
+	len = st.st_size;
+	hdr = mmap (NULL, len, PROT_READ, MAP_SHARED, memfd, 0);
+	if (hdr == MAP_FAILED)
+		return LIBMSR_ERR_GENERIC;
+
+	if (hdr->msr_magic != MSR_SHM_MAGIC
+	    || hdr->msr_slotsize < sizeof(msr_shm_slot_t)
+	    || hdr->msr_nslots == 0
+	    || (hdr->msr_nslots & (hdr->msr_nslots - 1))
+	    || SHM_ROUND(sizeof(*hdr))
+	       + (size_t) hdr->msr_nslots * hdr->msr_slotsize > len) {
+		munmap (hdr, len);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	ring->msr_shm_fd = memfd;
+	ring->msr_shm_len = len;
+	ring->msr_shm_hdr = hdr;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_shm_close(msr_shm_t *ring)
+{
+	munmap (ring->msr_shm_hdr, ring->msr_shm_len);
+	close (ring->msr_shm_fd);
+
+	ring->msr_shm_hdr = NULL;
+	ring->msr_shm_fd = -1;
+
+	return LIBMSR_ERR_OK;
+}
+
+uint64_t msr_shm_publish(msr_shm_t *ring, uint32_t dev, int status,
+	const msr_tracks_t *tracks)
+{
+	msr_shm_hdr_t *hdr = ring->msr_shm_hdr;
+	msr_shm_slot_t *slot;
+	struct timespec ts;
+	uint64_t seq;
+
+	seq = __atomic_load_n (&hdr->msr_head, __ATOMIC_RELAXED);
+	slot = shm_slot (hdr, seq);
+
+	/* Mark the slot unstable before touching its contents. */
+	__atomic_store_n (&slot->msr_seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	slot->msr_time = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	slot->msr_dev = dev;
+	slot->msr_status = status;
+	memcpy (&slot->msr_tracks, tracks, sizeof(*tracks));
+
+	__atomic_store_n (&slot->msr_seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n (&hdr->msr_head, seq + 1, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch (&hdr->msr_futex, 1, __ATOMIC_RELEASE);
+	shm_futex (&hdr->msr_futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	return seq;
+}
+
+uint64_t msr_shm_head(msr_shm_t *ring)
+{
+	return __atomic_load_n (&ring->msr_shm_hdr->msr_head, __ATOMIC_ACQUIRE);
+}
+
+int msr_shm_wait(msr_shm_t *ring, uint64_t seq, int timeout)
+{
+	msr_shm_hdr_t *hdr = ring->msr_shm_hdr;
+	struct timespec ts, *tsp = NULL;
+	uint32_t f;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+
+	while (1) {
+		f = __atomic_load_n (&hdr->msr_futex, __ATOMIC_ACQUIRE);
+
+		if (msr_shm_head (ring) > seq)
+			return LIBMSR_ERR_OK;
+
+		if (shm_futex (&hdr->msr_futex, FUTEX_WAIT, f, tsp) == -1
+		    && errno == ETIMEDOUT)
+			break;
+	}
+
+	return msr_shm_head (ring) > seq ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+}
+
+const msr_shm_slot_t *msr_shm_peek(msr_shm_t *ring, uint64_t seq)
+{
+	const msr_shm_slot_t *slot;
+
+	if (seq >= msr_shm_head (ring))
+		return NULL;
+
+	slot = shm_slot (ring->msr_shm_hdr, seq);
+
+	if (__atomic_load_n (&slot->msr_seq, __ATOMIC_ACQUIRE) != seq + 1)
+		return NULL;
+
+	return slot;
+}
+
+int msr_shm_check(const msr_shm_slot_t *slot, uint64_t seq)
+{
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n (&slot->msr_seq, __ATOMIC_RELAXED) != seq + 1)
+		return LIBMSR_ERR_GENERIC;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_shm_read(msr_shm_t *ring, uint64_t seq, msr_shm_slot_t *slot)
+{
+	const msr_shm_slot_t *s;
+
+	if ((s = msr_shm_peek (ring, seq)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	memcpy (slot, s, sizeof(*slot));
+
+	return msr_shm_check (s, seq);
+}
+
+int msr_shm_send_fd(int sock, int memfd, const void *msg, size_t len)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+
+	memset (&mh, 0, sizeof(mh));
+	memset (&ctl, 0, sizeof(ctl));
+
+	iov.iov_base = (void *) msg;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy (CMSG_DATA(cm), &memfd, sizeof(int));
+
+	if (sendmsg (sock, &mh, MSG_NOSIGNAL) == -1)
+		return LIBMSR_ERR_SERIAL;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_shm_recv_fd(int sock, int *memfd, void *msg, size_t *len)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	ssize_t r;
+
+	memset (&mh, 0, sizeof(mh));
+
+	iov.iov_base = msg;
+	iov.iov_len = *len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+
+	if ((r = recvmsg (sock, &mh, MSG_CMSG_CLOEXEC)) <= 0)
+		return LIBMSR_ERR_SERIAL;
+
+	*len = r;
+
+	for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET
+		    && cm->cmsg_type == SCM_RIGHTS) {
+			memcpy (memfd, CMSG_DATA(cm), sizeof(int));
+			return LIBMSR_ERR_OK;
+		}
+	}
+
+	return LIBMSR_ERR_SERIAL;
+}
@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "msr_internal.h"
+
+/*
+ * Session profiles.
+ *
+ * A profile is the set of device settings a kind of job needs. Applying
+ * one sends only the settings the device doesn't already have, as a
+ * single command queue, so they go out in one write and are answered
+ * in one round trip.
+ */
+
+static const msr_profile_t profiles[] = {
+	{ "iso-hico", MSR_CO_HI, 75, { 7, 5, 5 } },
+	{ "iso-loco", MSR_CO_LO, 75, { 7, 5, 5 } },
+	{ "aamva", MSR_CO_HI, 75, { 7, 5, 7 } },
+};
+
+#define NPROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/* One queued command per setting. */
+#define PROFILE_OPS 3
+
+const msr_profile_t *msr_profile_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < NPROFILES; i++)
+		if (strcmp (profiles[i].msr_name, name) == 0)
+			return &profiles[i];
+
+	return NULL;
+}
+
+static int valid (const msr_profile_t *p)
+{
+	int i, n = 0;
+
+	if (p->msr_co != 0 && p->msr_co != MSR_CO_HI && p->msr_co != MSR_CO_LO)
+		return 0;
+
+	if (p->msr_bpi != 0 && p->msr_bpi != 75 && p->msr_bpi != 210)
+		return 0;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		if (p->msr_bpc[i] == 0)
+			continue;
+		if (p->msr_bpc[i] < 5 || p->msr_bpc[i] > 8)
+			return 0;
+		n++;
+	}
+
+	/* The BPCs are set together, so either all or none are given. */
+	return n == 0 || n == MSR_MAX_TRACKS;
+}
+
+int msr_profile_apply(int fd, const msr_profile_t *p)
+{
+	MSR_LOCKED(fd);
+	msr_cmdq_op_t ops[PROFILE_OPS];
+	struct msr_settings *set, none;
+	msr_cmdq_t q;
+
+	if (!valid (p))
+		return LIBMSR_ERR_GENERIC;
+
+	if ((set = msr_settings (fd)) == NULL) {
+		memset (&none, 0, sizeof(none));
+		set = &none;
+	}
+
+	/* The queue never grows past this, so it needs no allocation. */
+	q.msr_ops = ops;
+	q.msr_nops = 0;
+	q.msr_cap = PROFILE_OPS;
+
+	if (p->msr_co != 0 && p->msr_co != set->co) {
+		if (p->msr_co == MSR_CO_HI)
+			msr_cmdq_set_hi_co (&q);
+		else
+			msr_cmdq_set_lo_co (&q);
+	}
+
+	if (p->msr_bpi != 0 && p->msr_bpi != set->bpi)
+		msr_cmdq_set_bpi (&q, p->msr_bpi);
+
+	if (p->msr_bpc[0] != 0
+	    && memcmp (p->msr_bpc, set->bpc, sizeof(set->bpc)) != 0)
+		msr_cmdq_set_bpc (&q, p->msr_bpc[0], p->msr_bpc[1],
+		    p->msr_bpc[2]);
+
+	if (q.msr_nops == 0)
+		return LIBMSR_ERR_OK;
+
+	return msr_cmdq_submit (fd, &q);
+}
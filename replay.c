@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * Session recording and replay.
+ *
+ * A recording is a log of the bytes libmsr wrote to and read from a
+ * device, in the order it saw them. After an 8-byte magic, it is a
+ * series of chunks, each with a header of
+ *
+ *   8 bytes  nanoseconds since the recording started
+ *   1 byte   MSR_IO_RX or MSR_IO_TX
+ *   2 bytes  length of the data that follows
+ *
+ * with all integers little-endian. Consecutive bytes in the same
+ * direction go into one chunk unless more than REC_GAP_NS passes
+ * between them, so the pauses in a session survive.
+ *
+ * A replay serves a recording from its own thread over one end of a
+ * socket pair, and hands out the other end as the device's fd. Bytes
+ * libmsr sends are checked against the recording, and the recorded
+ * answers are sent back either on the recorded schedule or at once.
+ */
+
+#define REC_MAGIC "MSRREC\0\1"
+#define REC_MAGIC_LEN 8
+#define REC_HDR_LEN 11
+#define REC_CHUNK 512
+#define REC_GAP_NS 1000000L
+
+struct msr_recorder {
+	FILE *f;
+	struct timespec start;
+	uint64_t t; /* when the pending chunk started */
+	uint64_t last; /* when its last byte was added */
+	int dir;
+	size_t len;
+	uint8_t buf[REC_CHUNK];
+};
+
+struct msr_replayer {
+	FILE *f;
+	int sock; /* our end of the socket pair */
+	int mode;
+	int done; /* the whole recording was served */
+	pthread_t thr;
+	msr_replay_stats_t stats;
+};
+
+/* Nanoseconds elapsed since the given CLOCK_MONOTONIC time. */
+static uint64_t since (const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000000ULL
+		+ now.tv_nsec - start->tv_nsec;
+}
+
+static void put_le (uint8_t *p, uint64_t v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, v >>= 8)
+		p[i] = v & 0xFF;
+}
+
+static uint64_t get_le (const uint8_t *p, int n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+
+	return v;
+}
+
+static int rec_flush (struct msr_recorder *rec)
+{
+	uint8_t hdr[REC_HDR_LEN];
+
+	if (rec->len == 0)
+		return 0;
+
+	put_le (hdr, rec->t, 8);
+	hdr[8] = rec->dir;
+	put_le (hdr + 9, rec->len, 2);
+
+	if (fwrite (hdr, 1, sizeof(hdr), rec->f) != sizeof(hdr)
+	    || fwrite (rec->buf, 1, rec->len, rec->f) != rec->len) {
+		rec->len = 0;
+		return -1;
+	}
+
+	rec->len = 0;
+
+	return 0;
+}
+
+void msr_record_io (struct msr_recorder *rec, int dir, const void *buf,
+	size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t now;
+	size_t n;
+
+	if (len == 0)
+		return;
+
+	now = since (&rec->start);
+
+	if (rec->len > 0 && (dir != rec->dir || now - rec->last > REC_GAP_NS))
+		rec_flush (rec);
+
+	while (len > 0) {
+		if (rec->len == 0) {
+			rec->dir = dir;
+			rec->t = now;
+		}
+
+		n = REC_CHUNK - rec->len;
+		if (n > len)
+			n = len;
+
+		memcpy (rec->buf + rec->len, p, n);
+		rec->len += n;
+		p += n;
+		len -= n;
+
+		if (rec->len == REC_CHUNK)
+			rec_flush (rec);
+	}
+
+	rec->last = now;
+}
+
+int msr_record_start (int fd, const char *path)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+	struct msr_recorder *rec;
+
+	if ((ds = msr_devstate (fd)) == NULL || ds->rec != NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((rec = calloc (1, sizeof(*rec))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((rec->f = fopen (path, "wb")) == NULL) {
+		free (rec);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	if (fwrite (REC_MAGIC, 1, REC_MAGIC_LEN, rec->f) != REC_MAGIC_LEN) {
+		fclose (rec->f);
+		free (rec);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &rec->start);
+	ds->rec = rec;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_record_stop (int fd)
+{
+	MSR_LOCKED(fd);
+	struct msr_devstate *ds;
+	struct msr_recorder *rec;
+	int ret = LIBMSR_ERR_OK;
+
+	if ((ds = msr_devstate (fd)) == NULL || (rec = ds->rec) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	ds->rec = NULL;
+
+	if (rec_flush (rec) == -1)
+		ret = LIBMSR_ERR_GENERIC;
+	if (fclose (rec->f) == EOF)
+		ret = LIBMSR_ERR_GENERIC;
+	free (rec);
+
+	return ret;
+}
+
+/*
+ * Read the next chunk of a recording. Returns 1 on success, 0 at the
+ * end of the recording, or -1 if it is malformed.
+ */
+static int next_chunk (FILE *f, uint64_t *t, int *dir, uint8_t *buf,
+	size_t *len)
+{
+	uint8_t hdr[REC_HDR_LEN];
+	size_t n;
+
+	if ((n = fread (hdr, 1, sizeof(hdr), f)) == 0)
+		return 0;
+	if (n != sizeof(hdr))
+		return -1;
+
+	*t = get_le (hdr, 8);
+	*dir = hdr[8];
+	*len = get_le (hdr + 9, 2);
+
+	if ((*dir != MSR_IO_RX && *dir != MSR_IO_TX) || *len > REC_CHUNK
+	    || fread (buf, 1, *len, f) != *len)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Wait for events on our end of the socket pair, for at most timeout
+ * milliseconds. Returns the events, 0 on timeout or -1 on error.
+ */
+static int wait_sock (int sock, short events, int timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = sock;
+	pfd.events = events | POLLRDHUP;
+
+	while ((r = poll (&pfd, 1, timeout)) == -1 && errno == EINTR)
+		;
+
+	return r > 0 ? pfd.revents : r;
+}
+
+/*
+ * Take the bytes libmsr sends in place of a recorded TX chunk, counting
+ * the ones that differ. Returns 1 on success, 0 if libmsr sent too
+ * little in time, or -1 once it has closed its end.
+ */
+static int take_tx (struct msr_replayer *rp, const uint8_t *want, size_t len)
+{
+	uint8_t buf[REC_CHUNK];
+	size_t i, got = 0;
+	ssize_t r;
+	int ev;
+
+	while (got < len) {
+		if ((ev = wait_sock (rp->sock, POLLIN, MSR_REPLAY_TIMEOUT)) <= 0)
+			return ev;
+
+		if ((r = read (rp->sock, buf + got, len - got)) > 0)
+			got += r;
+		else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+			return -1;
+	}
+
+	rp->stats.msr_tx_bytes += len;
+	for (i = 0; i < len; i++)
+		if (buf[i] != want[i])
+			rp->stats.msr_tx_mismatch++;
+
+	return 1;
+}
+
+/* Send a recorded RX chunk. Returns 0 on success, or -1 on error. */
+static int give_rx (struct msr_replayer *rp, const uint8_t *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = send (rp->sock, buf, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		rp->stats.msr_rx_bytes += r;
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * In real time, each answer is sent as long after the command before it
+ * as it was in the recording, however long libmsr took to send that
+ * command. Returns 0 once it is time, or -1 if libmsr went away first.
+ */
+static int wait_until (struct msr_replayer *rp, const struct timespec *base,
+	uint64_t t)
+{
+	uint64_t now;
+	int ev;
+
+	while ((now = since (base)) < t) {
+		ev = wait_sock (rp->sock, 0, (t - now + 999999) / 1000000);
+		if (ev < 0 || (ev & (POLLRDHUP | POLLHUP | POLLERR)))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *replay_thread (void *arg)
+{
+	struct msr_replayer *rp = arg;
+	struct timespec base;
+	uint8_t buf[REC_CHUNK];
+	uint64_t t;
+	size_t len;
+	int dir, r;
+
+	clock_gettime (CLOCK_MONOTONIC, &base);
+
+	while ((r = next_chunk (rp->f, &t, &dir, buf, &len)) == 1) {
+		rp->stats.msr_chunks++;
+
+		if (dir == MSR_IO_TX) {
+			if ((r = take_tx (rp, buf, len)) == -1)
+				break;
+			if (r == 0)
+				rp->stats.msr_desyncs++;
+
+			/* Time the next answer from this command. */
+			clock_gettime (CLOCK_MONOTONIC, &base);
+			base.tv_sec -= t / 1000000000ULL;
+			base.tv_nsec -= t % 1000000000ULL;
+			if (base.tv_nsec < 0) {
+				base.tv_sec--;
+				base.tv_nsec += 1000000000L;
+			}
+			continue;
+		}
+
+		if (rp->mode == MSR_REPLAY_REALTIME
+		    && wait_until (rp, &base, t) == -1)
+			break;
+
+		if (give_rx (rp, buf, len) == -1)
+			break;
+	}
+
+	rp->done = (r == 0);
+
+	/* libmsr reads end-of-file from here on. */
+	shutdown (rp->sock, SHUT_WR);
+
+	return NULL;
+}
+
+int msr_replay_open (const char *path, int mode, int *fd)
+{
+	struct msr_devstate *ds;
+	struct msr_replayer *rp;
+	char magic[REC_MAGIC_LEN];
+	int sv[2];
+
+	if (mode != MSR_REPLAY_REALTIME && mode != MSR_REPLAY_FAST)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((rp = calloc (1, sizeof(*rp))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	rp->mode = mode;
+
+	if ((rp->f = fopen (path, "rb")) == NULL)
+		goto out_free;
+
+	if (fread (magic, 1, sizeof(magic), rp->f) != sizeof(magic)
+	    || memcmp (magic, REC_MAGIC, REC_MAGIC_LEN))
+		goto out_close;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		goto out_close;
+
+	/* Like a port from msr_serial_open(), our end doesn't block. */
+	if ((ds = msr_devstate (sv[0])) == NULL
+	    || fcntl (sv[0], F_SETFL, MSR_BLOCKING) == -1)
+		goto out_sock;
+
+	rp->sock = sv[1];
+
+	if (pthread_create (&rp->thr, NULL, replay_thread, rp))
+		goto out_sock;
+
+	msr_devstate_reset (sv[0]);
+	ds->replay = rp;
+	ds->no_pause = (mode == MSR_REPLAY_FAST);
+	*fd = sv[0];
+
+	return LIBMSR_ERR_OK;
+
+out_sock:
+	close (sv[0]);
+	close (sv[1]);
+out_close:
+	fclose (rp->f);
+out_free:
+	free (rp);
+
+	return LIBMSR_ERR_GENERIC;
+}
+
+int msr_replay_close (int fd, msr_replay_stats_t *stats)
+{
+	struct msr_devstate *ds;
+	struct msr_replayer *rp;
+	int ret;
+
+	if ((ds = msr_devstate (fd)) == NULL || (rp = ds->replay) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if (ds->rec != NULL)
+		msr_record_stop (fd);
+
+	msr_devstate_close (fd);
+
+	pthread_join (rp->thr, NULL);
+	close (rp->sock);
+	fclose (rp->f);
+
+	if (stats != NULL)
+		*stats = rp->stats;
+
+	ret = (rp->done && rp->stats.msr_tx_mismatch == 0
+	    && rp->stats.msr_desyncs == 0) ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+
+	free (rp);
+
+	return ret;
+}
@@ -1,39 +1,161 @@
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/serial.h>
 
+#include <poll.h>
+
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <err.h>
 
-#include "libmsr.h"
+#include "msr_internal.h"
 
 /*
  * Serial I/O routines.
  */
-static int msr_serial_setup (int fd, speed_t baud);
+
+/*
+ * Whether a device has been unplugged, setting errno if so. Nothing is
+ * sent to or read from a device that's gone, so callers fail at once
+ * rather than waiting on a dead fd.
+ */
+static int gone (int fd)
+{
+	struct msr_devstate *ds = msr_devstate (fd);
+
+	if (ds == NULL || !__atomic_load_n (&ds->gone, __ATOMIC_ACQUIRE))
+		return 0;
+
+	errno = ENODEV;
+	return 1;
+}
+
+static void set_gone (int fd)
+{
+	struct msr_devstate *ds = msr_devstate (fd);
+
+	if (ds != NULL)
+		__atomic_store_n (&ds->gone, 1, __ATOMIC_RELEASE);
+}
+
+/* Whether an errno means the device itself has gone away. */
+static int unplugged (int e)
+{
+	return e == EIO || e == ENODEV || e == ENXIO;
+}
+
+static void record (int fd, int dir, const void *buf, size_t len)
+{
+	struct msr_devstate *ds = msr_devstate (fd);
+
+	if (ds != NULL && ds->rec != NULL)
+		msr_record_io (ds->rec, dir, buf, len);
+}
 
 int msr_serial_readchar (int fd, uint8_t * c)
 {
+	MSR_LOCKED(fd);
+	struct pollfd pfd;
 	char b;
 	int	r;
 
-	while ((r = read (fd, &b, 1)) == -1)
-		;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if (gone (fd))
+		return -1;
+
+	/* The fd is non-blocking, so sleep in poll() rather than spin. */
+	while ((r = read (fd, &b, 1)) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN) {
+			if (unplugged (errno))
+				set_gone (fd);
+			return -1;
+		}
+		if (poll (&pfd, 1, -1) == -1 && errno != EINTR)
+			return -1;
+		if (pfd.revents & POLLNVAL) {
+			errno = EBADF;
+			return -1;
+		}
+		/* A hangup with nothing left to read won't clear. */
+		if ((pfd.revents & (POLLERR | POLLHUP)) && gone (fd))
+			return -1;
+	}
+
+	if (r == 0) {
+		/* The other end is gone; there's no errno for that. */
+		set_gone (fd);
+		errno = 0;
+		return 0;
+	}
 
-	if (r != -1) {
-		*c = b;
+	*c = b;
+	record (fd, MSR_IO_RX, &b, r);
 #ifdef DEBUG
-		printf ("[0x%x]\n", b);
+	printf ("[0x%x]\n", b);
 #endif
-	}
 
 	return (r);
 }
 
+int msr_serial_readchar_timeout (int fd, uint8_t * c, int timeout)
+{
+	MSR_LOCKED(fd);
+	struct pollfd pfd;
+	char b;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	if (gone (fd))
+		return -1;
+
+	/*
+	 * Poll before reading: the fd may have been opened blocking, and
+	 * then a read() would wait however long the device stays silent.
+	 */
+	while (1) {
+		r = poll (&pfd, 1, timeout);
+		if (r == 0)
+			return 0;
+		if (r == -1 || (pfd.revents & POLLNVAL))
+			return -1;
+
+		if ((r = read (fd, &b, 1)) == 1)
+			break;
+
+		if (r == 0 || (r == -1 && unplugged (errno))) {
+			set_gone (fd);
+			return -1;
+		}
+
+		if (pfd.revents & (POLLERR | POLLHUP))
+			return -1;
+	}
+
+	*c = b;
+	record (fd, MSR_IO_RX, &b, 1);
+#ifdef DEBUG
+	printf ("[0x%x]\n", b);
+#endif
+
+	return 1;
+}
+
 int msr_serial_read (int fd, void * buf, size_t len)
 {
+	MSR_LOCKED(fd);
 	size_t i;
 	uint8_t b, *p;
 
@@ -43,7 +165,8 @@ int msr_serial_read (int fd, void * buf, size_t len)
 	printf("[RX %.3lu]", len);
 #endif
 	for (i = 0; i < len; i++) {
-		msr_serial_readchar (fd, &b);
+		if (msr_serial_readchar (fd, &b) != 1)
+			return LIBMSR_ERR_SERIAL;
 #ifdef DEBUG
 		printf(" %.2x", b);
 #endif
@@ -58,10 +181,21 @@ int msr_serial_read (int fd, void * buf, size_t len)
 
 int msr_serial_write (int fd, void * buf, size_t len)
 {
-	return (write (fd, buf, len));
+	MSR_LOCKED(fd);
+	ssize_t r;
+
+	if (gone (fd))
+		return -1;
+
+	if ((r = write (fd, buf, len)) > 0)
+		record (fd, MSR_IO_TX, buf, r);
+	else if (r == -1 && unplugged (errno))
+		set_gone (fd);
+
+	return (r);
 }
 
-static int
+int
 msr_serial_setup (int fd, speed_t baud)
 {
     struct termios options;
@@ -127,18 +261,145 @@ int msr_serial_open(char *path, int * fd, int blocking, speed_t baud)
 		return LIBMSR_ERR_SERIAL;
 	}
 
+	/* A device on an fd we keep no state for couldn't be locked. */
+	if (msr_devstate (f) == NULL) {
+		close (f);
+		errno = EMFILE;
+		return LIBMSR_ERR_SERIAL;
+	}
+
 	if (msr_serial_setup (f, baud) != LIBMSR_ERR_OK) {
 		close (f);
 		return LIBMSR_ERR_SERIAL;
 	}
 
+	msr_devstate_reset (f);
 	*fd = f;
 
 	return LIBMSR_ERR_OK;
 }
 
+/*
+ * Latency tuning.
+ *
+ * USB serial adapters hold back short replies until their latency
+ * timer runs out, 16 ms by default on FTDI chips, and the tty layer may
+ * defer handing bytes on. Each setting is tried on its own and checked
+ * afterwards, so the report says what is really in effect.
+ */
+
+/* The sysfs latency timer of the USB adapter behind a tty, if any. */
+static int timer_path (int fd, char *path, size_t len)
+{
+	struct stat st;
+
+	if (fstat (fd, &st) != 0 || !S_ISCHR (st.st_mode))
+		return -1;
+
+	snprintf (path, len, "/sys/dev/char/%u:%u/device/latency_timer",
+		major (st.st_rdev), minor (st.st_rdev));
+
+	return 0;
+}
+
+static int timer_get (const char *path)
+{
+	FILE *fp;
+	int ms;
+
+	if ((fp = fopen (path, "r")) == NULL)
+		return -1;
+	if (fscanf (fp, "%d", &ms) != 1)
+		ms = -1;
+	fclose (fp);
+
+	return ms;
+}
+
+static void timer_set (const char *path, int ms)
+{
+	FILE *fp;
+
+	if ((fp = fopen (path, "w")) == NULL)
+		return;
+	fprintf (fp, "%d\n", ms);
+	fclose (fp);
+}
+
+int msr_serial_latency(int fd, int want, msr_latency_t *lat)
+{
+	MSR_LOCKED(fd);
+	struct serial_struct ss;
+	struct termios t;
+	char path[64];
+	int have = 0;
+
+	lat->msr_timer_was = lat->msr_timer = -1;
+
+	/* Hand on each byte as soon as it arrives, without waiting. */
+	if ((want & MSR_LATENCY_TERMIOS) && tcgetattr (fd, &t) == 0) {
+		t.c_cc[VMIN] = 1;
+		t.c_cc[VTIME] = 0;
+		if (tcsetattr (fd, TCSANOW, &t) == 0 && tcgetattr (fd, &t) == 0
+		    && t.c_cc[VMIN] == 1 && t.c_cc[VTIME] == 0)
+			have |= MSR_LATENCY_TERMIOS;
+	}
+
+	if (timer_path (fd, path, sizeof(path)) == 0)
+		lat->msr_timer_was = timer_get (path);
+
+	/* Some drivers, ftdi_sio among them, also drop their timer here. */
+	if ((want & MSR_LATENCY_ASYNC) && ioctl (fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl (fd, TIOCSSERIAL, &ss) == 0
+		    && ioctl (fd, TIOCGSERIAL, &ss) == 0
+		    && (ss.flags & ASYNC_LOW_LATENCY))
+			have |= MSR_LATENCY_ASYNC;
+	}
+
+	if (lat->msr_timer_was >= 0) {
+		if ((want & MSR_LATENCY_TIMER)
+		    && timer_get (path) > MSR_LATENCY_TIMER_MS)
+			timer_set (path, MSR_LATENCY_TIMER_MS);
+		lat->msr_timer = timer_get (path);
+		if ((want & MSR_LATENCY_TIMER) && lat->msr_timer >= 0
+		    && lat->msr_timer <= MSR_LATENCY_TIMER_MS)
+			have |= MSR_LATENCY_TIMER;
+	}
+
+	lat->msr_applied = have;
+
+	return have == want ? LIBMSR_ERR_OK : LIBMSR_ERR_SERIAL;
+}
+
+int msr_serial_open_latency(char *path, int *fd, int blocking, speed_t baud,
+	int want, msr_latency_t *lat)
+{
+	struct msr_devstate *ds;
+	msr_latency_t ignored;
+	int r;
+
+	if ((r = msr_serial_open (path, fd, blocking, baud)) != LIBMSR_ERR_OK)
+		return r;
+
+	if ((ds = msr_devstate (*fd)) != NULL)
+		ds->latency = want;
+
+	msr_serial_latency (*fd, want, lat != NULL ? lat : &ignored);
+
+	return LIBMSR_ERR_OK;
+}
+
 int msr_serial_close(int fd)
 {
-	close (fd);
+	struct msr_devstate *ds = msr_devstate (fd);
+
+	if (ds != NULL && ds->replay != NULL)
+		return msr_replay_close (fd, NULL);
+
+	if (ds != NULL && ds->rec != NULL)
+		msr_record_stop (fd);
+
+	msr_devstate_close (fd);
 	return LIBMSR_ERR_OK;
 }
@@ -0,0 +1,933 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msr_internal.h"
+
+/*
+ * io_uring backend.
+ *
+ * For hosts with many readers, a ring keeps a read posted on every
+ * device and turns the protocol around without a system call per
+ * event. Reads are multishot where the kernel has them, drawing on a
+ * pool of buffers shared by all devices, so a quiet device costs
+ * nothing. Each completion's bytes are appended to its device's input,
+ * which is parsed again from the start until a whole response is there;
+ * responses are short, so that is cheaper than keeping parser state.
+ * A finished read or write is reported as an event and the device is
+ * re-armed, all in the next submission. If an LED change is queued, it
+ * goes out in place of the re-arm, which msr_uring_wait() holds back
+ * until the device's pause after the change is over, so the pause runs
+ * while the host handles the events. Writes are sent as a linked chain
+ * of a reset, a pause for the device and the write frame.
+ *
+ * A ring is driven by a single thread, and the devices on it must not
+ * be used through the rest of libmsr until they are removed.
+ */
+
+#ifndef MSR_NO_URING
+
+#include <linux/io_uring.h>
+
+/* Not in older kernel headers. */
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_BUFS 256 /* buffers in the shared pool, a power of two */
+#define URING_BUFSZ 256
+#define URING_BGID 0
+#define URING_INBUF 1024 /* enough for any response */
+#define URING_TXBUF 1024 /* enough for any write frame */
+
+/* Returned by the parsers while a response is incomplete. */
+#define MORE -1
+
+/* What a completion is for, in the low byte of its user_data. */
+enum {
+	OP_READ = 1, OP_ARM, OP_RESET, OP_DELAY, OP_FRAME, OP_CANCEL, OP_LED
+};
+
+struct slot {
+	int fd; /* -1 if the slot is free */
+	int mode; /* MSR_URING_ISO or MSR_URING_RAW */
+	int type; /* event expected next, MSR_URING_EV_* */
+	int pending; /* operations in flight */
+	int reading; /* a read is posted */
+	int removed; /* waiting for pending operations to drain */
+	int dead; /* the device failed, and is left alone */
+	int flushing; /* discarding input until a reset has taken */
+	int held; /* the arm waits for the pause after an LED change */
+	size_t inlen;
+	uint8_t in[URING_INBUF];
+	uint8_t arm[4];
+	size_t armlen;
+	uint8_t reset[2];
+	uint8_t led[2];
+	struct __kernel_timespec delay;
+	size_t txlen;
+	uint8_t tx[URING_TXBUF];
+	msr_tracks_t tracks;
+};
+
+struct msr_uring {
+	int fd;
+	int multishot;
+
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned sq_entries, sqt, to_submit;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned short br_tail;
+	uint8_t *bufs;
+
+	struct slot **slots;
+	size_t nslots;
+};
+
+static uint64_t user_data (size_t idx, int op)
+{
+	return (uint64_t) idx << 8 | op;
+}
+
+static int enter (msr_uring_t *ru, unsigned wait, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	void *argp = NULL;
+	size_t argsz = 0;
+	int r;
+
+	__atomic_store_n (ru->sq_tail, ru->sqt, __ATOMIC_RELEASE);
+
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			memset (&arg, 0, sizeof(arg));
+			arg.ts = (uintptr_t) &ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof(arg);
+		}
+	}
+
+	r = syscall (__NR_io_uring_enter, ru->fd, ru->to_submit, wait, flags,
+	    argp, argsz);
+	if (r > 0)
+		ru->to_submit -= r;
+
+	return r;
+}
+
+static struct io_uring_sqe *get_sqe (msr_uring_t *ru)
+{
+	struct io_uring_sqe *sqe;
+
+	/* If the queue is full, push what's in it to the kernel. */
+	if (ru->sqt - __atomic_load_n (ru->sq_head, __ATOMIC_ACQUIRE)
+	    == ru->sq_entries) {
+		enter (ru, 0, -1);
+		if (ru->sqt - __atomic_load_n (ru->sq_head, __ATOMIC_ACQUIRE)
+		    == ru->sq_entries)
+			return NULL;
+	}
+
+	sqe = &ru->sqes[ru->sqt & *ru->sq_mask];
+	memset (sqe, 0, sizeof(*sqe));
+	ru->sqt++;
+	ru->to_submit++;
+
+	return sqe;
+}
+
+static void give_buf (msr_uring_t *ru, unsigned bid)
+{
+	struct io_uring_buf *b;
+
+	b = &ru->br->bufs[ru->br_tail++ & (URING_BUFS - 1)];
+	b->addr = (uintptr_t) (ru->bufs + (size_t) bid * URING_BUFSZ);
+	b->len = URING_BUFSZ;
+	b->bid = bid;
+}
+
+static void publish_bufs (msr_uring_t *ru)
+{
+	__atomic_store_n (&ru->br->tail, ru->br_tail, __ATOMIC_RELEASE);
+}
+
+static int post_read (msr_uring_t *ru, size_t idx)
+{
+	struct slot *s = ru->slots[idx];
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe (ru)) == NULL)
+		return -1;
+
+	sqe->opcode = ru->multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = s->fd;
+	sqe->off = (uint64_t) -1;
+	sqe->len = ru->multishot ? 0 : URING_BUFSZ;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = user_data (idx, OP_READ);
+
+	s->reading = 1;
+	s->pending++;
+
+	return 0;
+}
+
+static int post_write (msr_uring_t *ru, size_t idx, int op, const void *buf,
+	size_t len, int link)
+{
+	struct slot *s = ru->slots[idx];
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe (ru)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = s->fd;
+	sqe->off = (uint64_t) -1;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = user_data (idx, op);
+
+	s->pending++;
+
+	return 0;
+}
+
+/*
+ * Give the device the fixed pause for a command with no response
+ * before whatever is linked after this.
+ */
+static int post_pause (msr_uring_t *ru, size_t idx, int op)
+{
+	struct slot *s = ru->slots[idx];
+	struct msr_devstate *ds = msr_devstate (s->fd);
+	struct io_uring_sqe *sqe;
+
+	s->delay.tv_sec = 0;
+	s->delay.tv_nsec = ds != NULL && ds->no_pause ? 0 : MSR_READY_FIXED_NS;
+
+	if ((sqe = get_sqe (ru)) == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) &s->delay;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ETIME_SUCCESS;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = user_data (idx, op);
+	s->pending++;
+
+	return 0;
+}
+
+/*
+ * Reset the device, then give it time to recover before whatever is
+ * linked after this, as msr_reset() does.
+ */
+static int post_reset (msr_uring_t *ru, size_t idx)
+{
+	struct slot *s = ru->slots[idx];
+	struct msr_devstate *ds = msr_devstate (s->fd);
+
+	s->reset[0] = MSR_ESC;
+	s->reset[1] = MSR_CMD_RESET;
+
+	if (ds != NULL) {
+		ds->led_applied = 0;
+		memset (&ds->settings, 0, sizeof(ds->settings));
+	}
+
+	/* Anything that arrives before the pause is over is stale. */
+	s->flushing = 1;
+
+	if (post_write (ru, idx, OP_RESET, s->reset, 2, 1) == -1)
+		return -1;
+
+	return post_pause (ru, idx, OP_DELAY);
+}
+
+/*
+ * Arm the device for a read. An LED change queued for it goes out
+ * instead, and the arm is held back for release() to send. While a
+ * reset is under way, the change is left for the next time.
+ */
+static int arm (msr_uring_t *ru, size_t idx)
+{
+	struct slot *s = ru->slots[idx];
+	uint8_t led;
+
+	s->armlen = 0;
+	s->arm[s->armlen++] = MSR_ESC;
+	s->arm[s->armlen++] = s->mode == MSR_URING_RAW ?
+		MSR_CMD_RAW_READ : MSR_CMD_READ;
+
+	s->type = MSR_URING_EV_READ;
+	s->inlen = 0;
+
+	if (!s->flushing && (led = msr_led_take (s->fd)) != 0) {
+		s->led[0] = MSR_ESC;
+		s->led[1] = led;
+		if (post_write (ru, idx, OP_LED, s->led, 2, 0) == -1)
+			return -1;
+		msr_led_note (s->fd);
+		s->held = 1;
+		return 0;
+	}
+
+	return post_write (ru, idx, OP_ARM, s->arm, s->armlen, 0);
+}
+
+/*
+ * Send the arms held back after LED changes whose pause is over. The
+ * rest wait for a later call, and the milliseconds until the first of
+ * them is due are returned, or -1 if there are none.
+ */
+static int release (msr_uring_t *ru)
+{
+	struct slot *s;
+	int due = -1, ms;
+	long left;
+	size_t i;
+
+	for (i = 0; i < ru->nslots; i++) {
+		s = ru->slots[i];
+		if (s->fd == -1 || !s->held || s->dead || s->removed)
+			continue;
+
+		if ((left = msr_led_left (s->fd)) > 0) {
+			ms = (left + 999999) / 1000000;
+			if (due == -1 || ms < due)
+				due = ms;
+			continue;
+		}
+
+		s->held = 0;
+		post_write (ru, i, OP_ARM, s->arm, s->armlen, 0);
+	}
+
+	return due;
+}
+
+static void record (struct slot *s, int dir, const void *buf, size_t len)
+{
+	struct msr_devstate *ds = msr_devstate (s->fd);
+
+	if (ds != NULL && ds->rec != NULL)
+		msr_record_io (ds->rec, dir, buf, len);
+}
+
+/*
+ * Parse a read response, as msr_iso_read_collect() and
+ * msr_raw_read_collect() do, from what has arrived of it so far.
+ */
+static int parse_read (struct slot *s)
+{
+	const uint8_t *in = s->in;
+	size_t len = s->inlen, pos = 0, n;
+	msr_track_t *tk;
+	uint8_t b;
+	int i, t;
+
+	/* As in getstart(), look for the start a few bytes in. */
+	for (i = 0; ; i++) {
+		if (pos == len)
+			return MORE;
+		if (in[pos++] == MSR_RW_START)
+			break;
+		if (i == 2)
+			return msr_fail (s->fd, LIBMSR_ERR_FRAMING,
+			    MSR_PHASE_START, in[pos - 1], 0);
+	}
+
+	for (t = 1; t <= MSR_MAX_TRACKS; t++) {
+		tk = &s->tracks.msr_tracks[t - 1];
+		tk->msr_tk_len = 0;
+
+		if (len - pos < 2)
+			return MORE;
+		if (in[pos] != MSR_ESC || in[pos + 1] != t)
+			return msr_fail (s->fd, LIBMSR_ERR_FRAMING,
+			    MSR_PHASE_DATA, in[pos] != MSR_ESC ? in[pos]
+			    : in[pos + 1], t);
+		pos += 2;
+
+		if (s->mode == MSR_URING_RAW) {
+			if (pos == len)
+				return MORE;
+			n = in[pos++];
+			if (len - pos < n)
+				return MORE;
+			memcpy (tk->msr_tk_data, in + pos, n);
+			tk->msr_tk_len = n;
+			pos += n;
+			continue;
+		}
+
+		while (1) {
+			if (pos == len)
+				return MORE;
+			b = in[pos++];
+			if (b == '%' || b == ';')
+				continue;
+			if (b == MSR_RW_END)
+				break;
+			if (b == MSR_ESC) {
+				/* A track the device couldn't decode. */
+				if (pos++ == len)
+					return MORE;
+				tk->msr_tk_len = 0;
+				break;
+			}
+			if (tk->msr_tk_len < MSR_MAX_TRACK_LEN)
+				tk->msr_tk_data[tk->msr_tk_len++] = b;
+		}
+	}
+
+	if (len - pos < sizeof(msr_end_t))
+		return MORE;
+	if (in[pos + 2] != MSR_ESC)
+		return msr_fail (s->fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    in[pos + 2], 0);
+	if (in[pos + 3] != MSR_STS_OK)
+		return msr_fail (s->fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    in[pos + 3], 0);
+
+	return LIBMSR_ERR_OK;
+}
+
+static int parse_status (struct slot *s)
+{
+	if (s->inlen < 2)
+		return MORE;
+	if (s->in[0] != MSR_ESC)
+		return msr_fail (s->fd, LIBMSR_ERR_FRAMING, MSR_PHASE_STATUS,
+		    s->in[0], 0);
+	if (s->in[1] != MSR_STS_OK)
+		return msr_fail (s->fd, LIBMSR_ERR_DEVICE, MSR_PHASE_STATUS,
+		    s->in[1], 0);
+
+	return LIBMSR_ERR_OK;
+}
+
+static void event (struct slot *s, int r, msr_uring_event_t *ev)
+{
+	ev->msr_fd = s->fd;
+	ev->msr_type = s->type;
+	ev->msr_result = r;
+	ev->msr_tracks = s->type == MSR_URING_EV_READ ? &s->tracks : NULL;
+}
+
+/* Give up on a device whose I/O failed. */
+static int fail (struct slot *s, int err, msr_uring_event_t *ev)
+{
+	if (s->dead || s->removed)
+		return 0;
+
+	s->dead = 1;
+	errno = err;
+	event (s, msr_fail (s->fd, LIBMSR_ERR_SERIAL, MSR_PHASE_COMMAND,
+	    0, 0), ev);
+
+	return 1;
+}
+
+/* Take in bytes from the device, returning 1 if a response is done. */
+static int input (msr_uring_t *ru, size_t idx, const uint8_t *buf,
+	size_t len, msr_uring_event_t *ev)
+{
+	struct slot *s = ru->slots[idx];
+	int r;
+
+	if (s->dead || s->removed)
+		return 0;
+
+	record (s, MSR_IO_RX, buf, len);
+
+	if (s->flushing)
+		return 0;
+
+	if (len > sizeof(s->in) - s->inlen) {
+		r = msr_fail (s->fd, LIBMSR_ERR_FRAMING, MSR_PHASE_DATA, 0, 0);
+	} else {
+		memcpy (s->in + s->inlen, buf, len);
+		s->inlen += len;
+		r = s->type == MSR_URING_EV_READ ? parse_read (s)
+			: parse_status (s);
+		if (r == MORE)
+			return 0;
+	}
+
+	event (s, r, ev);
+
+	/*
+	 * Re-arm for the next swipe. After a framing error we can't tell
+	 * where the device is in its response, so reset it first.
+	 */
+	if (r == LIBMSR_ERR_FRAMING)
+		post_reset (ru, idx);
+	arm (ru, idx);
+
+	return 1;
+}
+
+/*
+ * Send a write again. Without deferred task running, the kernel runs
+ * io_uring's work in a way tty writes take for a signal, so they can
+ * fail with EINTR having written nothing. What was linked after a
+ * reset was cancelled along with it, so that goes again too.
+ */
+static void resend (msr_uring_t *ru, size_t idx, int op)
+{
+	struct slot *s = ru->slots[idx];
+
+	if (op == OP_LED) {
+		post_write (ru, idx, OP_LED, s->led, 2, 0);
+		return;
+	}
+
+	if (op == OP_RESET && post_reset (ru, idx) == -1)
+		return;
+
+	if (op == OP_FRAME || (op == OP_RESET && s->type == MSR_URING_EV_WRITE))
+		post_write (ru, idx, OP_FRAME, s->tx, s->txlen, 0);
+	else
+		post_write (ru, idx, OP_ARM, s->arm, s->armlen, 0);
+}
+
+static int complete (msr_uring_t *ru, const struct io_uring_cqe *cqe,
+	msr_uring_event_t *ev)
+{
+	size_t idx = cqe->user_data >> 8;
+	int op = cqe->user_data & 0xff;
+	struct slot *s;
+	unsigned bid;
+	int r = 0;
+
+	if (idx >= ru->nslots || (s = ru->slots[idx]) == NULL)
+		return 0;
+
+	switch (op) {
+	case OP_READ:
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			s->reading = 0;
+			s->pending--;
+		}
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> 16;
+			if (cqe->res > 0)
+				r = input (ru, idx, ru->bufs
+				    + (size_t) bid * URING_BUFSZ, cqe->res, ev);
+			give_buf (ru, bid);
+		} else if (cqe->res == -EINVAL && ru->multishot) {
+			/* The kernel has no multishot reads. */
+			ru->multishot = 0;
+		} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+			/* The device hung up or failed. */
+			r = fail (s, cqe->res ? -cqe->res : 0, ev);
+		}
+
+		if (!s->reading && !s->dead && !s->removed)
+			post_read (ru, idx);
+		break;
+
+	case OP_ARM:
+	case OP_RESET:
+	case OP_FRAME:
+	case OP_LED:
+		s->pending--;
+		if (cqe->res == -EINTR && !s->dead && !s->removed) {
+			resend (ru, idx, op);
+			break;
+		}
+		if (cqe->res > 0)
+			record (s, MSR_IO_TX, op == OP_ARM ? s->arm
+			    : op == OP_RESET ? s->reset
+			    : op == OP_LED ? s->led : s->tx, cqe->res);
+		/* What follows a failed link is cancelled; ignore that. */
+		if (cqe->res < 0 && cqe->res != -ECANCELED)
+			r = fail (s, -cqe->res, ev);
+		break;
+
+	case OP_DELAY:
+		s->pending--;
+		/*
+		 * Only a pause that ran its course ends the flush. One
+		 * cancelled with its reset leaves it to the reset sent again.
+		 */
+		if (cqe->res == 0 || cqe->res == -ETIME) {
+			s->flushing = 0;
+			s->inlen = 0;
+		}
+		break;
+
+	default:
+		s->pending--;
+	}
+
+	/* A removed device's slot is free once nothing refers to it. */
+	if (s->removed && s->pending == 0)
+		s->fd = -1;
+
+	return r;
+}
+
+static size_t reap (msr_uring_t *ru, msr_uring_event_t *ev, size_t n)
+{
+	unsigned head = *ru->cq_head;
+	unsigned tail = __atomic_load_n (ru->cq_tail, __ATOMIC_ACQUIRE);
+	size_t got = 0;
+
+	while (head != tail && got < n) {
+		got += complete (ru, &ru->cqes[head & *ru->cq_mask], &ev[got]);
+		head++;
+	}
+
+	__atomic_store_n (ru->cq_head, head, __ATOMIC_RELEASE);
+	publish_bufs (ru);
+
+	return got;
+}
+
+int msr_uring_create(unsigned int entries, msr_uring_t **rup)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	msr_uring_t *ru;
+	uint8_t *sq, *cq;
+	unsigned i;
+
+	if ((ru = calloc (1, sizeof(*ru))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	memset (&p, 0, sizeof(p));
+	/* Completions are only handled in msr_uring_wait() anyway. */
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((ru->fd = syscall (__NR_io_uring_setup, entries, &p)) == -1
+	    && errno == EINVAL) {
+		/* Older kernels don't know those flags. */
+		memset (&p, 0, sizeof(p));
+		ru->fd = syscall (__NR_io_uring_setup, entries, &p);
+	}
+	if (ru->fd == -1 || !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	ru->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ru->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ru->cq_len > ru->sq_len)
+			ru->sq_len = ru->cq_len;
+		ru->cq_len = 0;
+	}
+
+	ru->sq_map = mmap (NULL, ru->sq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_SQ_RING);
+	if (ru->sq_map == MAP_FAILED) {
+		ru->sq_map = NULL;
+		goto fail;
+	}
+
+	if (ru->cq_len) {
+		ru->cq_map = mmap (NULL, ru->cq_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_CQ_RING);
+		if (ru->cq_map == MAP_FAILED) {
+			ru->cq_map = NULL;
+			goto fail;
+		}
+	}
+
+	ru->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ru->sqes = mmap (NULL, ru->sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_SQES);
+	if (ru->sqes == MAP_FAILED) {
+		ru->sqes = NULL;
+		goto fail;
+	}
+
+	sq = ru->sq_map;
+	cq = ru->cq_len ? ru->cq_map : ru->sq_map;
+
+	ru->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ru->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ru->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ru->sq_entries = p.sq_entries;
+	ru->sqt = *ru->sq_tail;
+	ru->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ru->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ru->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ru->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* Submission slots map one to one onto the SQE array. */
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned *) (sq + p.sq_off.array))[i] = i;
+
+	ru->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+	ru->br = mmap (NULL, ru->br_len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ru->br == MAP_FAILED) {
+		ru->br = NULL;
+		goto fail;
+	}
+
+	if ((ru->bufs = malloc ((size_t) URING_BUFS * URING_BUFSZ)) == NULL)
+		goto fail;
+
+	memset (&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) ru->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall (__NR_io_uring_register, ru->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		goto fail;
+
+	for (i = 0; i < URING_BUFS; i++)
+		give_buf (ru, i);
+	publish_bufs (ru);
+
+	ru->multishot = 1;
+	*rup = ru;
+
+	return LIBMSR_ERR_OK;
+
+fail:
+	msr_uring_destroy (ru);
+	return LIBMSR_ERR_GENERIC;
+}
+
+void msr_uring_destroy(msr_uring_t *ru)
+{
+	size_t i;
+
+	/* Closing the ring cancels whatever is still in flight. */
+	if (ru->fd != -1)
+		close (ru->fd);
+
+	if (ru->sqes != NULL)
+		munmap (ru->sqes, ru->sqes_len);
+	if (ru->cq_map != NULL)
+		munmap (ru->cq_map, ru->cq_len);
+	if (ru->sq_map != NULL)
+		munmap (ru->sq_map, ru->sq_len);
+	if (ru->br != NULL)
+		munmap (ru->br, ru->br_len);
+
+	for (i = 0; i < ru->nslots; i++)
+		free (ru->slots[i]);
+	free (ru->slots);
+	free (ru->bufs);
+	free (ru);
+}
+
+static struct slot *find (msr_uring_t *ru, int fd, size_t *idx)
+{
+	size_t i;
+
+	for (i = 0; i < ru->nslots; i++) {
+		if (ru->slots[i]->fd == fd && !ru->slots[i]->removed) {
+			*idx = i;
+			return ru->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+int msr_uring_add(msr_uring_t *ru, int fd, int mode)
+{
+	struct msr_devstate *ds;
+	struct slot **slots, *s;
+	size_t i;
+
+	if (fd < 0 || (mode != MSR_URING_ISO && mode != MSR_URING_RAW)
+	    || find (ru, fd, &i) != NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	for (i = 0; i < ru->nslots; i++)
+		if (ru->slots[i]->fd == -1)
+			break;
+
+	if (i == ru->nslots) {
+		if ((s = malloc (sizeof(*s))) == NULL)
+			return LIBMSR_ERR_GENERIC;
+		slots = realloc (ru->slots, (ru->nslots + 1) * sizeof(*slots));
+		if (slots == NULL) {
+			free (s);
+			return LIBMSR_ERR_GENERIC;
+		}
+		ru->slots = slots;
+		ru->slots[ru->nslots++] = s;
+	}
+
+	s = ru->slots[i];
+	memset (s, 0, sizeof(*s));
+	s->fd = fd;
+	s->mode = mode;
+
+	/* Keep msr_led_queue() from writing to it behind our back. */
+	if ((ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 1, __ATOMIC_RELAXED);
+
+	if (post_read (ru, i) == -1 || arm (ru, i) == -1
+	    || enter (ru, 0, -1) == -1) {
+		msr_uring_remove (ru, fd);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_uring_remove(msr_uring_t *ru, int fd)
+{
+	struct io_uring_sqe *sqe;
+	struct msr_devstate *ds;
+	struct slot *s;
+	size_t idx;
+
+	if ((s = find (ru, fd, &idx)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	s->removed = 1;
+	if ((ds = msr_devstate (fd)) != NULL)
+		__atomic_store_n (&ds->armed, 0, __ATOMIC_RELAXED);
+
+	if (s->reading && (sqe = get_sqe (ru)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = user_data (idx, OP_READ);
+		sqe->user_data = user_data (idx, OP_CANCEL);
+		s->pending++;
+		enter (ru, 0, -1);
+	}
+
+	if (s->pending == 0)
+		s->fd = -1;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_uring_write(msr_uring_t *ru, int fd, const msr_tracks_t *tracks)
+{
+	const msr_track_t *tk;
+	struct slot *s;
+	size_t idx, len = 0;
+	int i;
+
+	if ((s = find (ru, fd, &idx)) == NULL || s->dead
+	    || s->type == MSR_URING_EV_WRITE)
+		return LIBMSR_ERR_GENERIC;
+
+	s->tx[len++] = MSR_ESC;
+	s->tx[len++] = s->mode == MSR_URING_RAW ? MSR_CMD_RAW_WRITE
+		: MSR_CMD_WRITE;
+	s->tx[len++] = MSR_ESC;
+	s->tx[len++] = MSR_RW_START;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk = &tracks->msr_tracks[i];
+		s->tx[len++] = MSR_ESC;
+		s->tx[len++] = i + 1;
+		if (s->mode == MSR_URING_RAW)
+			s->tx[len++] = tk->msr_tk_len;
+		memcpy (s->tx + len, tk->msr_tk_data, tk->msr_tk_len);
+		len += tk->msr_tk_len;
+	}
+
+	s->tx[len++] = MSR_RW_END;
+	s->tx[len++] = MSR_FS;
+	s->txlen = len;
+
+	/* The device is waiting for a swipe, so reset it first. */
+	s->type = MSR_URING_EV_WRITE;
+	s->inlen = 0;
+	s->held = 0;
+
+	if (post_reset (ru, idx) == -1
+	    || post_write (ru, idx, OP_FRAME, s->tx, s->txlen, 0) == -1)
+		return LIBMSR_ERR_GENERIC;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_uring_wait(msr_uring_t *ru, msr_uring_event_t *ev, size_t n,
+	int timeout)
+{
+	size_t got;
+	int due;
+
+	/* Don't sleep past the end of an LED change's pause. */
+	if ((due = release (ru)) != -1 && (timeout < 0 || due < timeout))
+		timeout = due;
+
+	if ((got = reap (ru, ev, n)) == 0) {
+		if (enter (ru, 1, timeout) == -1 && errno != ETIME
+		    && errno != EINTR)
+			return -1;
+		got = reap (ru, ev, n);
+	}
+
+	release (ru);
+
+	/* Send the re-arms the events above called for. */
+	if (ru->to_submit > 0 && enter (ru, 0, -1) == -1)
+		return -1;
+
+	return got;
+}
+
+#else
+
+/* Built without io_uring support. */
+
+int msr_uring_create(unsigned int entries, msr_uring_t **rup)
+{
+	return LIBMSR_ERR_GENERIC;
+}
+
+void msr_uring_destroy(msr_uring_t *ru)
+{
+}
+
+int msr_uring_add(msr_uring_t *ru, int fd, int mode)
+{
+	return LIBMSR_ERR_GENERIC;
+}
+
+int msr_uring_remove(msr_uring_t *ru, int fd)
+{
+	return LIBMSR_ERR_GENERIC;
+}
+
+int msr_uring_write(msr_uring_t *ru, int fd, const msr_tracks_t *tracks)
+{
+	return LIBMSR_ERR_GENERIC;
+}
+
+int msr_uring_wait(msr_uring_t *ru, msr_uring_event_t *ev, size_t n,
+	int timeout)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+
+#include <sys/random.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "msr_internal.h"
+
+/*
+ * Swipe velocity index.
+ *
+ * Cards are identified by a keyed hash (SipHash-2-4) of their tracks in
+ * a canonical form, so the same card hashes the same whichever way it
+ * was swiped and whether it was read raw or ISO. The index maps hashes
+ * to counts of recent swipes in a table split into shards, each open
+ * addressed with linear probing. Entries are two words updated with
+ * compare-and-swap: the hash, and a state word holding the time slot
+ * the card was last seen in and a count for each of the last few slots.
+ * The window is three slots long, and the slot in progress is counted
+ * too, so a swipe is counted for between one and one and a third
+ * windows. Slots are numbered in 32 bits, so an entry left alone for
+ * 2^32 slots (49 days at the shortest window) looks recent again.
+ *
+ * Entries are never emptied, so probe sequences never break. Instead,
+ * one whose counts have all expired is taken over by the next card
+ * that probes past it, and when there is none, the least recently seen
+ * entry in the probe sequence is. Taking over an entry locks its state
+ * for two stores, and only threads that land on that entry wait. The
+ * hash is stored before the state is unlocked, so a thread that reads
+ * a state and then finds its card's hash still in the entry knows the
+ * state is its card's.
+ */
+
+#define VEL_SHARDS 16
+#define VEL_PROBE 16
+
+/*
+ * State word: the slot last seen, then one count per slot, newest
+ * first. 0 is the state of an entry just claimed.
+ */
+#define VEL_BUCKETS 4
+#define VEL_MAX 0xFE
+#define VEL_SLOT(s) ((uint32_t) ((s) >> 32))
+#define VEL_BUCKET(s, j) ((unsigned int) (((s) >> (8 * (j))) & 0xFF))
+
+/*
+ * How many slots a racing thread's clock may be behind ours. A state
+ * from further ahead than this is one that has wrapped, not a race.
+ */
+#define VEL_SKEW 2
+
+/* An entry being taken over; counts stop short of 0xFF, so no state is. */
+#define VEL_LOCKED UINT64_MAX
+
+/* Canonical track kinds, mixed into the hash input. */
+#define CANON_CHARS 0x10
+#define CANON_BITS 0x20
+
+struct vel_entry {
+	uint64_t key; /* the card's hash, or 0 if unused */
+	uint64_t state;
+};
+
+struct vel_shard {
+	struct vel_entry *entries;
+} __attribute__((aligned(64)));
+
+struct msr_velocity {
+	struct vel_shard shards[VEL_SHARDS];
+	uint64_t mask; /* entries per shard, less one */
+	uint64_t k0, k1; /* the hash key */
+	struct timespec t0; /* the start of slot 0 */
+	unsigned int slot_ms;
+};
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+static uint64_t get64 (const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64 (v);
+#endif
+	return v;
+}
+
+uint64_t msr_siphash(uint64_t k0, uint64_t k1, const uint8_t *in, size_t len)
+{
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, b = (uint64_t) len << 56;
+	size_t i, tail = len & 7;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		m = get64 (in + i);
+		v3 ^= m;
+		SIPROUND (v0, v1, v2, v3);
+		SIPROUND (v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	while (tail-- > 0)
+		b |= (uint64_t) in[i + tail] << (8 * tail);
+
+	v3 ^= b;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xFF;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Append ISO characters to the hash input, without sentinels. */
+static size_t canon_chars (uint8_t *out, int tn, const uint8_t *p,
+	size_t len)
+{
+	if (len > 0 && (p[0] == '%' || p[0] == ';')) {
+		p++;
+		len--;
+	}
+	if (len > 0 && p[len - 1] == '?')
+		len--;
+
+	if (len == 0)
+		return 0;
+
+	out[0] = CANON_CHARS | tn;
+	out[1] = len;
+	memcpy (out + 2, p, len);
+	return len + 2;
+}
+
+static int bit (const uint8_t *p, int k)
+{
+	return (p[k >> 3] >> (7 - (k & 7))) & 1;
+}
+
+/*
+ * Append a raw track that didn't decode to the hash input: its bits
+ * from the first one to the last, in whichever direction sorts first.
+ */
+static size_t canon_bits (uint8_t *out, int tn, const uint8_t *p,
+	size_t len)
+{
+	uint8_t fwd[MSR_MAX_TRACK_LEN], rev[MSR_MAX_TRACK_LEN];
+	int first = -1, last = -1, n, i, k;
+	size_t nbytes;
+
+	for (k = 0; k < (int) len * 8; k++) {
+		if (bit (p, k)) {
+			if (first < 0)
+				first = k;
+			last = k;
+		}
+	}
+
+	if (first < 0)
+		return 0;
+
+	n = last - first + 1;
+	nbytes = (n + 7) / 8;
+	memset (fwd, 0, nbytes);
+	memset (rev, 0, nbytes);
+
+	for (i = 0; i < n; i++) {
+		if (bit (p, first + i))
+			fwd[i >> 3] |= 0x80 >> (i & 7);
+		if (bit (p, last - i))
+			rev[i >> 3] |= 0x80 >> (i & 7);
+	}
+
+	out[0] = CANON_BITS | tn;
+	out[1] = nbytes;
+	memcpy (out + 2, memcmp (fwd, rev, nbytes) <= 0 ? fwd : rev, nbytes);
+	return nbytes + 2;
+}
+
+int msr_velocity_hash(const msr_velocity_t *v, const msr_tracks_t *tracks,
+	int mode, uint64_t *hash)
+{
+	uint8_t buf[MSR_MAX_TRACKS * (MSR_MAX_TRACK_LEN + 2)];
+	const msr_track_t *tk;
+	msr_track_t iso;
+	msr_detect_t det;
+	size_t len = 0;
+	int tn;
+
+	if (mode != MSR_VELOCITY_ISO && mode != MSR_VELOCITY_RAW)
+		return LIBMSR_ERR_GENERIC;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+		tk = &tracks->msr_tracks[tn];
+
+		if (mode == MSR_VELOCITY_ISO)
+			len += canon_chars (buf + len, tn, tk->msr_tk_data,
+				tk->msr_tk_len);
+		else if (msr_detect_decode (tk, &iso, &det) == LIBMSR_ERR_OK)
+			len += canon_chars (buf + len, tn, iso.msr_tk_data,
+				iso.msr_tk_len);
+		else
+			len += canon_bits (buf + len, tn, tk->msr_tk_data,
+				tk->msr_tk_len);
+	}
+
+	if (len == 0)
+		return LIBMSR_ERR_GENERIC;
+
+	*hash = msr_siphash (v->k0, v->k1, buf, len);
+
+	/* 0 marks an unused entry. */
+	if (*hash == 0)
+		*hash = 1;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_velocity_create(size_t entries, unsigned int window_ms,
+	const uint8_t key[16], msr_velocity_t **vp)
+{
+	msr_velocity_t *v;
+	uint8_t k[16];
+	size_t per = VEL_PROBE;
+	int i;
+
+	if (window_ms == 0)
+		return LIBMSR_ERR_GENERIC;
+
+	/* Keep the table at most half full. */
+	while (per * VEL_SHARDS < entries * 2)
+		per <<= 1;
+
+	if (key == NULL) {
+		if (getrandom (k, sizeof(k), 0) != sizeof(k))
+			return LIBMSR_ERR_GENERIC;
+		key = k;
+	}
+
+	if (posix_memalign ((void **) &v, 64, sizeof(*v)) != 0)
+		return LIBMSR_ERR_GENERIC;
+	memset (v, 0, sizeof(*v));
+
+	for (i = 0; i < VEL_SHARDS; i++) {
+		if ((v->shards[i].entries = calloc (per,
+		    sizeof(struct vel_entry))) == NULL) {
+			msr_velocity_destroy (v);
+			return LIBMSR_ERR_GENERIC;
+		}
+	}
+
+	v->mask = per - 1;
+	v->k0 = get64 (key);
+	v->k1 = get64 (key + 8);
+	v->slot_ms = (window_ms + VEL_BUCKETS - 2) / (VEL_BUCKETS - 1);
+	clock_gettime (CLOCK_MONOTONIC, &v->t0);
+
+	*vp = v;
+	return LIBMSR_ERR_OK;
+}
+
+void msr_velocity_destroy(msr_velocity_t *v)
+{
+	int i;
+
+	if (v == NULL)
+		return;
+
+	for (i = 0; i < VEL_SHARDS; i++)
+		free (v->shards[i].entries);
+	free (v);
+}
+
+static uint32_t now_slot (const msr_velocity_t *v)
+{
+	struct timespec ts;
+	uint64_t ms;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	ms = (uint64_t) (ts.tv_sec - v->t0.tv_sec) * 1000
+		+ (ts.tv_nsec - v->t0.tv_nsec) / 1000000;
+
+	return (uint32_t) (ms / v->slot_ms);
+}
+
+/* The number of slots since a state's last, or VEL_BUCKETS if expired. */
+static uint32_t age (uint64_t s, uint32_t slot)
+{
+	uint32_t d = slot - VEL_SLOT(s);
+
+	/* A racing thread's clock may be a little behind ours. */
+	if (VEL_SLOT(s) - slot <= VEL_SKEW)
+		return 0;
+
+	return d < VEL_BUCKETS ? d : VEL_BUCKETS;
+}
+
+static unsigned int count (uint64_t s, uint32_t slot)
+{
+	unsigned int n = 0;
+	uint32_t j, d = age (s, slot);
+
+	for (j = 0; j + d < VEL_BUCKETS; j++)
+		n += VEL_BUCKET(s, j);
+
+	return n;
+}
+
+/* A state with one more swipe in the current slot. */
+static uint64_t bump (uint64_t s, uint32_t slot)
+{
+	uint32_t back = VEL_SLOT(s) - slot;
+	uint64_t b = s & 0xFFFFFFFF;
+	uint32_t d;
+
+	if (s != 0 && back != 0 && back <= VEL_SKEW) {
+		/* Our clock is behind the entry's; count it where it falls. */
+		if (back < VEL_BUCKETS && VEL_BUCKET(s, back) < VEL_MAX)
+			s += 1ULL << (8 * back);
+		return s;
+	}
+
+	d = s == 0 ? VEL_BUCKETS : age (s, slot);
+	b = d < VEL_BUCKETS ? (b << (8 * d)) & 0xFFFFFFFF : 0;
+	if ((b & 0xFF) < VEL_MAX)
+		b++;
+
+	return (uint64_t) slot << 32 | b;
+}
+
+/* Wait out a takeover of an entry, returning its new state. */
+static uint64_t settle (struct vel_entry *e)
+{
+	uint64_t s;
+
+	while ((s = __atomic_load_n (&e->state, __ATOMIC_ACQUIRE))
+	    == VEL_LOCKED)
+		cpu_relax ();
+
+	return s;
+}
+
+/*
+ * Find a card's entry. When adding, an unused entry is claimed for it
+ * if it has none, and failing that one is taken over.
+ */
+static struct vel_entry *find (msr_velocity_t *v, uint64_t hash,
+	uint32_t slot, int add)
+{
+	struct vel_entry *base, *e, *victim;
+	uint64_t k, s, vs = 0;
+	uint64_t expect;
+	size_t i, at;
+
+	base = v->shards[hash >> 60].entries;
+
+retry:
+	victim = NULL;
+	at = hash & v->mask;
+
+	for (i = 0; i < VEL_PROBE; i++, at = (at + 1) & v->mask) {
+		e = &base[at];
+		k = __atomic_load_n (&e->key, __ATOMIC_ACQUIRE);
+
+		if (k == 0) {
+			if (!add)
+				return NULL;
+			expect = 0;
+			if (__atomic_compare_exchange_n (&e->key, &expect,
+			    hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return e;
+			k = expect;
+		}
+
+		if (k == hash)
+			return e;
+
+		s = settle (e);
+		if (__atomic_load_n (&e->key, __ATOMIC_ACQUIRE) != k)
+			goto retry;
+
+		/*
+		 * Prefer an expired entry, then the least recently seen,
+		 * leaving alone any just claimed.
+		 */
+		if (s != 0 && (victim == NULL
+		    || age (s, slot) > age (vs, slot))) {
+			victim = e;
+			vs = s;
+		}
+	}
+
+	if (!add || victim == NULL)
+		return NULL;
+
+	expect = vs;
+	if (!__atomic_compare_exchange_n (&victim->state, &expect, VEL_LOCKED,
+	    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		goto retry;
+
+	__atomic_store_n (&victim->key, hash, __ATOMIC_RELAXED);
+	__atomic_store_n (&victim->state, 0, __ATOMIC_RELEASE);
+
+	return victim;
+}
+
+int msr_velocity_add(msr_velocity_t *v, uint64_t hash, unsigned int *n)
+{
+	uint32_t slot = now_slot (v);
+	struct vel_entry *e;
+	uint64_t s, ns;
+
+again:
+	if ((e = find (v, hash, slot, 1)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	s = settle (e);
+	for (;;) {
+		if (s == VEL_LOCKED) {
+			s = settle (e);
+			continue;
+		}
+
+		/* Check the entry wasn't taken over before we read s. */
+		if (__atomic_load_n (&e->key, __ATOMIC_ACQUIRE) != hash)
+			goto again;
+
+		ns = bump (s, slot);
+		if (__atomic_compare_exchange_n (&e->state, &s, ns, 1,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	if (n != NULL)
+		*n = count (ns, slot);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_velocity_count(msr_velocity_t *v, uint64_t hash, unsigned int *n)
+{
+	uint32_t slot = now_slot (v);
+	struct vel_entry *e;
+	uint64_t s;
+
+	*n = 0;
+
+	if ((e = find (v, hash, slot, 0)) != NULL) {
+		s = settle (e);
+		if (s != 0 && __atomic_load_n (&e->key, __ATOMIC_ACQUIRE)
+		    == hash)
+			*n = count (s, slot);
+	}
+
+	return LIBMSR_ERR_OK;
+}
@@ -0,0 +1,198 @@
+#include <string.h>
+
+#include "msr_internal.h"
+
+/*
+ * Write verification.
+ *
+ * A card is written, read back raw, and each track compared with what
+ * should be on it as a bitstream. The device pads tracks with as many
+ * leading zeros as it is set to, so the comparison runs from the first
+ * set bit of each side to the last, 64 bits at a time.
+ */
+
+/* The first and one past the last set bit of a buffer, or -1 and 0. */
+static void bit_span (const uint8_t *buf, int len, int *first, int *end)
+{
+	int i, j;
+
+	for (i = 0; i < len && !buf[i]; i++)
+		;
+	for (j = len - 1; j >= i && !buf[j]; j--)
+		;
+
+	if (i == len) {
+		*first = -1;
+		*end = 0;
+		return;
+	}
+
+	*first = i * 8 + __builtin_clz (buf[i]) - 24;
+	*end = j * 8 + 8 - __builtin_ctz (buf[j]);
+}
+
+/*
+ * The 64 bits starting at bit pos, zero past the end of the buffer.
+ * There are no bits before the start of it.
+ */
+static uint64_t get64 (const uint8_t *buf, int len, int pos)
+{
+	uint64_t w = 0;
+	int i, k = pos >> 3, shift = pos & 7;
+
+	if (pos < 0)
+		return 0;
+
+	for (i = 0; i < 9; i++)
+		w = (w << (i < 8 ? 8 : shift))
+			| ((k + i < len ? buf[k + i] : 0)
+			   >> (i < 8 ? 0 : 8 - shift));
+
+	return w;
+}
+
+static uint8_t bitrev8 (uint8_t b)
+{
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+
+	return b;
+}
+
+/*
+ * Compare two tracks from their first set bit on, returning the number
+ * of bits that differ and the offset of the first, or -1 if none.
+ */
+static int track_diff (const msr_track_t *a, const msr_track_t *b, int *first)
+{
+	int as, ae, bs, be, n, i, errs = 0;
+	uint64_t d;
+
+	bit_span (a->msr_tk_data, a->msr_tk_len, &as, &ae);
+	bit_span (b->msr_tk_data, b->msr_tk_len, &bs, &be);
+
+	*first = -1;
+
+	/* A blank side, such as a track that read back empty. */
+	if (as < 0 || bs < 0) {
+		for (i = 0; i < a->msr_tk_len; i++)
+			errs += __builtin_popcount (a->msr_tk_data[i]);
+		for (i = 0; i < b->msr_tk_len; i++)
+			errs += __builtin_popcount (b->msr_tk_data[i]);
+		if (errs)
+			*first = 0;
+		return errs;
+	}
+
+	n = ae - as > be - bs ? ae - as : be - bs;
+
+	for (i = 0; i < n; i += 64) {
+		d = get64 (a->msr_tk_data, a->msr_tk_len, as + i)
+			^ get64 (b->msr_tk_data, b->msr_tk_len, bs + i);
+		if (n - i < 64)
+			d &= ~0ULL << (64 - (n - i));
+
+		if (d) {
+			if (*first < 0)
+				*first = i + __builtin_clzll (d);
+			errs += __builtin_popcountll (d);
+		}
+	}
+
+	return errs;
+}
+
+/* The usual character widths of each track, when a read gives no hint. */
+static const uint8_t default_bpc[MSR_MAX_TRACKS] = { 7, 5, 5 };
+
+/*
+ * Compare one track read back against what was written, in either
+ * direction.
+ */
+static int verify_track (const msr_track_t *written, int mode,
+	const msr_track_t *back, msr_verify_t *v, int tn)
+{
+	msr_track_t want, rev;
+	msr_detect_t det;
+	int i, errs, first, rerrs, rfirst, bpc;
+
+	v->msr_bit_errors[tn] = 0;
+	v->msr_first_error[tn] = -1;
+	v->msr_reversed[tn] = 0;
+
+	if (written->msr_tk_len == 0)
+		return v->msr_status[tn] = LIBMSR_ERR_OK;
+
+	if (mode == MSR_VERIFY_ISO) {
+		/* Encode at the width the card was read back at. */
+		bpc = (msr_detect_track (back, &det) == LIBMSR_ERR_OK)
+			? det.msr_bpc : default_bpc[tn];
+		if (msr_iso_encode_track (written, &want, bpc) != LIBMSR_ERR_OK)
+			return v->msr_status[tn] = LIBMSR_ERR_ISO;
+	} else
+		want = *written;
+
+	rev.msr_tk_len = back->msr_tk_len;
+	for (i = 0; i < back->msr_tk_len; i++)
+		rev.msr_tk_data[back->msr_tk_len - 1 - i] =
+			bitrev8 (back->msr_tk_data[i]);
+
+	errs = track_diff (&want, back, &first);
+	if (errs) {
+		rerrs = track_diff (&want, &rev, &rfirst);
+		if (rerrs < errs) {
+			errs = rerrs;
+			first = rfirst;
+			v->msr_reversed[tn] = 1;
+		}
+	}
+
+	v->msr_bit_errors[tn] = errs;
+	v->msr_first_error[tn] = first;
+
+	return v->msr_status[tn] = errs ? LIBMSR_ERR_VERIFY : LIBMSR_ERR_OK;
+}
+
+int msr_write_verify (int fd, msr_tracks_t *tracks, int mode, int retries,
+	msr_verify_t *v)
+{
+	MSR_LOCKED(fd);
+	msr_tracks_t back;
+	int i, r, ret = LIBMSR_ERR_GENERIC;
+
+	memset (v, 0, sizeof(*v));
+
+	if (mode != MSR_VERIFY_ISO && mode != MSR_VERIFY_RAW)
+		return LIBMSR_ERR_GENERIC;
+
+	while (v->msr_attempts <= retries) {
+		v->msr_attempts++;
+
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			v->msr_status[i] = LIBMSR_ERR_GENERIC;
+
+		ret = mode == MSR_VERIFY_ISO ? msr_iso_write (fd, tracks)
+			: msr_raw_write (fd, tracks);
+		if (ret != LIBMSR_ERR_OK)
+			continue;
+
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			back.msr_tracks[i].msr_tk_len = MSR_MAX_TRACK_LEN;
+
+		if ((ret = msr_raw_read (fd, &back)) != LIBMSR_ERR_OK)
+			continue;
+
+		for (i = 0; i < MSR_MAX_TRACKS; i++) {
+			r = verify_track (&tracks->msr_tracks[i], mode,
+				&back.msr_tracks[i], v, i);
+			if (r != LIBMSR_ERR_OK && ret == LIBMSR_ERR_OK)
+				ret = r;
+		}
+
+		if (ret == LIBMSR_ERR_OK)
+			break;
+	}
+
+	return ret;
+}
@@ -0,0 +1,736 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msr_internal.h"
+
+/*
+ * Compressed archives of raw tracks.
+ *
+ * Most raw tracks are a run of zeros, a clean string of characters and
+ * more zeros. Such a track is stored as the number of leading zeros,
+ * its direction and width, and the characters packed without their
+ * parity bits, which are put back when unpacking; the start of the
+ * characters can instead name an entry in a dictionary of common
+ * prefixes, such as a start sentinel and a BIN. Anything else is
+ * stored as runs of literal bytes and of zero bytes. Every packed track
+ * is unpacked again and compared before it is kept, so an archive
+ * always gives back exactly what went in.
+ *
+ * Records are grouped into blocks of MSR_ZARC_BLOCK, indexed by their
+ * offsets at the end of the archive, so any record can be found by
+ * unpacking at most one block.
+ */
+
+#define ZARC_MAGIC "MSRZ"
+#define ZARC_VERSION 1
+
+/* Track encodings. */
+#define Z_EMPTY 0
+#define Z_LITERAL 1
+#define Z_PACKED 2
+
+/* Literal tokens: up to 128 bytes as they are, or that many zeros. */
+#define Z_ZEROS 0x80
+#define Z_RUN 128
+
+/* Room for the worst case encoding of a record. */
+#define Z_RECMAX (MSR_MAX_TRACKS * (MSR_MAX_TRACK_LEN + 8))
+
+/* The most characters a track can hold. */
+#define Z_MAXCHARS (MSR_MAX_TRACK_LEN * 8 / 5)
+
+/* The most bytes a track's packed characters can take. */
+#define Z_PACKMAX ((Z_MAXCHARS * 7 + 7) / 8)
+
+struct zarc_hdr {
+	char magic[4];
+	uint32_t version;
+	uint64_t nrecords;
+	uint32_t nblocks;
+	uint32_t ndict;
+	uint64_t index; /* the offset of the block index */
+};
+
+struct msr_zarc {
+	msr_zdict_t dict;
+	uint8_t *buf; /* the blocks so far */
+	size_t len, cap;
+	uint64_t *index; /* the offset of each block in buf */
+	size_t nblocks, icap;
+	uint64_t nrecords;
+};
+
+/*
+ * What to write for each character value, by direction and width:
+ * the value with parity, least significant bit first when read
+ * forwards.
+ */
+static uint8_t emit[2][3][128];
+static pthread_once_t emit_once = PTHREAD_ONCE_INIT;
+
+static int width_index (int bpc)
+{
+	return bpc == 5 ? 0 : bpc == 7 ? 1 : 2;
+}
+
+static unsigned int with_parity (unsigned int v, int bpc)
+{
+	return v | (!__builtin_parity (v) << (bpc - 1));
+}
+
+static void emit_init (void)
+{
+	static const int widths[3] = { 5, 7, 8 };
+	unsigned int v, c, r;
+	int w, bpc, i;
+
+	for (w = 0; w < 3; w++) {
+		bpc = widths[w];
+		for (v = 0; v < 1u << (bpc - 1); v++) {
+			c = with_parity (v, bpc);
+			for (i = 0, r = 0; i < bpc; i++)
+				r |= ((c >> i) & 1) << (bpc - 1 - i);
+			emit[0][w][v] = r;
+			emit[1][w][v] = c;
+		}
+	}
+}
+
+static uint64_t load_le64 (const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64 (v);
+#endif
+	return v;
+}
+
+static void store_be32 (uint8_t *p, uint32_t v)
+{
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32 (v);
+#endif
+	memcpy (p, &v, sizeof(v));
+}
+
+static size_t put_varint (uint8_t *p, unsigned int v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+static const uint8_t *get_varint (const uint8_t *p, const uint8_t *end,
+	unsigned int *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 28) {
+		*v |= (unsigned int) (*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+/* Bit k of a raw track, read in the given direction. */
+static unsigned int rawbit (const uint8_t *raw, int nbits, int reversed,
+	int k)
+{
+	if (reversed)
+		k = nbits - 1 - k;
+
+	return (raw[k >> 3] >> (7 - (k & 7))) & 1;
+}
+
+/*
+ * Find the characters of a clean raw track, each as read from the card
+ * with parity in the top bit. Returns their number, or 0 if the track
+ * isn't one that can be packed.
+ */
+static int track_chars (const msr_track_t *tk, msr_detect_t *det,
+	uint8_t *vals)
+{
+	msr_track_t iso;
+	int nbits = tk->msr_tk_len * 8, n, j, i, pos;
+
+	if (msr_detect_decode (tk, &iso, det) != LIBMSR_ERR_OK)
+		return 0;
+
+	/* The characters, the sentinels and the LRC. */
+	n = iso.msr_tk_len + 3;
+	if (det->msr_lz + n * det->msr_bpc > nbits)
+		return 0;
+
+	for (j = 0, pos = det->msr_lz; j < n; j++) {
+		vals[j] = 0;
+		for (i = 0; i < det->msr_bpc; i++, pos++)
+			vals[j] |= rawbit (tk->msr_tk_data, nbits,
+				det->msr_reversed, pos) << i;
+	}
+
+	return n;
+}
+
+/* The longest dictionary entry a track starts with, as its index + 1. */
+static int dict_match (const msr_zdict_t *d, int bpc, const uint8_t *vals,
+	int n, int *len)
+{
+	unsigned int mask = (1u << (bpc - 1)) - 1;
+	const msr_zdict_ent_t *e;
+	int i, k, best = 0;
+
+	*len = 0;
+	for (i = 0; d != NULL && i < d->msr_n; i++) {
+		e = &d->msr_ent[i];
+		if (e->msr_bpc != bpc || e->msr_len > n || e->msr_len <= *len)
+			continue;
+		for (k = 0; k < e->msr_len; k++)
+			if ((vals[k] & mask) != e->msr_chars[k])
+				break;
+		if (k == e->msr_len) {
+			best = i + 1;
+			*len = e->msr_len;
+		}
+	}
+
+	return best;
+}
+
+/* Sequential writers of bit fields. */
+struct bits {
+	uint8_t *p;
+	uint64_t acc;
+	int n;
+};
+
+static void put_msb (struct bits *b, unsigned int v, int w)
+{
+	b->acc = b->acc << w | v;
+	b->n += w;
+	if (b->n >= 32) {
+		b->n -= 32;
+		store_be32 (b->p, b->acc >> b->n);
+		b->p += 4;
+	}
+}
+
+static void flush_msb (struct bits *b)
+{
+	b->acc <<= 32 - b->n;
+	for (; b->n > 0; b->n -= 8) {
+		*b->p++ = b->acc >> 24;
+		b->acc <<= 8;
+	}
+}
+
+static void put_lsb (struct bits *b, unsigned int v, int w)
+{
+	b->acc |= (uint64_t) v << b->n;
+	b->n += w;
+	while (b->n >= 8) {
+		*b->p++ = b->acc;
+		b->acc >>= 8;
+		b->n -= 8;
+	}
+}
+
+static void flush_lsb (struct bits *b)
+{
+	if (b->n > 0)
+		*b->p++ = b->acc;
+}
+
+/*
+ * Unpack a track, or just step over it if tk is NULL. Returns the end
+ * of the track's encoding, or NULL if it is malformed.
+ */
+static const uint8_t *unpack_track (const msr_zdict_ent_t *dict, int ndict,
+	const uint8_t *p, const uint8_t *end, msr_track_t *tk)
+{
+	unsigned int lz, nchars, nbytes, bpc, rev, di, dlen = 0, v, i, j, pos;
+	unsigned int mask;
+	const msr_zdict_ent_t *e = NULL;
+	uint8_t packed[Z_PACKMAX + 8], vals[Z_MAXCHARS];
+	const uint8_t *tab;
+	struct bits b;
+	size_t need;
+
+	if (p >= end)
+		return NULL;
+
+	switch (*p++) {
+	case Z_EMPTY:
+		if (tk != NULL)
+			tk->msr_tk_len = 0;
+		return p;
+
+	case Z_LITERAL:
+		if (p >= end)
+			return NULL;
+		nbytes = *p++;
+		for (i = 0; i < nbytes; i += v) {
+			if (p >= end)
+				return NULL;
+			v = (*p & (Z_ZEROS - 1)) + 1;
+			if (i + v > nbytes)
+				return NULL;
+			if (*p++ & Z_ZEROS) {
+				if (tk != NULL)
+					memset (tk->msr_tk_data + i, 0, v);
+				continue;
+			}
+			if ((size_t) (end - p) < v)
+				return NULL;
+			if (tk != NULL)
+				memcpy (tk->msr_tk_data + i, p, v);
+			p += v;
+		}
+		if (tk != NULL)
+			tk->msr_tk_len = nbytes;
+		return p;
+
+	case Z_PACKED:
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (end - p < 2)
+		return NULL;
+	bpc = *p & 0x0F;
+	rev = *p++ >> 4;
+	nbytes = *p++;
+	if ((p = get_varint (p, end, &lz)) == NULL
+	    || (p = get_varint (p, end, &nchars)) == NULL || p >= end)
+		return NULL;
+	di = *p++;
+
+	if ((bpc != 5 && bpc != 7 && bpc != 8) || rev > 1
+	    || nchars > Z_MAXCHARS || lz + nchars * bpc > nbytes * 8
+	    || di > (unsigned int) ndict)
+		return NULL;
+
+	if (di > 0) {
+		e = &dict[di - 1];
+		dlen = e->msr_len;
+		if (e->msr_bpc != bpc || dlen > nchars)
+			return NULL;
+	}
+
+	need = ((nchars - dlen) * (bpc - 1) + 7) / 8;
+	if ((size_t) (end - p) < need)
+		return NULL;
+
+	if (tk == NULL)
+		return p + need;
+
+	/* Read the packed characters a word at a time, from a padded copy. */
+	memcpy (packed, p, need);
+	memset (packed + need, 0, 8);
+	tab = emit[rev][width_index (bpc)];
+	mask = (1u << (bpc - 1)) - 1;
+
+	/*
+	 * Read forwards, each character's first bit is its least
+	 * significant; backwards, the characters run from last to first,
+	 * most significant bit first.
+	 */
+	i = rev ? nbytes * 8 - lz - nchars * bpc : lz;
+	memset (tk->msr_tk_data, 0, nbytes);
+	memset (&b, 0, sizeof(b));
+	b.p = tk->msr_tk_data + i / 8;
+	b.n = i % 8;
+
+	for (j = 0; j < dlen; j++)
+		vals[j] = tab[e->msr_chars[j] & mask];
+	for (pos = 0; j < nchars; j++, pos += bpc - 1)
+		vals[j] = tab[load_le64 (packed + pos / 8) >> pos % 8 & mask];
+
+	if (!rev)
+		for (j = 0; j < nchars; j++)
+			put_msb (&b, vals[j], bpc);
+	else
+		for (j = nchars; j-- > 0;)
+			put_msb (&b, vals[j], bpc);
+	flush_msb (&b);
+	tk->msr_tk_len = nbytes;
+
+	return p + need;
+}
+
+static size_t pack_literal (const msr_track_t *tk, uint8_t *out)
+{
+	const uint8_t *d = tk->msr_tk_data;
+	size_t len = tk->msr_tk_len, i = 0, n;
+	uint8_t *p = out;
+
+	*p++ = Z_LITERAL;
+	*p++ = len;
+
+	while (i < len) {
+		n = 0;
+		if (d[i] == 0) {
+			while (i + n < len && n < Z_RUN && d[i + n] == 0)
+				n++;
+			*p++ = Z_ZEROS | (n - 1);
+		} else {
+			/* Stop a literal run at a pair of zeros. */
+			while (i + n < len && n < Z_RUN && (d[i + n] != 0
+			    || (i + n + 1 < len && d[i + n + 1] != 0)))
+				n++;
+			*p++ = n - 1;
+			memcpy (p, d + i, n);
+			p += n;
+		}
+		i += n;
+	}
+
+	return p - out;
+}
+
+static size_t pack_track (const msr_zdict_t *dict, const msr_track_t *tk,
+	uint8_t *out)
+{
+	uint8_t vals[Z_MAXCHARS];
+	msr_detect_t det;
+	msr_track_t check;
+	struct bits b;
+	uint8_t *p = out;
+	int n, j, di, dlen;
+
+	if (tk->msr_tk_len == 0) {
+		*p = Z_EMPTY;
+		return 1;
+	}
+
+	if ((n = track_chars (tk, &det, vals)) == 0)
+		return pack_literal (tk, out);
+
+	*p++ = Z_PACKED;
+	*p++ = det.msr_bpc | det.msr_reversed << 4;
+	*p++ = tk->msr_tk_len;
+	p += put_varint (p, det.msr_lz);
+	p += put_varint (p, n);
+	di = dict_match (dict, det.msr_bpc, vals, n, &dlen);
+	*p++ = di;
+
+	memset (&b, 0, sizeof(b));
+	b.p = p;
+	for (j = dlen; j < n; j++)
+		put_lsb (&b, vals[j] & ((1u << (det.msr_bpc - 1)) - 1),
+			det.msr_bpc - 1);
+	flush_lsb (&b);
+
+	/* Keep it only if it comes back exactly as it was. */
+	if (unpack_track (dict->msr_ent, dict->msr_n, out, b.p, &check)
+	    != b.p || check.msr_tk_len != tk->msr_tk_len
+	    || memcmp (check.msr_tk_data, tk->msr_tk_data,
+	    tk->msr_tk_len) != 0)
+		return pack_literal (tk, out);
+
+	return b.p - out;
+}
+
+static int ent_cmp (const void *a, const void *b)
+{
+	return memcmp (a, b, sizeof(msr_zdict_ent_t));
+}
+
+struct ent_count {
+	size_t n;
+	msr_zdict_ent_t e;
+};
+
+static int count_cmp (const void *a, const void *b)
+{
+	const struct ent_count *x = a, *y = b;
+
+	return (x->n < y->n) - (x->n > y->n);
+}
+
+int msr_zarc_dict_build(const msr_tracks_t *tracks, size_t n,
+	msr_zdict_t *dict)
+{
+	uint8_t vals[Z_MAXCHARS];
+	msr_zdict_ent_t *ents;
+	struct ent_count *counts;
+	msr_detect_t det;
+	size_t i, j, k, ne = 0, nc = 0;
+	int tn, nch, plen;
+
+	memset (dict, 0, sizeof(*dict));
+
+	if ((ents = calloc (n * MSR_MAX_TRACKS + 1, sizeof(*ents))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	/*
+	 * Candidates are the start sentinel and BIN: six digits on a
+	 * numeric track, and a format code and six more on others.
+	 */
+	for (i = 0; i < n; i++) {
+		for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
+			nch = track_chars (&tracks[i].msr_tracks[tn], &det,
+				vals);
+			plen = det.msr_bpc == 5 ? 7 : 8;
+			if (nch < plen + 2)
+				continue;
+			ents[ne].msr_bpc = det.msr_bpc;
+			ents[ne].msr_len = plen;
+			for (k = 0; k < (size_t) plen; k++)
+				ents[ne].msr_chars[k] = vals[k]
+					& ((1u << (det.msr_bpc - 1)) - 1);
+			ne++;
+		}
+	}
+
+	qsort (ents, ne, sizeof(*ents), ent_cmp);
+
+	if ((counts = calloc (ne + 1, sizeof(*counts))) == NULL) {
+		free (ents);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	for (i = 0; i < ne; i = j) {
+		for (j = i + 1; j < ne && ent_cmp (&ents[i], &ents[j]) == 0;)
+			j++;
+		if (j - i < 2)
+			continue;
+		counts[nc].n = j - i;
+		counts[nc].e = ents[i];
+		nc++;
+	}
+
+	qsort (counts, nc, sizeof(*counts), count_cmp);
+
+	for (i = 0; i < nc && i < MSR_ZDICT_MAX; i++)
+		dict->msr_ent[dict->msr_n++] = counts[i].e;
+
+	free (counts);
+	free (ents);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_zarc_create(const msr_zdict_t *dict, msr_zarc_t **zp)
+{
+	msr_zarc_t *z;
+
+	if ((z = calloc (1, sizeof(*z))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if (dict != NULL)
+		z->dict = *dict;
+
+	pthread_once (&emit_once, emit_init);
+
+	*zp = z;
+	return LIBMSR_ERR_OK;
+}
+
+void msr_zarc_destroy(msr_zarc_t *z)
+{
+	if (z == NULL)
+		return;
+
+	free (z->buf);
+	free (z->index);
+	free (z);
+}
+
+int msr_zarc_add(msr_zarc_t *z, const msr_tracks_t *tracks)
+{
+	void *p;
+	size_t cap;
+	int tn;
+
+	if (z->len + Z_RECMAX > z->cap) {
+		cap = z->cap ? z->cap * 2 : 65536;
+		if ((p = realloc (z->buf, cap)) == NULL)
+			return LIBMSR_ERR_GENERIC;
+		z->buf = p;
+		z->cap = cap;
+	}
+
+	if (z->nrecords % MSR_ZARC_BLOCK == 0) {
+		if (z->nblocks == z->icap) {
+			cap = z->icap ? z->icap * 2 : 256;
+			if ((p = realloc (z->index, cap * sizeof(*z->index)))
+			    == NULL)
+				return LIBMSR_ERR_GENERIC;
+			z->index = p;
+			z->icap = cap;
+		}
+		z->index[z->nblocks++] = z->len;
+	}
+
+	for (tn = 0; tn < MSR_MAX_TRACKS; tn++)
+		z->len += pack_track (&z->dict, &tracks->msr_tracks[tn],
+			z->buf + z->len);
+
+	z->nrecords++;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_zarc_finish(msr_zarc_t *z, void **buf, size_t *len)
+{
+	struct zarc_hdr hdr;
+	size_t dictlen, start, index, size, i;
+	uint64_t off;
+	uint8_t *out;
+
+	dictlen = z->dict.msr_n * sizeof(msr_zdict_ent_t);
+	start = sizeof(hdr) + dictlen;
+	index = (start + z->len + 7) & ~(size_t) 7;
+	size = index + (z->nblocks + 1) * sizeof(off);
+
+	if ((out = calloc (1, size)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	memset (&hdr, 0, sizeof(hdr));
+	memcpy (hdr.magic, ZARC_MAGIC, sizeof(hdr.magic));
+	hdr.version = ZARC_VERSION;
+	hdr.nrecords = z->nrecords;
+	hdr.nblocks = z->nblocks;
+	hdr.ndict = z->dict.msr_n;
+	hdr.index = index;
+
+	memcpy (out, &hdr, sizeof(hdr));
+	memcpy (out + sizeof(hdr), z->dict.msr_ent, dictlen);
+	if (z->len > 0)
+		memcpy (out + start, z->buf, z->len);
+
+	/* Each block's offset, then the end of the last. */
+	for (i = 0; i <= z->nblocks; i++) {
+		off = start + (i < z->nblocks ? z->index[i] : z->len);
+		memcpy (out + index + i * sizeof(off), &off, sizeof(off));
+	}
+
+	*buf = out;
+	*len = size;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_zarc_open(const void *buf, size_t len, msr_zread_t *r)
+{
+	struct zarc_hdr hdr;
+	uint64_t off, prev = 0;
+	size_t i;
+
+	if (len < sizeof(hdr))
+		return LIBMSR_ERR_GENERIC;
+
+	memcpy (&hdr, buf, sizeof(hdr));
+
+	if (memcmp (hdr.magic, ZARC_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != ZARC_VERSION || hdr.ndict > MSR_ZDICT_MAX
+	    || hdr.nblocks != (hdr.nrecords + MSR_ZARC_BLOCK - 1)
+	    / MSR_ZARC_BLOCK
+	    || hdr.index > len
+	    || (len - hdr.index) / sizeof(off) < (uint64_t) hdr.nblocks + 1
+	    || hdr.index < sizeof(hdr) + hdr.ndict * sizeof(msr_zdict_ent_t))
+		return LIBMSR_ERR_GENERIC;
+
+	r->msr_base = buf;
+	r->msr_size = len;
+	r->msr_nrecords = hdr.nrecords;
+	r->msr_nblocks = hdr.nblocks;
+	r->msr_ndict = hdr.ndict;
+	r->msr_dict = (const msr_zdict_ent_t *) (r->msr_base + sizeof(hdr));
+	r->msr_index = r->msr_base + hdr.index;
+
+	for (i = 0; i < hdr.ndict; i++)
+		if (r->msr_dict[i].msr_len > sizeof(r->msr_dict[i].msr_chars))
+			return LIBMSR_ERR_GENERIC;
+
+	/* Block offsets must run forwards, within the blocks. */
+	for (i = 0; i <= hdr.nblocks; i++) {
+		memcpy (&off, r->msr_index + i * sizeof(off), sizeof(off));
+		if (off < (i == 0 ? sizeof(hdr) : prev) || off > hdr.index)
+			return LIBMSR_ERR_GENERIC;
+		prev = off;
+	}
+
+	pthread_once (&emit_once, emit_init);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Find a block's encoding. */
+static const uint8_t *block_at (const msr_zread_t *r, uint32_t b,
+	const uint8_t **end)
+{
+	uint64_t off[2];
+
+	memcpy (off, r->msr_index + b * sizeof(off[0]), sizeof(off));
+	*end = r->msr_base + off[1];
+
+	return r->msr_base + off[0];
+}
+
+static const uint8_t *unpack_record (const msr_zread_t *r, const uint8_t *p,
+	const uint8_t *end, msr_tracks_t *tracks)
+{
+	int tn;
+
+	for (tn = 0; tn < MSR_MAX_TRACKS && p != NULL; tn++)
+		p = unpack_track (r->msr_dict, r->msr_ndict, p, end,
+			tracks != NULL ? &tracks->msr_tracks[tn] : NULL);
+
+	return p;
+}
+
+int msr_zarc_get(const msr_zread_t *r, uint64_t i, msr_tracks_t *tracks)
+{
+	const uint8_t *p, *end;
+	uint64_t k;
+
+	if (i >= r->msr_nrecords)
+		return LIBMSR_ERR_GENERIC;
+
+	p = block_at (r, i / MSR_ZARC_BLOCK, &end);
+
+	for (k = 0; k < i % MSR_ZARC_BLOCK && p != NULL; k++)
+		p = unpack_record (r, p, end, NULL);
+
+	if (p == NULL || unpack_record (r, p, end, tracks) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_zarc_block(const msr_zread_t *r, uint32_t b, msr_tracks_t *tracks,
+	size_t *n)
+{
+	const uint8_t *p, *end;
+	uint64_t first = (uint64_t) b * MSR_ZARC_BLOCK;
+	size_t k;
+
+	*n = 0;
+	if (b >= r->msr_nblocks)
+		return LIBMSR_ERR_GENERIC;
+
+	p = block_at (r, b, &end);
+
+	for (k = 0; k < MSR_ZARC_BLOCK && first + k < r->msr_nrecords; k++)
+		if ((p = unpack_record (r, p, end, &tracks[k])) == NULL)
+			return LIBMSR_ERR_GENERIC;
+
+	*n = k;
+	return LIBMSR_ERR_OK;
+}